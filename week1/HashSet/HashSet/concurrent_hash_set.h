@@ -0,0 +1,308 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Set shared by many threads. Values are split into shards by the high bits of
+// their hash; writers of a shard take its mutex, while Has takes no lock at all.
+//
+// A shard is an open addressing table with control bytes like FlatHashSet. A value
+// is constructed before its control byte is published and is never changed or
+// destroyed while the table is in use: Erase only marks the slot deleted, and a
+// deleted slot is never reused. When a table fills up, the shard builds a new one
+// and frees the old one once no reader can still be inside it.
+template <typename Type, typename Hasher>
+class ConcurrentHashSet {
+public:
+	explicit ConcurrentHashSet(size_t shard_count = 64, const Hasher& new_hasher = {})
+		: hasher(new_hasher)
+		, shard_bits(BitsFor(shard_count))
+		, shards(size_t(1) << shard_bits)
+	{
+		for (auto& shard : shards) {
+			shard.table.store(new Table(Table::MIN_CAPACITY), std::memory_order_relaxed);
+		}
+	}
+
+	ConcurrentHashSet(const ConcurrentHashSet&) = delete;
+	ConcurrentHashSet& operator=(const ConcurrentHashSet&) = delete;
+
+	~ConcurrentHashSet() {
+		for (auto& shard : shards) {
+			delete shard.table.load(std::memory_order_relaxed);
+		}
+	}
+
+	// Returns whether the value was not in the set yet
+	bool Add(const Type& value) {
+		const uint64_t hash = Hash(value);
+		Shard& shard = GetShard(hash);
+		std::lock_guard<std::mutex> guard(shard.mutex);
+		Table* table = shard.table.load(std::memory_order_relaxed);
+		if (table->Find(value, hash) != Table::NOT_FOUND) {
+			return false;
+		}
+		if (table->used_count + 1 > Table::MaxLoad(table->capacity)) {
+			const size_t capacity = table->size + 1 > Table::MaxLoad(table->capacity) / 2 ? table->capacity * 2 : table->capacity;
+			Table* rebuilt = new Table(capacity);
+			table->ForEachValue([this, rebuilt](const Type& value) { rebuilt->Insert(value, Hash(value)); });
+			shard.table.store(rebuilt, std::memory_order_release);
+			WaitForReaders();
+			delete table;
+			table = rebuilt;
+		}
+		table->Insert(value, hash);
+		return true;
+	}
+
+	bool Has(const Type& value) const {
+		const uint64_t hash = Hash(value);
+		ReadGuard guard(*this);
+		const Table* table = GetShard(hash).table.load(std::memory_order_acquire);
+		return table->Find(value, hash) != Table::NOT_FOUND;
+	}
+
+	void Erase(const Type& value) {
+		const uint64_t hash = Hash(value);
+		Shard& shard = GetShard(hash);
+		std::lock_guard<std::mutex> guard(shard.mutex);
+		shard.table.load(std::memory_order_relaxed)->Erase(value, hash);
+	}
+
+	size_t Size() const {
+		size_t size = 0;
+		for (auto& shard : shards) {
+			std::lock_guard<std::mutex> guard(shard.mutex);
+			size += shard.table.load(std::memory_order_relaxed)->size;
+		}
+		return size;
+	}
+
+	size_t GetShardCount() const {
+		return shards.size();
+	}
+
+private:
+	// Control bytes are read as 64-bit words, so a group of 8 slots is matched with a
+	// few arithmetic operations on one atomic load
+	class Table {
+	public:
+		static constexpr size_t GROUP_SIZE = 8;
+		static constexpr size_t MIN_CAPACITY = 16;
+		static constexpr size_t NOT_FOUND = static_cast<size_t>(-1);
+		static constexpr uint8_t EMPTY = 0x80;
+		static constexpr uint8_t DELETED = 0xFE;
+
+		const size_t capacity;
+		// written under the shard mutex only
+		size_t size = 0;
+		size_t used_count = 0;
+
+		explicit Table(size_t capacity)
+			: capacity(capacity)
+			, controls(new std::atomic<uint64_t>[capacity / GROUP_SIZE])
+			, slots(new Slot[capacity])
+		{
+			for (size_t group = 0; group < capacity / GROUP_SIZE; ++group) {
+				controls[group].store(BroadcastByte(EMPTY), std::memory_order_relaxed);
+			}
+		}
+
+		~Table() {
+			// deleted slots keep their values until the whole table goes away
+			for (size_t slot = 0; slot < capacity; ++slot) {
+				if (GetControl(slot) != EMPTY) {
+					Values()[slot].~Type();
+				}
+			}
+		}
+
+		static size_t MaxLoad(size_t capacity) {
+			return capacity / 8 * 7;
+		}
+
+		size_t Find(const Type& value, uint64_t hash) const {
+			const uint8_t tag = HashTag(hash);
+			const size_t group_mask = capacity / GROUP_SIZE - 1;
+			size_t group = hash & group_mask;
+			for (size_t step = 1; step <= group_mask + 1; ++step) {
+				const uint64_t word = controls[group].load(std::memory_order_acquire);
+				for (uint64_t mask = MatchByte(word, tag); mask; mask &= mask - 1) {
+					const size_t slot = group * GROUP_SIZE + LowestByte(mask);
+					if (Values()[slot] == value) {
+						return slot;
+					}
+				}
+				if (MatchByte(word, EMPTY)) {
+					return NOT_FOUND;
+				}
+				group = (group + step) & group_mask;
+			}
+			return NOT_FOUND;
+		}
+
+		void Insert(const Type& value, uint64_t hash) {
+			const size_t group_mask = capacity / GROUP_SIZE - 1;
+			size_t group = hash & group_mask;
+			uint64_t mask;
+			for (size_t step = 1; !(mask = MatchByte(controls[group].load(std::memory_order_relaxed), EMPTY)); ++step) {
+				group = (group + step) & group_mask;
+			}
+			const size_t slot = group * GROUP_SIZE + LowestByte(mask);
+			new (&Values()[slot]) Type(value);
+			SetControl(slot, HashTag(hash));
+			++size;
+			++used_count;
+		}
+
+		void Erase(const Type& value, uint64_t hash) {
+			const size_t slot = Find(value, hash);
+			if (slot != NOT_FOUND) {
+				SetControl(slot, DELETED);
+				--size;
+			}
+		}
+
+		template <typename Callback>
+		void ForEachValue(Callback callback) const {
+			for (size_t slot = 0; slot < capacity; ++slot) {
+				if (GetControl(slot) < EMPTY) {
+					callback(Values()[slot]);
+				}
+			}
+		}
+
+	private:
+		using Slot = typename std::aligned_storage<sizeof(Type), alignof(Type)>::type;
+
+		std::unique_ptr<std::atomic<uint64_t>[]> controls;
+		std::unique_ptr<Slot[]> slots;
+
+		Type* Values() const {
+			return reinterpret_cast<Type*>(slots.get());
+		}
+
+		static uint64_t BroadcastByte(uint8_t byte) {
+			return 0x0101010101010101ull * byte;
+		}
+
+		// The high bit of byte i is set when byte i of word equals byte
+		static uint64_t MatchByte(uint64_t word, uint8_t byte) {
+			const uint64_t LOW_BITS = 0x7F7F7F7F7F7F7F7Full;
+			const uint64_t zero_where_equal = word ^ BroadcastByte(byte);
+			return ~(((zero_where_equal & LOW_BITS) + LOW_BITS) | zero_where_equal | LOW_BITS);
+		}
+
+		static size_t LowestByte(uint64_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+			return __builtin_ctzll(mask) / 8;
+#else
+			size_t bit = 0;
+			while (!(mask & 1)) {
+				mask >>= 1;
+				++bit;
+			}
+			return bit / 8;
+#endif
+		}
+
+		uint8_t GetControl(size_t slot) const {
+			return static_cast<uint8_t>(controls[slot / GROUP_SIZE].load(std::memory_order_relaxed) >> (slot % GROUP_SIZE * 8));
+		}
+
+		// Publishes the slot: a reader that sees the new byte also sees the value
+		void SetControl(size_t slot, uint8_t control) {
+			auto& word = controls[slot / GROUP_SIZE];
+			const size_t shift = slot % GROUP_SIZE * 8;
+			const uint64_t old_word = word.load(std::memory_order_relaxed);
+			word.store((old_word & ~(uint64_t(0xFF) << shift)) | uint64_t(control) << shift, std::memory_order_release);
+		}
+	};
+
+	struct alignas(64) Shard {
+		mutable std::mutex mutex;
+		std::atomic<Table*> table{ nullptr };
+	};
+
+	// Readers count themselves in one of two epochs; a slot per thread keeps them
+	// off each other's cache lines. A writer that has replaced a table flips the
+	// epoch and waits until the readers of the old one leave.
+	struct alignas(64) ReaderCounter {
+		std::atomic<uint64_t> count[2] = { {0}, {0} };
+	};
+	static constexpr size_t READER_COUNTER_COUNT = 64;
+
+	class ReadGuard {
+	public:
+		explicit ReadGuard(const ConcurrentHashSet& set) {
+			static std::atomic<size_t> next_thread_index{ 0 };
+			thread_local const size_t thread_index = next_thread_index++;
+			auto& reader_counter = set.reader_counters[thread_index % READER_COUNTER_COUNT];
+			while (true) {
+				const uint64_t epoch = set.epoch.load();
+				counter = &reader_counter.count[epoch & 1];
+				counter->fetch_add(1);
+				// a writer that flipped the epoch meanwhile may not have seen this reader
+				if (set.epoch.load() == epoch) {
+					break;
+				}
+				counter->fetch_sub(1);
+			}
+		}
+
+		~ReadGuard() {
+			counter->fetch_sub(1, std::memory_order_release);
+		}
+
+	private:
+		std::atomic<uint64_t>* counter;
+	};
+
+	Hasher hasher;
+	size_t shard_bits;
+	std::vector<Shard> shards;
+
+	mutable std::atomic<uint64_t> epoch{ 0 };
+	mutable ReaderCounter reader_counters[READER_COUNTER_COUNT];
+	std::mutex epoch_mutex;
+
+	static size_t BitsFor(size_t shard_count) {
+		size_t bits = 0;
+		while ((size_t(1) << bits) < shard_count) {
+			++bits;
+		}
+		return bits;
+	}
+
+	uint64_t Hash(const Type& value) const {
+		uint64_t hash = static_cast<uint64_t>(hasher(value)) * 0x9E3779B97F4A7C15ull;
+		return hash ^ (hash >> 29);
+	}
+
+	static uint8_t HashTag(uint64_t hash) {
+		return static_cast<uint8_t>(hash >> 57);
+	}
+
+	Shard& GetShard(uint64_t hash) const {
+		// the bits under the tag pick the shard, the low bits pick the group inside it
+		return const_cast<Shard&>(shards[shard_bits ? (hash << 7) >> (64 - shard_bits) : 0]);
+	}
+
+	void WaitForReaders() {
+		std::lock_guard<std::mutex> guard(epoch_mutex);
+		const uint64_t old_epoch = epoch.fetch_add(1);
+		for (auto& reader_counter : reader_counters) {
+			while (reader_counter.count[old_epoch & 1].load() != 0) {
+				std::this_thread::yield();
+			}
+		}
+	}
+};
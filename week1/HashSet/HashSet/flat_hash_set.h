@@ -0,0 +1,252 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FLAT_HASH_SET_SSE2 1
+#endif
+
+// Open addressing set in the style of Swiss tables. Slots are split into groups
+// of 16; every slot has a control byte: empty, deleted or the 7 high bits of the
+// hash of its value. A lookup compares the control bytes of a whole group with
+// one SIMD instruction and calls operator== only for slots whose 7 bits match.
+// Values are stored inline, the table doubles when 7/8 of the slots are used.
+template <typename Type, typename Hasher>
+class FlatHashSet {
+public:
+	explicit FlatHashSet(size_t expected_size = 0, const Hasher& new_hasher = {})
+		: hasher(new_hasher)
+	{
+		Allocate(CapacityFor(expected_size));
+	}
+
+	FlatHashSet(const FlatHashSet& other)
+		: hasher(other.hasher)
+	{
+		Allocate(other.capacity);
+		other.ForEachSlot([this](const Type& value) { Insert(value, Hash(value)); });
+	}
+
+	FlatHashSet(FlatHashSet&& other) noexcept
+		: hasher(other.hasher)
+	{
+		Swap(other);
+	}
+
+	FlatHashSet& operator=(FlatHashSet other) noexcept {
+		Swap(other);
+		return *this;
+	}
+
+	~FlatHashSet() {
+		Clear();
+	}
+
+	void Add(const Type& value) {
+		const size_t hash = Hash(value);
+		if (Find(value, hash) != NOT_FOUND) {
+			return;
+		}
+		if (size + deleted_count + 1 > MaxLoad(capacity)) {
+			// tombstones alone do not make the table grow
+			Rehash(size + 1 > MaxLoad(capacity) / 2 ? capacity * 2 : capacity);
+		}
+		Insert(value, hash);
+	}
+
+	bool Has(const Type& value) const {
+		return Find(value, Hash(value)) != NOT_FOUND;
+	}
+
+	void Erase(const Type& value) {
+		const size_t slot = Find(value, Hash(value));
+		if (slot == NOT_FOUND) {
+			return;
+		}
+		Values()[slot].~Type();
+		--size;
+		// a lookup stops at a group with an empty slot, so no probe sequence passes
+		// through such a group and the slot may become empty again
+		if (MatchByte(&controls[slot & ~(GROUP_SIZE - 1)], EMPTY)) {
+			controls[slot] = EMPTY;
+		} else {
+			controls[slot] = DELETED;
+			++deleted_count;
+		}
+	}
+
+	size_t Size() const {
+		return size;
+	}
+
+	size_t Capacity() const {
+		return capacity;
+	}
+
+private:
+	static constexpr size_t GROUP_SIZE = 16;
+	static constexpr size_t NOT_FOUND = static_cast<size_t>(-1);
+	static constexpr int8_t EMPTY = -128;
+	static constexpr int8_t DELETED = -2;
+
+	using Slot = typename std::aligned_storage<sizeof(Type), alignof(Type)>::type;
+
+	Hasher hasher;
+	size_t capacity = 0;
+	size_t size = 0;
+	size_t deleted_count = 0;
+	std::unique_ptr<int8_t[]> controls;
+	std::unique_ptr<Slot[]> slots;
+
+	Type* Values() const {
+		return reinterpret_cast<Type*>(slots.get());
+	}
+
+	static size_t MaxLoad(size_t capacity) {
+		return capacity / 8 * 7;
+	}
+
+	static size_t CapacityFor(size_t expected_size) {
+		size_t capacity = GROUP_SIZE;
+		while (MaxLoad(capacity) < expected_size) {
+			capacity *= 2;
+		}
+		return capacity;
+	}
+
+	size_t Hash(const Type& value) const {
+		// user hashers may be as weak as the identity, so the bits are mixed first
+		uint64_t hash = static_cast<uint64_t>(hasher(value)) * 0x9E3779B97F4A7C15ull;
+		return static_cast<size_t>(hash ^ (hash >> 29));
+	}
+
+	static int8_t HashTag(size_t hash) {
+		return static_cast<int8_t>(static_cast<uint64_t>(hash) >> 57);
+	}
+
+	// Bit i is set when control byte i of the group equals tag
+	static uint32_t MatchByte(const int8_t* group, int8_t tag) {
+#ifdef FLAT_HASH_SET_SSE2
+		const __m128i controls = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+		return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(controls, _mm_set1_epi8(tag))));
+#else
+		uint32_t mask = 0;
+		for (size_t i = 0; i < GROUP_SIZE; ++i) {
+			mask |= static_cast<uint32_t>(group[i] == tag) << i;
+		}
+		return mask;
+#endif
+	}
+
+	// Empty and deleted bytes are the only ones with the high bit set
+	static uint32_t MatchFree(const int8_t* group) {
+#ifdef FLAT_HASH_SET_SSE2
+		return static_cast<uint32_t>(_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(group))));
+#else
+		uint32_t mask = 0;
+		for (size_t i = 0; i < GROUP_SIZE; ++i) {
+			mask |= static_cast<uint32_t>(group[i] < 0) << i;
+		}
+		return mask;
+#endif
+	}
+
+	static size_t LowestBit(uint32_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+		return __builtin_ctz(mask);
+#else
+		size_t bit = 0;
+		while (!(mask & 1)) {
+			mask >>= 1;
+			++bit;
+		}
+		return bit;
+#endif
+	}
+
+	// Groups are visited with triangular steps, which reach every group of a power of two table
+	size_t Find(const Type& value, size_t hash) const {
+		const int8_t tag = HashTag(hash);
+		const size_t group_mask = capacity / GROUP_SIZE - 1;
+		size_t group = hash & group_mask;
+		for (size_t step = 1; step <= group_mask + 1; ++step) {
+			const int8_t* group_controls = &controls[group * GROUP_SIZE];
+			for (uint32_t mask = MatchByte(group_controls, tag); mask; mask &= mask - 1) {
+				const size_t slot = group * GROUP_SIZE + LowestBit(mask);
+				if (Values()[slot] == value) {
+					return slot;
+				}
+			}
+			if (MatchByte(group_controls, EMPTY)) {
+				return NOT_FOUND;
+			}
+			group = (group + step) & group_mask;
+		}
+		return NOT_FOUND;
+	}
+
+	// The table always has a free slot, so the probe ends
+	template <typename Value>
+	void Insert(Value&& value, size_t hash) {
+		const size_t group_mask = capacity / GROUP_SIZE - 1;
+		size_t group = hash & group_mask;
+		uint32_t mask;
+		for (size_t step = 1; !(mask = MatchFree(&controls[group * GROUP_SIZE])); ++step) {
+			group = (group + step) & group_mask;
+		}
+		const size_t slot = group * GROUP_SIZE + LowestBit(mask);
+		if (controls[slot] == DELETED) {
+			--deleted_count;
+		}
+		new (&Values()[slot]) Type(std::forward<Value>(value));
+		controls[slot] = HashTag(hash);
+		++size;
+	}
+
+	void Rehash(size_t new_capacity) {
+		FlatHashSet rehashed(MaxLoad(new_capacity), hasher);
+		ForEachSlot([&rehashed](Type& value) {
+			const size_t hash = rehashed.Hash(value);
+			rehashed.Insert(std::move(value), hash);
+		});
+		Swap(rehashed);
+	}
+
+	void Allocate(size_t new_capacity) {
+		capacity = new_capacity;
+		controls = std::make_unique<int8_t[]>(capacity);
+		std::memset(controls.get(), EMPTY, capacity);
+		slots = std::make_unique<Slot[]>(capacity);
+	}
+
+	template <typename Callback>
+	void ForEachSlot(Callback callback) const {
+		for (size_t slot = 0; slot < capacity; ++slot) {
+			if (controls[slot] >= 0) {
+				callback(Values()[slot]);
+			}
+		}
+	}
+
+	void Clear() {
+		ForEachSlot([](Type& value) { value.~Type(); });
+		size = 0;
+		deleted_count = 0;
+	}
+
+	void Swap(FlatHashSet& other) noexcept {
+		std::swap(hasher, other.hasher);
+		std::swap(capacity, other.capacity);
+		std::swap(size, other.size);
+		std::swap(deleted_count, other.deleted_count);
+		std::swap(controls, other.controls);
+		std::swap(slots, other.slots);
+	}
+};
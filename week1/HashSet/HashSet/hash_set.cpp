@@ -1,8 +1,18 @@
 #include "test_runner.h"
+#include "profile.h"
+#include "flat_hash_set.h"
+#include "concurrent_hash_set.h"
 
 #include <algorithm>
+#include <atomic>
 #include <forward_list>
 #include <iterator>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 
 using namespace std;
@@ -137,11 +147,380 @@ void TestEquivalence() {
 	ASSERT_EQUAL(2, bucket.front().value);
 }
 
+void TestFlatSmoke() {
+	FlatHashSet<int, IntHasher> hash_set(2);
+	hash_set.Add(3);
+	hash_set.Add(4);
+
+	ASSERT(hash_set.Has(3));
+	ASSERT(hash_set.Has(4));
+	ASSERT(!hash_set.Has(5));
+
+	hash_set.Erase(3);
+
+	ASSERT(!hash_set.Has(3));
+	ASSERT(hash_set.Has(4));
+	ASSERT(!hash_set.Has(5));
+
+	hash_set.Add(3);
+	hash_set.Add(5);
+
+	ASSERT(hash_set.Has(3));
+	ASSERT(hash_set.Has(4));
+	ASSERT(hash_set.Has(5));
+	ASSERT_EQUAL(hash_set.Size(), 3u);
+}
+
+void TestFlatEquivalence() {
+	FlatHashSet<TestValue, TestValueHasher> hash_set;
+	hash_set.Add(TestValue{ 2 });
+	hash_set.Add(TestValue{ 3 });
+
+	ASSERT(hash_set.Has(TestValue{ 2 }));
+	ASSERT(hash_set.Has(TestValue{ 3 }));
+	ASSERT_EQUAL(hash_set.Size(), 1u);
+
+	hash_set.Erase(TestValue{ 3 });
+	ASSERT(!hash_set.Has(TestValue{ 2 }));
+}
+
+void TestFlatGrowthAndErase() {
+	// many erasures leave tombstones, which must not break lookups or leak slots
+	mt19937 gen(7);
+	uniform_int_distribution<int> value_dist(0, 20000);
+	FlatHashSet<int, IntHasher> hash_set;
+	set<int> expected;
+	for (int i = 0; i < 300000; ++i) {
+		const int value = value_dist(gen);
+		if (gen() % 3 == 0) {
+			hash_set.Erase(value);
+			expected.erase(value);
+		} else {
+			hash_set.Add(value);
+			expected.insert(value);
+		}
+		if (i % 1000 == 0) {
+			ASSERT_EQUAL(hash_set.Size(), expected.size());
+		}
+	}
+	for (int value = -10; value <= 20010; ++value) {
+		ASSERT_EQUAL(hash_set.Has(value), expected.count(value) == 1);
+	}
+	ASSERT(hash_set.Capacity() <= 4 * expected.size() + 16);
+
+	const auto copy = hash_set;
+	for (const int value : expected) {
+		ASSERT(copy.Has(value));
+	}
+	ASSERT_EQUAL(copy.Size(), expected.size());
+}
+
+struct CountedString {
+	static int alive;
+
+	string value;
+
+	CountedString(string new_value) : value(move(new_value)) { ++alive; }
+	CountedString(const CountedString& other) : value(other.value) { ++alive; }
+	CountedString(CountedString&& other) : value(move(other.value)) { ++alive; }
+	~CountedString() { --alive; }
+
+	bool operator==(const CountedString& other) const {
+		return value == other.value;
+	}
+};
+
+int CountedString::alive = 0;
+
+struct CountedStringHasher {
+	size_t operator()(const CountedString& value) const {
+		return hash<string>()(value.value);
+	}
+};
+
+void TestFlatOwnsValues() {
+	{
+		FlatHashSet<CountedString, CountedStringHasher> hash_set;
+		for (int i = 0; i < 1000; ++i) {
+			hash_set.Add(CountedString("value " + to_string(i)));
+		}
+		for (int i = 0; i < 1000; i += 2) {
+			hash_set.Erase(CountedString("value " + to_string(i)));
+		}
+		ASSERT_EQUAL(CountedString::alive, 500);
+		ASSERT(hash_set.Has(CountedString("value 1")));
+		ASSERT(!hash_set.Has(CountedString("value 2")));
+
+		auto moved = move(hash_set);
+		ASSERT_EQUAL(CountedString::alive, 500);
+		ASSERT(moved.Has(CountedString("value 999")));
+	}
+	ASSERT_EQUAL(CountedString::alive, 0);
+}
+
+struct StringHasher {
+	size_t operator()(const string& value) const {
+		return hash<string>()(value);
+	}
+};
+
+template <typename Set>
+void RunSetOperations(const string& name, Set& hash_set, const vector<int>& keys, const vector<int>& missing_keys) {
+	size_t found = 0;
+	{
+		LOG_DURATION(name + ": add");
+		for (const int key : keys) {
+			hash_set.Add(key);
+		}
+	}
+	{
+		LOG_DURATION(name + ": has, hits and misses");
+		for (size_t i = 0; i < keys.size(); ++i) {
+			found += hash_set.Has(keys[i]) + hash_set.Has(missing_keys[i]);
+		}
+	}
+	{
+		LOG_DURATION(name + ": erase");
+		for (const int key : keys) {
+			hash_set.Erase(key);
+		}
+	}
+	ASSERT_EQUAL(found, keys.size());
+}
+
+template <typename Set>
+void RunStringSetOperations(const string& name, Set& hash_set, const vector<string>& keys) {
+	size_t found = 0;
+	{
+		LOG_DURATION(name + ": add strings");
+		for (const auto& key : keys) {
+			hash_set.Add(key);
+		}
+	}
+	{
+		LOG_DURATION(name + ": has strings");
+		for (const auto& key : keys) {
+			found += hash_set.Has(key);
+		}
+	}
+	ASSERT_EQUAL(found, keys.size());
+}
+
+// unordered_set with the same interface, for comparison
+template <typename Type, typename Hasher>
+struct StdHashSet {
+	unordered_set<Type, Hasher> values;
+
+	void Add(const Type& value) { values.insert(value); }
+	bool Has(const Type& value) const { return values.count(value) > 0; }
+	void Erase(const Type& value) { values.erase(value); }
+};
+
+void TestSpeed() {
+	const int key_count = 1000000;
+	mt19937 gen(11);
+	vector<int> keys(key_count), missing_keys(key_count);
+	for (int i = 0; i < key_count; ++i) {
+		keys[i] = static_cast<int>(gen() >> 1);
+		missing_keys[i] = -static_cast<int>(gen() >> 2) - 1;
+	}
+	sort(keys.begin(), keys.end());
+	keys.erase(unique(keys.begin(), keys.end()), keys.end());
+	shuffle(keys.begin(), keys.end(), gen);
+	missing_keys.resize(keys.size());
+
+	{
+		HashSet<int, IntHasher> hash_set(keys.size());
+		RunSetOperations("HashSet", hash_set, keys, missing_keys);
+	}
+	{
+		StdHashSet<int, IntHasher> hash_set;
+		RunSetOperations("unordered_set", hash_set, keys, missing_keys);
+	}
+	{
+		FlatHashSet<int, IntHasher> hash_set;
+		RunSetOperations("FlatHashSet", hash_set, keys, missing_keys);
+	}
+
+	vector<string> string_keys;
+	for (int i = 0; i < key_count / 4; ++i) {
+		string_keys.push_back("key_" + to_string(keys[i]));
+	}
+	{
+		HashSet<string, StringHasher> hash_set(string_keys.size());
+		RunStringSetOperations("HashSet", hash_set, string_keys);
+	}
+	{
+		StdHashSet<string, StringHasher> hash_set;
+		RunStringSetOperations("unordered_set", hash_set, string_keys);
+	}
+	{
+		FlatHashSet<string, StringHasher> hash_set;
+		RunStringSetOperations("FlatHashSet", hash_set, string_keys);
+	}
+}
+
+void TestConcurrentSmoke() {
+	ConcurrentHashSet<int, IntHasher> hash_set(4);
+	ASSERT_EQUAL(hash_set.GetShardCount(), 4u);
+	ASSERT(hash_set.Add(3));
+	ASSERT(!hash_set.Add(3));
+	ASSERT(hash_set.Has(3));
+	ASSERT(!hash_set.Has(4));
+	for (int i = 0; i < 10000; ++i) {
+		hash_set.Add(i);
+	}
+	ASSERT_EQUAL(hash_set.Size(), 10000u);
+	for (int i = 0; i < 10000; i += 2) {
+		hash_set.Erase(i);
+	}
+	hash_set.Erase(-1);
+	ASSERT_EQUAL(hash_set.Size(), 5000u);
+	for (int i = 0; i < 10000; ++i) {
+		ASSERT_EQUAL(hash_set.Has(i), i % 2 == 1);
+	}
+	// erased values come back after the tombstones are dropped
+	for (int round = 0; round < 10; ++round) {
+		for (int i = 0; i < 10000; i += 2) {
+			hash_set.Add(i);
+		}
+		for (int i = 0; i < 10000; i += 2) {
+			hash_set.Erase(i);
+		}
+	}
+	ASSERT_EQUAL(hash_set.Size(), 5000u);
+}
+
+void TestConcurrentStress() {
+	const size_t thread_count = max(4u, thread::hardware_concurrency());
+	const int stable_key_count = 1000;
+	const int key_count_per_thread = 20000;
+	// few shards, so the tables are rebuilt many times while the readers are inside
+	ConcurrentHashSet<int, IntHasher> hash_set(4);
+	for (int key = 0; key < stable_key_count; ++key) {
+		hash_set.Add(key);
+	}
+
+	atomic<size_t> error_count{ 0 };
+	vector<thread> threads;
+	for (size_t thread_index = 0; thread_index < thread_count; ++thread_index) {
+		threads.emplace_back([&, thread_index] {
+			const int first_key = stable_key_count + static_cast<int>(thread_index) * key_count_per_thread;
+			mt19937 gen(static_cast<unsigned>(thread_index));
+			for (int i = 0; i < key_count_per_thread; ++i) {
+				const int key = first_key + i;
+				// every thread owns its keys, so it knows whether each of them is in the set
+				if (!hash_set.Add(key) || !hash_set.Has(key)) {
+					++error_count;
+				}
+				if (i % 3 == 0) {
+					hash_set.Erase(key);
+					if (hash_set.Has(key)) {
+						++error_count;
+					}
+				}
+				const int stable_key = static_cast<int>(gen() % stable_key_count);
+				if (!hash_set.Has(stable_key) || hash_set.Has(-stable_key - 1)) {
+					++error_count;
+				}
+			}
+		});
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	ASSERT_EQUAL(error_count.load(), 0u);
+
+	const size_t kept_key_count = key_count_per_thread - (key_count_per_thread + 2) / 3;
+	ASSERT_EQUAL(hash_set.Size(), stable_key_count + thread_count * kept_key_count);
+	for (int key = stable_key_count; key < stable_key_count + static_cast<int>(thread_count) * key_count_per_thread; ++key) {
+		ASSERT_EQUAL(hash_set.Has(key), (key - stable_key_count) % key_count_per_thread % 3 != 0);
+	}
+}
+
+// FlatHashSet behind a single mutex, for comparison
+template <typename Type, typename Hasher>
+struct LockedFlatHashSet {
+	FlatHashSet<Type, Hasher> values;
+	mutable mutex values_mutex;
+
+	bool Add(const Type& value) {
+		lock_guard<mutex> guard(values_mutex);
+		const bool added = !values.Has(value);
+		values.Add(value);
+		return added;
+	}
+	bool Has(const Type& value) const {
+		lock_guard<mutex> guard(values_mutex);
+		return values.Has(value);
+	}
+};
+
+// Every thread does its share of the same number of operations: 95% lookups, 5% additions
+template <typename Set>
+void RunConcurrentOperations(const string& name, Set& hash_set, size_t thread_count, const vector<int>& keys) {
+	const size_t operation_count = 4000000;
+	atomic<size_t> found{ 0 };
+	LOG_DURATION(name + ", " + to_string(thread_count) + " threads");
+	vector<thread> threads;
+	for (size_t thread_index = 0; thread_index < thread_count; ++thread_index) {
+		threads.emplace_back([&, thread_index] {
+			size_t thread_found = 0;
+			for (size_t i = thread_index; i < operation_count; i += thread_count) {
+				if (i % 20 == 0) {
+					hash_set.Add(-static_cast<int>(i) - 1);
+				} else {
+					thread_found += hash_set.Has(keys[i % keys.size()]);
+				}
+			}
+			found += thread_found;
+		});
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	ASSERT_EQUAL(found.load(), operation_count - operation_count / 20);
+}
+
+void TestConcurrentSpeed() {
+	const size_t max_thread_count = max(4u, thread::hardware_concurrency());
+	mt19937 gen(13);
+	vector<int> keys(1000000);
+	for (auto& key : keys) {
+		key = static_cast<int>(gen() >> 1);
+	}
+
+	for (size_t thread_count = 1; thread_count <= max_thread_count; thread_count *= 2) {
+		{
+			LockedFlatHashSet<int, IntHasher> hash_set;
+			for (const int key : keys) {
+				hash_set.Add(key);
+			}
+			RunConcurrentOperations("FlatHashSet with mutex", hash_set, thread_count, keys);
+		}
+		{
+			ConcurrentHashSet<int, IntHasher> hash_set;
+			for (const int key : keys) {
+				hash_set.Add(key);
+			}
+			RunConcurrentOperations("ConcurrentHashSet", hash_set, thread_count, keys);
+		}
+	}
+}
+
 int main() {
 	TestRunner tr;
 	RUN_TEST(tr, TestSmoke);
 	RUN_TEST(tr, TestEmpty);
 	RUN_TEST(tr, TestIdempotency);
 	RUN_TEST(tr, TestEquivalence);
+	RUN_TEST(tr, TestFlatSmoke);
+	RUN_TEST(tr, TestFlatEquivalence);
+	RUN_TEST(tr, TestFlatGrowthAndErase);
+	RUN_TEST(tr, TestFlatOwnsValues);
+	RUN_TEST(tr, TestConcurrentSmoke);
+	RUN_TEST(tr, TestConcurrentStress);
+	RUN_TEST(tr, TestSpeed);
+	RUN_TEST(tr, TestConcurrentSpeed);
 	return 0;
 }
@@ -0,0 +1,213 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Collection shared by producer and worker threads, built as a MultiQueue: the
+// objects are spread over several shards, each a Collection (like
+// PriorityCollection) under its own mutex. Add goes to a random shard, PopMax
+// looks at the cached maxima of two random shards and pops from the better one.
+//
+// So the order is relaxed: PopMax returns one of the objects with the highest
+// priorities, on average within the top few times the shard count, but not
+// necessarily the highest one. With one shard the collection is exact and works
+// like Collection behind a single mutex.
+template <typename Collection>
+class ConcurrentPriorityCollection {
+public:
+	using Id = size_t;
+	using Item = decltype(std::declval<Collection&>().PopMax());
+
+	explicit ConcurrentPriorityCollection(size_t shard_count = 2 * std::max(1u, std::thread::hardware_concurrency()))
+		: shards(std::max<size_t>(shard_count, 1))
+	{
+	}
+
+	template <typename Object>
+	Id Add(Object&& object) {
+		const size_t shard_index = RandomIndex(shards.size());
+		Shard& shard = shards[shard_index];
+		Id id;
+		{
+			std::lock_guard<std::mutex> guard(shard.mutex);
+			id = shard.collection.Add(std::forward<Object>(object)) * shards.size() + shard_index;
+			shard.UpdateMaxPriority();
+			// before the object can be popped, so the size never goes below zero
+			size.fetch_add(1);
+		}
+		NotifyWaiting();
+		return id;
+	}
+
+	// Returns false when the object has already been popped
+	bool Promote(Id id, int delta = 1) {
+		Shard& shard = shards[id % shards.size()];
+		std::lock_guard<std::mutex> guard(shard.mutex);
+		const Id local_id = id / shards.size();
+		if (!shard.collection.IsValid(local_id)) {
+			return false;
+		}
+		shard.collection.Promote(local_id, delta);
+		shard.UpdateMaxPriority();
+		return true;
+	}
+
+	bool IsValid(Id id) const {
+		const Shard& shard = shards[id % shards.size()];
+		std::lock_guard<std::mutex> guard(shard.mutex);
+		return shard.collection.IsValid(id / shards.size());
+	}
+
+	// Relaxed like PopMax: the maximum of the shard with the highest cached
+	// maximum, which other threads may have changed by the time it returns
+	std::optional<Item> GetMax() const {
+		const size_t shard_index = FindMaxShard();
+		if (shard_index == NONE) {
+			return std::nullopt;
+		}
+		const Shard& shard = shards[shard_index];
+		std::lock_guard<std::mutex> guard(shard.mutex);
+		if (shard.collection.Size() == 0) {
+			return std::nullopt;
+		}
+		const auto max = shard.collection.GetMax();
+		return Item(max.first, max.second);
+	}
+
+	// Returns nothing only when every shard was seen empty
+	std::optional<Item> TryPopMax() {
+		const size_t first = RandomIndex(shards.size());
+		const size_t second = RandomIndex(shards.size());
+		const int first_priority = shards[first].max_priority.load(std::memory_order_relaxed);
+		const int second_priority = shards[second].max_priority.load(std::memory_order_relaxed);
+		if (auto item = TryPopFrom(first_priority >= second_priority ? first : second)) {
+			return item;
+		}
+		// the chosen shard was empty or got emptied meanwhile
+		for (size_t i = 0; i < shards.size(); ++i) {
+			if (auto item = TryPopFrom((first + i) % shards.size())) {
+				return item;
+			}
+		}
+		return std::nullopt;
+	}
+
+	// Waits for an object; returns nothing when the collection is closed and empty
+	std::optional<Item> PopMax() {
+		while (true) {
+			if (auto item = TryPopMax()) {
+				return item;
+			}
+			std::unique_lock<std::mutex> lock(wait_mutex);
+			++waiting_count;
+			not_empty.wait(lock, [this] { return size.load() > 0 || closed; });
+			--waiting_count;
+			if (closed && size.load() == 0) {
+				return std::nullopt;
+			}
+		}
+	}
+
+	// Wakes the waiting workers: PopMax stops waiting once the collection is empty
+	void Close() {
+		{
+			std::lock_guard<std::mutex> guard(wait_mutex);
+			closed = true;
+		}
+		not_empty.notify_all();
+	}
+
+	size_t Size() const {
+		return size.load(std::memory_order_relaxed);
+	}
+
+	size_t GetShardCount() const {
+		return shards.size();
+	}
+
+private:
+	static constexpr size_t NONE = static_cast<size_t>(-1);
+	static constexpr int EMPTY_PRIORITY = std::numeric_limits<int>::min();
+
+	struct alignas(64) Shard {
+		mutable std::mutex mutex;
+		Collection collection;
+		// read without the mutex to choose a shard
+		std::atomic<size_t> object_count{ 0 };
+		std::atomic<int> max_priority{ EMPTY_PRIORITY };
+
+		void UpdateMaxPriority() {
+			object_count.store(collection.Size(), std::memory_order_relaxed);
+			max_priority.store(collection.Size() ? collection.GetMax().second : EMPTY_PRIORITY, std::memory_order_relaxed);
+		}
+	};
+
+	std::vector<Shard> shards;
+	std::atomic<size_t> size{ 0 };
+
+	std::mutex wait_mutex;
+	std::condition_variable not_empty;
+	std::atomic<size_t> waiting_count{ 0 };
+	bool closed = false;
+
+	static size_t RandomIndex(size_t count) {
+		// xorshift, seeded differently in every thread
+		static std::atomic<uint64_t> next_seed{ 0x9E3779B97F4A7C15ull };
+		thread_local uint64_t state = next_seed.fetch_add(0x9E3779B97F4A7C15ull) | 1;
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return static_cast<size_t>(state % count);
+	}
+
+	size_t FindMaxShard() const {
+		size_t max_shard = NONE;
+		int max_priority = EMPTY_PRIORITY;
+		for (size_t i = 0; i < shards.size(); ++i) {
+			const int priority = shards[i].max_priority.load(std::memory_order_relaxed);
+			if (shards[i].object_count.load(std::memory_order_relaxed) > 0 && (max_shard == NONE || priority > max_priority)) {
+				max_shard = i;
+				max_priority = priority;
+			}
+		}
+		return max_shard;
+	}
+
+	std::optional<Item> TryPopFrom(size_t shard_index) {
+		Shard& shard = shards[shard_index];
+		if (shard.object_count.load(std::memory_order_relaxed) == 0) {
+			return std::nullopt;
+		}
+		std::optional<Item> item;
+		{
+			std::lock_guard<std::mutex> guard(shard.mutex);
+			if (shard.collection.Size() == 0) {
+				return std::nullopt;
+			}
+			item.emplace(shard.collection.PopMax());
+			shard.UpdateMaxPriority();
+		}
+		size.fetch_sub(1);
+		return item;
+	}
+
+	// A worker counts itself as waiting before it checks the size, and a producer
+	// increases the size before it checks for waiting workers, so one of them sees the other
+	void NotifyWaiting() {
+		if (waiting_count.load() > 0) {
+			{
+				std::lock_guard<std::mutex> guard(wait_mutex);
+			}
+			not_empty.notify_one();
+		}
+	}
+};
@@ -1,20 +1,202 @@
 #include "test_runner.h"
+#include "profile.h"
+#include "concurrent_priority_collection.h"
 #include <algorithm>
 #include <iostream>
 #include <iterator>
+#include <limits>
 #include <memory>
+#include <numeric>
+#include <random>
 #include <set>
 #include <map>
+#include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 using namespace std;
 
-template <typename T>
+// Indexed d-ary max heap of (priority, id): the heap keeps the keys and the slot
+// of each object, the slot keeps the object and its position in the heap, so a
+// priority change moves only the heap entry. Popped objects leave dead slots,
+// which are dropped once they outnumber the live ones; ids are never reused.
+template <typename T, size_t ARITY = 4>
 class PriorityCollection {
 public:
 	using Id = size_t;
 
+	Id Add(T object) {
+		const Id id = AddItem(move(object));
+		SiftUp(heap.size() - 1);
+		return id;
+	}
+
+	template <typename ObjInputIt, typename IdOutputIt>
+	void Add(ObjInputIt range_begin, ObjInputIt range_end, IdOutputIt ids_begin) {
+		const size_t old_size = heap.size();
+		IdOutputIt id_it = ids_begin;
+		for (ObjInputIt obj_it = range_begin; obj_it != range_end; obj_it++, id_it++) {
+			*id_it = AddItem(move(*obj_it));
+		}
+		if (heap.size() - old_size > old_size) {
+			// sifting down every inner node, from the last one, builds the heap in O(n)
+			for (size_t index = (heap.size() + ARITY - 2) / ARITY; index-- > 0;) {
+				SiftDown(index);
+			}
+		} else {
+			for (size_t index = old_size; index < heap.size(); ++index) {
+				SiftUp(index);
+			}
+		}
+	}
+
+	bool IsValid(Id id) const {
+		return id < slots_by_id.size() && slots_by_id[id] != NONE;
+	}
+
+	const T& Get(Id id) const {
+		return items[slots_by_id[id]].data;
+	}
+
+	// The delta may be negative as well
+	void Promote(Id id, int delta = 1) {
+		const size_t index = items[slots_by_id[id]].heap_index;
+		heap[index].priority += delta;
+		if (delta > 0) {
+			SiftUp(index);
+		} else {
+			SiftDown(index);
+		}
+	}
+
+	pair<const T&, int> GetMax() const {
+		return { items[heap.front().slot].data, heap.front().priority };
+	}
+
+	pair<T, int> PopMax() {
+		const HeapEntry top = heap.front();
+		Item& item = items[top.slot];
+		pair<T, int> result = { move(item.data), top.priority };
+		item.heap_index = NONE;
+		slots_by_id[top.id] = NONE;
+
+		heap.front() = heap.back();
+		heap.pop_back();
+		if (!heap.empty()) {
+			items[heap.front().slot].heap_index = 0;
+			SiftDown(0);
+		}
+		if (items.size() - heap.size() > max(heap.size(), MIN_COMPACTED_SIZE)) {
+			Compact();
+		}
+		return result;
+	}
+
+	size_t Size() const {
+		return heap.size();
+	}
+
+	// Moves the live objects over the dead slots and frees the rest
+	void Compact() {
+		size_t live_count = 0;
+		for (size_t slot = 0; slot < items.size(); ++slot) {
+			if (items[slot].heap_index == NONE) {
+				continue;
+			}
+			if (slot != live_count) {
+				items[live_count] = move(items[slot]);
+			}
+			Item& item = items[live_count];
+			slots_by_id[item.id] = live_count;
+			heap[item.heap_index].slot = live_count;
+			++live_count;
+		}
+		items.erase(items.begin() + live_count, items.end());
+		items.shrink_to_fit();
+	}
+
+private:
+	struct Item {
+		T data;
+		Id id;
+		size_t heap_index;
+	};
+
+	struct HeapEntry {
+		int priority;
+		Id id;
+		size_t slot;
+	};
+
+	static constexpr size_t NONE = static_cast<size_t>(-1);
+	static constexpr size_t MIN_COMPACTED_SIZE = 64;
+
+	vector<Item> items;
+	vector<size_t> slots_by_id;
+	vector<HeapEntry> heap;
+
+	// Equal priorities are ordered by id, the later object wins
+	static bool Less(const HeapEntry& lhs, const HeapEntry& rhs) {
+		return lhs.priority < rhs.priority || (lhs.priority == rhs.priority && lhs.id < rhs.id);
+	}
+
+	Id AddItem(T object) {
+		const Id id = slots_by_id.size();
+		slots_by_id.push_back(items.size());
+		heap.push_back({ 0, id, items.size() });
+		items.push_back({ move(object), id, heap.size() - 1 });
+		return id;
+	}
+
+	void Place(size_t index, const HeapEntry& entry) {
+		heap[index] = entry;
+		items[entry.slot].heap_index = index;
+	}
+
+	void SiftUp(size_t index) {
+		const HeapEntry entry = heap[index];
+		while (index > 0) {
+			const size_t parent = (index - 1) / ARITY;
+			if (!Less(heap[parent], entry)) {
+				break;
+			}
+			Place(index, heap[parent]);
+			index = parent;
+		}
+		Place(index, entry);
+	}
+
+	void SiftDown(size_t index) {
+		const HeapEntry entry = heap[index];
+		while (true) {
+			const size_t first_child = index * ARITY + 1;
+			if (first_child >= heap.size()) {
+				break;
+			}
+			const size_t last_child = min(first_child + ARITY, heap.size());
+			size_t max_child = first_child;
+			for (size_t child = first_child + 1; child < last_child; ++child) {
+				if (Less(heap[max_child], heap[child])) {
+					max_child = child;
+				}
+			}
+			if (!Less(entry, heap[max_child])) {
+				break;
+			}
+			Place(index, heap[max_child]);
+			index = max_child;
+		}
+		Place(index, entry);
+	}
+};
+
+// The first version, kept to compare with: a promotion is an erase and an insert in a tree
+template <typename T>
+class SetPriorityCollection {
+public:
+	using Id = size_t;
+
 	Id Add(T object) {
 		Id new_id = objects.size();
 		objects.push_back({ move(object) });
@@ -31,7 +213,7 @@ public:
 	}
 
 	bool IsValid(Id id) const {
-		return id >= 0 && id < objects.size() && objects[id].priority != NONE_PRIORITY;
+		return id < objects.size() && objects[id].priority != NONE_PRIORITY;
 	}
 
 	const T& Get(Id id) const {
@@ -109,8 +291,340 @@ void TestNoCopy() {
 	}
 }
 
+void TestEquivalence() {
+	PriorityCollection<int> heap_collection;
+	SetPriorityCollection<int> set_collection;
+	mt19937 gen(5);
+	vector<size_t> ids;
+	for (int step = 0; step < 200000; ++step) {
+		const unsigned operation = gen() % 10;
+		if (operation < 2 || ids.empty()) {
+			const int value = static_cast<int>(gen() % 1000);
+			const size_t id = heap_collection.Add(value);
+			ASSERT_EQUAL(set_collection.Add(value), id);
+			ids.push_back(id);
+		} else if (operation < 9) {
+			const size_t id = ids[gen() % ids.size()];
+			ASSERT_EQUAL(heap_collection.IsValid(id), set_collection.IsValid(id));
+			if (heap_collection.IsValid(id)) {
+				ASSERT_EQUAL(heap_collection.Get(id), set_collection.Get(id));
+				heap_collection.Promote(id);
+				set_collection.Promote(id);
+			}
+		} else if (heap_collection.Size() > 0) {
+			const auto heap_max = heap_collection.GetMax();
+			const auto set_max = set_collection.GetMax();
+			ASSERT_EQUAL(heap_max.first, set_max.first);
+			ASSERT_EQUAL(heap_max.second, set_max.second);
+			const auto heap_item = heap_collection.PopMax();
+			const auto set_item = set_collection.PopMax();
+			ASSERT_EQUAL(heap_item.first, set_item.first);
+			ASSERT_EQUAL(heap_item.second, set_item.second);
+		}
+	}
+	for (const size_t id : ids) {
+		ASSERT_EQUAL(heap_collection.IsValid(id), set_collection.IsValid(id));
+	}
+}
+
+void TestDeltas() {
+	PriorityCollection<string> strings;
+	const auto first_id = strings.Add("first");
+	const auto second_id = strings.Add("second");
+	const auto third_id = strings.Add("third");
+	strings.Promote(first_id, 10);
+	strings.Promote(second_id, 5);
+	strings.Promote(third_id, -3);
+	ASSERT_EQUAL(strings.GetMax().first, "first");
+	strings.Promote(first_id, -20);
+	ASSERT_EQUAL(strings.GetMax().first, "second");
+	ASSERT_EQUAL(strings.GetMax().second, 5);
+	strings.PopMax();
+	{
+		const auto item = strings.PopMax();
+		ASSERT_EQUAL(item.first, "third");
+		ASSERT_EQUAL(item.second, -3);
+	}
+	{
+		const auto item = strings.PopMax();
+		ASSERT_EQUAL(item.first, "first");
+		ASSERT_EQUAL(item.second, -10);
+	}
+	ASSERT_EQUAL(strings.Size(), 0u);
+}
+
+void TestBulkAddAndCompaction() {
+	PriorityCollection<StringNonCopyable> strings;
+	vector<StringNonCopyable> words;
+	for (int i = 0; i < 1000; ++i) {
+		words.push_back(StringNonCopyable(to_string(i).c_str()));
+	}
+	vector<size_t> ids(words.size());
+	strings.Add(words.begin(), words.end(), ids.begin());
+	for (size_t i = 0; i < ids.size(); ++i) {
+		strings.Promote(ids[i], static_cast<int>(i % 10));
+	}
+
+	// popping most of the objects makes the collection drop their slots
+	for (int i = 0; i < 900; ++i) {
+		const auto item = strings.PopMax();
+		ASSERT_EQUAL(stoi(item.first) % 10, 9 - i / 100);
+	}
+	ASSERT_EQUAL(strings.Size(), 100u);
+	size_t valid_count = 0;
+	for (size_t i = 0; i < ids.size(); ++i) {
+		if (strings.IsValid(ids[i])) {
+			++valid_count;
+			ASSERT_EQUAL(strings.Get(ids[i]), to_string(i));
+		}
+	}
+	ASSERT_EQUAL(valid_count, 100u);
+
+	// a small bulk addition goes into the existing heap
+	vector<StringNonCopyable> more_words;
+	more_words.push_back("new");
+	vector<size_t> more_ids(1);
+	strings.Add(more_words.begin(), more_words.end(), more_ids.begin());
+	ASSERT_EQUAL(more_ids[0], 1000u);
+	strings.Promote(more_ids[0], 100);
+	ASSERT_EQUAL(strings.GetMax().first, "new");
+}
+
+template <typename Collection>
+void RunPromotes(const string& name, size_t object_count, size_t promote_count) {
+	Collection collection;
+	vector<size_t> ids;
+	{
+		LOG_DURATION(name + ": add");
+		for (size_t i = 0; i < object_count; ++i) {
+			ids.push_back(collection.Add(static_cast<int>(i)));
+		}
+	}
+	mt19937 gen(3);
+	{
+		LOG_DURATION(name + ": promote");
+		for (size_t i = 0; i < promote_count; ++i) {
+			collection.Promote(ids[gen() % object_count]);
+		}
+	}
+	int last_priority = numeric_limits<int>::max();
+	{
+		LOG_DURATION(name + ": pop all");
+		for (size_t i = 0; i < object_count; ++i) {
+			const int priority = collection.PopMax().second;
+			ASSERT(priority <= last_priority);
+			last_priority = priority;
+		}
+	}
+}
+
+void TestSpeed() {
+	const size_t object_count = 100000;
+	const size_t promote_count = 10000000;
+	RunPromotes<SetPriorityCollection<int>>("set", object_count, promote_count);
+	RunPromotes<PriorityCollection<int>>("4-ary heap", object_count, promote_count);
+	RunPromotes<PriorityCollection<int, 2>>("binary heap", object_count, promote_count);
+
+	vector<int> objects(1000000);
+	iota(objects.begin(), objects.end(), 0);
+	vector<size_t> ids(objects.size());
+	PriorityCollection<int> collection;
+	{
+		LOG_DURATION("4-ary heap: bulk add of 1M objects");
+		collection.Add(objects.begin(), objects.end(), ids.begin());
+	}
+	ASSERT_EQUAL(collection.GetMax().first, 999999);
+}
+
+void TestConcurrentOneShard() {
+	ConcurrentPriorityCollection<PriorityCollection<int>> concurrent_collection(1);
+	PriorityCollection<int> collection;
+	mt19937 gen(9);
+	vector<size_t> ids;
+	for (int i = 0; i < 1000; ++i) {
+		ids.push_back(concurrent_collection.Add(i));
+		ASSERT_EQUAL(collection.Add(i), ids.back());
+	}
+	for (int i = 0; i < 10000; ++i) {
+		const size_t id = ids[gen() % ids.size()];
+		const int delta = static_cast<int>(gen() % 7) - 2;
+		ASSERT(concurrent_collection.Promote(id, delta));
+		collection.Promote(id, delta);
+	}
+	ASSERT_EQUAL(concurrent_collection.GetMax().value().second, collection.GetMax().second);
+	// with one shard the order is exact
+	while (collection.Size() > 0) {
+		const auto expected = collection.PopMax();
+		const auto item = concurrent_collection.TryPopMax().value();
+		ASSERT_EQUAL(item.first, expected.first);
+		ASSERT_EQUAL(item.second, expected.second);
+	}
+	ASSERT(!concurrent_collection.TryPopMax());
+	ASSERT(!concurrent_collection.Promote(ids[0]));
+	ASSERT(!concurrent_collection.IsValid(ids[0]));
+}
+
+void TestConcurrentRelaxedOrder() {
+	const size_t shard_count = 8;
+	const int object_count = 20000;
+	ConcurrentPriorityCollection<PriorityCollection<int>> collection(shard_count);
+	for (int i = 0; i < object_count; ++i) {
+		collection.Promote(collection.Add(i), i);
+	}
+	ASSERT_EQUAL(collection.Size(), static_cast<size_t>(object_count));
+
+	// the rank of a popped object: how many of the remaining ones have higher priorities
+	set<int> remaining;
+	for (int i = 0; i < object_count; ++i) {
+		remaining.insert(i);
+	}
+	size_t rank_sum = 0;
+	while (auto item = collection.TryPopMax()) {
+		ASSERT_EQUAL(item->first, item->second);
+		for (auto it = remaining.rbegin(); *it != item->second; ++it) {
+			++rank_sum;
+		}
+		remaining.erase(item->second);
+	}
+	ASSERT(remaining.empty());
+	const double mean_rank = static_cast<double>(rank_sum) / object_count;
+	cerr << "mean rank of popped objects with " << shard_count << " shards: " << mean_rank << endl;
+	ASSERT(mean_rank < 2.0 * shard_count);
+}
+
+void TestConcurrentJobs() {
+	const size_t producer_count = 4;
+	const size_t worker_count = 4;
+	const int jobs_per_producer = 20000;
+	ConcurrentPriorityCollection<PriorityCollection<int>> collection(8);
+
+	vector<thread> producers;
+	for (size_t producer = 0; producer < producer_count; ++producer) {
+		producers.emplace_back([&, producer] {
+			mt19937 gen(static_cast<unsigned>(producer));
+			vector<size_t> ids;
+			for (int i = 0; i < jobs_per_producer; ++i) {
+				ids.push_back(collection.Add(static_cast<int>(producer) * jobs_per_producer + i));
+				// the promoted job may have been popped already
+				collection.Promote(ids[gen() % ids.size()], static_cast<int>(gen() % 5));
+			}
+		});
+	}
+	vector<vector<int>> done_jobs(worker_count);
+	vector<thread> workers;
+	for (size_t worker = 0; worker < worker_count; ++worker) {
+		workers.emplace_back([&, worker] {
+			while (auto item = collection.PopMax()) {
+				done_jobs[worker].push_back(item->first);
+			}
+		});
+	}
+	for (auto& producer : producers) {
+		producer.join();
+	}
+	collection.Close();
+	for (auto& worker : workers) {
+		worker.join();
+	}
+
+	vector<int> all_done_jobs;
+	for (const auto& jobs : done_jobs) {
+		all_done_jobs.insert(all_done_jobs.end(), jobs.begin(), jobs.end());
+	}
+	sort(all_done_jobs.begin(), all_done_jobs.end());
+	vector<int> expected_jobs(producer_count * jobs_per_producer);
+	iota(expected_jobs.begin(), expected_jobs.end(), 0);
+	ASSERT(all_done_jobs == expected_jobs);
+	ASSERT_EQUAL(collection.Size(), 0u);
+}
+
+using JobCollection = ConcurrentPriorityCollection<PriorityCollection<int>>;
+
+// Runs thread_count threads, every one calling work(thread_index) once
+template <typename Work>
+void RunThreads(size_t thread_count, Work work) {
+	vector<thread> threads;
+	for (size_t thread_index = 0; thread_index < thread_count; ++thread_index) {
+		threads.emplace_back(work, thread_index);
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+}
+
+void TestConcurrentSpeed() {
+	const size_t max_thread_count = max(4u, thread::hardware_concurrency());
+	const size_t operation_count = 2000000;
+
+	for (size_t thread_count = 1; thread_count <= max_thread_count; thread_count *= 2) {
+		for (const size_t shard_count : { size_t(1), 2 * thread_count }) {
+			const string name = to_string(thread_count) + " threads, " + to_string(shard_count) + " shards";
+			{
+				// every thread adds a job and takes one: all fight over a short queue
+				JobCollection collection(shard_count);
+				LOG_DURATION(name + ": add and pop");
+				RunThreads(thread_count, [&](size_t thread_index) {
+					for (size_t i = thread_index; i < operation_count / 2; i += thread_count) {
+						collection.Add(static_cast<int>(i));
+						collection.TryPopMax();
+					}
+				});
+			}
+			{
+				// a fixed set of jobs, mostly reprioritized, sometimes taken
+				JobCollection collection(shard_count);
+				vector<size_t> ids;
+				for (int i = 0; i < 100000; ++i) {
+					ids.push_back(collection.Add(i));
+				}
+				LOG_DURATION(name + ": promote and pop");
+				RunThreads(thread_count, [&](size_t thread_index) {
+					mt19937 gen(static_cast<unsigned>(thread_index));
+					for (size_t i = thread_index; i < operation_count; i += thread_count) {
+						if (i % 10 == 0) {
+							collection.TryPopMax();
+						} else {
+							collection.Promote(ids[gen() % ids.size()]);
+						}
+					}
+				});
+			}
+			if (thread_count > 1) {
+				// half of the threads produce, the other half wait for jobs
+				JobCollection collection(shard_count);
+				const size_t producer_count = thread_count / 2;
+				LOG_DURATION(name + ": producers and waiting workers");
+				vector<thread> workers;
+				for (size_t worker = producer_count; worker < thread_count; ++worker) {
+					workers.emplace_back([&collection] {
+						while (collection.PopMax()) {
+						}
+					});
+				}
+				RunThreads(producer_count, [&](size_t thread_index) {
+					for (size_t i = thread_index; i < operation_count / 2; i += producer_count) {
+						collection.Add(static_cast<int>(i));
+					}
+				});
+				collection.Close();
+				for (auto& worker : workers) {
+					worker.join();
+				}
+			}
+		}
+	}
+}
+
 int main() {
 	TestRunner tr;
 	RUN_TEST(tr, TestNoCopy);
+	RUN_TEST(tr, TestEquivalence);
+	RUN_TEST(tr, TestDeltas);
+	RUN_TEST(tr, TestBulkAddAndCompaction);
+	RUN_TEST(tr, TestConcurrentOneShard);
+	RUN_TEST(tr, TestConcurrentRelaxedOrder);
+	RUN_TEST(tr, TestConcurrentJobs);
+	RUN_TEST(tr, TestSpeed);
+	RUN_TEST(tr, TestConcurrentSpeed);
 	return 0;
 }
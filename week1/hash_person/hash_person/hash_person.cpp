@@ -1,7 +1,13 @@
 #include "test_runner.h"
+#include "hash_quality.h"
+#include "profile.h"
+#include "struct_hash.h"
+#include <algorithm>
 #include <limits>
 #include <random>
+#include <string>
 #include <unordered_set>
+#include <vector>
 
 using namespace std;
 
@@ -9,30 +15,51 @@ struct Address {
 	string city, street;
 	int building;
 
-	bool operator==(const Address& other) const {
-		return
-			city == other.city &&
-			street == other.street &&
-			building == other.building;
-	}
+	bool operator==(const Address& other) const;
 };
 
+template <>
+struct StructFields<Address> : FieldList<&Address::city, &Address::street, &Address::building> {};
+
+bool Address::operator==(const Address& other) const {
+	return StructEqual<Address>()(*this, other);
+}
+
 struct Person {
 	string name;
 	int height;
 	double weight;
 	Address address;
 
-	bool operator==(const Person& other) const {
-		return
-			name == other.name &&
-			height == other.height &&
-			weight == other.weight &&
-			address == other.address;
-	}
+	bool operator==(const Person& other) const;
 };
 
+template <>
+struct StructFields<Person> : FieldList<&Person::name, &Person::height, &Person::weight, &Person::address> {};
+
+bool Person::operator==(const Person& other) const {
+	return StructEqual<Person>()(*this, other);
+}
+
 struct AddressHasher {
+	size_t operator()(const Address& value) const {
+		return HashCombiner().Add(value.city).Add(value.street).Add(value.building).Get();
+	}
+};
+
+struct PersonHasher {
+	size_t operator()(const Person& value) const {
+		return HashCombiner()
+			.Add(value.name)
+			.Add(value.height)
+			.Add(value.weight)
+			.AddHash(AddressHasher()(value.address))
+			.Get();
+	}
+};
+
+// The first versions, kept to compare with
+struct PolynomialAddressHasher {
 	size_t operator()(const Address& value) const {
 		size_t h1 = shash(value.city);
 		size_t h2 = shash(value.street);
@@ -46,7 +73,7 @@ struct AddressHasher {
 	hash<int> ihash;
 };
 
-struct PersonHasher {
+struct PolynomialPersonHasher {
 	size_t operator()(const Person& value) const {
 		size_t h1 = shash(value.name);
 		size_t h2 = ihash(value.height);
@@ -60,7 +87,7 @@ struct PersonHasher {
 	hash<string> shash;
 	hash<int> ihash;
 	hash<double> dhash;
-	AddressHasher ahash;
+	PolynomialAddressHasher ahash;
 };
 
 //  :
@@ -171,11 +198,139 @@ void TestDistribution() {
 	ASSERT(pearson_stat < critical_value);
 }
 
+Person GeneratePerson(mt19937& gen) {
+	uniform_int_distribution<int> height_dist(150, 200);
+	uniform_int_distribution<int> weight_dist(100, 240);
+	uniform_int_distribution<int> building_dist(1, 300);
+	uniform_int_distribution<int> word_dist(0, WORDS.size() - 1);
+
+	Person person;
+	person.name = WORDS[word_dist(gen)];
+	person.height = height_dist(gen);
+	person.weight = weight_dist(gen) * 0.5;
+	person.address.city = WORDS[word_dist(gen)];
+	person.address.street = WORDS[word_dist(gen)];
+	person.address.building = building_dist(gen);
+	return person;
+}
+
+// Flips one bit of the building number or of the height
+void ChangePerson(Person& person, mt19937& gen) {
+	if (gen() % 2) {
+		person.address.building ^= 1 << (gen() % 9);
+	} else {
+		person.height ^= 1 << (gen() % 8);
+	}
+}
+
+void TestHashQuality() {
+	const auto report = AnalyzeHashQuality(PersonHasher(), GeneratePerson, ChangePerson);
+	PrintHashQualityReport(cerr, "PersonHasher", report);
+	PrintHashQualityReport(cerr, "PolynomialPersonHasher",
+		AnalyzeHashQuality(PolynomialPersonHasher(), GeneratePerson, ChangePerson));
+
+	ASSERT_EQUAL(report.full_collision_count, 0u);
+	for (const auto& table : report.tables) {
+		ASSERT(table.occupancy_variance < 1.25 * table.expected_occupancy_variance);
+		ASSERT(table.collision_rate < table.expected_collision_rate + 0.01);
+	}
+	ASSERT(abs(report.avalanche_mean - 0.5) < 0.01);
+	ASSERT(report.avalanche_worst_bias < 0.03);
+}
+
+void TestStructHasher() {
+	const Person person = { "John", 180, 82.5, {"London", "Baker St", 221} };
+	StructHasher<Person> hasher;
+
+	Person same = person;
+	ASSERT(same == person);
+	ASSERT_EQUAL(hasher(same), hasher(person));
+	same.weight = 0.0;
+	Person negative_zero = person;
+	negative_zero.weight = -0.0;
+	ASSERT(same == negative_zero);
+	ASSERT_EQUAL(hasher(same), hasher(negative_zero));
+
+	// every field counts, the nested ones too
+	Person other = person;
+	other.address.building = 222;
+	ASSERT(!(other == person));
+	ASSERT(hasher(other) != hasher(person));
+	other = person;
+	other.height = 181;
+	ASSERT(hasher(other) != hasher(person));
+
+	// the same characters split between fields in another way
+	ASSERT(StructHasher<Address>()({ "Lon", "donBaker St", 221 }) != StructHasher<Address>()({ "London", "Baker St", 221 }));
+	ASSERT(StructHasher<Address>()({ "", "", 0 }) != StructHasher<Address>()({ "", "", 1 }));
+
+	const auto report = AnalyzeHashQuality(hasher, GeneratePerson, ChangePerson);
+	PrintHashQualityReport(cerr, "StructHasher<Person>", report);
+	ASSERT_EQUAL(report.full_collision_count, 0u);
+	for (const auto& table : report.tables) {
+		ASSERT(table.occupancy_variance < 1.25 * table.expected_occupancy_variance);
+	}
+	ASSERT(abs(report.avalanche_mean - 0.5) < 0.01);
+	ASSERT(report.avalanche_worst_bias < 0.03);
+}
+
+template <typename Hasher>
+void RunPersonSetOperations(const string& name, const vector<Person>& persons, const vector<Person>& missing_persons) {
+	size_t hash_sum = 0;
+	{
+		LOG_DURATION(name + ": hash only");
+		const Hasher hasher;
+		for (const auto& person : persons) {
+			hash_sum += hasher(person);
+		}
+	}
+	// keeps the hashing from being optimized out
+	ASSERT(hash_sum != 1);
+
+	unordered_set<Person, Hasher> person_set;
+	size_t found = 0;
+	{
+		LOG_DURATION(name + ": insert");
+		for (const auto& person : persons) {
+			person_set.insert(person);
+		}
+	}
+	{
+		LOG_DURATION(name + ": find, hits and misses");
+		for (size_t i = 0; i < persons.size(); ++i) {
+			found += person_set.count(persons[i]) + person_set.count(missing_persons[i]);
+		}
+	}
+	ASSERT_EQUAL(found, persons.size());
+}
+
+void TestSpeed() {
+	const size_t person_count = 1000000;
+	mt19937 gen(7);
+	unordered_set<Person, StructHasher<Person>> distinct_persons;
+	while (distinct_persons.size() < person_count) {
+		distinct_persons.insert(GeneratePerson(gen));
+	}
+	vector<Person> persons(distinct_persons.begin(), distinct_persons.end());
+	shuffle(persons.begin(), persons.end(), gen);
+	vector<Person> missing_persons = persons;
+	for (auto& person : missing_persons) {
+		person.height = -person.height;
+	}
+
+	RunPersonSetOperations<PolynomialPersonHasher>("PolynomialPersonHasher", persons, missing_persons);
+	RunPersonSetOperations<PersonHasher>("PersonHasher", persons, missing_persons);
+	RunPersonSetOperations<StructHasher<Person>>("StructHasher<Person>", persons, missing_persons);
+}
+
 int main() {
 	TestRunner tr;
 	RUN_TEST(tr, TestSmoke);
 	RUN_TEST(tr, TestPurity);
 	RUN_TEST(tr, TestDistribution);
+	RUN_TEST(tr, TestHashQuality);
+	RUN_TEST(tr, TestStructHasher);
+	RUN_TEST(tr, TestSpeed);
 
 	return 0;
 }
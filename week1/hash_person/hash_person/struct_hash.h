@@ -0,0 +1,129 @@
+#pragma once
+
+#include "hash_quality.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+// Hashing and comparison of aggregates generated from a list of their fields:
+//
+//   template <>
+//   struct StructFields<Address> : FieldList<&Address::city, &Address::street, &Address::building> {};
+//
+// after which StructHasher<Address> and StructEqual<Address> are ready to use.
+// A field with its own StructFields is walked into, so nested structs are
+// hashed in the same pass.
+
+template <auto... Members>
+struct FieldList {
+	static constexpr bool DEFINED = true;
+
+	template <typename Type, typename Callback>
+	static void ForEachField(const Type& value, Callback&& callback) {
+		(callback(value.*Members), ...);
+	}
+
+	template <typename Type>
+	static bool AllFieldsEqual(const Type& lhs, const Type& rhs) {
+		return ((lhs.*Members == rhs.*Members) && ...);
+	}
+};
+
+template <typename Type>
+struct StructFields {
+	static constexpr bool DEFINED = false;
+};
+
+// One hash state for all fields: the words of every field, including the bytes
+// of strings, are absorbed two at a time, and only Get finalizes
+class HashStream {
+public:
+	template <typename Value>
+	void Write(const Value& value) {
+		if constexpr (StructFields<Value>::DEFINED) {
+			StructFields<Value>::ForEachField(value, [this](const auto& field) { Write(field); });
+		} else if constexpr (std::is_integral_v<Value> || std::is_enum_v<Value>) {
+			WriteWord(static_cast<uint64_t>(value));
+		} else if constexpr (std::is_floating_point_v<Value>) {
+			// 0.0 == -0.0, so both must hash the same
+			const double normalized = value == 0 ? 0.0 : static_cast<double>(value);
+			uint64_t word;
+			std::memcpy(&word, &normalized, sizeof(word));
+			WriteWord(word);
+		} else if constexpr (std::is_convertible_v<const Value&, std::string_view>) {
+			WriteBytes(std::string_view(value));
+		} else {
+			WriteWord(std::hash<Value>()(value));
+		}
+	}
+
+	size_t Get() const {
+		const uint64_t state = has_pending_word ? Absorb(pending_word, 0) : this->state;
+		return static_cast<size_t>(HashMix(state ^ SECRETS[2], word_count ^ SECRETS[3]));
+	}
+
+private:
+	static constexpr uint64_t SECRETS[] = {
+		0xA0761D6478BD642Full, 0xE7037ED1A0B428DBull, 0x8EBC6AF09C88C6E3ull, 0x589965CC75374CC3ull,
+	};
+
+	uint64_t state = SECRETS[0];
+	uint64_t pending_word = 0;
+	bool has_pending_word = false;
+	uint64_t word_count = 0;
+
+	uint64_t Absorb(uint64_t first, uint64_t second) const {
+		return HashMix(first ^ SECRETS[1], second ^ state);
+	}
+
+	void WriteWord(uint64_t word) {
+		++word_count;
+		if (has_pending_word) {
+			state = Absorb(pending_word, word);
+		} else {
+			pending_word = word;
+		}
+		has_pending_word = !has_pending_word;
+	}
+
+	// The length goes first, so "ab" + "c" and "a" + "bc" differ
+	void WriteBytes(std::string_view bytes) {
+		WriteWord(bytes.size());
+		size_t offset = 0;
+		for (; offset + sizeof(uint64_t) <= bytes.size(); offset += sizeof(uint64_t)) {
+			uint64_t word;
+			std::memcpy(&word, bytes.data() + offset, sizeof(word));
+			WriteWord(word);
+		}
+		if (offset < bytes.size()) {
+			uint64_t word = 0;
+			std::memcpy(&word, bytes.data() + offset, bytes.size() - offset);
+			WriteWord(word);
+		}
+	}
+};
+
+template <typename Type>
+struct StructHasher {
+	static_assert(StructFields<Type>::DEFINED, "StructFields is not specialized for the type");
+
+	size_t operator()(const Type& value) const {
+		HashStream stream;
+		stream.Write(value);
+		return stream.Get();
+	}
+};
+
+template <typename Type>
+struct StructEqual {
+	static_assert(StructFields<Type>::DEFINED, "StructFields is not specialized for the type");
+
+	bool operator()(const Type& lhs, const Type& rhs) const {
+		return StructFields<Type>::AllFieldsEqual(lhs, rhs);
+	}
+};
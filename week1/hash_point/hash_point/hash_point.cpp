@@ -1,4 +1,5 @@
 #include "test_runner.h"
+#include "hash_quality.h"
 #include <limits>
 #include <random>
 #include <unordered_set>
@@ -18,6 +19,14 @@ struct Point3D {
 };
 
 struct Hasher {
+	size_t operator()(const Point3D& value) const {
+		return HashCombiner().Add(value.x).Add(value.y).Add(value.z).Get();
+	}
+};
+
+// The first version, kept to compare with: hash<int> is the identity, so
+// near points get near hashes
+struct PolynomialHasher {
 	size_t operator()(const Point3D& value) const {
 		size_t hx = cthash(value.x);
 		size_t hy = cthash(value.y);
@@ -177,6 +186,44 @@ void TestDistribution() {
 	ASSERT(pearson_stat < critical_value);
 }
 
+Point3D GenerateGridPoint(mt19937& gen) {
+	uniform_int_distribution<CoordType> dist(-50, 50);
+	return { dist(gen), dist(gen), dist(gen) };
+}
+
+Point3D GenerateAnyPoint(mt19937& gen) {
+	uniform_int_distribution<CoordType> dist(
+		numeric_limits<CoordType>::min(),
+		numeric_limits<CoordType>::max()
+	);
+	return { dist(gen), dist(gen), dist(gen) };
+}
+
+void FlipCoordinateBit(Point3D& point, mt19937& gen) {
+	CoordType* coords[] = { &point.x, &point.y, &point.z };
+	*coords[gen() % 3] ^= CoordType(1) << (gen() % 32);
+}
+
+void TestHashQuality() {
+	for (const auto& [name, generate] : {
+		make_pair("grid", GenerateGridPoint),
+		make_pair("any", GenerateAnyPoint),
+	}) {
+		const auto report = AnalyzeHashQuality(Hasher(), generate, FlipCoordinateBit);
+		PrintHashQualityReport(cerr, string("Hasher, ") + name + " points", report);
+		PrintHashQualityReport(cerr, string("PolynomialHasher, ") + name + " points",
+			AnalyzeHashQuality(PolynomialHasher(), generate, FlipCoordinateBit));
+
+		ASSERT_EQUAL(report.full_collision_count, 0u);
+		for (const auto& table : report.tables) {
+			ASSERT(table.occupancy_variance < 1.25 * table.expected_occupancy_variance);
+			ASSERT(table.collision_rate < table.expected_collision_rate + 0.01);
+		}
+		ASSERT(abs(report.avalanche_mean - 0.5) < 0.01);
+		ASSERT(report.avalanche_worst_bias < 0.03);
+	}
+}
+
 int main() {
 	TestRunner tr;
 	RUN_TEST(tr, TestSmoke);
@@ -185,6 +232,7 @@ int main() {
 	RUN_TEST(tr, TestY);
 	RUN_TEST(tr, TestZ);
 	RUN_TEST(tr, TestDistribution);
+	RUN_TEST(tr, TestHashQuality);
 
 	return 0;
 }
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <type_traits>
+#include <unordered_set>
+#include <vector>
+
+// Folds the 128-bit product of a and b into 64 bits, the mixing step of wyhash
+inline uint64_t HashMix(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+	const unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+	return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+#else
+	const uint64_t a_low = a & 0xFFFFFFFF, a_high = a >> 32;
+	const uint64_t b_low = b & 0xFFFFFFFF, b_high = b >> 32;
+	const uint64_t low_low = a_low * b_low, low_high = a_low * b_high;
+	const uint64_t high_low = a_high * b_low, high_high = a_high * b_high;
+	const uint64_t middle = (low_low >> 32) + (low_high & 0xFFFFFFFF) + (high_low & 0xFFFFFFFF);
+	const uint64_t low = (low_low & 0xFFFFFFFF) | (middle << 32);
+	const uint64_t high = high_high + (low_high >> 32) + (high_low >> 32) + (middle >> 32);
+	return low ^ high;
+#endif
+}
+
+// Combines the fields of a struct into one hash:
+//   return HashCombiner().Add(value.x).Add(value.y).Get();
+// Every field goes through a full 64x64 multiplication, so each bit of the
+// result depends on every bit of every field, unlike a polynomial of the field
+// hashes, which keeps identity hashes of integers almost linear.
+class HashCombiner {
+public:
+	explicit HashCombiner(uint64_t seed = 0)
+		: state(seed ^ SECRETS[0])
+	{
+	}
+
+	template <typename Field>
+	HashCombiner& Add(const Field& field) {
+		if constexpr (std::is_integral_v<Field> || std::is_enum_v<Field>) {
+			return AddHash(static_cast<uint64_t>(field));
+		} else {
+			return AddHash(std::hash<Field>()(field));
+		}
+	}
+
+	// For fields with their own hasher
+	HashCombiner& AddHash(uint64_t hash) {
+		state = HashMix(state ^ SECRETS[1], hash ^ SECRETS[2]);
+		++field_count;
+		return *this;
+	}
+
+	size_t Get() const {
+		return static_cast<size_t>(HashMix(state ^ SECRETS[3], field_count ^ SECRETS[1]));
+	}
+
+private:
+	static constexpr uint64_t SECRETS[] = {
+		0xA0761D6478BD642Full, 0xE7037ED1A0B428DBull, 0x8EBC6AF09C88C6E3ull, 0x589965CC75374CC3ull,
+	};
+
+	uint64_t state;
+	uint64_t field_count = 0;
+};
+
+struct HashTableStats {
+	size_t bucket_count = 0;
+	size_t longest_chain = 0;
+	double occupancy_variance = 0;
+	// for a random hash the variance is about sample_count / bucket_count
+	double expected_occupancy_variance = 0;
+	// share of the samples that land in an already occupied bucket
+	double collision_rate = 0;
+	double expected_collision_rate = 0;
+};
+
+struct HashQualityReport {
+	size_t sample_count = 0;
+	// distinct samples with the hash of another distinct sample
+	size_t full_collision_count = 0;
+	std::vector<HashTableStats> tables;
+	// share of the 64 output bits that flip when a sample changes slightly, ideally 0.5
+	double avalanche_mean = 0;
+	// the largest deviation of one output bit from flipping half of the time
+	double avalanche_worst_bias = 0;
+};
+
+struct HashQualitySettings {
+	size_t sample_count = 100000;
+	size_t avalanche_sample_count = 10000;
+	// powers of two next to primes: bucket = hash % bucket_count, as in most tables
+	std::vector<size_t> bucket_counts = { 1024, 1031, 16384, 16381, 131072, 131071 };
+	unsigned seed = 42;
+};
+
+template <typename Hasher, typename Type>
+HashTableStats ComputeHashTableStats(const Hasher& hasher, const std::vector<Type>& samples, size_t bucket_count) {
+	std::vector<size_t> buckets(bucket_count);
+	size_t collision_count = 0;
+	for (const auto& sample : samples) {
+		collision_count += buckets[hasher(sample) % bucket_count]++ > 0;
+	}
+
+	HashTableStats stats;
+	stats.bucket_count = bucket_count;
+	stats.longest_chain = *std::max_element(buckets.begin(), buckets.end());
+	const double n = static_cast<double>(samples.size());
+	const double m = static_cast<double>(bucket_count);
+	const double mean = n / m;
+	for (const size_t size : buckets) {
+		stats.occupancy_variance += (size - mean) * (size - mean);
+	}
+	stats.occupancy_variance /= m;
+	stats.expected_occupancy_variance = mean * (1 - 1 / m);
+	stats.collision_rate = collision_count / n;
+	// all but the expected number of occupied buckets m * (1 - (1 - 1/m)^n) are collisions
+	stats.expected_collision_rate = 1 - m * (1 - std::pow(1 - 1 / m, n)) / n;
+	return stats;
+}
+
+// generate(mt19937&) returns a random sample, mutate(sample, mt19937&) makes the
+// smallest change to it, like flipping one bit of one field
+template <typename Hasher, typename Generator, typename Mutator>
+HashQualityReport AnalyzeHashQuality(const Hasher& hasher, Generator generate, Mutator mutate,
+		const HashQualitySettings& settings = {}) {
+	using Type = decltype(generate(std::declval<std::mt19937&>()));
+	std::mt19937 gen(settings.seed);
+
+	std::unordered_set<Type, Hasher> distinct_samples(settings.sample_count, hasher);
+	for (size_t i = 0; i < settings.sample_count; ++i) {
+		distinct_samples.insert(generate(gen));
+	}
+	const std::vector<Type> samples(distinct_samples.begin(), distinct_samples.end());
+
+	HashQualityReport report;
+	report.sample_count = samples.size();
+	std::vector<size_t> hashes;
+	hashes.reserve(samples.size());
+	for (const auto& sample : samples) {
+		hashes.push_back(hasher(sample));
+	}
+	std::sort(hashes.begin(), hashes.end());
+	report.full_collision_count = hashes.size() - (std::unique(hashes.begin(), hashes.end()) - hashes.begin());
+
+	for (const size_t bucket_count : settings.bucket_counts) {
+		report.tables.push_back(ComputeHashTableStats(hasher, samples, bucket_count));
+	}
+
+	const size_t bit_count = 8 * sizeof(size_t);
+	std::vector<size_t> flip_counts(bit_count);
+	size_t pair_count = 0;
+	for (size_t i = 0; i < settings.avalanche_sample_count; ++i) {
+		Type sample = generate(gen);
+		Type changed = sample;
+		mutate(changed, gen);
+		if (changed == sample) {
+			continue;
+		}
+		const size_t difference = hasher(sample) ^ hasher(changed);
+		for (size_t bit = 0; bit < bit_count; ++bit) {
+			flip_counts[bit] += (difference >> bit) & 1;
+		}
+		++pair_count;
+	}
+	for (const size_t flip_count : flip_counts) {
+		const double flip_rate = pair_count ? static_cast<double>(flip_count) / pair_count : 0;
+		report.avalanche_mean += flip_rate / bit_count;
+		report.avalanche_worst_bias = std::max(report.avalanche_worst_bias, std::abs(flip_rate - 0.5));
+	}
+	return report;
+}
+
+inline void PrintHashQualityReport(std::ostream& output, const std::string& name, const HashQualityReport& report) {
+	output << name << ": " << report.sample_count << " samples, "
+		<< report.full_collision_count << " full collisions, avalanche "
+		<< std::fixed << std::setprecision(3) << report.avalanche_mean
+		<< " (worst bit bias " << report.avalanche_worst_bias << ")\n";
+	for (const auto& table : report.tables) {
+		output << "  " << std::setw(7) << table.bucket_count << " buckets: longest chain " << std::setw(5) << table.longest_chain
+			<< ", variance " << std::setprecision(2) << table.occupancy_variance << " / " << table.expected_occupancy_variance
+			<< ", collisions " << std::setprecision(3) << table.collision_rate << " / " << table.expected_collision_rate << "\n";
+	}
+	output << std::defaultfloat;
+}
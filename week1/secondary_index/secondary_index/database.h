@@ -0,0 +1,662 @@
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+struct Record {
+	std::string id;
+	std::string title;
+	std::string user;
+	int timestamp;
+	int karma;
+};
+
+// Secondary index as flat arrays of (key, slot) sorted by key, then by slot.
+// Additions are collected in a small unsorted buffer, which is sorted and merged
+// into a delta array once it fills up; the delta is merged into the main array
+// when it grows to a fraction of it. Lookups merge the three on the fly. Entries
+// of erased records are not removed one by one: the database skips them and
+// drops them all at once with Purge.
+template <typename Key>
+class SortedIndex {
+public:
+	using Slot = uint32_t;
+
+	struct Entry {
+		Key key;
+		Slot slot;
+
+		bool operator<(const Entry& other) const {
+			return key < other.key || (key == other.key && slot < other.slot);
+		}
+	};
+
+	void Add(Key key, Slot slot) {
+		pending.push_back({ key, slot });
+		if (pending.size() >= PENDING_LIMIT) {
+			Flush();
+		}
+	}
+
+	// Calls callback(slot) for the keys in [low, high] in order, while it returns true
+	template <typename Callback>
+	void ForEachInRange(Key low, Key high, Callback callback) const {
+		if (high < low) {
+			return;
+		}
+		std::vector<Entry> pending_in_range;
+		for (const Entry& entry : pending) {
+			if (!(entry.key < low) && !(high < entry.key)) {
+				pending_in_range.push_back(entry);
+			}
+		}
+		std::sort(pending_in_range.begin(), pending_in_range.end());
+
+		Cursor cursors[] = {
+			FindRange(main, low, high),
+			FindRange(delta, low, high),
+			{ pending_in_range.data(), pending_in_range.data() + pending_in_range.size() },
+		};
+		while (true) {
+			Cursor* next = nullptr;
+			for (Cursor& cursor : cursors) {
+				if (cursor.current != cursor.end && (!next || *cursor.current < *next->current)) {
+					next = &cursor;
+				}
+			}
+			if (!next || !callback(next->current++->slot)) {
+				return;
+			}
+		}
+	}
+
+	// Replaces the contents with the entries, sorted at once
+	void Build(std::vector<Entry> entries) {
+		std::sort(entries.begin(), entries.end());
+		main.swap(entries);
+		delta.clear();
+		pending.clear();
+	}
+
+	// Drops the entries of the slots for which is_erased(slot) is true
+	template <typename Predicate>
+	void Purge(Predicate is_erased) {
+		Flush();
+		MergeInto(main, delta);
+		main.erase(std::remove_if(main.begin(), main.end(), [&is_erased](const Entry& entry) {
+			return is_erased(entry.slot);
+		}), main.end());
+	}
+
+	// Counts the entries of erased records too
+	size_t CountInRange(Key low, Key high) const {
+		if (high < low) {
+			return 0;
+		}
+		size_t count = 0;
+		for (const auto& entries : { &main, &delta }) {
+			const Cursor cursor = FindRange(*entries, low, high);
+			count += cursor.end - cursor.current;
+		}
+		for (const Entry& entry : pending) {
+			count += !(entry.key < low) && !(high < entry.key);
+		}
+		return count;
+	}
+
+	size_t GetEntryCount() const {
+		return main.size() + delta.size() + pending.size();
+	}
+
+	size_t GetMemoryUsage() const {
+		return (main.capacity() + delta.capacity() + pending.capacity()) * sizeof(Entry);
+	}
+
+private:
+	static constexpr size_t PENDING_LIMIT = 4096;
+	// the delta is merged into the main array when it reaches 1/8 of it
+	static constexpr size_t DELTA_RATIO = 8;
+
+	std::vector<Entry> main;
+	std::vector<Entry> delta;
+	std::vector<Entry> pending;
+
+	struct Cursor {
+		const Entry* current;
+		const Entry* end;
+	};
+
+	static Cursor FindRange(const std::vector<Entry>& entries, Key low, Key high) {
+		const Entry* begin = std::lower_bound(entries.data(), entries.data() + entries.size(), low, [](const Entry& entry, Key key) {
+			return entry.key < key;
+		});
+		const Entry* end = std::upper_bound(begin, entries.data() + entries.size(), high, [](Key key, const Entry& entry) {
+			return key < entry.key;
+		});
+		return { begin, end };
+	}
+
+	static void MergeInto(std::vector<Entry>& target, std::vector<Entry>& source) {
+		if (source.empty()) {
+			return;
+		}
+		std::vector<Entry> merged(target.size() + source.size());
+		std::merge(target.begin(), target.end(), source.begin(), source.end(), merged.begin());
+		target.swap(merged);
+		source.clear();
+	}
+
+	void Flush() {
+		std::sort(pending.begin(), pending.end());
+		MergeInto(delta, pending);
+		if (delta.size() * DELTA_RATIO >= main.size()) {
+			MergeInto(main, delta);
+		}
+	}
+};
+
+// Slots by the ids of their records, with open addressing. An entry keeps 32 bits
+// of the id hash next to the slot, so records are compared only on a hash match
+// and the table grows without hashing the ids again. Linear probing lets erased
+// entries be removed by shifting the following ones back instead of tombstones.
+class SlotsById {
+public:
+	using Slot = uint32_t;
+	static constexpr Slot NONE = static_cast<Slot>(-1);
+
+	SlotsById()
+		: entries(MIN_CAPACITY, EMPTY)
+	{
+	}
+
+	// get_id(slot) returns the id of the record in the slot
+	template <typename GetId>
+	Slot Find(const std::string& id, GetId get_id) const {
+		const size_t position = FindPosition(id, get_id);
+		return position == NOT_FOUND ? NONE : GetSlot(entries[position]);
+	}
+
+	// The id must not be in the table yet
+	void Insert(const std::string& id, Slot slot) {
+		if ((size + 1) * 2 > entries.size()) {
+			Grow();
+		}
+		Place(MakeEntry(HashTag(id), slot));
+		++size;
+	}
+
+	template <typename GetId>
+	bool Erase(const std::string& id, GetId get_id) {
+		size_t position = FindPosition(id, get_id);
+		if (position == NOT_FOUND) {
+			return false;
+		}
+		const size_t mask = entries.size() - 1;
+		// moves back every following entry which may not stay after the hole
+		for (size_t next = (position + 1) & mask; entries[next] != EMPTY; next = (next + 1) & mask) {
+			const size_t home = GetTag(entries[next]) & mask;
+			if (((next - home) & mask) >= ((next - position) & mask)) {
+				entries[position] = entries[next];
+				position = next;
+			}
+		}
+		entries[position] = EMPTY;
+		--size;
+		return true;
+	}
+
+	size_t Size() const {
+		return size;
+	}
+
+	size_t GetMemoryUsage() const {
+		return entries.capacity() * sizeof(uint64_t);
+	}
+
+private:
+	static constexpr size_t MIN_CAPACITY = 16;
+	static constexpr size_t NOT_FOUND = static_cast<size_t>(-1);
+	static constexpr uint64_t EMPTY = 0;
+
+	std::vector<uint64_t> entries;
+	size_t size = 0;
+
+	static uint32_t HashTag(const std::string& id) {
+		const uint64_t hash = static_cast<uint64_t>(std::hash<std::string>()(id)) * 0x9E3779B97F4A7C15ull;
+		return static_cast<uint32_t>(hash >> 32);
+	}
+
+	static uint64_t MakeEntry(uint32_t tag, Slot slot) {
+		return static_cast<uint64_t>(tag) << 32 | (static_cast<uint64_t>(slot) + 1);
+	}
+
+	static uint32_t GetTag(uint64_t entry) {
+		return static_cast<uint32_t>(entry >> 32);
+	}
+
+	static Slot GetSlot(uint64_t entry) {
+		return static_cast<Slot>((entry & 0xFFFFFFFF) - 1);
+	}
+
+	template <typename GetId>
+	size_t FindPosition(const std::string& id, GetId get_id) const {
+		const uint32_t tag = HashTag(id);
+		const size_t mask = entries.size() - 1;
+		for (size_t position = tag & mask; entries[position] != EMPTY; position = (position + 1) & mask) {
+			if (GetTag(entries[position]) == tag && get_id(GetSlot(entries[position])) == id) {
+				return position;
+			}
+		}
+		return NOT_FOUND;
+	}
+
+	void Place(uint64_t entry) {
+		const size_t mask = entries.size() - 1;
+		size_t position = GetTag(entry) & mask;
+		while (entries[position] != EMPTY) {
+			position = (position + 1) & mask;
+		}
+		entries[position] = entry;
+	}
+
+	void Grow() {
+		std::vector<uint64_t> old_entries(entries.size() * 2, EMPTY);
+		entries.swap(old_entries);
+		for (const uint64_t entry : old_entries) {
+			if (entry != EMPTY) {
+				Place(entry);
+			}
+		}
+	}
+};
+
+struct Range {
+	int low;
+	int high;
+};
+
+// A record matches when it satisfies every given predicate
+struct Query {
+	std::optional<std::string> user;
+	std::optional<Range> timestamp;
+	std::optional<Range> karma;
+};
+
+struct QueryPlan {
+	enum class Index {
+		// nothing can match
+		NONE,
+		USER_TIMESTAMP,
+		TIMESTAMP,
+		KARMA,
+	};
+
+	// the index whose range is walked
+	Index scanned = Index::NONE;
+	// the index whose range is turned into a bitmap of slots to check the scanned ones against
+	Index intersected = Index::NONE;
+	size_t scanned_count = 0;
+	size_t intersected_count = 0;
+};
+
+// Records live in fixed-size chunks, so their addresses stay valid while the
+// database grows, and the fields the indexes are built on are also kept in
+// columns by slot. An erased slot is reused only after the indexes have dropped
+// its entries.
+class Database {
+public:
+	bool Put(const Record& record) {
+		if (slots_by_id.Find(record.id, IdOfSlot{ this }) != SlotsById::NONE) {
+			return false;
+		}
+		const Slot slot = AllocateSlot();
+		slots_by_id.Insert(record.id, slot);
+		GetRecord(slot) = record;
+		timestamps[slot] = record.timestamp;
+		karmas[slot] = record.karma;
+		user_ids[slot] = InternUser(record.user);
+		alive[slot] = true;
+
+		timestamp_index.Add(record.timestamp, slot);
+		karma_index.Add(record.karma, slot);
+		user_timestamp_index.Add(UserTimestampKey(user_ids[slot], record.timestamp), slot);
+		return true;
+	}
+
+	const Record* GetById(const std::string& id) const {
+		const Slot slot = slots_by_id.Find(id, IdOfSlot{ this });
+		if (slot == SlotsById::NONE) {
+			return nullptr;
+		}
+		return &GetRecord(slot);
+	}
+
+	bool Erase(const std::string& id) {
+		const Slot slot = slots_by_id.Find(id, IdOfSlot{ this });
+		if (slot == SlotsById::NONE) {
+			return false;
+		}
+		slots_by_id.Erase(id, IdOfSlot{ this });
+		GetRecord(slot) = Record();
+		alive[slot] = false;
+		erased_slots.push_back(slot);
+		if (erased_slots.size() > std::max(MIN_PURGED_COUNT, slots_by_id.Size() / 4)) {
+			Purge();
+		}
+		return true;
+	}
+
+	template <typename Callback>
+	void RangeByTimestamp(int low, int high, Callback callback) const {
+		timestamp_index.ForEachInRange(low, high, MakeSlotCallback(callback));
+	}
+
+	template <typename Callback>
+	void RangeByKarma(int low, int high, Callback callback) const {
+		karma_index.ForEachInRange(low, high, MakeSlotCallback(callback));
+	}
+
+	template <typename Callback>
+	void AllByUser(const std::string& user, Callback callback) const {
+		const auto it = user_ids_by_name.find(user);
+		if (it != user_ids_by_name.end()) {
+			user_timestamp_index.ForEachInRange(UserTimestampKey(it->second, std::numeric_limits<int>::min()),
+				UserTimestampKey(it->second, std::numeric_limits<int>::max()), MakeSlotCallback(callback));
+		}
+	}
+
+	// Fills an empty database; the indexes are sorted at once, in parallel when
+	// thread_count > 1. Records with repeated ids are skipped, like in Put.
+	void Load(std::vector<Record> records, size_t thread_count = 1) {
+		if (Size() > 0) {
+			throw std::logic_error("Load into a non-empty database");
+		}
+		std::vector<SortedIndex<int>::Entry> timestamp_entries, karma_entries;
+		std::vector<SortedIndex<uint64_t>::Entry> user_timestamp_entries;
+		for (Record& record : records) {
+			if (slots_by_id.Find(record.id, IdOfSlot{ this }) != SlotsById::NONE) {
+				continue;
+			}
+			const Slot slot = AllocateSlot();
+			slots_by_id.Insert(record.id, slot);
+			timestamps[slot] = record.timestamp;
+			karmas[slot] = record.karma;
+			user_ids[slot] = InternUser(record.user);
+			alive[slot] = true;
+			timestamp_entries.push_back({ record.timestamp, slot });
+			karma_entries.push_back({ record.karma, slot });
+			user_timestamp_entries.push_back({ UserTimestampKey(user_ids[slot], record.timestamp), slot });
+			GetRecord(slot) = std::move(record);
+		}
+
+		std::vector<std::function<void()>> builds = {
+			[&] { timestamp_index.Build(std::move(timestamp_entries)); },
+			[&] { karma_index.Build(std::move(karma_entries)); },
+			[&] { user_timestamp_index.Build(std::move(user_timestamp_entries)); },
+		};
+		std::vector<std::thread> threads;
+		for (size_t i = 1; i < builds.size() && i < thread_count; ++i) {
+			threads.emplace_back(builds[i]);
+		}
+		for (size_t i = threads.size() + 1; i < builds.size(); ++i) {
+			builds[i]();
+		}
+		builds[0]();
+		for (auto& thread : threads) {
+			thread.join();
+		}
+	}
+
+	// Calls callback(record) for every record, in no particular order
+	template <typename Callback>
+	void ForEachRecord(Callback callback) const {
+		for (Slot slot = 0; slot < timestamps.size(); ++slot) {
+			if (alive[slot]) {
+				callback(static_cast<const Record&>(GetRecord(slot)));
+			}
+		}
+	}
+
+	// Calls the callback for the matching records in the order of the scanned index
+	template <typename Callback>
+	void Find(const Query& query, Callback callback) const {
+		Find(query, PlanQuery(query), callback);
+	}
+
+	// Walks the smallest of the index ranges the predicates give, as counted in the
+	// indexes, and checks the rest of the predicates in the columns. When the next
+	// smallest range is not much larger, it is marked in a bitmap of slots first:
+	// checking a bit is cheaper than a random read of a column.
+	QueryPlan PlanQuery(const Query& query) const {
+		QueryPlan plan;
+		const std::optional<UserId> user_id = FindUser(query);
+		if (query.user && !user_id) {
+			return plan;
+		}
+
+		std::vector<std::pair<size_t, QueryPlan::Index>> candidates;
+		if (user_id) {
+			// the composite index covers the timestamp predicate as well
+			candidates.push_back({ CountInIndex(QueryPlan::Index::USER_TIMESTAMP, query, *user_id), QueryPlan::Index::USER_TIMESTAMP });
+		} else if (query.timestamp || !query.karma) {
+			candidates.push_back({ CountInIndex(QueryPlan::Index::TIMESTAMP, query, 0), QueryPlan::Index::TIMESTAMP });
+		}
+		if (query.karma) {
+			candidates.push_back({ CountInIndex(QueryPlan::Index::KARMA, query, 0), QueryPlan::Index::KARMA });
+		}
+		std::sort(candidates.begin(), candidates.end());
+
+		std::tie(plan.scanned_count, plan.scanned) = candidates[0];
+		if (candidates.size() > 1) {
+			const size_t filter_cost = plan.scanned_count * RANDOM_READ_COST;
+			const size_t bitmap_cost = candidates[1].first + plan.scanned_count + timestamps.size() / 64;
+			if (bitmap_cost < filter_cost) {
+				std::tie(plan.intersected_count, plan.intersected) = candidates[1];
+			}
+		}
+		return plan;
+	}
+
+	template <typename Callback>
+	void Find(const Query& query, const QueryPlan& plan, Callback callback) const {
+		if (plan.scanned == QueryPlan::Index::NONE) {
+			return;
+		}
+		const UserId user_id = FindUser(query).value_or(0);
+		std::vector<uint64_t> bitmap;
+		if (plan.intersected != QueryPlan::Index::NONE) {
+			bitmap.resize((timestamps.size() + 63) / 64);
+			ForEachInIndex(plan.intersected, query, user_id, [&bitmap](Slot slot) {
+				bitmap[slot / 64] |= uint64_t(1) << (slot % 64);
+				return true;
+			});
+		}
+		ForEachInIndex(plan.scanned, query, user_id, [&](Slot slot) {
+			if (!bitmap.empty() && !(bitmap[slot / 64] >> (slot % 64) & 1)) {
+				return true;
+			}
+			if (!alive[slot] || !MatchesUncovered(slot, query, user_id, plan)) {
+				return true;
+			}
+			return callback(static_cast<const Record&>(GetRecord(slot)));
+		});
+	}
+
+	size_t Size() const {
+		return slots_by_id.Size();
+	}
+
+	// Without the heap memory of the strings and of the user table
+	size_t GetMemoryUsage() const {
+		return record_chunks.size() * CHUNK_SIZE * sizeof(Record)
+			+ timestamps.capacity() * sizeof(int) + karmas.capacity() * sizeof(int)
+			+ user_ids.capacity() * sizeof(UserId) + alive.capacity() * sizeof(bool)
+			+ (free_slots.capacity() + erased_slots.capacity()) * sizeof(Slot)
+			+ slots_by_id.GetMemoryUsage()
+			+ timestamp_index.GetMemoryUsage() + karma_index.GetMemoryUsage() + user_timestamp_index.GetMemoryUsage();
+	}
+
+private:
+	using Slot = uint32_t;
+	using UserId = uint32_t;
+
+	static constexpr size_t CHUNK_SIZE = 4096;
+	static constexpr size_t MIN_PURGED_COUNT = 4096;
+	// a read of a column at a random slot costs about this many sequential steps
+	static constexpr size_t RANDOM_READ_COST = 4;
+
+	std::vector<std::unique_ptr<Record[]>> record_chunks;
+	std::vector<int> timestamps;
+	std::vector<int> karmas;
+	std::vector<UserId> user_ids;
+	std::vector<bool> alive;
+	std::vector<Slot> free_slots;
+	// erased, but still in the indexes
+	std::vector<Slot> erased_slots;
+
+	SlotsById slots_by_id;
+	std::unordered_map<std::string, UserId> user_ids_by_name;
+
+	SortedIndex<int> timestamp_index;
+	SortedIndex<int> karma_index;
+	// user in the high 32 bits, timestamp in the low ones
+	SortedIndex<uint64_t> user_timestamp_index;
+
+	Record& GetRecord(Slot slot) const {
+		return record_chunks[slot / CHUNK_SIZE][slot % CHUNK_SIZE];
+	}
+
+	struct IdOfSlot {
+		const Database* database;
+
+		const std::string& operator()(Slot slot) const {
+			return database->GetRecord(slot).id;
+		}
+	};
+
+	Slot AllocateSlot() {
+		if (!free_slots.empty()) {
+			const Slot slot = free_slots.back();
+			free_slots.pop_back();
+			return slot;
+		}
+		const Slot slot = static_cast<Slot>(timestamps.size());
+		if (slot % CHUNK_SIZE == 0) {
+			record_chunks.push_back(std::make_unique<Record[]>(CHUNK_SIZE));
+		}
+		timestamps.push_back(0);
+		karmas.push_back(0);
+		user_ids.push_back(0);
+		alive.push_back(false);
+		return slot;
+	}
+
+	UserId InternUser(const std::string& user) {
+		return user_ids_by_name.emplace(user, static_cast<UserId>(user_ids_by_name.size())).first->second;
+	}
+
+	static uint64_t UserTimestampKey(UserId user_id, int timestamp) {
+		// flipping the sign bit keeps the order of negative timestamps
+		return static_cast<uint64_t>(user_id) << 32 | (static_cast<uint32_t>(timestamp) ^ 0x80000000u);
+	}
+
+	std::optional<UserId> FindUser(const Query& query) const {
+		if (!query.user) {
+			return std::nullopt;
+		}
+		const auto it = user_ids_by_name.find(*query.user);
+		if (it == user_ids_by_name.end()) {
+			return std::nullopt;
+		}
+		return it->second;
+	}
+
+	static Range GetRange(const std::optional<Range>& range) {
+		return range.value_or(Range{ std::numeric_limits<int>::min(), std::numeric_limits<int>::max() });
+	}
+
+	template <typename SlotCallback>
+	void ForEachInIndex(QueryPlan::Index index, const Query& query, UserId user_id, SlotCallback callback) const {
+		const Range timestamp = GetRange(query.timestamp);
+		const Range karma = GetRange(query.karma);
+		switch (index) {
+		case QueryPlan::Index::USER_TIMESTAMP:
+			user_timestamp_index.ForEachInRange(UserTimestampKey(user_id, timestamp.low), UserTimestampKey(user_id, timestamp.high), callback);
+			break;
+		case QueryPlan::Index::TIMESTAMP:
+			timestamp_index.ForEachInRange(timestamp.low, timestamp.high, callback);
+			break;
+		case QueryPlan::Index::KARMA:
+			karma_index.ForEachInRange(karma.low, karma.high, callback);
+			break;
+		case QueryPlan::Index::NONE:
+			break;
+		}
+	}
+
+	size_t CountInIndex(QueryPlan::Index index, const Query& query, UserId user_id) const {
+		const Range timestamp = GetRange(query.timestamp);
+		const Range karma = GetRange(query.karma);
+		switch (index) {
+		case QueryPlan::Index::USER_TIMESTAMP:
+			if (timestamp.high < timestamp.low) {
+				return 0;
+			}
+			return user_timestamp_index.CountInRange(UserTimestampKey(user_id, timestamp.low), UserTimestampKey(user_id, timestamp.high));
+		case QueryPlan::Index::TIMESTAMP:
+			return timestamp_index.CountInRange(timestamp.low, timestamp.high);
+		case QueryPlan::Index::KARMA:
+			return karma_index.CountInRange(karma.low, karma.high);
+		case QueryPlan::Index::NONE:
+			break;
+		}
+		return 0;
+	}
+
+	// Checks the predicates that neither index of the plan has checked
+	bool MatchesUncovered(Slot slot, const Query& query, UserId user_id, const QueryPlan& plan) const {
+		const auto covered = [&plan](QueryPlan::Index index) {
+			return plan.scanned == index || plan.intersected == index;
+		};
+		const bool user_covered = covered(QueryPlan::Index::USER_TIMESTAMP);
+		if (query.user && !user_covered && user_ids[slot] != user_id) {
+			return false;
+		}
+		if (query.timestamp && !user_covered && !covered(QueryPlan::Index::TIMESTAMP)
+				&& (timestamps[slot] < query.timestamp->low || timestamps[slot] > query.timestamp->high)) {
+			return false;
+		}
+		if (query.karma && !covered(QueryPlan::Index::KARMA)
+				&& (karmas[slot] < query.karma->low || karmas[slot] > query.karma->high)) {
+			return false;
+		}
+		return true;
+	}
+
+	template <typename Callback>
+	auto MakeSlotCallback(Callback& callback) const {
+		return [this, &callback](Slot slot) {
+			return !alive[slot] || callback(static_cast<const Record&>(GetRecord(slot)));
+		};
+	}
+
+	void Purge() {
+		const auto is_erased = [this](Slot slot) { return !alive[slot]; };
+		timestamp_index.Purge(is_erased);
+		karma_index.Purge(is_erased);
+		user_timestamp_index.Purge(is_erased);
+		free_slots.insert(free_slots.end(), erased_slots.begin(), erased_slots.end());
+		erased_slots.clear();
+	}
+};
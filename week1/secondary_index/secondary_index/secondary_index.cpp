@@ -1,23 +1,28 @@
 #include "test_runner.h"
 #include "profile.h"
+#include "database.h"
+#include "wal.h"
+#include "versioned_database.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <limits>
 #include <map>
 #include <string>
 #include <unordered_map>
 #include <deque>
 #include <memory>
+#include <random>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
 
 using namespace std;
 
-struct Record {
-	string id;
-	string title;
-	string user;
-	int timestamp;
-	int karma;
-};
-
 struct IndexIterators {
 	multimap<int, shared_ptr<Record>>::iterator karma_iter;
 	multimap<int, shared_ptr<Record>>::iterator timestamp_iter;
@@ -33,7 +38,8 @@ void IterateOverRange(Iterator begin, Iterator end, Callback callback) {
 	}
 }
 
-class Database {
+// The first version, kept to compare with: five node based containers per record
+class MultimapDatabase {
 public:
 	bool Put(const Record& record) {
 		auto it = make_shared<Record>(record);
@@ -184,6 +190,765 @@ void TestHighload() {
 	ASSERT_EQUAL(0, count);
 }
 
+template <typename Db>
+vector<string> CollectKarmaRange(const Db& db, int low, int high) {
+	vector<string> ids;
+	int last_karma = low;
+	db.RangeByKarma(low, high, [&](const Record& record) {
+		ASSERT(record.karma >= last_karma);
+		last_karma = record.karma;
+		ids.push_back(record.id);
+		return true;
+	});
+	sort(ids.begin(), ids.end());
+	return ids;
+}
+
+template <typename Db>
+vector<string> CollectTimestampRange(const Db& db, int low, int high) {
+	vector<string> ids;
+	db.RangeByTimestamp(low, high, [&](const Record& record) {
+		ids.push_back(record.id);
+		return true;
+	});
+	sort(ids.begin(), ids.end());
+	return ids;
+}
+
+template <typename Db>
+vector<string> CollectUser(const Db& db, const string& user) {
+	vector<string> ids;
+	db.AllByUser(user, [&](const Record& record) {
+		ASSERT_EQUAL(record.user, user);
+		ids.push_back(record.id);
+		return true;
+	});
+	sort(ids.begin(), ids.end());
+	return ids;
+}
+
+void TestEquivalence() {
+	Database db;
+	MultimapDatabase expected_db;
+	mt19937 gen(17);
+	for (int step = 0; step < 100000; ++step) {
+		const string id = "id" + to_string(gen() % 20000);
+		const unsigned operation = gen() % 100;
+		if (operation < 60) {
+			const Record record = { id, "title" + to_string(step), "user" + to_string(gen() % 50),
+				static_cast<int>(gen() % 1000), static_cast<int>(gen() % 200) - 100 };
+			ASSERT_EQUAL(db.Put(record), expected_db.Put(record));
+		} else if (operation < 95) {
+			ASSERT_EQUAL(db.Erase(id), expected_db.Erase(id));
+		} else {
+			const auto record = db.GetById(id);
+			const auto expected_record = expected_db.GetById(id);
+			ASSERT_EQUAL(record != nullptr, expected_record != nullptr);
+			if (record) {
+				ASSERT_EQUAL(record->title, expected_record->title);
+			}
+			const int low = static_cast<int>(gen() % 200) - 100;
+			const int high = low + static_cast<int>(gen() % 20);
+			ASSERT_EQUAL(CollectKarmaRange(db, low, high), CollectKarmaRange(expected_db, low, high));
+			const int from = static_cast<int>(gen() % 1000);
+			ASSERT_EQUAL(CollectTimestampRange(db, from, from + 10), CollectTimestampRange(expected_db, from, from + 10));
+			const string user = "user" + to_string(gen() % 51);
+			ASSERT_EQUAL(CollectUser(db, user), CollectUser(expected_db, user));
+		}
+	}
+	ASSERT_EQUAL(CollectKarmaRange(db, -100, 100), CollectKarmaRange(expected_db, -100, 100));
+}
+
+void TestEarlyStop() {
+	Database db;
+	for (int i = 0; i < 10000; ++i) {
+		db.Put({ "id" + to_string(i), "title", "user", i, i % 100 });
+	}
+	vector<int> timestamps;
+	db.RangeByTimestamp(100, 200, [&timestamps](const Record& record) {
+		timestamps.push_back(record.timestamp);
+		return timestamps.size() < 5;
+	});
+	ASSERT_EQUAL(timestamps, vector<int>({ 100, 101, 102, 103, 104 }));
+
+	int count = 0;
+	db.RangeByKarma(200, 100, [&count](const Record&) {
+		++count;
+		return true;
+	});
+	db.AllByUser("nobody", [&count](const Record&) {
+		++count;
+		return true;
+	});
+	ASSERT_EQUAL(count, 0);
+}
+
+template <typename Db>
+void RunOperations(const string& name, size_t record_count) {
+	const size_t user_count = 100000;
+	const size_t query_count = 1000;
+	mt19937 gen(23);
+	Db db;
+	{
+		LOG_DURATION(name + ": put");
+		for (size_t i = 0; i < record_count; ++i) {
+			db.Put({ "id" + to_string(i), "title", "user" + to_string(gen() % user_count),
+				static_cast<int>(gen() % 1000000000), static_cast<int>(gen() % 2000001) - 1000000 });
+		}
+	}
+	size_t found = 0;
+	{
+		LOG_DURATION(name + ": " + to_string(query_count) + " x RangeByKarma");
+		for (size_t i = 0; i < query_count; ++i) {
+			const int low = static_cast<int>(gen() % 2000001) - 1000000;
+			db.RangeByKarma(low, low + 1000, [&found](const Record&) {
+				++found;
+				return true;
+			});
+		}
+	}
+	{
+		LOG_DURATION(name + ": " + to_string(query_count) + " x AllByUser");
+		for (size_t i = 0; i < query_count; ++i) {
+			db.AllByUser("user" + to_string(gen() % user_count), [&found](const Record& record) {
+				found += record.karma > 0;
+				return true;
+			});
+		}
+	}
+	{
+		LOG_DURATION(name + ": erase");
+		for (size_t i = 0; i < record_count; ++i) {
+			db.Erase("id" + to_string(i));
+		}
+	}
+	ASSERT(found > 0);
+}
+
+void TestSpeed() {
+	RunOperations<MultimapDatabase>("multimap, 1M records", 1000000);
+	RunOperations<Database>("flat indexes, 1M records", 1000000);
+	RunOperations<Database>("flat indexes, 10M records", 10000000);
+}
+
+vector<string> CollectQuery(const Database& db, const Query& query, const QueryPlan& plan) {
+	vector<string> ids;
+	db.Find(query, plan, [&](const Record& record) {
+		ids.push_back(record.id);
+		return true;
+	});
+	sort(ids.begin(), ids.end());
+	return ids;
+}
+
+// The matching records found by walking all of them
+template <typename Db>
+vector<string> CollectQueryByScan(const Db& db, const Query& query) {
+	vector<string> ids;
+	db.RangeByTimestamp(numeric_limits<int>::min(), numeric_limits<int>::max(), [&](const Record& record) {
+		const bool matches = (!query.user || record.user == *query.user)
+			&& (!query.timestamp || (query.timestamp->low <= record.timestamp && record.timestamp <= query.timestamp->high))
+			&& (!query.karma || (query.karma->low <= record.karma && record.karma <= query.karma->high));
+		if (matches) {
+			ids.push_back(record.id);
+		}
+		return true;
+	});
+	sort(ids.begin(), ids.end());
+	return ids;
+}
+
+void TestQueries() {
+	Database db;
+	MultimapDatabase expected_db;
+	mt19937 gen(29);
+	for (int i = 0; i < 20000; ++i) {
+		const Record record = { "id" + to_string(i), "title", "user" + to_string(gen() % 30),
+			static_cast<int>(gen() % 2000) - 1000, static_cast<int>(gen() % 200) - 100 };
+		db.Put(record);
+		expected_db.Put(record);
+		if (gen() % 4 == 0) {
+			const string id = "id" + to_string(gen() % (i + 1));
+			db.Erase(id);
+			expected_db.Erase(id);
+		}
+	}
+
+	using Index = QueryPlan::Index;
+	for (int i = 0; i < 300; ++i) {
+		Query query;
+		if (gen() % 2) {
+			query.user = "user" + to_string(gen() % 31);
+		}
+		if (gen() % 2) {
+			const int low = static_cast<int>(gen() % 2000) - 1000;
+			query.timestamp = Range{ low, low + static_cast<int>(gen() % 500) };
+		}
+		if (gen() % 2) {
+			const int low = static_cast<int>(gen() % 200) - 100;
+			query.karma = Range{ low, low + static_cast<int>(gen() % 100) };
+		}
+		const vector<string> expected = CollectQueryByScan(expected_db, query);
+		const QueryPlan plan = db.PlanQuery(query);
+		ASSERT_EQUAL(CollectQuery(db, query, plan), expected);
+
+		// every other plan gives the same records
+		for (const Index scanned : { Index::USER_TIMESTAMP, Index::TIMESTAMP, Index::KARMA }) {
+			for (const Index intersected : { Index::NONE, Index::USER_TIMESTAMP, Index::TIMESTAMP, Index::KARMA }) {
+				const bool needs_user = scanned == Index::USER_TIMESTAMP || intersected == Index::USER_TIMESTAMP;
+				if (plan.scanned == Index::NONE || scanned == intersected || (needs_user && !query.user)) {
+					continue;
+				}
+				QueryPlan other_plan;
+				other_plan.scanned = scanned;
+				other_plan.intersected = intersected;
+				ASSERT_EQUAL(CollectQuery(db, query, other_plan), expected);
+			}
+		}
+	}
+}
+
+void TestQueryPlans() {
+	Database db;
+	for (int i = 0; i < 10000; ++i) {
+		db.Put({ "id" + to_string(i), "title", i % 100 == 0 ? "rare" : "common", i, i % 1000 });
+	}
+	using Index = QueryPlan::Index;
+	ASSERT(db.PlanQuery({ string("nobody"), nullopt, nullopt }).scanned == Index::NONE);
+	{
+		const QueryPlan plan = db.PlanQuery({ string("rare"), nullopt, Range{ 0, 500 } });
+		ASSERT(plan.scanned == Index::USER_TIMESTAMP);
+		ASSERT_EQUAL(plan.scanned_count, 100u);
+	}
+	{
+		const QueryPlan plan = db.PlanQuery({ string("common"), Range{ 0, 9999 }, Range{ 7, 7 } });
+		ASSERT(plan.scanned == Index::KARMA);
+		ASSERT_EQUAL(plan.scanned_count, 10u);
+	}
+	{
+		const QueryPlan plan = db.PlanQuery({ nullopt, Range{ 0, 4999 }, Range{ 0, 399 } });
+		ASSERT(plan.scanned == Index::KARMA);
+		ASSERT(plan.intersected == Index::TIMESTAMP);
+	}
+	ASSERT(db.PlanQuery({}).scanned == Index::TIMESTAMP);
+
+	int count = 0;
+	db.Find({ string("common"), nullopt, nullopt }, [&count](const Record&) {
+		return ++count < 3;
+	});
+	ASSERT_EQUAL(count, 3);
+}
+
+void TestQuerySpeed() {
+	const size_t record_count = 2000000;
+	const size_t user_count = 10000;
+	const int max_timestamp = 100000000;
+	mt19937 gen(31);
+	uniform_real_distribution<double> unit(0, 1);
+	Database db;
+	for (size_t i = 0; i < record_count; ++i) {
+		// a few users write most of the records
+		const size_t user = static_cast<size_t>(pow(unit(gen), 6) * user_count);
+		db.Put({ "id" + to_string(i), "title", "user" + to_string(user),
+			static_cast<int>(gen() % max_timestamp), static_cast<int>(gen() % 10000) });
+	}
+
+	const size_t query_count = 100;
+	const auto run_queries = [&](const string& name, auto make_query) {
+		vector<Query> queries;
+		for (size_t i = 0; i < query_count; ++i) {
+			queries.push_back(make_query());
+		}
+		size_t filtered_count = 0;
+		{
+			LOG_DURATION(name + ": all records of the user, filtered in the callback");
+			for (const Query& query : queries) {
+				const auto matches = [&query](const Record& record) {
+					return (!query.timestamp || (query.timestamp->low <= record.timestamp && record.timestamp <= query.timestamp->high))
+						&& (!query.karma || (query.karma->low <= record.karma && record.karma <= query.karma->high));
+				};
+				if (query.user) {
+					db.AllByUser(*query.user, [&](const Record& record) {
+						filtered_count += matches(record);
+						return true;
+					});
+				} else {
+					db.RangeByTimestamp(query.timestamp->low, query.timestamp->high, [&](const Record& record) {
+						filtered_count += matches(record);
+						return true;
+					});
+				}
+			}
+		}
+		size_t found_count = 0;
+		{
+			LOG_DURATION(name + ": Find");
+			for (const Query& query : queries) {
+				db.Find(query, [&found_count](const Record&) {
+					++found_count;
+					return true;
+				});
+			}
+		}
+		ASSERT_EQUAL(found_count, filtered_count);
+
+		found_count = 0;
+		{
+			LOG_DURATION(name + ": Find, the best index only");
+			for (const Query& query : queries) {
+				QueryPlan plan = db.PlanQuery(query);
+				plan.intersected = QueryPlan::Index::NONE;
+				db.Find(query, plan, [&found_count](const Record&) {
+					++found_count;
+					return true;
+				});
+			}
+		}
+		ASSERT_EQUAL(found_count, filtered_count);
+	};
+
+	const int day = max_timestamp / 365;
+	run_queries("heavy user, a week, karma >= 9000", [&] {
+		const int from = static_cast<int>(gen() % (max_timestamp - 7 * day));
+		return Query{ string("user0"), Range{ from, from + 7 * day }, Range{ 9000, numeric_limits<int>::max() } };
+	});
+	run_queries("any user, karma >= 9990", [&] {
+		return Query{ "user" + to_string(gen() % user_count), nullopt, Range{ 9990, numeric_limits<int>::max() } };
+	});
+	run_queries("no user, a quarter, karma in 1%", [&] {
+		const int from = static_cast<int>(gen() % (max_timestamp - 91 * day));
+		const int karma = static_cast<int>(gen() % 9900);
+		return Query{ nullopt, Range{ from, from + 91 * day }, Range{ karma, karma + 99 } };
+	});
+	run_queries("no user, half a year, karma in 25%", [&] {
+		const int from = static_cast<int>(gen() % (max_timestamp - 182 * day));
+		const int karma = static_cast<int>(gen() % 7500);
+		return Query{ nullopt, Range{ from, from + 182 * day }, Range{ karma, karma + 2499 } };
+	});
+}
+
+// All records as text, to compare whole databases
+vector<string> CollectRecords(const Database& db) {
+	vector<string> records;
+	db.ForEachRecord([&records](const Record& record) {
+		records.push_back(record.id + "|" + record.title + "|" + record.user + "|"
+			+ to_string(record.timestamp) + "|" + to_string(record.karma));
+	});
+	sort(records.begin(), records.end());
+	return records;
+}
+
+class TemporaryDirectory {
+public:
+	explicit TemporaryDirectory(const string& name)
+		: path(filesystem::temp_directory_path() / name)
+	{
+		filesystem::remove_all(path);
+	}
+
+	~TemporaryDirectory() {
+		filesystem::remove_all(path);
+	}
+
+	const filesystem::path& GetPath() const {
+		return path;
+	}
+
+private:
+	filesystem::path path;
+};
+
+void TestLoad() {
+	mt19937 gen(37);
+	vector<Record> records;
+	Database expected_db;
+	for (int i = 0; i < 50000; ++i) {
+		records.push_back({ "id" + to_string(gen() % 40000), "title" + to_string(i), "user" + to_string(gen() % 100),
+			static_cast<int>(gen() % 1000), static_cast<int>(gen() % 200) - 100 });
+		expected_db.Put(records.back());
+	}
+	for (size_t thread_count : { 1, 2, 4 }) {
+		Database db;
+		db.Load(records, thread_count);
+		ASSERT_EQUAL(db.Size(), expected_db.Size());
+		ASSERT_EQUAL(CollectRecords(db), CollectRecords(expected_db));
+		ASSERT_EQUAL(CollectKarmaRange(db, -10, 10), CollectKarmaRange(expected_db, -10, 10));
+		ASSERT_EQUAL(CollectTimestampRange(db, 100, 120), CollectTimestampRange(expected_db, 100, 120));
+		ASSERT_EQUAL(CollectUser(db, "user7"), CollectUser(expected_db, "user7"));
+		ASSERT(db.Put({ "new", "title", "user7", 110, 0 }));
+		ASSERT_EQUAL(CollectTimestampRange(db, 110, 110).size(), CollectTimestampRange(expected_db, 110, 110).size() + 1);
+	}
+
+	Database db;
+	db.Put(records[0]);
+	bool thrown = false;
+	try {
+		db.Load(records);
+	} catch (const logic_error&) {
+		thrown = true;
+	}
+	ASSERT(thrown);
+}
+
+void TestRecovery() {
+	TemporaryDirectory directory("secondary_index_test_recovery");
+	DurabilitySettings settings;
+	settings.directory = directory.GetPath();
+	settings.snapshot_interval = 7000;
+	settings.recovery_thread_count = 3;
+	Database expected_db;
+	mt19937 gen(41);
+	for (int restart = 0; restart < 5; ++restart) {
+		DurableDatabase db(settings);
+		ASSERT_EQUAL(CollectRecords(db.GetDatabase()), CollectRecords(expected_db));
+		for (int step = 0; step < 10000; ++step) {
+			const string id = "id" + to_string(gen() % 5000);
+			if (gen() % 3) {
+				const Record record = { id, "title" + to_string(step), "user" + to_string(gen() % 20),
+					static_cast<int>(gen() % 1000), static_cast<int>(gen() % 200) - 100 };
+				ASSERT_EQUAL(db.Put(record), expected_db.Put(record));
+			} else {
+				ASSERT_EQUAL(db.Erase(id), expected_db.Erase(id));
+			}
+		}
+		ASSERT_EQUAL(CollectUser(db.GetDatabase(), "user3"), CollectUser(expected_db, "user3"));
+	}
+	DurableDatabase db(settings);
+	ASSERT_EQUAL(CollectRecords(db.GetDatabase()), CollectRecords(expected_db));
+	ASSERT_EQUAL(CollectKarmaRange(db.GetDatabase(), -5, 5), CollectKarmaRange(expected_db, -5, 5));
+
+	// the older snapshots and logs are gone
+	size_t file_count = 0;
+	for (const auto& entry : filesystem::directory_iterator(directory.GetPath())) {
+		file_count += entry.is_regular_file();
+	}
+	ASSERT_EQUAL(file_count, 2u);
+}
+
+filesystem::path FindLog(const filesystem::path& directory) {
+	for (const auto& entry : filesystem::directory_iterator(directory)) {
+		if (entry.path().filename().string().rfind("log.", 0) == 0) {
+			return entry.path();
+		}
+	}
+	return {};
+}
+
+void TestTornLog() {
+	TemporaryDirectory directory("secondary_index_test_torn_log");
+	DurabilitySettings settings;
+	settings.directory = directory.GetPath();
+	{
+		DurableDatabase db(settings);
+		for (int i = 0; i < 100; ++i) {
+			db.Put({ "id" + to_string(i), "title", "user", i, i });
+		}
+		db.Erase("id0");
+		db.Sync();
+		ASSERT_EQUAL(db.GetLog().GetEntryCount(), 101u);
+	}
+	// the last entry, the erase of id0, is written only in part
+	const filesystem::path log_path = FindLog(directory.GetPath());
+	filesystem::resize_file(log_path, filesystem::file_size(log_path) - 3);
+	{
+		DurableDatabase db(settings);
+		ASSERT_EQUAL(db.GetRecoveryStats().replayed_entry_count, 100u);
+		ASSERT_EQUAL(db.GetDatabase().Size(), 100u);
+		ASSERT(db.GetDatabase().GetById("id0") != nullptr);
+		db.Erase("id1");
+	}
+	{
+		// an entry with a wrong checksum hides the whole entries after it
+		string log;
+		BinaryWriter writer(log);
+		writer.WriteInt(5, 4);
+		writer.WriteInt(0, 4);
+		log += string(5, 'x');
+		string payload;
+		BinaryWriter(payload).WriteInt(static_cast<uint8_t>(WriteAheadLog::EntryKind::PUT), 1);
+		BinaryWriter(payload).WriteRecord({ "id1000", "title", "user", 1000, 1000 });
+		writer.WriteInt(payload.size(), 4);
+		writer.WriteInt(Checksum(payload), 4);
+		log += payload;
+		ofstream(FindLog(directory.GetPath()), ios::binary | ios::app) << log;
+	}
+	{
+		DurableDatabase db(settings);
+		ASSERT_EQUAL(db.GetDatabase().Size(), 99u);
+		ASSERT(db.GetDatabase().GetById("id1") == nullptr);
+		ASSERT(db.GetDatabase().GetById("id0") != nullptr);
+		ASSERT(db.GetDatabase().GetById("id1000") == nullptr);
+	}
+}
+
+void TestDurabilitySpeed() {
+	const size_t record_count = 1000000;
+	const auto make_record = [](size_t i) {
+		return Record{ "id" + to_string(i), "title", "user" + to_string(i % 100000),
+			static_cast<int>(i * 2654435761u % 1000000000), static_cast<int>(i % 2000001) - 1000000 };
+	};
+	{
+		Database db;
+		LOG_DURATION("no log: " + to_string(record_count) + " x Put");
+		for (size_t i = 0; i < record_count; ++i) {
+			db.Put(make_record(i));
+		}
+	}
+
+	TemporaryDirectory directory("secondary_index_durability_speed");
+	DurabilitySettings settings;
+	settings.directory = directory.GetPath();
+	settings.snapshot_interval = 10 * record_count;
+	const auto run_puts = [&](const string& name, size_t count, size_t sync_interval) {
+		filesystem::remove_all(directory.GetPath());
+		DurableDatabase db(settings);
+		{
+			LOG_DURATION(name + ": " + to_string(count) + " x Put");
+			for (size_t i = 0; i < count; ++i) {
+				db.Put(make_record(i));
+				if ((i + 1) % sync_interval == 0) {
+					db.Sync();
+				}
+			}
+			db.Sync();
+		}
+		cerr << "  " << db.GetLog().GetGroupCount() << " groups written" << endl;
+	};
+	run_puts("log, Sync after every 10", record_count / 100, 10);
+	run_puts("log, Sync after every 1000", record_count, 1000);
+	run_puts("log, Sync at the end", record_count, record_count);
+
+	{
+		LOG_DURATION("recovery from the log and a new snapshot");
+		DurableDatabase db(settings);
+		ASSERT_EQUAL(db.GetDatabase().Size(), record_count);
+	}
+	for (size_t thread_count : { 1, 4 }) {
+		settings.recovery_thread_count = thread_count;
+		LOG_DURATION("recovery from the snapshot, thread_count " + to_string(thread_count));
+		DurableDatabase db(settings);
+		ASSERT_EQUAL(db.GetDatabase().Size(), record_count);
+	}
+}
+
+void TestVersionedEquivalence() {
+	VersionedDatabase db;
+	Database expected_db;
+	mt19937 gen(43);
+	for (int step = 0; step < 100000; ++step) {
+		const string id = "id" + to_string(gen() % 20000);
+		const unsigned operation = gen() % 100;
+		if (operation < 60) {
+			const Record record = { id, "title" + to_string(step), "user" + to_string(gen() % 50),
+				static_cast<int>(gen() % 1000), static_cast<int>(gen() % 200) - 100 };
+			ASSERT_EQUAL(db.Put(record), expected_db.Put(record));
+		} else if (operation < 95) {
+			ASSERT_EQUAL(db.Erase(id), expected_db.Erase(id));
+		} else {
+			db.Commit();
+			const auto view = db.Read();
+			ASSERT_EQUAL(view.Size(), expected_db.Size());
+			const auto record = view.GetById(id);
+			const auto expected_record = expected_db.GetById(id);
+			ASSERT_EQUAL(record != nullptr, expected_record != nullptr);
+			if (record) {
+				ASSERT_EQUAL(record->title, expected_record->title);
+			}
+			const int low = static_cast<int>(gen() % 200) - 100;
+			const int high = low + static_cast<int>(gen() % 20);
+			ASSERT_EQUAL(CollectKarmaRange(view, low, high), CollectKarmaRange(expected_db, low, high));
+			const int from = static_cast<int>(gen() % 1000);
+			ASSERT_EQUAL(CollectTimestampRange(view, from, from + 10), CollectTimestampRange(expected_db, from, from + 10));
+			const string user = "user" + to_string(gen() % 51);
+			ASSERT_EQUAL(CollectUser(view, user), CollectUser(expected_db, user));
+		}
+	}
+	db.Commit();
+	ASSERT_EQUAL(CollectKarmaRange(db.Read(), -100, 100), CollectKarmaRange(expected_db, -100, 100));
+	// the erased records are freed by the merges, so few are left besides the live ones
+	ASSERT(db.GetRecordCount() < 2 * expected_db.Size() + 4096);
+}
+
+void TestVersionedSnapshots() {
+	VersionedDatabase db;
+	for (int i = 0; i < 10000; ++i) {
+		db.Put({ "id" + to_string(i), "title", "user" + to_string(i % 10), i, i % 100 });
+	}
+	ASSERT_EQUAL(db.Read().Size(), 0u);
+	db.Commit();
+	ASSERT_EQUAL(db.GetVersion(), 1u);
+	{
+		const auto old_view = db.Read();
+		const vector<string> old_ids = CollectKarmaRange(old_view, 0, 99);
+		for (int i = 0; i < 10000; ++i) {
+			db.Erase("id" + to_string(i));
+			db.Put({ "new" + to_string(i), "title", "user" + to_string(i % 10), i, i % 100 });
+			if (i % 100 == 0) {
+				db.Commit();
+			}
+		}
+		db.Commit();
+		ASSERT_EQUAL(old_view.GetVersion(), 1u);
+		ASSERT_EQUAL(old_view.Size(), 10000u);
+		ASSERT_EQUAL(CollectKarmaRange(old_view, 0, 99), old_ids);
+		ASSERT_EQUAL(old_view.GetById("id5")->title, "title");
+		ASSERT(old_view.GetById("new5") == nullptr);
+		// the pinned version keeps its records
+		ASSERT_EQUAL(db.GetRecordCount(), 20000u);
+
+		const auto view = db.Read();
+		ASSERT(view.GetById("id5") == nullptr);
+		ASSERT(view.GetById("new5") != nullptr);
+		ASSERT_EQUAL(CollectUser(view, "user3").size(), 1000u);
+		ASSERT_EQUAL(CollectTimestampRange(view, 0, 9999).size(), 10000u);
+	}
+	// the records the merges dropped while the view was open
+	db.CollectGarbage();
+	ASSERT(db.GetRecordCount() < 20000u);
+}
+
+// The writer puts and erases the records in pairs within one commit, so a
+// consistent view sees either both records of a pair or neither
+void TestVersionedConcurrency() {
+	VersionedDatabase db;
+	atomic<bool> done = false;
+	thread writer([&] {
+		for (int i = 0; i < 20000; ++i) {
+			for (const string prefix : { "a", "b" }) {
+				db.Put({ prefix + to_string(i), "title", "user", i, i % 100 });
+				if (i >= 100) {
+					db.Erase(prefix + to_string(i - 100));
+				}
+			}
+			db.Commit();
+		}
+		done = true;
+	});
+
+	vector<thread> readers;
+	atomic<size_t> view_count = 0;
+	// a failed ASSERT in a thread would terminate the process, so readers only count errors
+	atomic<size_t> error_count = 0;
+	for (int reader = 0; reader < 3; ++reader) {
+		readers.emplace_back([&] {
+			VersionedDatabase::Version last_version = 0;
+			while (!done) {
+				const auto view = db.Read();
+				if (view.GetVersion() < last_version) {
+					++error_count;
+				}
+				last_version = view.GetVersion();
+				size_t count = 0;
+				view.RangeByKarma(0, 99, [&](const Record& record) {
+					++count;
+					const string pair_id = (record.id[0] == 'a' ? "b" : "a") + record.id.substr(1);
+					if (view.GetById(pair_id) == nullptr) {
+						++error_count;
+					}
+					return true;
+				});
+				if (count != view.Size() || count % 2 != 0) {
+					++error_count;
+				}
+				++view_count;
+			}
+		});
+	}
+	writer.join();
+	for (auto& reader : readers) {
+		reader.join();
+	}
+	ASSERT_EQUAL(error_count.load(), 0u);
+	ASSERT(view_count > 0);
+	// the erased records wait for a merge, up to a compaction
+	db.CollectGarbage();
+	ASSERT(db.GetRecordCount() <= db.Read().Size() + 4096);
+}
+
+// Queries per second while one thread writes all the time: the versioned
+// database against Database behind a shared_mutex
+void TestVersionedSpeed() {
+	const size_t record_count = 1000000;
+	const size_t commit_interval = 1000;
+	const auto make_record = [](size_t i) {
+		return Record{ "id" + to_string(i), "title", "user" + to_string(i % 100000),
+			static_cast<int>(i * 2654435761u % 1000000000), static_cast<int>(i % 2000001) - 1000000 };
+	};
+	const auto run = [&](const string& name, auto& db, auto write, auto query) {
+		for (size_t i = 0; i < record_count; ++i) {
+			write(db, i);
+		}
+		for (const size_t reader_count : { 1, 2, 4 }) {
+			atomic<bool> done = false;
+			atomic<size_t> query_count = 0;
+			size_t write_count = 0;
+			thread writer([&] {
+				while (!done) {
+					write(db, record_count + write_count++);
+				}
+			});
+			vector<thread> readers;
+			atomic<size_t> idle_reader_count = 0;
+			for (size_t reader = 0; reader < reader_count; ++reader) {
+				readers.emplace_back([&, reader] {
+					mt19937 gen(static_cast<unsigned>(reader));
+					size_t found = 0;
+					while (!done) {
+						found += query(db, static_cast<int>(gen() % 1000000000));
+						++query_count;
+					}
+					if (found == 0) {
+						++idle_reader_count;
+					}
+				});
+			}
+			this_thread::sleep_for(chrono::seconds(1));
+			done = true;
+			writer.join();
+			for (auto& reader : readers) {
+				reader.join();
+			}
+			ASSERT_EQUAL(idle_reader_count.load(), 0u);
+			cerr << name << ", reader_count " << reader_count << ": " << query_count << " queries and "
+				<< write_count << " writes per second" << endl;
+		}
+	};
+
+	VersionedDatabase versioned_db;
+	run("versioned", versioned_db, [&](VersionedDatabase& db, size_t i) {
+		db.Put(make_record(i));
+		db.Erase("id" + to_string(i - record_count / 2));
+		if (i % commit_interval == 0) {
+			db.Commit();
+		}
+	}, [](const VersionedDatabase& db, int from) {
+		size_t count = 0;
+		db.Read().RangeByTimestamp(from, from + 100000, [&count](const Record&) {
+			++count;
+			return true;
+		});
+		return count;
+	});
+
+	struct LockedDatabase {
+		mutable shared_mutex mutex;
+		Database db;
+	} locked_db;
+	run("shared_mutex", locked_db, [&](LockedDatabase& locked, size_t i) {
+		lock_guard<shared_mutex> guard(locked.mutex);
+		locked.db.Put(make_record(i));
+		locked.db.Erase("id" + to_string(i - record_count / 2));
+	}, [](const LockedDatabase& locked, int from) {
+		size_t count = 0;
+		shared_lock<shared_mutex> guard(locked.mutex);
+		locked.db.RangeByTimestamp(from, from + 100000, [&count](const Record&) {
+			++count;
+			return true;
+		});
+		return count;
+	});
+}
+
 int main() {
 	TestRunner tr;
 	RUN_TEST(tr, TestRangeBoundaries);
@@ -191,5 +956,19 @@ int main() {
 	RUN_TEST(tr, TestReplacement);
 	RUN_TEST(tr, TestErase);
 	RUN_TEST(tr, TestHighload);
+	RUN_TEST(tr, TestEquivalence);
+	RUN_TEST(tr, TestEarlyStop);
+	RUN_TEST(tr, TestQueries);
+	RUN_TEST(tr, TestQueryPlans);
+	RUN_TEST(tr, TestLoad);
+	RUN_TEST(tr, TestRecovery);
+	RUN_TEST(tr, TestTornLog);
+	RUN_TEST(tr, TestVersionedEquivalence);
+	RUN_TEST(tr, TestVersionedSnapshots);
+	RUN_TEST(tr, TestVersionedConcurrency);
+	RUN_TEST(tr, TestSpeed);
+	RUN_TEST(tr, TestQuerySpeed);
+	RUN_TEST(tr, TestDurabilitySpeed);
+	RUN_TEST(tr, TestVersionedSpeed);
 	return 0;
 }
@@ -0,0 +1,469 @@
+#pragma once
+
+#include "database.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Database for one writer thread and any number of reader threads. The writer
+// calls Put and Erase, which take effect together on Commit: it publishes a new
+// numbered version. A reader takes a ReadView, which pins the latest version
+// and sees exactly it for as long as it lives, without locks, however much the
+// writer changes meanwhile.
+//
+// Every index is a stack of immutable sorted runs: Commit sorts the changes
+// into a new run and merges runs of similar sizes, so a version is just the
+// list of its runs, shared with the versions around it. A record is never
+// changed in place: Erase marks the version from which it is gone, and the
+// entries of gone records are dropped when their runs are merged. A merged run,
+// a dropped record or a replaced version is freed once no reader has pinned a
+// version older than the one that stopped using it.
+class VersionedDatabase {
+	struct Snapshot;
+
+public:
+	using Version = uint64_t;
+
+	class ReadView {
+	public:
+		ReadView(ReadView&& other)
+			: snapshot(other.snapshot)
+			, pin(std::exchange(other.pin, nullptr))
+		{
+		}
+
+		ReadView(const ReadView&) = delete;
+		ReadView& operator=(const ReadView&) = delete;
+		ReadView& operator=(ReadView&&) = delete;
+
+		~ReadView() {
+			if (pin) {
+				pin->store(UNPINNED, std::memory_order_release);
+			}
+		}
+
+		// The record stays valid while the view lives
+		const Record* GetById(const std::string& id) const {
+			const Record* found = nullptr;
+			const size_t hash = std::hash<std::string>()(id);
+			ForEachVisible(snapshot->id_runs, hash, hash, [&](const StoredRecord& stored) {
+				if (stored.record.id == id) {
+					found = &stored.record;
+					return false;
+				}
+				return true;
+			});
+			return found;
+		}
+
+		template <typename Callback>
+		void RangeByTimestamp(int low, int high, Callback callback) const {
+			ForEachVisible(snapshot->timestamp_runs, low, high, [&callback](const StoredRecord& stored) {
+				return callback(stored.record);
+			});
+		}
+
+		template <typename Callback>
+		void RangeByKarma(int low, int high, Callback callback) const {
+			ForEachVisible(snapshot->karma_runs, low, high, [&callback](const StoredRecord& stored) {
+				return callback(stored.record);
+			});
+		}
+
+		template <typename Callback>
+		void AllByUser(const std::string& user, Callback callback) const {
+			const size_t hash = std::hash<std::string>()(user);
+			ForEachVisible(snapshot->user_runs, UserKey(hash, std::numeric_limits<int>::min()), UserKey(hash, std::numeric_limits<int>::max()),
+				[&](const StoredRecord& stored) {
+					// other users with the same hash
+					return stored.record.user != user || callback(stored.record);
+				});
+		}
+
+		size_t Size() const {
+			return snapshot->size;
+		}
+
+		Version GetVersion() const {
+			return snapshot->version;
+		}
+
+	private:
+		friend class VersionedDatabase;
+
+		const Snapshot* snapshot;
+		std::atomic<Version>* pin;
+
+		ReadView(const Snapshot* snapshot, std::atomic<Version>* pin)
+			: snapshot(snapshot)
+			, pin(pin)
+		{
+		}
+
+		// Merges the runs on the fly and skips the records gone in this version
+		template <typename Runs, typename Key, typename Callback>
+		void ForEachVisible(const Runs& runs, Key low, Key high, Callback callback) const {
+			if (high < low) {
+				return;
+			}
+			struct Cursor {
+				const Entry<Key>* current;
+				const Entry<Key>* end;
+			};
+			std::vector<Cursor> cursors;
+			for (const auto* run : runs) {
+				const auto begin = std::lower_bound(run->begin(), run->end(), low, [](const Entry<Key>& entry, const Key& key) {
+					return entry.key < key;
+				});
+				const auto end = std::upper_bound(begin, run->end(), high, [](const Key& key, const Entry<Key>& entry) {
+					return key < entry.key;
+				});
+				if (begin != end) {
+					cursors.push_back({ &*begin, &*begin + (end - begin) });
+				}
+			}
+			while (true) {
+				Cursor* next = nullptr;
+				for (Cursor& cursor : cursors) {
+					if (cursor.current != cursor.end && (!next || *cursor.current < *next->current)) {
+						next = &cursor;
+					}
+				}
+				if (!next) {
+					return;
+				}
+				const StoredRecord& stored = *next->current++->record;
+				// the runs of a version hold only the records put up to it
+				if (stored.erased.load(std::memory_order_relaxed) > snapshot->version && !callback(stored)) {
+					return;
+				}
+			}
+		}
+	};
+
+	explicit VersionedDatabase(size_t max_reader_count = 256)
+		: pins(std::max<size_t>(max_reader_count, 1))
+		, current(new Snapshot())
+	{
+	}
+
+	VersionedDatabase(const VersionedDatabase&) = delete;
+	VersionedDatabase& operator=(const VersionedDatabase&) = delete;
+
+	// No ReadView may outlive the database
+	~VersionedDatabase() {
+		const auto free_entries = [this](auto& index) {
+			index.Clear([this](StoredRecord* record) { ReleaseEntry(record, nullptr); });
+		};
+		free_entries(id_index);
+		free_entries(timestamp_index);
+		free_entries(karma_index);
+		free_entries(user_index);
+		for (Retired& retired : retired_queue) {
+			FreeRecords(retired);
+		}
+		delete current.load();
+	}
+
+	// Pins the latest version; waits while max_reader_count views are open.
+	// May be called from any thread.
+	ReadView Read() const {
+		thread_local size_t first_pin = std::hash<std::thread::id>()(std::this_thread::get_id());
+		for (size_t attempt = 0;; ++attempt) {
+			std::atomic<Version>& pin = pins[(first_pin + attempt) % pins.size()].version;
+			Version expected = UNPINNED;
+			// the published version is not newer than the current snapshot, so
+			// pinning it first keeps the snapshot from being freed before it is read
+			if (pin.load(std::memory_order_relaxed) == UNPINNED && pin.compare_exchange_strong(expected, latest_version.load())) {
+				first_pin = (first_pin + attempt) % pins.size();
+				const Snapshot* snapshot = current.load();
+				pin.store(snapshot->version);
+				return ReadView(snapshot, &pin);
+			}
+			if (attempt % pins.size() == pins.size() - 1) {
+				std::this_thread::yield();
+			}
+		}
+	}
+
+	// Put, Erase, Commit and CollectGarbage belong to the writer thread.
+	// The changes are seen by the views taken after the next Commit.
+	bool Put(const Record& record) {
+		if (live_records.count(record.id)) {
+			return false;
+		}
+		StoredRecord* stored = new StoredRecord(record);
+		++record_count;
+		live_records.emplace(stored->record.id, stored);
+		id_index.Add(std::hash<std::string>()(record.id), stored);
+		timestamp_index.Add(record.timestamp, stored);
+		karma_index.Add(record.karma, stored);
+		user_index.Add(UserKey(std::hash<std::string>()(record.user), record.timestamp), stored);
+		has_changes = true;
+		return true;
+	}
+
+	bool Erase(const std::string& id) {
+		const auto it = live_records.find(id);
+		if (it == live_records.end()) {
+			return false;
+		}
+		it->second->erased.store(next_version, std::memory_order_relaxed);
+		live_records.erase(it);
+		++erased_record_count;
+		has_changes = true;
+		return true;
+	}
+
+	// Publishes the changes since the previous Commit as a new version
+	void Commit() {
+		if (!has_changes) {
+			return;
+		}
+		Retired retired;
+		retired.version = next_version;
+		// merge everything when the gone records outnumber the live ones
+		const bool compact = erased_record_count > std::max(MIN_COMPACTED_COUNT, live_records.size());
+		const auto release_entry = [this, &retired](StoredRecord* record) { ReleaseEntry(record, &retired); };
+		id_index.Commit(compact, retired, release_entry);
+		timestamp_index.Commit(compact, retired, release_entry);
+		karma_index.Commit(compact, retired, release_entry);
+		user_index.Commit(compact, retired, release_entry);
+
+		auto snapshot = std::make_unique<Snapshot>();
+		snapshot->version = next_version;
+		snapshot->size = live_records.size();
+		snapshot->id_runs = id_index.GetRuns();
+		snapshot->timestamp_runs = timestamp_index.GetRuns();
+		snapshot->karma_runs = karma_index.GetRuns();
+		snapshot->user_runs = user_index.GetRuns();
+		retired.snapshot.reset(current.exchange(snapshot.release()));
+		latest_version.store(next_version);
+		retired_queue.push_back(std::move(retired));
+		++next_version;
+		has_changes = false;
+		CollectGarbage();
+	}
+
+	// Frees what only the versions no view has pinned were using; Commit calls it too
+	void CollectGarbage() {
+		Version oldest_pinned = UNPINNED;
+		for (const ReaderPin& pin : pins) {
+			oldest_pinned = std::min(oldest_pinned, pin.version.load());
+		}
+		while (!retired_queue.empty() && retired_queue.front().version <= oldest_pinned) {
+			FreeRecords(retired_queue.front());
+			retired_queue.pop_front();
+		}
+	}
+
+	// The last committed version
+	Version GetVersion() const {
+		return next_version - 1;
+	}
+
+	// Records still held in memory, with the gone ones that are not freed yet
+	size_t GetRecordCount() const {
+		return record_count;
+	}
+
+private:
+	static constexpr Version NEVER = std::numeric_limits<Version>::max();
+	static constexpr Version UNPINNED = std::numeric_limits<Version>::max();
+	static constexpr size_t INDEX_COUNT = 4;
+	static constexpr size_t MIN_COMPACTED_COUNT = 4096;
+
+	using UserKey = std::pair<size_t, int>;
+
+	struct StoredRecord {
+		Record record;
+		// the first version without the record
+		std::atomic<Version> erased{ NEVER };
+		// entries in the indexes of the writer, pending or in runs; writer only
+		size_t entry_count = INDEX_COUNT;
+
+		explicit StoredRecord(const Record& record)
+			: record(record)
+		{
+		}
+	};
+
+	template <typename Key>
+	struct Entry {
+		Key key;
+		StoredRecord* record;
+
+		bool operator<(const Entry& other) const {
+			return key < other.key || (key == other.key && std::less<StoredRecord*>()(record, other.record));
+		}
+	};
+
+	template <typename Key>
+	using Run = std::vector<Entry<Key>>;
+
+	// Immutable once published
+	struct Snapshot {
+		Version version = 0;
+		size_t size = 0;
+		std::vector<const Run<size_t>*> id_runs;
+		std::vector<const Run<int>*> timestamp_runs;
+		std::vector<const Run<int>*> karma_runs;
+		std::vector<const Run<UserKey>*> user_runs;
+	};
+
+	// What the versions before this one used and the later ones do not
+	struct Retired {
+		Version version = 0;
+		std::unique_ptr<const Snapshot> snapshot;
+		std::vector<std::shared_ptr<const void>> runs;
+		std::vector<StoredRecord*> records;
+	};
+
+	template <typename Key>
+	class VersionedIndex {
+	public:
+		void Add(Key key, StoredRecord* record) {
+			pending.push_back({ key, record });
+		}
+
+		// Turns the pending entries into a run and merges the top runs while the
+		// lower one is at most twice as large, so there are O(log n) runs
+		template <typename ReleaseEntry>
+		void Commit(bool compact, Retired& retired, ReleaseEntry release_entry) {
+			std::sort(pending.begin(), pending.end());
+			Run<Key> fresh = Merge({}, pending, release_entry);
+			pending.clear();
+			if (!fresh.empty()) {
+				runs.push_back(std::make_shared<const Run<Key>>(std::move(fresh)));
+			}
+			if (compact) {
+				Run<Key> merged;
+				for (const auto& run : runs) {
+					merged = Merge(merged, *run, release_entry);
+					retired.runs.push_back(run);
+				}
+				runs.clear();
+				if (!merged.empty()) {
+					runs.push_back(std::make_shared<const Run<Key>>(std::move(merged)));
+				}
+			}
+			while (runs.size() >= 2 && runs[runs.size() - 2]->size() <= 2 * runs.back()->size()) {
+				Run<Key> merged = Merge(*runs[runs.size() - 2], *runs.back(), release_entry);
+				for (size_t i = 0; i < 2; ++i) {
+					retired.runs.push_back(std::move(runs.back()));
+					runs.pop_back();
+				}
+				if (!merged.empty()) {
+					runs.push_back(std::make_shared<const Run<Key>>(std::move(merged)));
+				}
+			}
+		}
+
+		std::vector<const Run<Key>*> GetRuns() const {
+			std::vector<const Run<Key>*> result;
+			for (const auto& run : runs) {
+				result.push_back(run.get());
+			}
+			return result;
+		}
+
+		template <typename ReleaseEntry>
+		void Clear(ReleaseEntry release_entry) {
+			for (const auto& run : runs) {
+				for (const Entry<Key>& entry : *run) {
+					release_entry(entry.record);
+				}
+			}
+			for (const Entry<Key>& entry : pending) {
+				release_entry(entry.record);
+			}
+			runs.clear();
+			pending.clear();
+		}
+
+	private:
+		std::vector<std::shared_ptr<const Run<Key>>> runs;
+		std::vector<Entry<Key>> pending;
+
+		// Drops the entries of the erased records: the new run belongs to the
+		// version being committed and the later ones, which do not see them
+		template <typename ReleaseEntry>
+		static Run<Key> Merge(const Run<Key>& lhs, const Run<Key>& rhs, ReleaseEntry release_entry) {
+			Run<Key> merged;
+			merged.reserve(lhs.size() + rhs.size());
+			const auto keep = [&](const Entry<Key>& entry) {
+				if (entry.record->erased.load(std::memory_order_relaxed) == NEVER) {
+					merged.push_back(entry);
+				} else {
+					release_entry(entry.record);
+				}
+			};
+			auto left = lhs.begin();
+			auto right = rhs.begin();
+			while (left != lhs.end() && right != rhs.end()) {
+				keep(*right < *left ? *right++ : *left++);
+			}
+			std::for_each(left, lhs.end(), keep);
+			std::for_each(right, rhs.end(), keep);
+			return merged;
+		}
+	};
+
+	struct alignas(64) ReaderPin {
+		// the oldest version the reader may still use
+		std::atomic<Version> version{ UNPINNED };
+	};
+
+	mutable std::vector<ReaderPin> pins;
+	std::atomic<const Snapshot*> current;
+	std::atomic<Version> latest_version{ 0 };
+
+	// the rest belongs to the writer
+	Version next_version = 1;
+	bool has_changes = false;
+	std::unordered_map<std::string_view, StoredRecord*> live_records;
+	VersionedIndex<size_t> id_index;
+	VersionedIndex<int> timestamp_index;
+	VersionedIndex<int> karma_index;
+	VersionedIndex<UserKey> user_index;
+	std::deque<Retired> retired_queue;
+	size_t record_count = 0;
+	// erased records with entries still in the indexes
+	size_t erased_record_count = 0;
+
+	// Frees the record with its last entry, at once without retired
+	void ReleaseEntry(StoredRecord* record, Retired* retired) {
+		if (--record->entry_count > 0) {
+			return;
+		}
+		if (record->erased.load(std::memory_order_relaxed) != NEVER) {
+			--erased_record_count;
+		}
+		if (retired) {
+			retired->records.push_back(record);
+		} else {
+			delete record;
+			--record_count;
+		}
+	}
+
+	void FreeRecords(Retired& retired) {
+		for (StoredRecord* record : retired.records) {
+			delete record;
+		}
+		record_count -= retired.records.size();
+		retired.records.clear();
+	}
+};
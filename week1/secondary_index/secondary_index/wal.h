@@ -0,0 +1,545 @@
+#pragma once
+
+#include "database.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+// Little-endian encoding of log entries and snapshots
+class BinaryWriter {
+public:
+	explicit BinaryWriter(std::string& output)
+		: output(output)
+	{
+	}
+
+	void WriteInt(uint64_t value, size_t size) {
+		for (size_t i = 0; i < size; ++i) {
+			output.push_back(static_cast<char>(value >> (8 * i)));
+		}
+	}
+
+	void WriteString(std::string_view value) {
+		WriteInt(value.size(), 4);
+		output.append(value);
+	}
+
+	void WriteRecord(const Record& record) {
+		WriteString(record.id);
+		WriteString(record.title);
+		WriteString(record.user);
+		WriteInt(static_cast<uint32_t>(record.timestamp), 4);
+		WriteInt(static_cast<uint32_t>(record.karma), 4);
+	}
+
+private:
+	std::string& output;
+};
+
+// Reading past the end throws out_of_range
+class BinaryReader {
+public:
+	explicit BinaryReader(std::string_view input)
+		: input(input)
+	{
+	}
+
+	uint64_t ReadInt(size_t size) {
+		Require(size);
+		uint64_t value = 0;
+		for (size_t i = 0; i < size; ++i) {
+			value |= static_cast<uint64_t>(static_cast<unsigned char>(input[position + i])) << (8 * i);
+		}
+		position += size;
+		return value;
+	}
+
+	std::string_view ReadBytes(size_t size) {
+		Require(size);
+		const std::string_view bytes = input.substr(position, size);
+		position += size;
+		return bytes;
+	}
+
+	std::string ReadString() {
+		return std::string(ReadBytes(ReadInt(4)));
+	}
+
+	Record ReadRecord() {
+		Record record;
+		record.id = ReadString();
+		record.title = ReadString();
+		record.user = ReadString();
+		record.timestamp = static_cast<int>(static_cast<uint32_t>(ReadInt(4)));
+		record.karma = static_cast<int>(static_cast<uint32_t>(ReadInt(4)));
+		return record;
+	}
+
+	bool AtEnd() const {
+		return position == input.size();
+	}
+
+	size_t GetPosition() const {
+		return position;
+	}
+
+private:
+	std::string_view input;
+	size_t position = 0;
+
+	void Require(size_t size) const {
+		if (input.size() - position < size) {
+			throw std::out_of_range("unexpected end of data");
+		}
+	}
+};
+
+// FNV-1a, enough to tell a torn write from a whole entry
+inline uint32_t Checksum(std::string_view bytes) {
+	uint32_t hash = 2166136261u;
+	for (const char byte : bytes) {
+		hash = (hash ^ static_cast<unsigned char>(byte)) * 16777619u;
+	}
+	return hash;
+}
+
+inline std::string ReadFile(const std::filesystem::path& path) {
+	std::ifstream input(path, std::ios::binary);
+	return std::string(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+}
+
+// Writes the file and makes the operating system put it on the disk
+inline void WriteFileDurably(const std::filesystem::path& path, std::string_view bytes) {
+	std::FILE* file = std::fopen(path.string().c_str(), "wb");
+	if (!file) {
+		throw std::runtime_error("cannot open " + path.string());
+	}
+	const bool written = std::fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size() && std::fflush(file) == 0;
+#ifdef _WIN32
+	const bool synced = written && _commit(_fileno(file)) == 0;
+#else
+	const bool synced = written && fsync(fileno(file)) == 0;
+#endif
+	std::fclose(file);
+	if (!synced) {
+		throw std::runtime_error("cannot write " + path.string());
+	}
+}
+
+// Append-only log of Put and Erase with group commit. Append only encodes the
+// entry into a buffer, a flusher thread writes whatever has gathered and syncs
+// the file once for the whole group. A caller that needs its change on the disk
+// waits for the number Append returned with WaitDurable.
+//
+// Entry: payload size (4 bytes), checksum of the payload (4), payload: the kind
+// (1) and a record or an id.
+class WriteAheadLog {
+public:
+	enum class EntryKind : uint8_t {
+		PUT = 1,
+		ERASE = 2,
+	};
+
+	struct Settings {
+		// how long the flusher waits for more entries to write them together
+		std::chrono::microseconds group_commit_delay{ 500 };
+		// Append waits for the flusher when this much is not written yet
+		size_t max_buffered_bytes = 64 << 20;
+		// without syncing, a crash of the machine may lose the last groups
+		bool sync = true;
+	};
+
+	WriteAheadLog(const std::filesystem::path& path, Settings settings)
+		: settings(settings)
+		, file(std::fopen(path.string().c_str(), "ab"))
+	{
+		if (!file) {
+			throw std::runtime_error("cannot open " + path.string());
+		}
+		flusher = std::thread([this] { RunFlusher(); });
+	}
+
+	WriteAheadLog(const WriteAheadLog&) = delete;
+	WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+	~WriteAheadLog() {
+		{
+			std::lock_guard<std::mutex> guard(mutex);
+			stopping = true;
+		}
+		has_entries.notify_one();
+		flusher.join();
+		std::fclose(file);
+	}
+
+	uint64_t AppendPut(const Record& record) {
+		return Append(EntryKind::PUT, [&record](BinaryWriter& writer) { writer.WriteRecord(record); });
+	}
+
+	uint64_t AppendErase(const std::string& id) {
+		return Append(EntryKind::ERASE, [&id](BinaryWriter& writer) { writer.WriteString(id); });
+	}
+
+	// Waits until the entry with the number and all before it are written and synced
+	void WaitDurable(uint64_t entry_number) {
+		std::unique_lock<std::mutex> lock(mutex);
+		if (durable_count < entry_number) {
+			// someone is waiting, so the group is not delayed any longer
+			flush_requested = true;
+			has_entries.notify_one();
+		}
+		flushed.wait(lock, [&] { return durable_count >= entry_number || failed; });
+		if (failed) {
+			throw std::runtime_error("cannot write the log");
+		}
+	}
+
+	uint64_t GetEntryCount() const {
+		std::lock_guard<std::mutex> guard(mutex);
+		return entry_count;
+	}
+
+	uint64_t GetGroupCount() const {
+		std::lock_guard<std::mutex> guard(mutex);
+		return group_count;
+	}
+
+	// Calls callback(kind, reader) for the entries of a log up to the first damaged
+	// one: the tail of a crash. Returns the number of whole entries.
+	template <typename Callback>
+	static size_t Replay(std::string_view log, Callback callback) {
+		BinaryReader reader(log);
+		size_t count = 0;
+		try {
+			while (!reader.AtEnd()) {
+				const size_t size = reader.ReadInt(4);
+				const uint32_t checksum = static_cast<uint32_t>(reader.ReadInt(4));
+				const std::string_view payload = reader.ReadBytes(size);
+				if (Checksum(payload) != checksum) {
+					break;
+				}
+				BinaryReader payload_reader(payload);
+				callback(static_cast<EntryKind>(payload_reader.ReadInt(1)), payload_reader);
+				++count;
+			}
+		} catch (const std::out_of_range&) {
+		}
+		return count;
+	}
+
+private:
+	const Settings settings;
+	std::FILE* file;
+
+	mutable std::mutex mutex;
+	std::condition_variable has_entries;
+	std::condition_variable flushed;
+	std::string buffer;
+	uint64_t entry_count = 0;
+	uint64_t durable_count = 0;
+	uint64_t group_count = 0;
+	bool stopping = false;
+	bool flush_requested = false;
+	bool failed = false;
+	std::thread flusher;
+
+	template <typename WritePayload>
+	uint64_t Append(EntryKind kind, WritePayload write_payload) {
+		// encoded outside the lock, so producers only contend for the copy into the buffer
+		std::string payload;
+		BinaryWriter payload_writer(payload);
+		payload_writer.WriteInt(static_cast<uint8_t>(kind), 1);
+		write_payload(payload_writer);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		if (buffer.size() >= settings.max_buffered_bytes) {
+			has_entries.notify_one();
+			flushed.wait(lock, [this] { return buffer.size() < settings.max_buffered_bytes || failed; });
+		}
+		if (buffer.empty()) {
+			has_entries.notify_one();
+		}
+		BinaryWriter writer(buffer);
+		writer.WriteInt(payload.size(), 4);
+		writer.WriteInt(Checksum(payload), 4);
+		buffer += payload;
+		return ++entry_count;
+	}
+
+	void RunFlusher() {
+		std::string group;
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			has_entries.wait(lock, [this] { return !buffer.empty() || stopping; });
+			if (buffer.empty() && stopping) {
+				return;
+			}
+			// lets more entries join the group
+			has_entries.wait_for(lock, settings.group_commit_delay, [this] { return stopping || flush_requested; });
+			flush_requested = false;
+			group.clear();
+			group.swap(buffer);
+			const uint64_t group_end = entry_count;
+			lock.unlock();
+
+			bool written = std::fwrite(group.data(), 1, group.size(), file) == group.size() && std::fflush(file) == 0;
+			if (written && settings.sync) {
+#ifdef _WIN32
+				written = _commit(_fileno(file)) == 0;
+#else
+				written = fsync(fileno(file)) == 0;
+#endif
+			}
+
+			lock.lock();
+			if (written) {
+				durable_count = group_end;
+				++group_count;
+			} else {
+				failed = true;
+			}
+			flushed.notify_all();
+		}
+	}
+};
+
+struct DurabilitySettings {
+	std::filesystem::path directory;
+	WriteAheadLog::Settings log;
+	// a snapshot is written after this many log entries
+	size_t snapshot_interval = 1000000;
+	// threads to parse the snapshot and to build the indexes during recovery
+	size_t recovery_thread_count = std::max(1u, std::thread::hardware_concurrency());
+};
+
+struct RecoveryStats {
+	size_t snapshot_record_count = 0;
+	size_t replayed_entry_count = 0;
+	double seconds = 0;
+};
+
+// Database that survives restarts. The directory holds snapshot.N, the whole
+// database before the entries of log.N, and log.N itself. A snapshot is written
+// to a temporary file and renamed, then the next log is started and the older
+// files are removed, so a crash at any point leaves a snapshot and the logs after it.
+//
+// A snapshot is split into blocks of records, each with its size in bytes, so
+// recovery parses the blocks in parallel.
+class DurableDatabase {
+public:
+	explicit DurableDatabase(DurabilitySettings settings)
+		: settings(std::move(settings))
+	{
+		std::filesystem::create_directories(this->settings.directory);
+		Recover();
+	}
+
+	bool Put(const Record& record) {
+		if (!database.Put(record)) {
+			return false;
+		}
+		last_entry = log->AppendPut(record);
+		OnLogged();
+		return true;
+	}
+
+	bool Erase(const std::string& id) {
+		if (!database.Erase(id)) {
+			return false;
+		}
+		last_entry = log->AppendErase(id);
+		OnLogged();
+		return true;
+	}
+
+	// Waits until all the changes made so far are on the disk
+	void Sync() {
+		log->WaitDurable(last_entry);
+	}
+
+	const Database& GetDatabase() const {
+		return database;
+	}
+
+	// Writes a snapshot and starts a new log
+	void Checkpoint() {
+		const uint64_t next_sequence = sequence + 1;
+		const auto temporary_path = settings.directory / "snapshot.tmp";
+		WriteFileDurably(temporary_path, EncodeSnapshot(database));
+		std::filesystem::rename(temporary_path, GetPath("snapshot", next_sequence));
+
+		log.reset();
+		sequence = next_sequence;
+		log = std::make_unique<WriteAheadLog>(GetPath("log", sequence), settings.log);
+		last_entry = 0;
+		entries_since_snapshot = 0;
+		RemoveFilesBefore(sequence);
+	}
+
+	const RecoveryStats& GetRecoveryStats() const {
+		return recovery_stats;
+	}
+
+	const WriteAheadLog& GetLog() const {
+		return *log;
+	}
+
+	static std::string EncodeSnapshot(const Database& database) {
+		std::string snapshot = SNAPSHOT_MAGIC;
+		std::string block;
+		size_t block_record_count = 0;
+		const auto write_block = [&] {
+			BinaryWriter writer(snapshot);
+			writer.WriteInt(block.size(), 8);
+			writer.WriteInt(block_record_count, 8);
+			snapshot += block;
+			block.clear();
+			block_record_count = 0;
+		};
+		database.ForEachRecord([&](const Record& record) {
+			BinaryWriter(block).WriteRecord(record);
+			if (++block_record_count == SNAPSHOT_BLOCK_RECORD_COUNT) {
+				write_block();
+			}
+		});
+		if (block_record_count > 0) {
+			write_block();
+		}
+		return snapshot;
+	}
+
+	static std::vector<Record> DecodeSnapshot(std::string_view snapshot, size_t thread_count) {
+		if (snapshot.substr(0, SNAPSHOT_MAGIC.size()) != SNAPSHOT_MAGIC) {
+			throw std::runtime_error("not a snapshot");
+		}
+		struct Block {
+			std::string_view bytes;
+			size_t first_record;
+			size_t record_count;
+		};
+		std::vector<Block> blocks;
+		size_t record_count = 0;
+		BinaryReader reader(snapshot.substr(SNAPSHOT_MAGIC.size()));
+		while (!reader.AtEnd()) {
+			const size_t size = reader.ReadInt(8);
+			const size_t block_record_count = reader.ReadInt(8);
+			blocks.push_back({ reader.ReadBytes(size), record_count, block_record_count });
+			record_count += block_record_count;
+		}
+
+		std::vector<Record> records(record_count);
+		std::vector<std::thread> threads;
+		const auto parse_blocks = [&](size_t thread_index) {
+			for (size_t i = thread_index; i < blocks.size(); i += thread_count) {
+				BinaryReader block_reader(blocks[i].bytes);
+				for (size_t j = 0; j < blocks[i].record_count; ++j) {
+					records[blocks[i].first_record + j] = block_reader.ReadRecord();
+				}
+			}
+		};
+		for (size_t thread_index = 1; thread_index < thread_count; ++thread_index) {
+			threads.emplace_back(parse_blocks, thread_index);
+		}
+		parse_blocks(0);
+		for (auto& thread : threads) {
+			thread.join();
+		}
+		return records;
+	}
+
+private:
+	static inline const std::string SNAPSHOT_MAGIC = "SNAPSHOT1\n";
+	static constexpr size_t SNAPSHOT_BLOCK_RECORD_COUNT = 16384;
+
+	const DurabilitySettings settings;
+	Database database;
+	std::unique_ptr<WriteAheadLog> log;
+	uint64_t sequence = 0;
+	uint64_t last_entry = 0;
+	size_t entries_since_snapshot = 0;
+	RecoveryStats recovery_stats;
+
+	std::filesystem::path GetPath(const std::string& kind, uint64_t file_sequence) const {
+		return settings.directory / (kind + "." + std::to_string(file_sequence));
+	}
+
+	// The sequences of the files named kind.N, in increasing order
+	std::vector<uint64_t> ListSequences(const std::string& kind) const {
+		std::vector<uint64_t> sequences;
+		for (const auto& entry : std::filesystem::directory_iterator(settings.directory)) {
+			const std::string name = entry.path().filename().string();
+			const std::string prefix = kind + ".";
+			if (name.compare(0, prefix.size(), prefix) == 0 && name.size() > prefix.size()
+					&& std::all_of(name.begin() + prefix.size(), name.end(), [](char c) { return '0' <= c && c <= '9'; })) {
+				sequences.push_back(std::stoull(name.substr(prefix.size())));
+			}
+		}
+		std::sort(sequences.begin(), sequences.end());
+		return sequences;
+	}
+
+	void Recover() {
+		const auto start = std::chrono::steady_clock::now();
+		const std::vector<uint64_t> snapshots = ListSequences("snapshot");
+		if (!snapshots.empty()) {
+			sequence = snapshots.back();
+			std::vector<Record> records = DecodeSnapshot(ReadFile(GetPath("snapshot", sequence)), settings.recovery_thread_count);
+			recovery_stats.snapshot_record_count = records.size();
+			database.Load(std::move(records), settings.recovery_thread_count);
+		}
+		for (const uint64_t log_sequence : ListSequences("log")) {
+			if (log_sequence < sequence) {
+				continue;
+			}
+			recovery_stats.replayed_entry_count += WriteAheadLog::Replay(ReadFile(GetPath("log", log_sequence)),
+				[this](WriteAheadLog::EntryKind kind, BinaryReader& reader) {
+					if (kind == WriteAheadLog::EntryKind::PUT) {
+						database.Put(reader.ReadRecord());
+					} else if (kind == WriteAheadLog::EntryKind::ERASE) {
+						database.Erase(reader.ReadString());
+					}
+				});
+			sequence = log_sequence;
+		}
+		recovery_stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		// the entries after a damaged one are lost anyway, and the new log must not follow them
+		Checkpoint();
+	}
+
+	void OnLogged() {
+		if (++entries_since_snapshot >= settings.snapshot_interval) {
+			Checkpoint();
+		}
+	}
+
+	void RemoveFilesBefore(uint64_t first_kept_sequence) {
+		for (const std::string kind : { "snapshot", "log" }) {
+			for (const uint64_t file_sequence : ListSequences(kind)) {
+				if (file_sequence < first_kept_sequence) {
+					std::filesystem::remove(GetPath(kind, file_sequence));
+				}
+			}
+		}
+	}
+};
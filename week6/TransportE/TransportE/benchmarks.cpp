@@ -0,0 +1,581 @@
+#include "benchmarks.h"
+#include "database.h"
+#include "request.h"
+#include "parse.h"
+#include "profile.h"
+#include "pareto_router.h"
+#include "stop_index.h"
+#include <chrono>
+#include <memory>
+#include <optional>
+#include <random>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+namespace {
+
+	string GridStopName(size_t row, size_t col) {
+		return "S" + to_string(row) + "_" + to_string(col);
+	}
+
+	// side x side stops with a linear bus along every row and every column
+	void AddGridCityStopsAndBuses(Database& db, size_t side) {
+		const double lat_step = 0.005, lon_step = 0.008;
+		for (size_t row = 0; row < side; ++row) {
+			for (size_t col = 0; col < side; ++col) {
+				Database::StopParams params{ GridStopName(row, col), 55.5 + row * lat_step, 37.5 + col * lon_step, {} };
+				if (col + 1 < side) {
+					params.distances[GridStopName(row, col + 1)] = 650;
+				}
+				if (row + 1 < side) {
+					params.distances[GridStopName(row + 1, col)] = 720;
+				}
+				db.AddOrUpdateStop(params);
+			}
+		}
+		for (size_t line = 0; line < side; ++line) {
+			Database::BusParams row_bus{ "R" + to_string(line), {} };
+			Database::BusParams col_bus{ "C" + to_string(line), {} };
+			for (size_t i = 0; i < side; ++i) {
+				row_bus.stops_names.push_back(GridStopName(line, i));
+				col_bus.stops_names.push_back(GridStopName(i, line));
+			}
+			db.AddBusWithRoute(row_bus);
+			db.AddBusWithRoute(col_bus);
+		}
+	}
+
+	void SetupGridCityRouting(Database& db, Database::RouterMode mode, int bus_wait_time = 6) {
+		Database::RouterSettings settings{ bus_wait_time, ConvertFromKmPerHourToMPerMin(30.0), ConvertFromKmPerHourToMPerMin(5.0), 1000.0 };
+		settings.mode = mode;
+		db.SetRouterSettings(settings);
+		db.UpdateGraphAndRouter();
+	}
+
+	void FillGridCity(Database& db, size_t side, Database::RouterMode mode = Database::RouterMode::ALL_PAIRS) {
+		AddGridCityStopsAndBuses(db, side);
+		db.UpdateDistanceMatrix();
+		db.UpdateAllBusesStats();
+		SetupGridCityRouting(db, mode);
+	}
+
+	// Random linear buses wandering over the central part of the grid
+	void AddDowntownBuses(Database& db, size_t side, size_t bus_count, size_t bus_length, mt19937& gen) {
+		const size_t low = side / 4, high = side - side / 4 - 1;
+		uniform_int_distribution<size_t> coord_dist(low, high);
+		uniform_int_distribution<int> step_dist(0, 3);
+		for (size_t bus = 0; bus < bus_count; ++bus) {
+			size_t row = coord_dist(gen), col = coord_dist(gen);
+			Database::BusParams params{ "D" + to_string(bus), { GridStopName(row, col) } };
+			while (params.stops_names.size() < bus_length) {
+				switch (step_dist(gen)) {
+				case 0: row = row > low ? row - 1 : row + 1; break;
+				case 1: row = row < high ? row + 1 : row - 1; break;
+				case 2: col = col > low ? col - 1 : col + 1; break;
+				default: col = col < high ? col + 1 : col - 1; break;
+				}
+				params.stops_names.push_back(GridStopName(row, col));
+			}
+			db.AddBusWithRoute(params);
+		}
+	}
+
+	Json::Node MakeRouteRequestNode(const string& from, const string& to, int id, int alternatives) {
+		using namespace Json;
+		map<string, Node> attrs;
+		attrs["type"] = string("Route");
+		attrs["from"] = from;
+		attrs["to"] = to;
+		attrs["id"] = id;
+		attrs["alternatives"] = alternatives;
+		return Node(attrs);
+	}
+
+
+	// Discards the output, remembering its size and when the first byte came
+	class MeasuringStreamBuf : public streambuf {
+	public:
+		size_t GetSize() const { return size; }
+		optional<chrono::steady_clock::time_point> GetFirstByteTime() const { return first_byte_time; }
+
+	protected:
+		int overflow(int c) override {
+			if (c != EOF) {
+				Count(1);
+			}
+			return c;
+		}
+		streamsize xsputn(const char*, streamsize count) override {
+			Count(count);
+			return count;
+		}
+
+	private:
+		size_t size = 0;
+		optional<chrono::steady_clock::time_point> first_byte_time;
+
+		void Count(streamsize count) {
+			if (!first_byte_time) {
+				first_byte_time = chrono::steady_clock::now();
+			}
+			size += count;
+		}
+	};
+}
+
+void BenchmarkRouteAlternatives() {
+	const size_t side = 15;
+	const int query_count = 200;
+	Database db;
+	FillGridCity(db, side);
+
+	mt19937 gen(42);
+	uniform_int_distribution<size_t> coord_dist(0, side - 1);
+	vector<pair<string, string>> queries;
+	for (int i = 0; i < query_count; ++i) {
+		queries.push_back({
+			GridStopName(coord_dist(gen), coord_dist(gen)),
+			GridStopName(coord_dist(gen), coord_dist(gen))
+		});
+	}
+
+	for (const int k : { 1, 3, 5 }) {
+		vector<RequestHolder> requests;
+		for (int i = 0; i < query_count; ++i) {
+			requests.push_back(ParseRequest(Request::Mode::READ, MakeRouteRequestNode(queries[i].first, queries[i].second, i, k)));
+		}
+		LOG_DURATION("Route alternatives, K = " + to_string(k) + ", " + to_string(query_count) + " queries");
+		ProcessStatRequests(db, requests);
+	}
+}
+
+void BenchmarkPointToPointRouting() {
+	const size_t side = 40;
+	const int query_count = 300;
+	mt19937 gen(7);
+	uniform_int_distribution<size_t> vertex_dist(0, side * side - 1);
+	vector<pair<size_t, size_t>> queries;
+	for (int i = 0; i < query_count; ++i) {
+		queries.push_back({ vertex_dist(gen), vertex_dist(gen) });
+	}
+
+	const vector<pair<string, Database::RouterMode>> modes = {
+		{"dijkstra", Database::RouterMode::DIJKSTRA},
+		{"astar", Database::RouterMode::ASTAR},
+		{"alt", Database::RouterMode::ALT},
+	};
+	for (const auto& [mode_name, mode] : modes) {
+		Database db;
+		{
+			LOG_DURATION("Grid city " + to_string(side) + "x" + to_string(side) + " build, " + mode_name);
+			FillGridCity(db, side, mode);
+		}
+		const auto router = db.GetPointRouter();
+		size_t total_expanded = 0;
+		{
+			LOG_DURATION("Point-to-point routing, " + mode_name + ", " + to_string(query_count) + " queries");
+			for (const auto& [from, to] : queries) {
+				size_t expanded = 0;
+				router->FindRoute(from, to, &expanded);
+				total_expanded += expanded;
+			}
+		}
+		cerr << "Expanded vertices per query, " << mode_name << ": " << total_expanded / query_count << endl;
+	}
+}
+
+void BenchmarkDatabaseBuild() {
+	const size_t side = 100;
+	Database db;
+	{
+		LOG_DURATION("Grid city " + to_string(side) + "x" + to_string(side) + ", stops and buses");
+		AddGridCityStopsAndBuses(db, side);
+	}
+	{
+		LOG_DURATION("Grid city " + to_string(side) + "x" + to_string(side) + ", distance matrix");
+		db.UpdateDistanceMatrix();
+	}
+	const auto& distances = db.GetDistanceMatrix();
+	cerr << "Distance matrix: " << distances.GetEntryCount() << " distances, " << distances.GetMemoryUsage() << " bytes" << endl;
+	{
+		LOG_DURATION("Grid city " + to_string(side) + "x" + to_string(side) + ", buses stats x10");
+		for (int i = 0; i < 10; ++i) {
+			db.UpdateAllBusesStats();
+		}
+	}
+	{
+		LOG_DURATION("Grid city " + to_string(side) + "x" + to_string(side) + ", graph");
+		SetupGridCityRouting(db, Database::RouterMode::DIJKSTRA);
+	}
+}
+
+void BenchmarkParetoRouting() {
+	const size_t side = 20;
+	const int query_count = 100;
+	mt19937 gen(11);
+	Database db;
+	AddGridCityStopsAndBuses(db, side);
+	AddDowntownBuses(db, side, 150, 25, gen);
+	db.UpdateDistanceMatrix();
+	db.UpdateAllBusesStats();
+	SetupGridCityRouting(db, Database::RouterMode::DIJKSTRA, 1);
+
+	uniform_int_distribution<size_t> coord_dist(side / 4, side - side / 4 - 1);
+	vector<pair<size_t, size_t>> queries;
+	for (int i = 0; i < query_count; ++i) {
+		queries.push_back({ coord_dist(gen) * side + coord_dist(gen), coord_dist(gen) * side + coord_dist(gen) });
+	}
+
+	Graph::ParetoRouter<double> router(*db.GetGraph());
+	for (const size_t max_boardings : { 3, 5, 8 }) {
+		size_t total_labels = 0, total_routes = 0;
+		{
+			LOG_DURATION("Pareto routing downtown, max " + to_string(max_boardings) + " boardings, " + to_string(query_count) + " queries");
+			for (const auto& [from, to] : queries) {
+				size_t label_count = 0;
+				total_routes += router.FindRoutes(from, to, max_boardings, 0, &label_count).size();
+				total_labels += label_count;
+			}
+		}
+		cerr << "Labels per query: " << total_labels / query_count
+			<< ", Pareto routes per query: " << static_cast<double>(total_routes) / query_count << endl;
+	}
+}
+
+void BenchmarkStatRequestsDeduplication() {
+	const size_t side = 30;
+	const int request_count = 20000;
+	Database db;
+	FillGridCity(db, side, Database::RouterMode::DIJKSTRA);
+
+	// a skewed batch: a few popular sources and stops, buses asked about over and over
+	mt19937 gen(5);
+	uniform_int_distribution<size_t> coord_dist(0, side - 1);
+	uniform_int_distribution<size_t> popular_dist(0, 9);
+	uniform_int_distribution<int> type_dist(0, 3);
+	vector<RequestHolder> requests;
+	for (int id = 0; id < request_count; ++id) {
+		using namespace Json;
+		map<string, Node> attrs;
+		attrs["id"] = id;
+		switch (type_dist(gen)) {
+		case 0:
+			attrs["type"] = string("Bus");
+			attrs["name"] = "R" + to_string(coord_dist(gen));
+			break;
+		case 1:
+			attrs["type"] = string("Stop");
+			attrs["name"] = GridStopName(popular_dist(gen), coord_dist(gen));
+			break;
+		default:
+			attrs["type"] = string("Route");
+			attrs["from"] = GridStopName(popular_dist(gen), popular_dist(gen));
+			attrs["to"] = GridStopName(coord_dist(gen), coord_dist(gen));
+			break;
+		}
+		requests.push_back(ParseRequest(Request::Mode::READ, Node(attrs)));
+	}
+
+	const auto start = chrono::steady_clock::now();
+	{
+		LOG_DURATION("Stat requests one by one, " + to_string(request_count) + " requests");
+		for (const auto& request : requests) {
+			static_cast<const ReadRequest&>(*request).Process(db);
+		}
+	}
+	const auto middle = chrono::steady_clock::now();
+	StatRequestsStats stats;
+	{
+		LOG_DURATION("Stat requests deduplicated, " + to_string(request_count) + " requests");
+		ProcessStatRequests(db, requests, &stats);
+	}
+	const auto finish = chrono::steady_clock::now();
+
+	const auto naive_ms = chrono::duration_cast<chrono::milliseconds>(middle - start).count();
+	const auto batch_ms = chrono::duration_cast<chrono::milliseconds>(finish - middle).count();
+	cerr << "Dedup ratio: " << static_cast<double>(stats.request_count) / stats.unique_request_count
+		<< ", " << stats.coalesced_request_count << " routes in " << stats.coalesced_search_count << " searches"
+		<< ", time saved: " << naive_ms - batch_ms << " ms" << endl;
+}
+
+void BenchmarkStopNameIndex() {
+	const size_t name_count = 300000;
+	const int query_count = 10000;
+	mt19937 gen(13);
+	// names combine words of a shared vocabulary, like "Ulitsa Lenina" and "Lenina metro" do
+	uniform_int_distribution<int> letter_dist('a', 'z');
+	uniform_int_distribution<int> length_dist(4, 10);
+	vector<string> vocabulary(20000);
+	for (auto& word : vocabulary) {
+		for (int i = length_dist(gen); i > 0; --i) {
+			word += static_cast<char>(letter_dist(gen));
+		}
+		word[0] = toupper(word[0]);
+	}
+	uniform_int_distribution<size_t> word_dist(0, vocabulary.size() - 1);
+	vector<string> names;
+	for (size_t i = 0; i < name_count; ++i) {
+		names.push_back(vocabulary[word_dist(gen)] + " " + vocabulary[word_dist(gen)] + " " + to_string(i % 97));
+	}
+
+	vector<string> queries;
+	uniform_int_distribution<size_t> name_dist(0, name_count - 1);
+	for (int i = 0; i < query_count; ++i) {
+		string query = names[name_dist(gen)];
+		query[uniform_int_distribution<size_t>(0, query.size() - 1)(gen)] = 'x';
+		queries.push_back(move(query));
+	}
+
+	unique_ptr<StopNameIndex> index;
+	{
+		LOG_DURATION("Stop name index build, " + to_string(name_count) + " names");
+		index = make_unique<StopNameIndex>(names);
+	}
+	cerr << "Index bytes per name: " << index->GetMemoryUsage() / index->GetNameCount() << endl;
+
+	size_t found = 0;
+	auto start = chrono::steady_clock::now();
+	for (const auto& query : queries) {
+		found += index->FindByPrefix(string_view(query).substr(0, 4), 10).size();
+	}
+	auto finish = chrono::steady_clock::now();
+	cerr << "Prefix lookup: " << chrono::duration<double, micro>(finish - start).count() / query_count << " us" << endl;
+
+	for (const size_t max_distance : { 1, 2 }) {
+		start = chrono::steady_clock::now();
+		for (const auto& query : queries) {
+			found += index->FindSimilar(query, max_distance, 10).size();
+		}
+		finish = chrono::steady_clock::now();
+		cerr << "Fuzzy lookup, " << max_distance << " edits: "
+			<< chrono::duration<double, micro>(finish - start).count() / query_count << " us" << endl;
+	}
+	cerr << "Found names: " << found << endl;
+}
+
+void BenchmarkShardedRouting() {
+	const size_t side = 60;
+	const int query_count = 300;
+	mt19937 gen(17);
+	uniform_int_distribution<size_t> vertex_dist(0, side * side - 1);
+	vector<pair<size_t, size_t>> queries;
+	for (int i = 0; i < query_count; ++i) {
+		queries.push_back({ vertex_dist(gen), vertex_dist(gen) });
+	}
+
+	// Every bus ride is an edge, so a bus crossing the whole city would make all of
+	// its stops boundary ones; here buses are local and overlap by two stops
+	Database db;
+	for (size_t row = 0; row < side; ++row) {
+		for (size_t col = 0; col < side; ++col) {
+			Database::StopParams params{ GridStopName(row, col), 55.5 + row * 0.005, 37.5 + col * 0.008, {} };
+			if (col + 1 < side) {
+				params.distances[GridStopName(row, col + 1)] = 650;
+			}
+			if (row + 1 < side) {
+				params.distances[GridStopName(row + 1, col)] = 720;
+			}
+			db.AddOrUpdateStop(params);
+		}
+	}
+	const size_t bus_length = 8;
+	for (size_t line = 0; line < side; ++line) {
+		for (size_t first = 0; first + 1 < side; first += bus_length - 2) {
+			Database::BusParams row_bus{ "R" + to_string(line) + "_" + to_string(first), {} };
+			Database::BusParams col_bus{ "C" + to_string(line) + "_" + to_string(first), {} };
+			for (size_t i = first; i < min(side, first + bus_length); ++i) {
+				row_bus.stops_names.push_back(GridStopName(line, i));
+				col_bus.stops_names.push_back(GridStopName(i, line));
+			}
+			db.AddBusWithRoute(row_bus);
+			db.AddBusWithRoute(col_bus);
+		}
+	}
+	db.UpdateDistanceMatrix();
+	db.UpdateAllBusesStats();
+
+	SetupGridCityRouting(db, Database::RouterMode::DIJKSTRA);
+	{
+		LOG_DURATION("Single process routing, dijkstra, " + to_string(query_count) + " queries");
+		for (const auto& [from, to] : queries) {
+			db.GetPointRouter()->FindRoute(from, to);
+		}
+	}
+	for (const size_t shard_count : { 2, 4, 8 }) {
+		{
+			LOG_DURATION("Grid city " + to_string(side) + "x" + to_string(side) + " build, " + to_string(shard_count) + " shards");
+			Database::RouterSettings settings{ 6, ConvertFromKmPerHourToMPerMin(30.0), ConvertFromKmPerHourToMPerMin(5.0), 1000.0 };
+			settings.mode = Database::RouterMode::SHARDED;
+			settings.shard_count = shard_count;
+			db.SetRouterSettings(settings);
+			db.UpdateGraphAndRouter();
+		}
+		const auto router = db.GetShardedRouter();
+		cerr << "Boundary vertices: " << router->GetBoundaryVertexCount() << " of " << side * side << endl;
+		LOG_DURATION("Sharded routing, " + to_string(shard_count) + " shards, " + to_string(query_count) + " queries");
+		for (const auto& [from, to] : queries) {
+			router->FindRoute(from, to);
+		}
+	}
+}
+
+void BenchmarkInfoResponsesPrinting() {
+	const size_t side = 100;
+	const int request_count = 200000;
+	Database db;
+	AddGridCityStopsAndBuses(db, side);
+	db.UpdateDistanceMatrix();
+	db.UpdateAllBusesStats();
+
+	mt19937 gen(19);
+	uniform_int_distribution<size_t> coord_dist(0, side - 1);
+	vector<RequestHolder> requests;
+	for (int id = 0; id < request_count; ++id) {
+		using namespace Json;
+		map<string, Node> attrs;
+		attrs["id"] = id;
+		if (id % 2 == 0) {
+			attrs["type"] = string("Bus");
+			attrs["name"] = (id % 4 == 0 ? "R" : "C") + to_string(coord_dist(gen));
+		} else {
+			attrs["type"] = string("Stop");
+			attrs["name"] = GridStopName(coord_dist(gen), coord_dist(gen));
+		}
+		requests.push_back(ParseRequest(Request::Mode::READ, Node(attrs)));
+	}
+	const auto responses = ProcessStatRequests(db, requests);
+
+	size_t json_size = 0;
+	{
+		LOG_DURATION("Info responses via Json::Node, " + to_string(request_count) + " responses");
+		ostringstream os;
+		os << ResponsesToJson(responses);
+		json_size = os.str().size();
+	}
+	{
+		LOG_DURATION("Prerender info responses, " + to_string(side * side) + " stops");
+		db.PrerenderInfoJson(thread::hardware_concurrency());
+	}
+	{
+		LOG_DURATION("Info responses prerendered, " + to_string(request_count) + " responses");
+		ostringstream os;
+		PrintResponsesJson(responses, os);
+		if (os.str().size() != json_size) {
+			cerr << "Prerendered output differs" << endl;
+		}
+	}
+}
+
+void BenchmarkStreamingResponses() {
+	const size_t side = 30;
+	const int request_count = 100000;
+	Database db;
+	FillGridCity(db, side, Database::RouterMode::DIJKSTRA);
+	db.PrerenderInfoJson(thread::hardware_concurrency());
+
+	mt19937 gen(29);
+	uniform_int_distribution<size_t> coord_dist(0, side - 1);
+	vector<RequestHolder> requests;
+	for (int id = 0; id < request_count; ++id) {
+		using namespace Json;
+		if (id % 10 == 0) {
+			requests.push_back(ParseRequest(Request::Mode::READ,
+				MakeRouteRequestNode(GridStopName(coord_dist(gen), coord_dist(gen)), GridStopName(coord_dist(gen), coord_dist(gen)), id, 1)));
+			continue;
+		}
+		map<string, Node> attrs;
+		attrs["id"] = id;
+		attrs["type"] = string(id % 2 ? "Stop" : "Bus");
+		attrs["name"] = id % 2 ? GridStopName(coord_dist(gen), coord_dist(gen)) : "R" + to_string(coord_dist(gen));
+		requests.push_back(ParseRequest(Request::Mode::READ, Node(attrs)));
+	}
+
+	auto report = [](const string& name, chrono::steady_clock::time_point start, const MeasuringStreamBuf& buf) {
+		const auto finish = chrono::steady_clock::now();
+		cerr << name << ": first byte after " << chrono::duration_cast<chrono::milliseconds>(*buf.GetFirstByteTime() - start).count()
+			<< " ms, done after " << chrono::duration_cast<chrono::milliseconds>(finish - start).count()
+			<< " ms, " << buf.GetSize() << " bytes" << endl;
+	};
+	{
+		MeasuringStreamBuf buf;
+		ostream output(&buf);
+		output.precision(6);
+		const auto start = chrono::steady_clock::now();
+		const auto responses = ProcessStatRequests(db, requests);
+		PrintResponsesJson(responses, output);
+		report("Collected responses, " + to_string(request_count) + " requests", start, buf);
+	}
+	for (const size_t thread_count : { 1, 4 }) {
+		MeasuringStreamBuf buf;
+		ostream output(&buf);
+		output.precision(6);
+		const auto start = chrono::steady_clock::now();
+		ResponseStreamWriter writer(output);
+		ProcessStatRequests(db, requests, writer, thread_count);
+		writer.Finish();
+		report("Streamed responses, " + to_string(thread_count) + " threads", start, buf);
+		cerr << "Largest reorder buffer: " << writer.GetMaxBufferedCount() << " responses" << endl;
+	}
+}
+
+void BenchmarkIsochrone() {
+	const size_t side = 50;
+	const int query_count = 100;
+	Database db;
+	FillGridCity(db, side, Database::RouterMode::DIJKSTRA);
+
+	mt19937 gen(31);
+	uniform_int_distribution<size_t> coord_dist(0, side - 1);
+	vector<string> sources;
+	for (int i = 0; i < query_count; ++i) {
+		sources.push_back(GridStopName(coord_dist(gen), coord_dist(gen)));
+	}
+	for (const int max_time : { 10, 20, 30, 60, 90, 120 }) {
+		vector<RequestHolder> requests;
+		for (int id = 0; id < query_count; ++id) {
+			using namespace Json;
+			map<string, Node> attrs;
+			attrs["type"] = string("Isochrone");
+			attrs["from"] = sources[id];
+			attrs["max_time"] = max_time;
+			attrs["id"] = id;
+			requests.push_back(ParseRequest(Request::Mode::READ, Node(attrs)));
+		}
+		size_t reachable_count = 0;
+		{
+			LOG_DURATION("Isochrone, " + to_string(max_time) + " min, " + to_string(query_count) + " queries");
+			for (const auto& request : requests) {
+				const auto response = static_cast<const ReadRequest&>(*request).Process(db);
+				reachable_count += static_cast<const IsochroneResponse&>(*response).stops.size();
+			}
+		}
+		cerr << "Reachable stops per query: " << reachable_count / query_count << " of " << side * side << endl;
+	}
+
+	// what clients do without the request: a route to every stop
+	{
+		vector<RequestHolder> requests;
+		for (size_t i = 0; i < side * side; ++i) {
+			requests.push_back(ParseRequest(Request::Mode::READ, MakeRouteRequestNode(sources[0], GridStopName(i / side, i % side), i, 0)));
+		}
+		LOG_DURATION("Route to every stop from one source, " + to_string(requests.size()) + " queries");
+		for (const auto& request : requests) {
+			static_cast<const ReadRequest&>(*request).Process(db);
+		}
+	}
+}
+
+void RunAllBenchmarks() {
+	BenchmarkRouteAlternatives();
+	BenchmarkPointToPointRouting();
+	BenchmarkDatabaseBuild();
+	BenchmarkParetoRouting();
+	BenchmarkStatRequestsDeduplication();
+	BenchmarkStopNameIndex();
+	BenchmarkShardedRouting();
+	BenchmarkInfoResponsesPrinting();
+	BenchmarkStreamingResponses();
+	BenchmarkIsochrone();
+}
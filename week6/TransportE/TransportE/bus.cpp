@@ -1,5 +1,5 @@
 #include "bus.h"
-#include <set>
+#include <algorithm>
 
 using namespace std;
 
@@ -10,9 +10,9 @@ Bus::Bus(const std::string& bus_id, const vector<StopPtr>& bus_stops, bool is_ro
 {
 }
 
-void Bus::UpdateStats() {
+void Bus::UpdateStats(const DistanceMatrix& distances) {
 	stats.unique_stops_count = ComputeUniqueStopsCount();
-	stats.route_length = ComputeRouteLength();
+	stats.route_length = ComputeRouteLength(distances);
 	stats.geographical_route_length = ComputeGeographicalRouteLength();
 	stats.curvature = ComputeCurvature(stats.route_length, stats.geographical_route_length);
 }
@@ -27,8 +27,8 @@ const string& Bus::GetId() const {
 	return id;
 }
 
-const vector<StopPtr>& Bus::GetStops() const {
-	return stops;
+Bus::RouteView Bus::GetStops() const {
+	return { stops, is_roundtrip };
 }
 
 bool Bus::IsRoundtrip() const {
@@ -40,19 +40,27 @@ Bus::Stats Bus::GetStats() const {
 }
 
 size_t Bus::GetStopsCount() const {
-	return stops.size();
+	return GetStops().size();
 }
 
 size_t Bus::ComputeUniqueStopsCount() const {
-	auto unique_stops = set<StopPtr>(stops.begin(), stops.end());
-	return unique_stops.size();
+	vector<size_t> stops_indices;
+	stops_indices.reserve(stops.size());
+	for (const auto& stop : stops) {
+		stops_indices.push_back(stop->GetIndex());
+	}
+	sort(stops_indices.begin(), stops_indices.end());
+	return unique(stops_indices.begin(), stops_indices.end()) - stops_indices.begin();
 }
 
-double Bus::ComputeRouteLength() const {
+double Bus::ComputeRouteLength(const DistanceMatrix& distances) const {
 	double new_route_length = 0;
 	const int n = stops.size();
 	for (int i = 1; i < n; ++i) {
-		new_route_length += ComputeRealDistanceBetweenStops(stops[i - 1], stops[i]);
+		new_route_length += ComputeRealDistanceBetweenStops(distances, stops[i - 1], stops[i]);
+		if (!is_roundtrip) {
+			new_route_length += ComputeRealDistanceBetweenStops(distances, stops[i], stops[i - 1]);
+		}
 	}
 	return new_route_length;
 }
@@ -63,7 +71,7 @@ double Bus::ComputeGeographicalRouteLength() const {
 	for (int i = 1; i < n; ++i) {
 		new_route_length += ComputeGeographicalDistanceBetweenStops(stops[i - 1], stops[i]);
 	}
-	return new_route_length;
+	return is_roundtrip ? new_route_length : 2 * new_route_length;
 }
 
 double Bus::ComputeCurvature(double real_length, double geographical_length) const {
@@ -1,7 +1,9 @@
 #pragma once
 
+#include "distance_matrix.h"
 #include <string>
 #include <memory>
+#include <mutex>
 #include <vector>
 #include <set>
 #include <unordered_map>
@@ -9,11 +11,18 @@
 
 struct Bus;
 struct Stop;
-using BusPtr = std::shared_ptr<Bus>;
-using StopPtr = std::shared_ptr<Stop>;
+// Stops and buses are owned by Database, these handles never own them
+using BusPtr = Bus*;
+using StopPtr = Stop*;
 
 using StopsDistances = std::unordered_map<std::string, double>;
 
+// JSON answer to an info request split around its request_id
+struct PrerenderedJson {
+	std::string head;
+	std::string tail;
+};
+
 struct Bus {
 public:
 	struct Stats {
@@ -23,24 +32,66 @@ public:
 		double curvature = 0.0;
 	};
 
+	// Full sequence of stops on the route; a linear route is stored once and
+	// its way back is produced on the fly
+	class RouteView {
+	public:
+		class Iterator {
+		public:
+			Iterator(const RouteView* view, size_t pos) : view(view), pos(pos) {}
+			StopPtr operator*() const { return (*view)[pos]; }
+			Iterator& operator++() { ++pos; return *this; }
+			bool operator==(const Iterator& other) const { return pos == other.pos; }
+			bool operator!=(const Iterator& other) const { return pos != other.pos; }
+		private:
+			const RouteView* view;
+			size_t pos;
+		};
+
+		RouteView(const std::vector<StopPtr>& stops, bool is_roundtrip) : stops(stops), is_roundtrip(is_roundtrip) {}
+
+		size_t size() const {
+			return is_roundtrip || stops.empty() ? stops.size() : 2 * stops.size() - 1;
+		}
+		StopPtr operator[](size_t pos) const {
+			return pos < stops.size() ? stops[pos] : stops[2 * stops.size() - 2 - pos];
+		}
+		Iterator begin() const { return { this, 0 }; }
+		Iterator end() const { return { this, size() }; }
+
+	private:
+		const std::vector<StopPtr>& stops;
+		bool is_roundtrip;
+	};
+
+	// For a linear route bus_stops holds the way there only
 	Bus(const std::string& bus_id, const std::vector<StopPtr>& bus_stops, bool is_roundtrip_bus);
 
-	void UpdateStats();
+	void UpdateStats(const DistanceMatrix& distances);
 	static void AddBusToStopsBuses(BusPtr bus);
 
 	const std::string& GetId() const;
-	const std::vector<StopPtr>& GetStops() const;
+	RouteView GetStops() const;
 	bool IsRoundtrip() const;
 	Stats GetStats() const;
 	size_t GetStopsCount() const;
+
+	// Rendered once on first access; must not be used before the stats are final
+	template <typename Render>
+	const PrerenderedJson& GetInfoJson(Render render) const {
+		std::call_once(info_json_flag, [&] { info_json = render(*this); });
+		return info_json;
+	}
 private:
 	std::string id;
 	std::vector<StopPtr> stops;
 	bool is_roundtrip;
 	Stats stats;
+	mutable std::once_flag info_json_flag;
+	mutable PrerenderedJson info_json;
 
 	size_t ComputeUniqueStopsCount() const;
-	double ComputeRouteLength() const;
+	double ComputeRouteLength(const DistanceMatrix& distances) const;
 	double ComputeGeographicalRouteLength() const;
 	double ComputeCurvature(double real_length, double geographical_length) const;
 };
@@ -59,26 +110,32 @@ struct Stop {
 	size_t GetIndex() const;
 
 	Stop& SetCoords(double lat_in_degrees, double lon_in_degrees);
+	bool HasCoords() const;
 	Coords GetCoordsInRadians() const;
 
 	Stop& AddBus(BusPtr bus);
 	const std::set<std::string>& GetBuses() const;
 
-	Stop& SetDistances(const StopsDistances& new_distances);
-	Stop& AddDistance(const std::string& other_stop, double distance);
-	StopsDistances GetDistances() const;
-	std::optional<double> GetDistanceTo(StopPtr other_stop) const;
+	// Rendered once on first access; must not be used before all buses are added
+	template <typename Render>
+	const PrerenderedJson& GetInfoJson(Render render) const {
+		std::call_once(info_json_flag, [&] { info_json = render(*this); });
+		return info_json;
+	}
 
-	friend double ComputeRealDistanceBetweenStops(StopPtr lhs, StopPtr rhs);
 	friend double ComputeGeographicalDistanceBetweenStops(StopPtr lhs, StopPtr rhs);
 private:
 	size_t index;
 	std::string name;
 	Coords coords;
+	bool has_coords = false;
 	std::set<std::string> buses;
-	StopsDistances distances;
+	mutable std::once_flag info_json_flag;
+	mutable PrerenderedJson info_json;
 };
 
 double DegreesToRadians(double degree);
-double ComputeRealDistanceBetweenStops(StopPtr lhs, StopPtr rhs);
+Stop::Coords ConvertCoordsToRadians(const Stop::Coords& coords_in_degrees);
+double ComputeGeographicalDistance(const Stop::Coords& lhs_in_radians, const Stop::Coords& rhs_in_radians);
+double ComputeRealDistanceBetweenStops(const DistanceMatrix& distances, StopPtr lhs, StopPtr rhs);
 double ComputeGeographicalDistanceBetweenStops(StopPtr lhs, StopPtr rhs);
@@ -1,17 +1,22 @@
 #include "database.h"
 #include "profile.h"
+#include "k_shortest_paths.h"
+#include "response.h"
+#include <algorithm>
+#include <future>
+#include <cmath>
+#include <stdexcept>
 
 using namespace std;
 
 void Database::AddStop(const StopParams& params) {
 	if (!stops.count(params.name)) {
-		auto stop = make_shared<Stop>(params.name);
-		stop->SetCoords(params.lat, params.lon);
-		SetDistancesForStop(stop, params.distances);
+		StopPtr stop = &stops_pool.emplace_back(params.name);
 		stop->SetIndex(stop_last_index);
 		stop_last_index++;
-		stops[params.name] = move(stop);
+		stops[params.name] = stop;
 		stops_by_index.push_back(params.name);
+		SetDistancesForStop(stop, params.distances);
 	}
 }
 
@@ -19,17 +24,20 @@ void Database::AddOrUpdateStop(const StopParams& params) {
 	if (!stops.count(params.name)) {
 		AddStop(params);
 	} else {
-		auto& stop = stops[params.name];
-		stop->SetCoords(params.lat, params.lon);
-		SetDistancesForStop(stop, params.distances);
+		SetDistancesForStop(stops[params.name], params.distances);
 	}
+	stops[params.name]->SetCoords(params.lat, params.lon);
 }
 
 void Database::SetDistancesForStop(StopPtr stop, const StopsDistances& distances) {
 	for (const auto& [other_stop, distance] : distances) {
 		AddStop({ other_stop });
+		new_distances.push_back({
+			static_cast<DistanceMatrix::StopIndex>(stop->GetIndex()),
+			static_cast<DistanceMatrix::StopIndex>(stops.at(other_stop)->GetIndex()),
+			static_cast<DistanceMatrix::Distance>(distance)
+		});
 	}
-	stop->SetDistances(move(distances));
 }
 
 void Database::AddBusWithRoute(const BusParams& params) {
@@ -39,11 +47,7 @@ void Database::AddBusWithRoute(const BusParams& params) {
 			AddStop({ name });
 			bus_stops.push_back(stops[name]);
 		}
-		for (int i = bus_stops.size() - 2; i >= 0; --i) {
-			StopPtr stop = bus_stops[i];
-			bus_stops.push_back(stop);
-		}
-		auto bus = make_shared<Bus>(params.id, bus_stops, false);
+		BusPtr bus = &buses_pool.emplace_back(params.id, bus_stops, false);
 		Bus::AddBusToStopsBuses(bus);
 		buses[params.id] = bus;
 	}
@@ -56,7 +60,7 @@ void Database::AddBusWithRingRoute(const BusParams& params) {
 			AddStop({ name });
 			bus_stops.push_back(stops[name]);
 		}
-		auto bus = make_shared<Bus>(params.id, bus_stops, true);
+		BusPtr bus = &buses_pool.emplace_back(params.id, bus_stops, true);
 		Bus::AddBusToStopsBuses(bus);
 		buses[params.id] = bus;
 	}
@@ -82,6 +86,18 @@ std::string Database::GetStopNameByIndex(size_t index) const {
 	return stops_by_index.at(index);
 }
 
+vector<pair<StopPtr, double>> Database::GetStopsWithinDistance(const Stop::Coords& coords, double max_distance) const {
+	const auto coords_in_radians = ConvertCoordsToRadians(coords);
+	vector<pair<StopPtr, double>> result;
+	for (const auto& [name, stop] : stops) {
+		const double distance = ComputeGeographicalDistance(coords_in_radians, stop->GetCoordsInRadians());
+		if (distance <= max_distance) {
+			result.push_back({ stop, distance });
+		}
+	}
+	return result;
+}
+
 RouterActivityPtr Database::GetWaitActivityByEdge(size_t edge_id) const {
 	return wait_activities_by_edge.at(edge_id);
 }
@@ -90,6 +106,16 @@ RouterActivityPtr Database::GetBusActivityByEdge(size_t edge_id) const {
 	return bus_activities_by_edge.at(edge_id);
 }
 
+vector<Graph::VertexId> Database::GetStopsIndicesByEdge(size_t edge_id) const {
+	const auto& ride = rides_by_edge.at(edge_id);
+	const auto bus_stops = ride.bus->GetStops();
+	vector<Graph::VertexId> result;
+	for (size_t pos = ride.first_stop_pos; pos <= ride.last_stop_pos; ++pos) {
+		result.push_back(bus_stops[pos]->GetIndex());
+	}
+	return result;
+}
+
 
 void Database::SetRouterSettings(const RouterSettings& params) {
 	router_settings = params;
@@ -103,35 +129,184 @@ TransportGraphPtr Database::GetGraph() const {
 	return graph;
 }
 
+TransportGraphPtr Database::GetReversedGraph() const {
+	lock_guard<mutex> guard(reversed_graph_mutex);
+	if (!reversed_graph && graph) {
+		reversed_graph = make_shared<TransportGraph>(Graph::BuildReversedGraph(*graph));
+	}
+	return reversed_graph;
+}
+
 TransportRouterPtr Database::GetRouter() const {
 	return router;
 }
 
+TransportPointRouterPtr Database::GetPointRouter() const {
+	return point_router;
+}
+
+ShardedRouterPtr Database::GetShardedRouter() const {
+	return sharded_router;
+}
+
+StopNameIndexPtr Database::GetStopNameIndex() const {
+	return stop_name_index;
+}
+
+const DistanceMatrix& Database::GetDistanceMatrix() const {
+	return distance_matrix;
+}
+
+void Database::UpdateDistanceMatrix() {
+	if (new_distances.empty()) {
+		return;
+	}
+	auto entries = distance_matrix.GetEntries();
+	entries.insert(entries.end(), new_distances.begin(), new_distances.end());
+	distance_matrix = DistanceMatrix(stops_pool.size(), move(entries));
+	new_distances.clear();
+	new_distances.shrink_to_fit();
+}
+
 void Database::UpdateAllBusesStats() {
-	for (auto& [id, bus] : buses) {
-		bus->UpdateStats();
+	for (auto& bus : buses_pool) {
+		bus.UpdateStats(distance_matrix);
+	}
+}
+
+void Database::PrerenderInfoJson(size_t thread_count) {
+	thread_count = max<size_t>(thread_count, 1);
+	vector<future<void>> futures;
+	for (size_t part = 0; part < thread_count; ++part) {
+		futures.push_back(async(launch::async, [this, part, thread_count] {
+			for (size_t i = part; i < stops_pool.size(); i += thread_count) {
+				GetStopInfoJson(&stops_pool[i]);
+			}
+			for (size_t i = part; i < buses_pool.size(); i += thread_count) {
+				GetBusInfoJson(&buses_pool[i]);
+			}
+		}));
+	}
+	for (auto& f : futures) {
+		f.get();
 	}
 }
 
+void Database::UpdateStopNameIndex() {
+	stop_name_index = make_shared<StopNameIndex>(stops_by_index);
+}
+
 void Database::UpdateGraphAndRouter() {
 	const size_t vertex_count = stops.size();
-	graph = make_shared<TransportGraph>(vertex_count);
+	graph = nullptr;
+	{
+		lock_guard<mutex> guard(reversed_graph_mutex);
+		reversed_graph = nullptr;
+	}
+	router = nullptr;
+	point_router = nullptr;
+	sharded_router = nullptr;
+
+	// the sharded router starts its workers before the first edge and takes the edges
+	// one by one, so that the whole graph is never held by a single process
+	if (router_settings.mode == RouterMode::SHARDED) {
+		const size_t shard_count = router_settings.shard_count;
+		if (shard_count == 0 || shard_count > max<size_t>(vertex_count, 1)) {
+			throw invalid_argument("shard_count must be between 1 and the stop count");
+		}
+		sharded_router = make_shared<ShardedRouter>(PartitionStops(shard_count), shard_count);
+	} else {
+		graph = make_shared<TransportGraph>(vertex_count);
+	}
+	auto add_edge = [this](const Graph::Edge<double>& edge) {
+		return sharded_router ? sharded_router->AddEdge(edge) : graph->AddEdge(edge);
+	};
+
+	rides_by_edge.clear();
 	const double wait_time = router_settings.bus_wait_time;
 	for (auto& [bus_id, bus] : buses) {
-		const auto& stops = bus->GetStops();
+		const auto stops = bus->GetStops();
 		const int n = stops.size();
 		for (int i = 0; i < n - 1; ++i) {
 			double distance = 0;
 			for (int j = i + 1; j < n; ++j) {
-				distance += ComputeRealDistanceBetweenStops(stops[j - 1], stops[j]);
+				distance += ComputeRealDistanceBetweenStops(distance_matrix, stops[j - 1], stops[j]);
 				const double bus_time = distance / router_settings.bus_velocity;
 				const size_t span_count = j - i;
 
-				const auto edge_id = graph->AddEdge({ stops[i]->GetIndex(), stops[j]->GetIndex(), wait_time + bus_time });
+				const auto edge_id = add_edge({ stops[i]->GetIndex(), stops[j]->GetIndex(), wait_time + bus_time });
 				wait_activities_by_edge[edge_id] = make_shared<WaitActivity>(stops[i]->GetName(), wait_time);
 				bus_activities_by_edge[edge_id] = make_shared<BusActivity>(bus_id, bus_time, span_count);
+				rides_by_edge.push_back({ bus, static_cast<size_t>(i), static_cast<size_t>(j) });
 			}
 		}
 	}
-	router = make_shared<TransportRouter>(*graph);
+
+	// every landmark is a stop
+	const size_t landmark_count = min(router_settings.landmark_count, vertex_count);
+	switch (router_settings.mode) {
+	case RouterMode::ALL_PAIRS:
+		router = make_shared<TransportRouter>(*graph);
+		break;
+	case RouterMode::DIJKSTRA:
+		point_router = make_shared<TransportPointRouter>(*graph, *GetReversedGraph());
+		break;
+	case RouterMode::ASTAR:
+		if (auto lower_bound = BuildGeographicalLowerBound()) {
+			point_router = make_shared<TransportPointRouter>(*graph, *GetReversedGraph(), 0, move(lower_bound));
+		} else {
+			point_router = make_shared<TransportPointRouter>(*graph, *GetReversedGraph(), landmark_count);
+		}
+		break;
+	case RouterMode::ALT:
+		point_router = make_shared<TransportPointRouter>(*graph, *GetReversedGraph(), landmark_count);
+		break;
+	case RouterMode::SHARDED:
+		sharded_router->Build();
+		break;
+	}
+}
+
+// Stops without coordinates are all placed at the origin, the partition stays balanced anyway
+vector<Graph::CellId> Database::PartitionStops(size_t cell_count) const {
+	vector<Graph::Point> points(stops.size(), { 0.0, 0.0 });
+	for (const auto& [name, stop] : stops) {
+		if (stop->HasCoords()) {
+			const auto coords = stop->GetCoordsInRadians();
+			points[stop->GetIndex()] = { coords.lon * cos(coords.lat), coords.lat };
+		}
+	}
+	return Graph::PartitionByCoordinates(points, cell_count);
+}
+
+TransportPointRouter::LowerBound Database::BuildGeographicalLowerBound() const {
+	vector<Stop::Coords> coords_by_index(stops.size());
+	for (const auto& [name, stop] : stops) {
+		if (!stop->HasCoords()) {
+			return {};
+		}
+		coords_by_index[stop->GetIndex()] = stop->GetCoordsInRadians();
+	}
+
+	// Every edge costs one wait plus the ride. Road distances are not guaranteed to
+	// exceed great-circle ones, so the ride bound is scaled by the smallest ratio of
+	// ride time to straight-line travel time over all edges
+	const double wait_time = router_settings.bus_wait_time;
+	const double velocity = router_settings.bus_velocity;
+	double factor = 1.0;
+	const size_t edge_count = graph->GetEdgeCount();
+	for (Graph::EdgeId edge_id = 0; edge_id < edge_count; ++edge_id) {
+		const auto& edge = graph->GetEdge(edge_id);
+		const double straight_time = ComputeGeographicalDistance(coords_by_index[edge.from], coords_by_index[edge.to]) / velocity;
+		if (straight_time > 0) {
+			factor = min(factor, (edge.weight - wait_time) / straight_time);
+		}
+	}
+
+	return [coords_by_index = move(coords_by_index), factor, velocity, wait_time](Graph::VertexId from, Graph::VertexId to) {
+		if (from == to) {
+			return 0.0;
+		}
+		return wait_time + factor * ComputeGeographicalDistance(coords_by_index[from], coords_by_index[to]) / velocity;
+	};
 }
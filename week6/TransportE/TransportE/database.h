@@ -2,7 +2,12 @@
 
 #include "bus.h"
 #include "router.h"
+#include "point_to_point_router.h"
+#include "sharded_router.h"
 #include "router_activity.h"
+#include "stop_index.h"
+#include <deque>
+#include <mutex>
 #include <unordered_map>
 #include <vector>
 #include <memory>
@@ -11,6 +16,10 @@ using TransportGraph = Graph::DirectedWeightedGraph<double>;
 using TransportGraphPtr = std::shared_ptr<Graph::DirectedWeightedGraph<double>>;
 using TransportRouter = Graph::Router<double>;
 using TransportRouterPtr = std::shared_ptr<Graph::Router<double>>;
+using TransportPointRouter = Graph::PointToPointRouter<double>;
+using TransportPointRouterPtr = std::shared_ptr<Graph::PointToPointRouter<double>>;
+using ShardedRouterPtr = std::shared_ptr<ShardedRouter>;
+using StopNameIndexPtr = std::shared_ptr<StopNameIndex>;
 
 class Database {
 public:
@@ -26,40 +35,90 @@ public:
 		std::vector<std::string> stops_names;
 	};
 
+	enum class RouterMode {
+		ALL_PAIRS,
+		DIJKSTRA,
+		ASTAR,
+		ALT,
+		SHARDED,
+	};
+
 	struct RouterSettings {
 		int bus_wait_time;
 		double bus_velocity;
+		double pedestrian_velocity;
+		double max_walk_distance;
+		RouterMode mode = RouterMode::ALL_PAIRS;
+		size_t landmark_count = 8;
+		size_t shard_count = 4;
 	};
 
+	Database() = default;
+	Database(const Database&) = delete;
+	Database& operator=(const Database&) = delete;
+
 	void AddStop(const StopParams& params);
 	void AddOrUpdateStop(const StopParams& params);
+	// Distances are collected while loading and take effect in UpdateDistanceMatrix
 	void SetDistancesForStop(StopPtr stop, const StopsDistances& params);
 	void AddBusWithRoute(const BusParams& params);
 	void AddBusWithRingRoute(const BusParams& params);
 	BusPtr GetBus(const std::string& id) const;
 	StopPtr GetStop(const std::string& id) const;
 	std::string GetStopNameByIndex(size_t index) const;
+	std::vector<std::pair<StopPtr, double>> GetStopsWithinDistance(const Stop::Coords& coords, double max_distance) const;
+	StopNameIndexPtr GetStopNameIndex() const;
+	const DistanceMatrix& GetDistanceMatrix() const;
 
 	void SetRouterSettings(const RouterSettings& params);
 	const RouterSettings& GetRouterSettings() const;
 
+	// Both are null in the sharded mode, where no process holds the whole graph
 	TransportGraphPtr GetGraph() const;
+	TransportGraphPtr GetReversedGraph() const;
 	TransportRouterPtr GetRouter() const;
+	TransportPointRouterPtr GetPointRouter() const;
+	ShardedRouterPtr GetShardedRouter() const;
 	RouterActivityPtr GetWaitActivityByEdge(size_t edge_id) const;
 	RouterActivityPtr GetBusActivityByEdge(size_t edge_id) const;
+	std::vector<Graph::VertexId> GetStopsIndicesByEdge(size_t edge_id) const;
 
+	void UpdateDistanceMatrix();
 	void UpdateAllBusesStats();
+	void UpdateStopNameIndex();
+	// Renders info answers of all stops and buses ahead of the first requests
+	void PrerenderInfoJson(size_t thread_count);
 	void UpdateGraphAndRouter();
 private:
+	std::deque<Stop> stops_pool;
+	std::deque<Bus> buses_pool;
 	std::unordered_map<std::string, StopPtr> stops;
 	std::unordered_map<std::string, BusPtr> buses;
 	RouterSettings router_settings;
+	StopNameIndexPtr stop_name_index;
+	DistanceMatrix distance_matrix;
+	std::vector<DistanceMatrix::Entry> new_distances;
 
 	size_t stop_last_index = 0;
 	std::vector<std::string> stops_by_index;
 	std::unordered_map<size_t, RouterActivityPtr> wait_activities_by_edge;
 	std::unordered_map<size_t, RouterActivityPtr> bus_activities_by_edge;
 
+	struct EdgeRide {
+		BusPtr bus;
+		size_t first_stop_pos;
+		size_t last_stop_pos;
+	};
+	std::vector<EdgeRide> rides_by_edge;
+
 	TransportGraphPtr graph;
+	// built on first use: only the point routers and alternative routes need it
+	mutable std::mutex reversed_graph_mutex;
+	mutable TransportGraphPtr reversed_graph;
 	TransportRouterPtr router;
+	TransportPointRouterPtr point_router;
+	ShardedRouterPtr sharded_router;
+
+	TransportPointRouter::LowerBound BuildGeographicalLowerBound() const;
+	std::vector<Graph::CellId> PartitionStops(size_t cell_count) const;
 };
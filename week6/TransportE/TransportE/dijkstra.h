@@ -0,0 +1,166 @@
+#pragma once
+
+#include "graph.h"
+
+#include <algorithm>
+#include <functional>
+#include <optional>
+#include <queue>
+#include <utility>
+#include <vector>
+
+namespace Graph {
+
+	// Single-query Dijkstra over DirectedWeightedGraph. Several sources with
+	// initial weights may be added, so one run serves multi-source requests.
+	template <typename Weight>
+	class ShortestPathSearch {
+	private:
+		using Graph = DirectedWeightedGraph<Weight>;
+
+	public:
+		explicit ShortestPathSearch(const Graph& graph);
+
+		void AddSource(VertexId vertex, Weight initial_weight);
+
+		// Settles vertices in order of weight until should_stop(vertex, weight) returns true
+		template <typename StopPredicate>
+		void Run(StopPredicate should_stop);
+		// Same, skipping edges rejected by is_edge_allowed and ordering the queue by
+		// weight + estimate(vertex); estimate must be a consistent lower bound
+		template <typename StopPredicate, typename EdgeFilter, typename Heuristic>
+		void Run(StopPredicate should_stop, EdgeFilter is_edge_allowed, Heuristic estimate);
+
+		std::optional<Weight> GetWeight(VertexId vertex) const;
+		bool IsSettled(VertexId vertex) const;
+		std::optional<EdgeId> GetPrevEdge(VertexId vertex) const;
+		std::vector<EdgeId> GetRouteEdges(VertexId vertex) const;
+		VertexId GetRouteSource(VertexId vertex) const;
+		size_t GetExpandedCount() const;
+
+	private:
+		struct VertexData {
+			std::optional<Weight> weight;
+			std::optional<EdgeId> prev_edge;
+			bool settled = false;
+		};
+		using QueueItem = std::pair<Weight, VertexId>;
+
+		template <typename Heuristic>
+		void PushToQueue(VertexId vertex, Weight weight, Heuristic& estimate);
+
+		const Graph& graph_;
+		std::vector<VertexData> vertices_data_;
+		std::vector<VertexId> pending_sources_;
+		std::priority_queue<QueueItem, std::vector<QueueItem>, std::greater<QueueItem>> queue_;
+		size_t expanded_count_ = 0;
+	};
+
+
+	template <typename Weight>
+	ShortestPathSearch<Weight>::ShortestPathSearch(const Graph& graph)
+		: graph_(graph)
+		, vertices_data_(graph.GetVertexCount())
+	{
+	}
+
+	template <typename Weight>
+	void ShortestPathSearch<Weight>::AddSource(VertexId vertex, Weight initial_weight) {
+		auto& data = vertices_data_[vertex];
+		if (!data.weight || initial_weight < *data.weight) {
+			data.weight = initial_weight;
+			data.prev_edge = std::nullopt;
+			pending_sources_.push_back(vertex);
+		}
+	}
+
+	template <typename Weight>
+	template <typename StopPredicate>
+	void ShortestPathSearch<Weight>::Run(StopPredicate should_stop) {
+		Run(should_stop, [](EdgeId) { return true; }, [](VertexId) { return Weight{}; });
+	}
+
+	template <typename Weight>
+	template <typename StopPredicate, typename EdgeFilter, typename Heuristic>
+	void ShortestPathSearch<Weight>::Run(StopPredicate should_stop, EdgeFilter is_edge_allowed, Heuristic estimate) {
+		for (const VertexId source : pending_sources_) {
+			PushToQueue(source, *vertices_data_[source].weight, estimate);
+		}
+		pending_sources_.clear();
+		while (!queue_.empty()) {
+			const VertexId vertex = queue_.top().second;
+			auto& data = vertices_data_[vertex];
+			if (data.settled || queue_.top().first > *data.weight + estimate(vertex)) {
+				queue_.pop();
+				continue;
+			}
+			const Weight weight = *data.weight;
+			if (should_stop(vertex, weight)) {
+				return;
+			}
+			queue_.pop();
+			data.settled = true;
+			++expanded_count_;
+			for (const EdgeId edge_id : graph_.GetIncidentEdges(vertex)) {
+				if (!is_edge_allowed(edge_id)) {
+					continue;
+				}
+				const auto& edge = graph_.GetEdge(edge_id);
+				auto& to_data = vertices_data_[edge.to];
+				const Weight candidate_weight = weight + edge.weight;
+				if (!to_data.settled && (!to_data.weight || candidate_weight < *to_data.weight)) {
+					to_data.weight = candidate_weight;
+					to_data.prev_edge = edge_id;
+					PushToQueue(edge.to, candidate_weight, estimate);
+				}
+			}
+		}
+	}
+
+	template <typename Weight>
+	template <typename Heuristic>
+	void ShortestPathSearch<Weight>::PushToQueue(VertexId vertex, Weight weight, Heuristic& estimate) {
+		queue_.push({ weight + estimate(vertex), vertex });
+	}
+
+	template <typename Weight>
+	std::optional<Weight> ShortestPathSearch<Weight>::GetWeight(VertexId vertex) const {
+		return vertices_data_[vertex].weight;
+	}
+
+	template <typename Weight>
+	bool ShortestPathSearch<Weight>::IsSettled(VertexId vertex) const {
+		return vertices_data_[vertex].settled;
+	}
+
+	template <typename Weight>
+	std::optional<EdgeId> ShortestPathSearch<Weight>::GetPrevEdge(VertexId vertex) const {
+		return vertices_data_[vertex].prev_edge;
+	}
+
+	template <typename Weight>
+	std::vector<EdgeId> ShortestPathSearch<Weight>::GetRouteEdges(VertexId vertex) const {
+		std::vector<EdgeId> edges;
+		for (std::optional<EdgeId> edge_id = vertices_data_[vertex].prev_edge;
+			edge_id;
+			edge_id = vertices_data_[graph_.GetEdge(*edge_id).from].prev_edge) {
+			edges.push_back(*edge_id);
+		}
+		std::reverse(std::begin(edges), std::end(edges));
+		return edges;
+	}
+
+	template <typename Weight>
+	VertexId ShortestPathSearch<Weight>::GetRouteSource(VertexId vertex) const {
+		while (const auto& prev_edge = vertices_data_[vertex].prev_edge) {
+			vertex = graph_.GetEdge(*prev_edge).from;
+		}
+		return vertex;
+	}
+
+	template <typename Weight>
+	size_t ShortestPathSearch<Weight>::GetExpandedCount() const {
+		return expanded_count_;
+	}
+
+}
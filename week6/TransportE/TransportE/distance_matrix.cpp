@@ -0,0 +1,83 @@
+#include "distance_matrix.h"
+#include <algorithm>
+#include <numeric>
+#include <stdexcept>
+
+using namespace std;
+
+DistanceMatrix::DistanceMatrix(size_t stop_count, vector<Entry> entries)
+	: row_offsets_(stop_count + 1, 0)
+{
+	stable_sort(entries.begin(), entries.end(), [](const Entry& lhs, const Entry& rhs) {
+		return make_pair(lhs.from, lhs.to) < make_pair(rhs.from, rhs.to);
+	});
+	targets_.reserve(entries.size());
+	distances_.reserve(entries.size());
+	for (size_t i = 0; i < entries.size(); ++i) {
+		const auto& entry = entries[i];
+		if (entry.from >= stop_count || entry.to >= stop_count) {
+			throw out_of_range("distance between unknown stops");
+		}
+		if (i + 1 < entries.size() && entries[i + 1].from == entry.from && entries[i + 1].to == entry.to) {
+			continue;
+		}
+		targets_.push_back(entry.to);
+		distances_.push_back(entry.distance);
+		++row_offsets_[entry.from + 1];
+	}
+	partial_sum(row_offsets_.begin(), row_offsets_.end(), row_offsets_.begin());
+}
+
+optional<DistanceMatrix::Distance> DistanceMatrix::Find(StopIndex from, StopIndex to) const {
+	if (from + 1 >= row_offsets_.size()) {
+		return nullopt;
+	}
+	const uint32_t first = row_offsets_[from];
+	size_t count = row_offsets_[from + 1] - first;
+	if (count == 0) {
+		return nullopt;
+	}
+	// the halving step compiles to a conditional move, so rows are searched without branch mispredictions
+	const StopIndex* base = targets_.data() + first;
+	while (count > 1) {
+		const size_t half = count / 2;
+		base = base[half] <= to ? base + half : base;
+		count -= half;
+	}
+	if (*base != to) {
+		return nullopt;
+	}
+	return distances_[base - targets_.data()];
+}
+
+optional<DistanceMatrix::Distance> DistanceMatrix::FindEitherWay(StopIndex from, StopIndex to) const {
+	if (const auto distance = Find(from, to)) {
+		return distance;
+	}
+	return Find(to, from);
+}
+
+vector<DistanceMatrix::Entry> DistanceMatrix::GetEntries() const {
+	vector<Entry> entries;
+	entries.reserve(targets_.size());
+	for (StopIndex from = 0; from + 1 < row_offsets_.size(); ++from) {
+		for (uint32_t i = row_offsets_[from]; i < row_offsets_[from + 1]; ++i) {
+			entries.push_back({ from, targets_[i], distances_[i] });
+		}
+	}
+	return entries;
+}
+
+size_t DistanceMatrix::GetStopCount() const {
+	return row_offsets_.empty() ? 0 : row_offsets_.size() - 1;
+}
+
+size_t DistanceMatrix::GetEntryCount() const {
+	return targets_.size();
+}
+
+size_t DistanceMatrix::GetMemoryUsage() const {
+	return row_offsets_.capacity() * sizeof(uint32_t)
+		+ targets_.capacity() * sizeof(StopIndex)
+		+ distances_.capacity() * sizeof(Distance);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+// Road distances between stops in compressed sparse rows: the distances from
+// stop i are distances_[row_offsets_[i], row_offsets_[i + 1]), sorted by the
+// index of the target stop in targets_.
+class DistanceMatrix {
+public:
+	using StopIndex = uint32_t;
+	using Distance = uint32_t;
+
+	struct Entry {
+		StopIndex from;
+		StopIndex to;
+		Distance distance;
+	};
+
+	DistanceMatrix() = default;
+	// When a pair is repeated, the later entry wins
+	DistanceMatrix(size_t stop_count, std::vector<Entry> entries);
+
+	std::optional<Distance> Find(StopIndex from, StopIndex to) const;
+	// The way back is used when only it is known
+	std::optional<Distance> FindEitherWay(StopIndex from, StopIndex to) const;
+
+	std::vector<Entry> GetEntries() const;
+	size_t GetStopCount() const;
+	size_t GetEntryCount() const;
+	size_t GetMemoryUsage() const;
+
+private:
+	std::vector<uint32_t> row_offsets_;
+	std::vector<StopIndex> targets_;
+	std::vector<Distance> distances_;
+};
@@ -0,0 +1,63 @@
+#include "graph_partition.h"
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+namespace Graph {
+
+	namespace {
+
+		void Bisect(const vector<Point>& points, vector<VertexId>::iterator begin, vector<VertexId>::iterator end,
+			CellId first_cell, size_t cell_count, vector<CellId>& cells) {
+			const size_t size = end - begin;
+			if (cell_count <= 1 || size <= 1) {
+				for (auto it = begin; it != end; ++it) {
+					cells[*it] = first_cell;
+				}
+				return;
+			}
+
+			double mean_x = 0, mean_y = 0;
+			for (auto it = begin; it != end; ++it) {
+				mean_x += points[*it].x;
+				mean_y += points[*it].y;
+			}
+			mean_x /= size;
+			mean_y /= size;
+			double xx = 0, xy = 0, yy = 0;
+			for (auto it = begin; it != end; ++it) {
+				const double dx = points[*it].x - mean_x, dy = points[*it].y - mean_y;
+				xx += dx * dx;
+				xy += dx * dy;
+				yy += dy * dy;
+			}
+			// principal eigenvector of the 2x2 covariance matrix
+			const double angle = 0.5 * atan2(2 * xy, xx - yy);
+			const double axis_x = cos(angle), axis_y = sin(angle);
+			auto projection = [&](VertexId vertex) {
+				return make_pair(points[vertex].x * axis_x + points[vertex].y * axis_y, vertex);
+			};
+
+			const size_t left_cell_count = cell_count / 2;
+			const auto middle = begin + size * left_cell_count / cell_count;
+			nth_element(begin, middle, end, [&](VertexId lhs, VertexId rhs) {
+				return projection(lhs) < projection(rhs);
+			});
+			Bisect(points, begin, middle, first_cell, left_cell_count, cells);
+			Bisect(points, middle, end, first_cell + left_cell_count, cell_count - left_cell_count, cells);
+		}
+
+	}
+
+	vector<CellId> PartitionByCoordinates(const vector<Point>& points, size_t cell_count) {
+		vector<VertexId> vertices(points.size());
+		for (VertexId vertex = 0; vertex < vertices.size(); ++vertex) {
+			vertices[vertex] = vertex;
+		}
+		vector<CellId> cells(points.size(), 0);
+		Bisect(points, vertices.begin(), vertices.end(), 0, max<size_t>(cell_count, 1), cells);
+		return cells;
+	}
+
+}
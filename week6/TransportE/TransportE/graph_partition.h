@@ -0,0 +1,22 @@
+#pragma once
+
+#include "graph.h"
+
+#include <utility>
+#include <vector>
+
+namespace Graph {
+
+	using CellId = size_t;
+
+	struct Point {
+		double x;
+		double y;
+	};
+
+	// Recursive inertial bisection: every part is split by a line orthogonal to
+	// its principal axis, so cells are compact, balanced within one vertex and
+	// cut few edges of a planar-like network. cell_count need not be a power of two.
+	std::vector<CellId> PartitionByCoordinates(const std::vector<Point>& points, size_t cell_count);
+
+}
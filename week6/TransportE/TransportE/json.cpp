@@ -121,6 +121,33 @@ namespace Json {
 		return Document{ LoadNode(input) };
 	}
 
+	// Quotes and backslashes in names and messages must not end the string early
+	void PrintString(ostream& os, const string& value) {
+		os << '"';
+		for (const char c : value) {
+			switch (c) {
+			case '"':
+				os << "\\\"";
+				break;
+			case '\\':
+				os << "\\\\";
+				break;
+			case '\n':
+				os << "\\n";
+				break;
+			case '\t':
+				os << "\\t";
+				break;
+			case '\r':
+				os << "\\r";
+				break;
+			default:
+				os << c;
+			}
+		}
+		os << '"';
+	}
+
 	void Node::AddToStream(ostream& os) const {
 		if (holds_alternative<vector<Node>>(*this)) {
 			const auto& nodes = AsArray();
@@ -144,7 +171,8 @@ namespace Json {
 					os << ",\n";
 				}
 				first = false;
-				os << '"' << key << "\": " << node;
+				PrintString(os, key);
+				os << ": " << node;
 			}
 			os << "\n}";
 		}
@@ -158,7 +186,7 @@ namespace Json {
 			os << (AsBool() ? "true" : "false");
 		}
 		else {
-			os << '"' << AsString() << '"';
+			PrintString(os, AsString());
 		}
 	}
 
@@ -0,0 +1,175 @@
+#pragma once
+
+#include "dijkstra.h"
+#include "graph.h"
+
+#include <optional>
+#include <queue>
+#include <set>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace Graph {
+
+	// Edge ids of the reversed graph match the ids of the original one
+	template <typename Weight>
+	DirectedWeightedGraph<Weight> BuildReversedGraph(const DirectedWeightedGraph<Weight>& graph) {
+		DirectedWeightedGraph<Weight> reversed_graph(graph.GetVertexCount());
+		const size_t edge_count = graph.GetEdgeCount();
+		for (EdgeId edge_id = 0; edge_id < edge_count; ++edge_id) {
+			const auto& edge = graph.GetEdge(edge_id);
+			reversed_graph.AddEdge({ edge.to, edge.from, edge.weight });
+		}
+		return reversed_graph;
+	}
+
+	template <typename Weight>
+	struct WeightedPath {
+		Weight weight;
+		std::vector<EdgeId> edges;
+	};
+
+	// Yen's algorithm. One backward search from the target builds a shortest-path
+	// tree that is reused by every spur search: it is taken as is when the spur
+	// restrictions do not touch it and serves as the A* estimate otherwise.
+	template <typename Weight>
+	class KShortestPathsFinder {
+	private:
+		using Graph = DirectedWeightedGraph<Weight>;
+		using Path = WeightedPath<Weight>;
+
+	public:
+		KShortestPathsFinder(const Graph& graph, const Graph& reversed_graph);
+
+		// accept(candidate, accepted_paths) decides whether a loopless candidate is diverse
+		// enough; at most max_candidates paths are generated in total
+		template <typename AcceptPredicate>
+		std::vector<Path> Find(VertexId from, VertexId to, size_t k, AcceptPredicate accept, size_t max_candidates) const;
+
+	private:
+		const Graph& graph_;
+		const Graph& reversed_graph_;
+
+		std::optional<Path> FindSpurPath(
+			const ShortestPathSearch<Weight>& target_tree, VertexId spur, VertexId to,
+			const std::unordered_set<EdgeId>& banned_edges, const std::vector<bool>& banned_vertices) const;
+	};
+
+
+	template <typename Weight>
+	KShortestPathsFinder<Weight>::KShortestPathsFinder(const Graph& graph, const Graph& reversed_graph)
+		: graph_(graph)
+		, reversed_graph_(reversed_graph)
+	{
+	}
+
+	template <typename Weight>
+	template <typename AcceptPredicate>
+	std::vector<WeightedPath<Weight>> KShortestPathsFinder<Weight>::Find(
+		VertexId from, VertexId to, size_t k, AcceptPredicate accept, size_t max_candidates) const {
+		std::vector<Path> accepted;
+		if (k == 0) {
+			return accepted;
+		}
+
+		ShortestPathSearch<Weight> target_tree(reversed_graph_);
+		target_tree.AddSource(to, 0);
+		target_tree.Run([](VertexId, Weight) { return false; });
+
+		const std::unordered_set<EdgeId> no_banned_edges;
+		const std::vector<bool> no_banned_vertices(graph_.GetVertexCount(), false);
+		auto first_path = FindSpurPath(target_tree, from, to, no_banned_edges, no_banned_vertices);
+		if (!first_path) {
+			return accepted;
+		}
+
+		auto by_weight = [](const Path& lhs, const Path& rhs) {
+			return std::make_pair(lhs.weight, lhs.edges) > std::make_pair(rhs.weight, rhs.edges);
+		};
+		std::priority_queue<Path, std::vector<Path>, decltype(by_weight)> candidates(by_weight);
+		std::set<std::vector<EdgeId>> known_paths = { first_path->edges };
+		std::vector<Path> generated;
+		candidates.push(std::move(*first_path));
+
+		std::vector<bool> banned_vertices(graph_.GetVertexCount(), false);
+		while (!candidates.empty() && accepted.size() < k && generated.size() < max_candidates) {
+			generated.push_back(candidates.top());
+			candidates.pop();
+			const Path& path = generated.back();
+			if (accept(path, accepted)) {
+				accepted.push_back(path);
+			}
+
+			Weight root_weight = 0;
+			VertexId spur = from;
+			std::vector<VertexId> root_vertices;
+			for (size_t i = 0; i < path.edges.size(); ++i) {
+				std::unordered_set<EdgeId> banned_edges;
+				for (const Path& other : generated) {
+					if (other.edges.size() > i && std::equal(path.edges.begin(), path.edges.begin() + i, other.edges.begin())) {
+						banned_edges.insert(other.edges[i]);
+					}
+				}
+				if (auto spur_path = FindSpurPath(target_tree, spur, to, banned_edges, banned_vertices)) {
+					std::vector<EdgeId> edges(path.edges.begin(), path.edges.begin() + i);
+					edges.insert(edges.end(), spur_path->edges.begin(), spur_path->edges.end());
+					if (known_paths.insert(edges).second) {
+						candidates.push({ root_weight + spur_path->weight, std::move(edges) });
+					}
+				}
+
+				const auto& edge = graph_.GetEdge(path.edges[i]);
+				root_weight += edge.weight;
+				banned_vertices[spur] = true;
+				root_vertices.push_back(spur);
+				spur = edge.to;
+			}
+			for (const VertexId vertex : root_vertices) {
+				banned_vertices[vertex] = false;
+			}
+		}
+		return accepted;
+	}
+
+	template <typename Weight>
+	std::optional<WeightedPath<Weight>> KShortestPathsFinder<Weight>::FindSpurPath(
+		const ShortestPathSearch<Weight>& target_tree, VertexId spur, VertexId to,
+		const std::unordered_set<EdgeId>& banned_edges, const std::vector<bool>& banned_vertices) const {
+		const auto spur_to_target = target_tree.GetWeight(spur);
+		if (!spur_to_target) {
+			return std::nullopt;
+		}
+
+		auto is_edge_allowed = [&](EdgeId edge_id) {
+			return !banned_edges.count(edge_id) && !banned_vertices[graph_.GetEdge(edge_id).to];
+		};
+
+		Path tree_path{ *spur_to_target, {} };
+		bool tree_path_allowed = true;
+		for (VertexId vertex = spur; vertex != to && tree_path_allowed; ) {
+			const EdgeId edge_id = *target_tree.GetPrevEdge(vertex);
+			tree_path_allowed = is_edge_allowed(edge_id);
+			tree_path.edges.push_back(edge_id);
+			vertex = graph_.GetEdge(edge_id).to;
+		}
+		if (tree_path_allowed) {
+			return tree_path;
+		}
+
+		ShortestPathSearch<Weight> search(graph_);
+		search.AddSource(spur, 0);
+		search.Run(
+			[to](VertexId vertex, Weight) { return vertex == to; },
+			[&](EdgeId edge_id) {
+				return is_edge_allowed(edge_id) && target_tree.GetWeight(graph_.GetEdge(edge_id).to);
+			},
+			[&target_tree](VertexId vertex) { return *target_tree.GetWeight(vertex); }
+		);
+		if (!search.GetWeight(to)) {
+			return std::nullopt;
+		}
+		return Path{ *search.GetWeight(to), search.GetRouteEdges(to) };
+	}
+
+}
@@ -1,23 +1,78 @@
 #include "request.h"
 #include "tests.h"
+#include "benchmarks.h"
+#include "server.h"
+#include "trace.h"
+#include <fstream>
+#include <thread>
 
 using namespace std;
 
-int main() {
+int main(int argc, char* argv[]) {
 	RunAllTests();
 
+	if (argc > 1 && string(argv[1]) == "--bench") {
+		RunAllBenchmarks();
+		return 0;
+	}
+
 	cout.precision(6);
 
 	try {
 		Json::Document doc = Json::Load(cin);
+		if (argc > 2 && string(argv[1]) == "--loadgen") {
+			vector<string> request_lines;
+			for (const auto& node : doc.GetRoot().AsMap().at("stat_requests").AsArray()) {
+				request_lines.push_back(SerializeToLine(node));
+			}
+			const auto stats = RunLoadGenerator({ argv[2] }, request_lines);
+			cout << stats.request_count << " requests in " << stats.seconds << " s: "
+				<< stats.request_count / stats.seconds << " rps, p50 " << stats.p50_latency_us
+				<< " us, p99 " << stats.p99_latency_us << " us\n";
+			return 0;
+		}
+
 		Database db;
 		const auto base_requests = ReadJsonRequests("base_requests", doc);
 		ProcessBaseRequests(db, base_requests);
 		const auto settings_requests = ReadJsonRequests("routing_settings", doc);
 		ProcessSettingsRequests(db, settings_requests);
+		if (argc > 2 && string(argv[1]) == "--server") {
+			db.PrerenderInfoJson(thread::hardware_concurrency());
+			QueryServer server(db, { argv[2], thread::hardware_concurrency(), argc > 3 ? argv[3] : "" });
+			server.Run();
+			return 0;
+		}
+		if (argc > 2 && string(argv[1]) == "--replay") {
+			ifstream trace_file(argv[2], ios::binary);
+			const auto trace = ReadTrace(trace_file);
+			db.PrerenderInfoJson(thread::hardware_concurrency());
+			const auto stats = ReplayTrace(db, trace, { argc > 3 ? stod(argv[3]) : 0.0 });
+			PrintReplayStats(stats, cout);
+			if (argc > 4) {
+				// the first replay stores the golden answers, the next ones compare against them
+				if (ifstream golden(argv[4], ios::binary); golden) {
+					const auto difference = CompareWithGolden(stats.answers, golden);
+					cout << "golden: " << (difference ? *difference : "match") << '\n';
+					return difference ? 1 : 0;
+				}
+				ofstream golden(argv[4], ios::binary);
+				WriteGolden(stats.answers, golden);
+				cout << "golden: written\n";
+			}
+			return 0;
+		}
+		if (argc > 2 && string(argv[1]) == "--record") {
+			ofstream trace_file(argv[2], ios::binary);
+			TraceWriter trace(trace_file);
+			for (const auto& node : doc.GetRoot().AsMap().at("stat_requests").AsArray()) {
+				trace.Record(SerializeToLine(node));
+			}
+		}
 		const auto stat_requests = ReadJsonRequests("stat_requests", doc);
-		const auto responses = ProcessStatRequests(db, stat_requests);
-		cout << ResponsesToJson(responses);
+		ResponseStreamWriter writer(cout);
+		ProcessStatRequests(db, stat_requests, writer, thread::hardware_concurrency());
+		writer.Finish();
 	} catch (const runtime_error& e) {
 		cerr << "Exception: " << e.what() << '\n';
 	}
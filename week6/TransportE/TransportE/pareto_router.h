@@ -0,0 +1,168 @@
+#pragma once
+
+#include "graph.h"
+#include "k_shortest_paths.h"
+
+#include <algorithm>
+#include <functional>
+#include <optional>
+#include <queue>
+#include <tuple>
+#include <vector>
+
+namespace Graph {
+
+	// Multi-criteria label-setting search over (total weight, edge count). In the
+	// transport graph every edge is one boarding, so the result is the Pareto set
+	// of routes over time and number of boardings.
+	template <typename Weight>
+	class ParetoRouter {
+	private:
+		using Graph = DirectedWeightedGraph<Weight>;
+
+	public:
+		struct ParetoPath {
+			WeightedPath<Weight> path;
+			size_t edge_count;
+		};
+
+		explicit ParetoRouter(const Graph& graph);
+
+		// Routes are sorted by edge count; at most max_routes of them are returned,
+		// the fastest one is always kept. max_routes == 0 returns them all
+		std::vector<ParetoPath> FindRoutes(VertexId from, VertexId to, size_t max_edge_count, size_t max_routes, size_t* label_count = nullptr) const;
+
+	private:
+		const Graph& graph_;
+
+		using LabelId = size_t;
+		struct Label {
+			Weight weight;
+			size_t edge_count;
+			VertexId vertex;
+			std::optional<LabelId> parent;
+			EdgeId edge;
+			bool dominated = false;
+		};
+
+		// Bag keeps non-dominated labels of a vertex sorted by edge count, so weights strictly decrease
+		class Bag {
+		public:
+			bool IsDominated(const Label& label, const std::vector<Label>& labels) const;
+			void Insert(LabelId label_id, std::vector<Label>& labels);
+			const std::vector<LabelId>& GetLabels() const { return label_ids; }
+		private:
+			std::vector<LabelId> label_ids;
+		};
+
+		std::vector<EdgeId> CollectEdges(const std::vector<Label>& labels, LabelId label_id) const;
+	};
+
+
+	template <typename Weight>
+	bool ParetoRouter<Weight>::Bag::IsDominated(const Label& label, const std::vector<Label>& labels) const {
+		for (const LabelId id : label_ids) {
+			const Label& other = labels[id];
+			if (other.edge_count > label.edge_count) {
+				break;
+			}
+			if (other.weight <= label.weight) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	template <typename Weight>
+	void ParetoRouter<Weight>::Bag::Insert(LabelId label_id, std::vector<Label>& labels) {
+		const Label& label = labels[label_id];
+		std::vector<LabelId> updated;
+		updated.reserve(label_ids.size() + 1);
+		bool inserted = false;
+		for (const LabelId id : label_ids) {
+			Label& other = labels[id];
+			if (!inserted && other.edge_count >= label.edge_count) {
+				updated.push_back(label_id);
+				inserted = true;
+			}
+			if (other.edge_count >= label.edge_count && other.weight >= label.weight) {
+				other.dominated = true;
+			} else {
+				updated.push_back(id);
+			}
+		}
+		if (!inserted) {
+			updated.push_back(label_id);
+		}
+		label_ids = std::move(updated);
+	}
+
+	template <typename Weight>
+	ParetoRouter<Weight>::ParetoRouter(const Graph& graph)
+		: graph_(graph)
+	{
+	}
+
+	template <typename Weight>
+	std::vector<typename ParetoRouter<Weight>::ParetoPath> ParetoRouter<Weight>::FindRoutes(
+		VertexId from, VertexId to, size_t max_edge_count, size_t max_routes, size_t* label_count) const {
+		std::vector<Label> labels;
+		std::vector<Bag> bags(graph_.GetVertexCount());
+
+		using QueueItem = std::tuple<Weight, size_t, LabelId>;
+		std::priority_queue<QueueItem, std::vector<QueueItem>, std::greater<QueueItem>> queue;
+
+		labels.push_back({ 0, 0, from, std::nullopt, 0 });
+		bags[from].Insert(0, labels);
+		queue.push({ 0, 0, 0 });
+
+		while (!queue.empty()) {
+			const LabelId label_id = std::get<2>(queue.top());
+			queue.pop();
+			if (labels[label_id].dominated) {
+				continue;
+			}
+			const Label label = labels[label_id];
+			if (label.vertex == to || label.edge_count == max_edge_count) {
+				continue;
+			}
+			for (const EdgeId edge_id : graph_.GetIncidentEdges(label.vertex)) {
+				const auto& edge = graph_.GetEdge(edge_id);
+				Label candidate{ label.weight + edge.weight, label.edge_count + 1, edge.to, label_id, edge_id };
+				// a label that the target already beats cannot lead to a new Pareto route
+				if (bags[edge.to].IsDominated(candidate, labels) || bags[to].IsDominated(candidate, labels)) {
+					continue;
+				}
+				labels.push_back(candidate);
+				bags[edge.to].Insert(labels.size() - 1, labels);
+				queue.push({ candidate.weight, candidate.edge_count, labels.size() - 1 });
+			}
+		}
+		if (label_count) {
+			*label_count = labels.size();
+		}
+
+		std::vector<ParetoPath> result;
+		for (const LabelId label_id : bags[to].GetLabels()) {
+			const Label& label = labels[label_id];
+			result.push_back({ { label.weight, CollectEdges(labels, label_id) }, label.edge_count });
+		}
+		if (max_routes > 0 && result.size() > max_routes) {
+			ParetoPath fastest = std::move(result.back());
+			result.resize(max_routes - 1);
+			result.push_back(std::move(fastest));
+		}
+		return result;
+	}
+
+	template <typename Weight>
+	std::vector<EdgeId> ParetoRouter<Weight>::CollectEdges(const std::vector<Label>& labels, LabelId label_id) const {
+		std::vector<EdgeId> edges;
+		for (std::optional<LabelId> id = label_id; labels[*id].parent; id = labels[*id].parent) {
+			edges.push_back(labels[*id].edge);
+		}
+		std::reverse(edges.begin(), edges.end());
+		return edges;
+	}
+
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include "dijkstra.h"
+#include "graph.h"
+#include "k_shortest_paths.h"
+
+#include <algorithm>
+#include <functional>
+#include <optional>
+#include <vector>
+
+namespace Graph {
+
+	// Answers single queries with a goal-directed search instead of an all-pairs table.
+	// The estimate is the maximum of an optional caller-provided lower bound and
+	// ALT landmark bounds; both are consistent, so their maximum is consistent too.
+	template <typename Weight>
+	class PointToPointRouter {
+	private:
+		using Graph = DirectedWeightedGraph<Weight>;
+
+	public:
+		using LowerBound = std::function<Weight(VertexId from, VertexId to)>;
+
+		PointToPointRouter(const Graph& graph, const Graph& reversed_graph, size_t landmark_count = 0, LowerBound lower_bound = {});
+
+		std::optional<WeightedPath<Weight>> FindRoute(VertexId from, VertexId to, size_t* expanded_count = nullptr) const;
+		size_t GetLandmarkCount() const;
+
+	private:
+		const Graph& graph_;
+		LowerBound lower_bound_;
+
+		struct Landmark {
+			std::vector<std::optional<Weight>> weights_from;
+			std::vector<std::optional<Weight>> weights_to;
+		};
+		std::vector<Landmark> landmarks_;
+
+		void SelectLandmarks(const Graph& reversed_graph, size_t landmark_count);
+		Weight EstimateByLandmarks(VertexId vertex, VertexId to) const;
+	};
+
+
+	template <typename Weight>
+	PointToPointRouter<Weight>::PointToPointRouter(const Graph& graph, const Graph& reversed_graph, size_t landmark_count, LowerBound lower_bound)
+		: graph_(graph)
+		, lower_bound_(std::move(lower_bound))
+	{
+		SelectLandmarks(reversed_graph, std::min(landmark_count, graph.GetVertexCount()));
+	}
+
+	template <typename Weight>
+	std::optional<WeightedPath<Weight>> PointToPointRouter<Weight>::FindRoute(VertexId from, VertexId to, size_t* expanded_count) const {
+		auto estimate = [this, to](VertexId vertex) {
+			Weight result = landmarks_.empty() ? Weight{} : EstimateByLandmarks(vertex, to);
+			if (lower_bound_) {
+				result = std::max(result, lower_bound_(vertex, to));
+			}
+			return result;
+		};
+
+		ShortestPathSearch<Weight> search(graph_);
+		search.AddSource(from, 0);
+		search.Run([to](VertexId vertex, Weight) { return vertex == to; }, [](EdgeId) { return true; }, estimate);
+		if (expanded_count) {
+			*expanded_count = search.GetExpandedCount();
+		}
+		if (!search.GetWeight(to)) {
+			return std::nullopt;
+		}
+		return WeightedPath<Weight>{ *search.GetWeight(to), search.GetRouteEdges(to) };
+	}
+
+	template <typename Weight>
+	size_t PointToPointRouter<Weight>::GetLandmarkCount() const {
+		return landmarks_.size();
+	}
+
+	template <typename Weight>
+	void PointToPointRouter<Weight>::SelectLandmarks(const Graph& reversed_graph, size_t landmark_count) {
+		auto compute_weights = [](const Graph& graph, VertexId source) {
+			ShortestPathSearch<Weight> search(graph);
+			search.AddSource(source, 0);
+			search.Run([](VertexId, Weight) { return false; });
+			std::vector<std::optional<Weight>> weights(graph.GetVertexCount());
+			for (VertexId vertex = 0; vertex < weights.size(); ++vertex) {
+				weights[vertex] = search.GetWeight(vertex);
+			}
+			return weights;
+		};
+
+		// farthest-point selection: each next landmark maximizes the distance to the closest chosen one
+		const size_t vertex_count = graph_.GetVertexCount();
+		std::vector<std::optional<Weight>> closest_landmark_weights(vertex_count);
+		VertexId next_landmark = 0;
+		while (landmarks_.size() < landmark_count) {
+			Landmark landmark{ compute_weights(graph_, next_landmark), compute_weights(reversed_graph, next_landmark) };
+			std::optional<VertexId> farthest;
+			for (VertexId vertex = 0; vertex < vertex_count; ++vertex) {
+				auto& closest = closest_landmark_weights[vertex];
+				if (const auto& weight = landmark.weights_from[vertex]; weight && (!closest || *weight < *closest)) {
+					closest = weight;
+				}
+				if (closest && (!farthest || *closest > *closest_landmark_weights[*farthest])) {
+					farthest = vertex;
+				}
+			}
+			landmarks_.push_back(std::move(landmark));
+			if (!farthest || *closest_landmark_weights[*farthest] == Weight{}) {
+				break;
+			}
+			next_landmark = *farthest;
+		}
+	}
+
+	template <typename Weight>
+	Weight PointToPointRouter<Weight>::EstimateByLandmarks(VertexId vertex, VertexId to) const {
+		Weight result{};
+		for (const auto& landmark : landmarks_) {
+			const auto& from_landmark_to_vertex = landmark.weights_from[vertex];
+			const auto& from_landmark_to_target = landmark.weights_from[to];
+			if (from_landmark_to_vertex && from_landmark_to_target) {
+				result = std::max(result, *from_landmark_to_target - *from_landmark_to_vertex);
+			}
+			const auto& from_vertex_to_landmark = landmark.weights_to[vertex];
+			const auto& from_target_to_landmark = landmark.weights_to[to];
+			if (from_vertex_to_landmark && from_target_to_landmark) {
+				result = std::max(result, *from_vertex_to_landmark - *from_target_to_landmark);
+			}
+		}
+		return result;
+	}
+
+}
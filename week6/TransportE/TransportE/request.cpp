@@ -1,8 +1,27 @@
 #include "request.h"
 #include "parse.h"
+#include "dijkstra.h"
+#include "k_shortest_paths.h"
+#include "pareto_router.h"
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <limits>
+#include <set>
+#include <stdexcept>
+#include <unordered_set>
 
 using namespace std;
 
+// Counts come from clients, so a negative one is an error and a huge one is capped
+size_t ReadCount(const Json::Node& node, const string& name, size_t max_count = numeric_limits<size_t>::max()) {
+	const int count = node.AsInt();
+	if (count < 0) {
+		throw invalid_argument(name + " must not be negative");
+	}
+	return min(static_cast<size_t>(count), max_count);
+}
+
 void AddStopRequest::ParseFrom(string_view input) {
 	params.name = ReadToken(input, ": ");
 	params.lat = ConvertToDouble(ReadToken(input, ", "));
@@ -88,6 +107,25 @@ void AddRouterSettingsRequest::ParseFrom(const Json::Node& node) {
 	const auto& attrs = node.AsMap();
 	params.bus_wait_time = attrs.at("bus_wait_time").AsInt();
 	params.bus_velocity = ConvertFromKmPerHourToMPerMin(attrs.at("bus_velocity").AsDouble());
+	params.pedestrian_velocity = ConvertFromKmPerHourToMPerMin(
+		attrs.count("pedestrian_velocity") ? attrs.at("pedestrian_velocity").AsDouble() : 5.0);
+	params.max_walk_distance = attrs.count("max_walk_distance") ? attrs.at("max_walk_distance").AsDouble() : 1000.0;
+	if (attrs.count("router_mode")) {
+		static const unordered_map<string, Database::RouterMode> modes = {
+			{"all_pairs", Database::RouterMode::ALL_PAIRS},
+			{"dijkstra", Database::RouterMode::DIJKSTRA},
+			{"astar", Database::RouterMode::ASTAR},
+			{"alt", Database::RouterMode::ALT},
+			{"sharded", Database::RouterMode::SHARDED},
+		};
+		params.mode = modes.at(attrs.at("router_mode").AsString());
+	}
+	if (attrs.count("landmark_count")) {
+		params.landmark_count = ReadCount(attrs.at("landmark_count"), "landmark_count");
+	}
+	if (attrs.count("shard_count")) {
+		params.shard_count = ReadCount(attrs.at("shard_count"), "shard_count");
+	}
 }
 
 void AddRouterSettingsRequest::Process(Database& db) const {
@@ -111,6 +149,10 @@ ResponsePtr GetBusInfoRequest::Process(const Database& db) const {
 	return make_shared<BusInfoResponse>(request_id, bus_id, db.GetBus(bus_id));
 }
 
+optional<string> GetBusInfoRequest::GetCanonicalKey() const {
+	return "Bus\n" + bus_id;
+}
+
 
 void GetStopInfoRequest::ParseFrom(string_view input) {
 	stop_id = input;
@@ -128,6 +170,20 @@ ResponsePtr GetStopInfoRequest::Process(const Database& db) const {
 	return make_shared<StopInfoResponse>(request_id, stop_id, db.GetStop(stop_id));
 }
 
+optional<string> GetStopInfoRequest::GetCanonicalKey() const {
+	return "Stop\n" + stop_id;
+}
+
+
+vector<RouterActivityPtr> BuildRouteActivities(const Database& db, const vector<Graph::EdgeId>& edges) {
+	vector<RouterActivityPtr> activities;
+	activities.reserve(2 * edges.size());
+	for (const auto edge_id : edges) {
+		activities.push_back(db.GetWaitActivityByEdge(edge_id));
+		activities.push_back(db.GetBusActivityByEdge(edge_id));
+	}
+	return activities;
+}
 
 void GetRouteBetweenStopsRequest::ParseFrom(const Json::Node& node) {
 	using namespace Json;
@@ -136,11 +192,53 @@ void GetRouteBetweenStopsRequest::ParseFrom(const Json::Node& node) {
 	from = attrs.at("from").AsString();
 	to = attrs.at("to").AsString();
 	request_id = attrs.at("id").AsInt();
+	if (attrs.count("alternatives")) {
+		alternatives_count = ReadCount(attrs.at("alternatives"), "alternatives", MAX_ALTERNATIVES_COUNT);
+	}
+	if (attrs.count("max_overlap")) {
+		max_overlap = attrs.at("max_overlap").AsDouble();
+	}
+	if (attrs.count("pareto")) {
+		pareto = attrs.at("pareto").AsBool();
+	}
+	if (attrs.count("max_boardings")) {
+		max_boardings = ReadCount(attrs.at("max_boardings"), "max_boardings", MAX_BOARDINGS);
+	}
+	if (attrs.count("max_routes")) {
+		max_pareto_routes = ReadCount(attrs.at("max_routes"), "max_routes", MAX_PARETO_ROUTES);
+		// the router takes 0 for no limit, a client cannot ask for that
+		if (max_pareto_routes == 0) {
+			throw invalid_argument("max_routes must be positive");
+		}
+	}
 }
 
 ResponsePtr GetRouteBetweenStopsRequest::Process(const Database& db) const {
 	StopPtr from_stop = db.GetStop(from);
 	StopPtr to_stop = db.GetStop(to);
+	if (!from_stop || !to_stop) {
+		return make_shared<RouteBetweenStopsInfoResponse>(false, request_id);
+	}
+	if (pareto) {
+		return ProcessPareto(db, from_stop, to_stop);
+	}
+	if (alternatives_count > 0) {
+		return ProcessAlternatives(db, from_stop, to_stop);
+	}
+	if (TransportPointRouterPtr point_router = db.GetPointRouter()) {
+		const auto path = point_router->FindRoute(from_stop->GetIndex(), to_stop->GetIndex());
+		if (!path) {
+			return make_shared<RouteBetweenStopsInfoResponse>(false, request_id);
+		}
+		return make_shared<RouteBetweenStopsInfoResponse>(true, request_id, path->weight, BuildRouteActivities(db, path->edges));
+	}
+	if (ShardedRouterPtr sharded_router = db.GetShardedRouter()) {
+		const auto path = sharded_router->FindRoute(from_stop->GetIndex(), to_stop->GetIndex());
+		if (!path) {
+			return make_shared<RouteBetweenStopsInfoResponse>(false, request_id);
+		}
+		return make_shared<RouteBetweenStopsInfoResponse>(true, request_id, path->weight, BuildRouteActivities(db, path->edges));
+	}
 	TransportRouterPtr router = db.GetRouter();
 	TransportGraphPtr graph = db.GetGraph();
 	const auto& route = router->BuildRoute(from_stop->GetIndex(), to_stop->GetIndex());
@@ -159,6 +257,288 @@ ResponsePtr GetRouteBetweenStopsRequest::Process(const Database& db) const {
 	}
 }
 
+optional<string> GetRouteBetweenStopsRequest::GetCanonicalKey() const {
+	ostringstream key;
+	key.precision(17);
+	key << "Route\n" << from << '\n' << to << '\n' << alternatives_count << ' ' << max_overlap
+		<< ' ' << pareto << ' ' << max_boardings << ' ' << max_pareto_routes;
+	return key.str();
+}
+
+bool GetRouteBetweenStopsRequest::CanBeCoalesced() const {
+	return !pareto && alternatives_count == 0;
+}
+
+vector<ResponsePtr> GetRouteBetweenStopsRequest::ProcessFromOneSource(
+	const Database& db, const vector<const GetRouteBetweenStopsRequest*>& requests) {
+	const StopPtr from_stop = db.GetStop(requests.front()->from);
+	unordered_set<Graph::VertexId> targets;
+	for (const auto* request : requests) {
+		if (const StopPtr to_stop = db.GetStop(request->to)) {
+			targets.insert(to_stop->GetIndex());
+		}
+	}
+
+	// a plain Dijkstra search settles every target with the same weights as the point router
+	Graph::ShortestPathSearch<double> search(*db.GetGraph());
+	search.AddSource(from_stop->GetIndex(), 0);
+	size_t targets_left = targets.size();
+	search.Run([&](Graph::VertexId vertex, double) {
+		return targets_left == 0 || (targets.count(vertex) && --targets_left == 0);
+	});
+
+	vector<ResponsePtr> responses;
+	for (const auto* request : requests) {
+		const StopPtr to_stop = db.GetStop(request->to);
+		if (const auto weight = to_stop ? search.GetWeight(to_stop->GetIndex()) : nullopt) {
+			responses.push_back(make_shared<RouteBetweenStopsInfoResponse>(
+				true, request->request_id, *weight, BuildRouteActivities(db, search.GetRouteEdges(to_stop->GetIndex()))));
+		} else {
+			responses.push_back(make_shared<RouteBetweenStopsInfoResponse>(false, request->request_id));
+		}
+	}
+	return responses;
+}
+
+
+// Returns nullopt if the rides pass through some stop twice
+optional<set<pair<Graph::VertexId, Graph::VertexId>>> ComputeRouteHops(const Database& db, const vector<Graph::EdgeId>& edges) {
+	set<pair<Graph::VertexId, Graph::VertexId>> hops;
+	set<Graph::VertexId> visited_stops;
+	for (const auto edge_id : edges) {
+		const auto stops_indices = db.GetStopsIndicesByEdge(edge_id);
+		if (visited_stops.empty()) {
+			visited_stops.insert(stops_indices.front());
+		}
+		for (size_t i = 1; i < stops_indices.size(); ++i) {
+			if (!visited_stops.insert(stops_indices[i]).second) {
+				return nullopt;
+			}
+			hops.insert({ stops_indices[i - 1], stops_indices[i] });
+		}
+	}
+	return hops;
+}
+
+ResponsePtr GetRouteBetweenStopsRequest::ProcessAlternatives(const Database& db, StopPtr from_stop, StopPtr to_stop) const {
+	using Path = Graph::WeightedPath<double>;
+
+	const TransportGraphPtr graph = db.GetGraph();
+	if (!graph) {
+		return make_shared<RouteBetweenStopsInfoResponse>(false, request_id);
+	}
+
+	// Diversity is measured on the stop-to-stop hops the rides cover, since
+	// a single bus edge may span several stops
+	vector<set<pair<Graph::VertexId, Graph::VertexId>>> accepted_hops;
+	auto is_diverse = [&](const Path& candidate, const vector<Path>&) {
+		auto hops = ComputeRouteHops(db, candidate.edges);
+		if (!hops) {
+			return false;
+		}
+		for (const auto& other_hops : accepted_hops) {
+			size_t shared_count = 0;
+			for (const auto& hop : *hops) {
+				shared_count += other_hops.count(hop);
+			}
+			if (!hops->empty() && shared_count > max_overlap * hops->size()) {
+				return false;
+			}
+		}
+		accepted_hops.push_back(move(*hops));
+		return true;
+	};
+
+	Graph::KShortestPathsFinder<double> finder(*graph, *db.GetReversedGraph());
+	const auto paths = finder.Find(from_stop->GetIndex(), to_stop->GetIndex(), alternatives_count, is_diverse, 10 * alternatives_count);
+	if (paths.empty()) {
+		return make_shared<RouteBetweenStopsInfoResponse>(false, request_id);
+	}
+
+	vector<RouteItems> routes;
+	for (const auto& path : paths) {
+		routes.push_back({ path.weight, BuildRouteActivities(db, path.edges) });
+	}
+	auto response = make_shared<RouteBetweenStopsInfoResponse>(true, request_id, routes.front().total_time, routes.front().items);
+	response->alternatives = move(routes);
+	return response;
+}
+
+ResponsePtr GetRouteBetweenStopsRequest::ProcessPareto(const Database& db, StopPtr from_stop, StopPtr to_stop) const {
+	const TransportGraphPtr graph = db.GetGraph();
+	if (!graph) {
+		return make_shared<RouteBetweenStopsInfoResponse>(false, request_id);
+	}
+
+	Graph::ParetoRouter<double> router(*graph);
+	const auto paths = router.FindRoutes(from_stop->GetIndex(), to_stop->GetIndex(), max_boardings, max_pareto_routes);
+	if (paths.empty()) {
+		return make_shared<RouteBetweenStopsInfoResponse>(false, request_id);
+	}
+
+	vector<RouteItems> routes;
+	for (const auto& pareto_path : paths) {
+		routes.push_back({ pareto_path.path.weight, BuildRouteActivities(db, pareto_path.path.edges) });
+	}
+	auto response = make_shared<RouteBetweenStopsInfoResponse>(true, request_id, routes.back().total_time, routes.back().items);
+	response->alternatives = move(routes);
+	return response;
+}
+
+Stop::Coords ParseCoords(const Json::Node& node) {
+	const auto& attrs = node.AsMap();
+	return { attrs.at("latitude").AsDouble(), attrs.at("longitude").AsDouble() };
+}
+
+void GetRouteBetweenCoordsRequest::ParseFrom(const Json::Node& node) {
+	using namespace Json;
+
+	const auto& attrs = node.AsMap();
+	from = ParseCoords(attrs.at("from"));
+	to = ParseCoords(attrs.at("to"));
+	request_id = attrs.at("id").AsInt();
+}
+
+optional<string> GetRouteBetweenCoordsRequest::GetCanonicalKey() const {
+	ostringstream key;
+	key.precision(17);
+	key << "RouteByCoords\n" << from.lat << ' ' << from.lon << ' ' << to.lat << ' ' << to.lon;
+	return key.str();
+}
+
+ResponsePtr GetRouteBetweenCoordsRequest::Process(const Database& db) const {
+	const TransportGraphPtr graph = db.GetGraph();
+	if (!graph) {
+		return make_shared<RouteBetweenStopsInfoResponse>(false, request_id);
+	}
+	const auto& settings = db.GetRouterSettings();
+	const double walk_velocity = settings.pedestrian_velocity;
+
+	unordered_map<Graph::VertexId, double> origin_walk_distances;
+	for (const auto& [stop, distance] : db.GetStopsWithinDistance(from, settings.max_walk_distance)) {
+		origin_walk_distances[stop->GetIndex()] = distance;
+	}
+	unordered_map<Graph::VertexId, double> destination_walk_distances;
+	for (const auto& [stop, distance] : db.GetStopsWithinDistance(to, settings.max_walk_distance)) {
+		destination_walk_distances[stop->GetIndex()] = distance;
+	}
+
+	const double direct_distance = ComputeGeographicalDistance(ConvertCoordsToRadians(from), ConvertCoordsToRadians(to));
+	double best_weight = direct_distance / walk_velocity;
+	optional<Graph::VertexId> best_destination;
+
+	Graph::ShortestPathSearch<double> search(*graph);
+	for (const auto& [vertex, distance] : origin_walk_distances) {
+		search.AddSource(vertex, distance / walk_velocity);
+	}
+	search.Run([&](Graph::VertexId vertex, double weight) {
+		if (weight >= best_weight) {
+			return true;
+		}
+		if (const auto it = destination_walk_distances.find(vertex); it != destination_walk_distances.end()) {
+			const double candidate_weight = weight + it->second / walk_velocity;
+			if (candidate_weight < best_weight) {
+				best_weight = candidate_weight;
+				best_destination = vertex;
+			}
+		}
+		return false;
+	});
+
+	vector<RouterActivityPtr> activities;
+	if (!best_destination) {
+		activities.push_back(make_shared<WalkActivity>(nullopt, nullopt, best_weight, direct_distance));
+	} else {
+		const auto origin = search.GetRouteSource(*best_destination);
+		const double origin_distance = origin_walk_distances.at(origin);
+		activities.push_back(make_shared<WalkActivity>(
+			nullopt, db.GetStopNameByIndex(origin), origin_distance / walk_velocity, origin_distance));
+		for (auto& activity : BuildRouteActivities(db, search.GetRouteEdges(*best_destination))) {
+			activities.push_back(move(activity));
+		}
+		const double destination_distance = destination_walk_distances.at(*best_destination);
+		activities.push_back(make_shared<WalkActivity>(
+			db.GetStopNameByIndex(*best_destination), nullopt, destination_distance / walk_velocity, destination_distance));
+	}
+	return make_shared<RouteBetweenStopsInfoResponse>(true, request_id, best_weight, move(activities));
+}
+
+void SearchStopsRequest::ParseFrom(const Json::Node& node) {
+	using namespace Json;
+
+	const auto& attrs = node.AsMap();
+	query = attrs.at("query").AsString();
+	request_id = attrs.at("id").AsInt();
+	if (attrs.count("fuzzy")) {
+		fuzzy = attrs.at("fuzzy").AsBool();
+	}
+	if (attrs.count("max_distance")) {
+		max_distance = ReadCount(attrs.at("max_distance"), "max_distance", MAX_FUZZY_DISTANCE);
+	}
+	if (attrs.count("limit")) {
+		limit = ReadCount(attrs.at("limit"), "limit");
+	}
+}
+
+ResponsePtr SearchStopsRequest::Process(const Database& db) const {
+	vector<string> names;
+	if (const StopNameIndexPtr index = db.GetStopNameIndex()) {
+		if (fuzzy) {
+			for (const auto& match : index->FindSimilar(query, max_distance, limit)) {
+				names.push_back(string(match.name));
+			}
+		} else {
+			for (const auto name : index->FindByPrefix(query, limit)) {
+				names.push_back(string(name));
+			}
+		}
+	}
+	return make_shared<SearchStopsResponse>(request_id, move(names));
+}
+
+optional<string> SearchStopsRequest::GetCanonicalKey() const {
+	ostringstream key;
+	key << "StopSearch\n" << query << '\n' << fuzzy << ' ' << max_distance << ' ' << limit;
+	return key.str();
+}
+
+void GetIsochroneRequest::ParseFrom(const Json::Node& node) {
+	using namespace Json;
+
+	const auto& attrs = node.AsMap();
+	from = attrs.at("from").AsString();
+	max_time = attrs.at("max_time").AsDouble();
+	request_id = attrs.at("id").AsInt();
+}
+
+ResponsePtr GetIsochroneRequest::Process(const Database& db) const {
+	const StopPtr from_stop = db.GetStop(from);
+	const TransportGraphPtr graph = db.GetGraph();
+	if (!from_stop || !graph) {
+		return make_shared<IsochroneResponse>(false, request_id);
+	}
+
+	Graph::ShortestPathSearch<double> search(*graph);
+	search.AddSource(from_stop->GetIndex(), 0);
+	vector<IsochroneResponse::ReachableStop> stops;
+	// vertices are settled in order of arrival, so the first one over the budget ends the search
+	search.Run([&](Graph::VertexId vertex, double weight) {
+		if (weight > max_time) {
+			return true;
+		}
+		stops.push_back({ db.GetStopNameByIndex(vertex), weight });
+		return false;
+	});
+	return make_shared<IsochroneResponse>(true, request_id, move(stops));
+}
+
+optional<string> GetIsochroneRequest::GetCanonicalKey() const {
+	ostringstream key;
+	key.precision(17);
+	key << "Isochrone\n" << from << '\n' << max_time;
+	return key.str();
+}
+
 
 RequestHolder Request::Create(Request::Type type) {
 	switch (type) {
@@ -176,6 +556,12 @@ RequestHolder Request::Create(Request::Type type) {
 		return make_unique<GetStopInfoRequest>();
 	case Request::Type::GET_ROUTE_BETWEEN_STOPS:
 		return make_unique<GetRouteBetweenStopsRequest>();
+	case Request::Type::GET_ROUTE_BETWEEN_COORDS:
+		return make_unique<GetRouteBetweenCoordsRequest>();
+	case Request::Type::SEARCH_STOPS:
+		return make_unique<SearchStopsRequest>();
+	case Request::Type::GET_ISOCHRONE:
+		return make_unique<GetIsochroneRequest>();
 	default:
 		return nullptr;
 	}
@@ -224,6 +610,12 @@ optional<Request::Type> ConvertRequestTypeFromJson(Request::Mode request_mode, c
 			return Request::Type::GET_STOP_INFO;
 		} else if (type == "Route") {
 			return Request::Type::GET_ROUTE_BETWEEN_STOPS;
+		} else if (type == "RouteByCoords") {
+			return Request::Type::GET_ROUTE_BETWEEN_COORDS;
+		} else if (type == "StopSearch") {
+			return Request::Type::SEARCH_STOPS;
+		} else if (type == "Isochrone") {
+			return Request::Type::GET_ISOCHRONE;
 		}
 	}
 
@@ -315,7 +707,9 @@ void ProcessBaseRequests(Database& db, const vector<RequestHolder>& requests) {
 		const auto& request = static_cast<const ModifyRequest&>(*request_holder);
 		request.Process(db);
 	}
+	db.UpdateDistanceMatrix();
 	db.UpdateAllBusesStats();
+	db.UpdateStopNameIndex();
 }
 
 void ProcessSettingsRequests(Database& db, const std::vector<RequestHolder>& requests) {
@@ -326,11 +720,145 @@ void ProcessSettingsRequests(Database& db, const std::vector<RequestHolder>& req
 	db.UpdateGraphAndRouter();
 }
 
-vector<ResponsePtr> ProcessStatRequests(Database& db, const vector<RequestHolder>& requests) {
-	vector<ResponsePtr> responses;
-	for (const auto& request_holder : requests) {
-		const auto& request = static_cast<const ReadRequest&>(*request_holder);
-		responses.push_back(request.Process(db));
+namespace {
+
+	// Unique requests are answered in units: one request or the coalesced routes from one source
+	struct StatRequestsPlan {
+		vector<vector<size_t>> units;
+		// requests answered by a copy of the response to the unique request with the same canonical key
+		unordered_map<size_t, vector<size_t>> duplicates;
+		size_t unique_request_count = 0;
+		size_t coalesced_request_count = 0;
+		size_t coalesced_search_count = 0;
+	};
+
+	// Plans requests [first, last) of the batch
+	StatRequestsPlan PlanStatRequests(const Database& db, const vector<RequestHolder>& requests, size_t first, size_t last) {
+		StatRequestsPlan plan;
+		vector<size_t> unique_indices;
+		unordered_map<string, size_t> unique_by_key;
+		for (size_t i = first; i < last; ++i) {
+			const auto key = static_cast<const ReadRequest&>(*requests[i]).GetCanonicalKey();
+			if (key) {
+				const auto [it, inserted] = unique_by_key.emplace(*key, i);
+				if (!inserted) {
+					plan.duplicates[it->second].push_back(i);
+					continue;
+				}
+			}
+			unique_indices.push_back(i);
+		}
+		plan.unique_request_count = unique_indices.size();
+
+		// with an all-pairs router a route is a table lookup, so only search-based modes gain from coalescing
+		unordered_map<string, vector<size_t>> routes_by_source;
+		if (db.GetPointRouter()) {
+			for (const size_t i : unique_indices) {
+				if (requests[i]->type != Request::Type::GET_ROUTE_BETWEEN_STOPS) {
+					continue;
+				}
+				const auto& request = static_cast<const GetRouteBetweenStopsRequest&>(*requests[i]);
+				if (request.CanBeCoalesced() && db.GetStop(request.GetFrom())) {
+					routes_by_source[request.GetFrom()].push_back(i);
+				}
+			}
+		}
+
+		unordered_set<size_t> coalesced;
+		for (auto& [from, indices] : routes_by_source) {
+			if (indices.size() < 2) {
+				continue;
+			}
+			coalesced.insert(indices.begin(), indices.end());
+			plan.coalesced_request_count += indices.size();
+			++plan.coalesced_search_count;
+			plan.units.push_back(move(indices));
+		}
+		for (const size_t i : unique_indices) {
+			if (!coalesced.count(i)) {
+				plan.units.push_back({ i });
+			}
+		}
+		// units go in the order of their first requests, so answers rarely wait in a reorder buffer
+		sort(plan.units.begin(), plan.units.end(), [](const auto& lhs, const auto& rhs) {
+			return lhs.front() < rhs.front();
+		});
+		return plan;
+	}
+
+	template <typename Callback>
+	void ProcessStatRequestsUnit(const Database& db, const vector<RequestHolder>& requests, const StatRequestsPlan& plan,
+		const vector<size_t>& unit, Callback on_response) {
+		vector<ResponsePtr> responses;
+		if (unit.size() == 1) {
+			responses.push_back(static_cast<const ReadRequest&>(*requests[unit.front()]).Process(db));
+		} else {
+			vector<const GetRouteBetweenStopsRequest*> source_requests;
+			for (const size_t i : unit) {
+				source_requests.push_back(static_cast<const GetRouteBetweenStopsRequest*>(requests[i].get()));
+			}
+			responses = GetRouteBetweenStopsRequest::ProcessFromOneSource(db, source_requests);
+		}
+		for (size_t k = 0; k < unit.size(); ++k) {
+			if (const auto it = plan.duplicates.find(unit[k]); it != plan.duplicates.end()) {
+				for (const size_t duplicate : it->second) {
+					on_response(duplicate, responses[k]->CloneWithRequestId(requests[duplicate]->request_id));
+				}
+			}
+			on_response(unit[k], move(responses[k]));
+		}
 	}
+
+	void AddToStatRequestsStats(const StatRequestsPlan& plan, size_t request_count, StatRequestsStats* stats) {
+		if (stats) {
+			stats->request_count += request_count;
+			stats->unique_request_count += plan.unique_request_count;
+			stats->coalesced_request_count += plan.coalesced_request_count;
+			stats->coalesced_search_count += plan.coalesced_search_count;
+		}
+	}
+
+}
+
+vector<ResponsePtr> ProcessStatRequests(Database& db, const vector<RequestHolder>& requests, StatRequestsStats* stats) {
+	const auto plan = PlanStatRequests(db, requests, 0, requests.size());
+	vector<ResponsePtr> responses(requests.size());
+	for (const auto& unit : plan.units) {
+		ProcessStatRequestsUnit(db, requests, plan, unit, [&responses](size_t index, ResponsePtr response) {
+			responses[index] = move(response);
+		});
+	}
+	if (stats) {
+		*stats = {};
+	}
+	AddToStatRequestsStats(plan, requests.size(), stats);
 	return responses;
 }
+
+void ProcessStatRequests(Database& db, const vector<RequestHolder>& requests, ResponseStreamWriter& writer,
+	size_t thread_count, size_t window_size, StatRequestsStats* stats) {
+	if (stats) {
+		*stats = {};
+	}
+	for (size_t first = 0; first < requests.size(); first += window_size) {
+		const size_t last = min(requests.size(), first + window_size);
+		const auto plan = PlanStatRequests(db, requests, first, last);
+		atomic<size_t> next_unit = 0;
+		auto process_units = [&] {
+			for (size_t unit; (unit = next_unit++) < plan.units.size(); ) {
+				ProcessStatRequestsUnit(db, requests, plan, plan.units[unit], [&writer](size_t index, ResponsePtr response) {
+					writer.Write(index, *response);
+				});
+			}
+		};
+		vector<future<void>> futures;
+		for (size_t i = 1; i < thread_count; ++i) {
+			futures.push_back(async(launch::async, process_units));
+		}
+		process_units();
+		for (auto& f : futures) {
+			f.get();
+		}
+		AddToStatRequestsStats(plan, last - first, stats);
+	}
+}
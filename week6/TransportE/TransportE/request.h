@@ -22,6 +22,9 @@ struct Request {
 		GET_BUS_INFO,
 		GET_STOP_INFO,
 		GET_ROUTE_BETWEEN_STOPS,
+		GET_ROUTE_BETWEEN_COORDS,
+		SEARCH_STOPS,
+		GET_ISOCHRONE,
 	};
 
 	enum class Mode {
@@ -83,6 +86,8 @@ private:
 struct ReadRequest : Request {
 	using Request::Request;
 	virtual ResponsePtr Process(const Database& db) const = 0;
+	// Requests with equal keys have equal answers up to request_id
+	virtual std::optional<std::string> GetCanonicalKey() const { return std::nullopt; }
 };
 
 struct GetBusInfoRequest : ReadRequest {
@@ -90,6 +95,7 @@ struct GetBusInfoRequest : ReadRequest {
 	void ParseFrom(std::string_view input) override;
 	void ParseFrom(const Json::Node& node) override;
 	ResponsePtr Process(const Database& db) const override;
+	std::optional<std::string> GetCanonicalKey() const override;
 private:
 	std::string bus_id;
 };
@@ -99,6 +105,7 @@ struct GetStopInfoRequest : ReadRequest {
 	void ParseFrom(std::string_view input) override;
 	void ParseFrom(const Json::Node& node) override;
 	ResponsePtr Process(const Database& db) const override;
+	std::optional<std::string> GetCanonicalKey() const override;
 private:
 	std::string stop_id;
 };
@@ -107,8 +114,62 @@ struct GetRouteBetweenStopsRequest : ReadRequest {
 	GetRouteBetweenStopsRequest() : ReadRequest(Type::GET_ROUTE_BETWEEN_STOPS) {}
 	void ParseFrom(const Json::Node& node) override;
 	ResponsePtr Process(const Database& db) const override;
+	std::optional<std::string> GetCanonicalKey() const override;
+
+	// Plain route requests from one stop are answered by a single search
+	bool CanBeCoalesced() const;
+	const std::string& GetFrom() const { return from; }
+	static std::vector<ResponsePtr> ProcessFromOneSource(const Database& db, const std::vector<const GetRouteBetweenStopsRequest*>& requests);
 private:
+	static constexpr size_t MAX_ALTERNATIVES_COUNT = 16;
+	static constexpr size_t MAX_BOARDINGS = 16;
+	static constexpr size_t MAX_PARETO_ROUTES = 16;
+
 	std::string from, to;
+	size_t alternatives_count = 0;
+	double max_overlap = 0.7;
+	bool pareto = false;
+	size_t max_boardings = 5;
+	size_t max_pareto_routes = 4;
+
+	// Both search the whole graph, so in the sharded mode their routes are not found
+	ResponsePtr ProcessAlternatives(const Database& db, StopPtr from_stop, StopPtr to_stop) const;
+	ResponsePtr ProcessPareto(const Database& db, StopPtr from_stop, StopPtr to_stop) const;
+};
+
+struct GetRouteBetweenCoordsRequest : ReadRequest {
+	GetRouteBetweenCoordsRequest() : ReadRequest(Type::GET_ROUTE_BETWEEN_COORDS) {}
+	void ParseFrom(const Json::Node& node) override;
+	ResponsePtr Process(const Database& db) const override;
+	std::optional<std::string> GetCanonicalKey() const override;
+private:
+	Stop::Coords from, to;
+};
+
+struct SearchStopsRequest : ReadRequest {
+	SearchStopsRequest() : ReadRequest(Type::SEARCH_STOPS) {}
+	void ParseFrom(const Json::Node& node) override;
+	ResponsePtr Process(const Database& db) const override;
+	std::optional<std::string> GetCanonicalKey() const override;
+private:
+	// trigrams stop filtering candidates long before that, so a larger bound only scans every name
+	static constexpr size_t MAX_FUZZY_DISTANCE = 3;
+
+	std::string query;
+	bool fuzzy = false;
+	size_t max_distance = 1;
+	size_t limit = 10;
+};
+
+// Stops reachable from one stop within max_time minutes, found by one search cut at the budget
+struct GetIsochroneRequest : ReadRequest {
+	GetIsochroneRequest() : ReadRequest(Type::GET_ISOCHRONE) {}
+	void ParseFrom(const Json::Node& node) override;
+	ResponsePtr Process(const Database& db) const override;
+	std::optional<std::string> GetCanonicalKey() const override;
+private:
+	std::string from;
+	double max_time = 0.0;
 };
 
 template <typename Number>
@@ -131,5 +192,18 @@ std::vector<RequestHolder> ReadJsonRequests(const std::string& requests_section,
 
 void ProcessBaseRequests(Database& db, const std::vector<RequestHolder>& requests);
 void ProcessSettingsRequests(Database& db, const std::vector<RequestHolder>& requests);
-std::vector<ResponsePtr> ProcessStatRequests(Database& db, const std::vector<RequestHolder>& requests);
+struct StatRequestsStats {
+	size_t request_count = 0;
+	size_t unique_request_count = 0;
+	size_t coalesced_request_count = 0;
+	size_t coalesced_search_count = 0;
+};
+
+// Identical requests are computed once and route requests from one stop share a search
+std::vector<ResponsePtr> ProcessStatRequests(Database& db, const std::vector<RequestHolder>& requests, StatRequestsStats* stats = nullptr);
+// Same answers written to the stream as soon as they are ready, computed by thread_count threads.
+// Requests go in windows of window_size, so only answers of one window wait in the reorder
+// buffer; deduplication and coalescing happen within a window.
+void ProcessStatRequests(Database& db, const std::vector<RequestHolder>& requests, ResponseStreamWriter& writer,
+	size_t thread_count = 1, size_t window_size = 4096, StatRequestsStats* stats = nullptr);
 
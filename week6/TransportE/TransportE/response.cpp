@@ -1,9 +1,43 @@
 #include "response.h"
+#include <algorithm>
 #include <iostream>
 #include <sstream>
+#include <stdexcept>
 
 using namespace std;
 
+namespace {
+
+	template <typename ResponseType>
+	ResponsePtr CloneResponse(const ResponseType& response, size_t rid) {
+		auto clone = make_shared<ResponseType>(response);
+		clone->request_id = rid;
+		return clone;
+	}
+
+	PrerenderedJson SplitAroundRequestId(const Response& response) {
+		ostringstream os;
+		os.precision(6);
+		os << response.ToJson();
+		const string json = os.str();
+		const string key = "\"request_id\": ";
+		const size_t key_end = json.find(key) + key.size();
+		const size_t value_end = json.find_first_not_of("0123456789", key_end);
+		return { json.substr(0, key_end), json.substr(value_end) };
+	}
+
+	void PrintPrerenderedJson(ostream& stream, const PrerenderedJson& json, size_t request_id) {
+		stream.write(json.head.data(), json.head.size());
+		stream << request_id;
+		stream.write(json.tail.data(), json.tail.size());
+	}
+
+}
+
+void Response::PrintJson(ostream& stream) const {
+	stream << ToJson();
+}
+
 string BusInfoResponse::ToString() const {
 	ostringstream os;
 	os << "Bus " << bus_id << ": ";
@@ -36,6 +70,18 @@ Json::Node BusInfoResponse::ToJson() const {
 	return Node(nodes_map);
 }
 
+void BusInfoResponse::PrintJson(ostream& stream) const {
+	if (bus) {
+		PrintPrerenderedJson(stream, GetBusInfoJson(bus), request_id);
+	} else {
+		Response::PrintJson(stream);
+	}
+}
+
+ResponsePtr BusInfoResponse::CloneWithRequestId(size_t rid) const {
+	return CloneResponse(*this, rid);
+}
+
 string StopInfoResponse::ToString() const {
 	ostringstream os;
 	os << "Stop " << stop_id << ": ";
@@ -72,6 +118,30 @@ Json::Node StopInfoResponse::ToJson() const {
 	return Node(nodes_map);
 }
 
+void StopInfoResponse::PrintJson(ostream& stream) const {
+	if (stop) {
+		PrintPrerenderedJson(stream, GetStopInfoJson(stop), request_id);
+	} else {
+		Response::PrintJson(stream);
+	}
+}
+
+ResponsePtr StopInfoResponse::CloneWithRequestId(size_t rid) const {
+	return CloneResponse(*this, rid);
+}
+
+Json::Node RouteItems::ToJson() const {
+	using namespace Json;
+	map<string, Node> nodes_map;
+	vector<Node> nodes;
+	for (const auto& activity : items) {
+		nodes.push_back(activity->ToJson());
+	}
+	nodes_map["items"] = Node(nodes);
+	nodes_map["total_time"] = total_time;
+	return Node(nodes_map);
+}
+
 Json::Node RouteBetweenStopsInfoResponse::ToJson() const {
 	using namespace Json;
 	map<string, Node> nodes_map;
@@ -83,6 +153,13 @@ Json::Node RouteBetweenStopsInfoResponse::ToJson() const {
 		}
 		nodes_map["items"] = Node(nodes);
 		nodes_map["total_time"] = total_time;
+		if (!alternatives.empty()) {
+			vector<Node> alternatives_nodes;
+			for (const auto& alternative : alternatives) {
+				alternatives_nodes.push_back(alternative.ToJson());
+			}
+			nodes_map["alternatives"] = Node(alternatives_nodes);
+		}
 	}
 	else {
 		nodes_map["error_message"] = Node(string("not found"));
@@ -90,12 +167,80 @@ Json::Node RouteBetweenStopsInfoResponse::ToJson() const {
 	return Node(nodes_map);
 }
 
+ResponsePtr RouteBetweenStopsInfoResponse::CloneWithRequestId(size_t rid) const {
+	return CloneResponse(*this, rid);
+}
+
+Json::Node SearchStopsResponse::ToJson() const {
+	using namespace Json;
+	map<string, Node> nodes_map;
+	nodes_map["request_id"] = Node((int)request_id);
+	vector<Node> nodes;
+	for (const auto& name : stops_names) {
+		nodes.push_back(Node(name));
+	}
+	nodes_map["stops"] = Node(nodes);
+	return Node(nodes_map);
+}
+
+ResponsePtr SearchStopsResponse::CloneWithRequestId(size_t rid) const {
+	return CloneResponse(*this, rid);
+}
+
+Json::Node IsochroneResponse::ToJson() const {
+	using namespace Json;
+	map<string, Node> nodes_map;
+	nodes_map["request_id"] = Node((int)request_id);
+	if (found) {
+		vector<Node> nodes;
+		for (const auto& stop : stops) {
+			map<string, Node> stop_map;
+			stop_map["stop_name"] = Node(stop.name);
+			stop_map["time"] = Node(stop.time);
+			nodes.push_back(Node(stop_map));
+		}
+		nodes_map["stops"] = Node(nodes);
+	} else {
+		nodes_map["error_message"] = Node(string("not found"));
+	}
+	return Node(nodes_map);
+}
+
+ResponsePtr IsochroneResponse::CloneWithRequestId(size_t rid) const {
+	return CloneResponse(*this, rid);
+}
+
+const PrerenderedJson& GetBusInfoJson(BusPtr bus) {
+	return bus->GetInfoJson([bus](const Bus&) {
+		return SplitAroundRequestId(BusInfoResponse(0, bus->GetId(), bus));
+	});
+}
+
+const PrerenderedJson& GetStopInfoJson(StopPtr stop) {
+	return stop->GetInfoJson([stop](const Stop&) {
+		return SplitAroundRequestId(StopInfoResponse(0, stop->GetName(), stop));
+	});
+}
+
 void PrintResponses(const vector<ResponsePtr>& responses, ostream& stream) {
 	for (const ResponsePtr& response : responses) {
 		stream << response->ToString() << '\n';
 	}
 }
 
+void PrintResponsesJson(const vector<ResponsePtr>& responses, ostream& stream) {
+	stream << "[\n";
+	bool first = true;
+	for (const ResponsePtr& response : responses) {
+		if (!first) {
+			stream << ",\n";
+		}
+		first = false;
+		response->PrintJson(stream);
+	}
+	stream << "\n]";
+}
+
 Json::Node ResponsesToJson(const vector<ResponsePtr>& responses) {
 	using namespace Json;
 	vector<Node> nodes;
@@ -104,3 +249,61 @@ Json::Node ResponsesToJson(const vector<ResponsePtr>& responses) {
 	}
 	return Node(nodes);
 }
+
+ResponseStreamWriter::ResponseStreamWriter(ostream& stream, size_t chunk_size)
+	: stream(stream)
+	, chunk_size(chunk_size)
+	, chunk("[\n")
+{
+}
+
+void ResponseStreamWriter::Write(size_t index, const Response& response) {
+	// rendering is the expensive part, so it happens outside the lock
+	ostringstream os;
+	os.precision(stream.precision());
+	response.PrintJson(os);
+
+	lock_guard<mutex> guard(write_mutex);
+	if (index != next_index) {
+		buffered.emplace(index, os.str());
+		max_buffered_count = max(max_buffered_count, buffered.size());
+		return;
+	}
+	if (next_index++ > 0) {
+		chunk += ",\n";
+	}
+	chunk += os.str();
+	for (auto it = buffered.begin(); it != buffered.end() && it->first == next_index; it = buffered.erase(it)) {
+		chunk += ",\n";
+		chunk += it->second;
+		++next_index;
+	}
+	if (chunk.size() >= chunk_size) {
+		FlushChunk();
+	}
+}
+
+void ResponseStreamWriter::Finish() {
+	lock_guard<mutex> guard(write_mutex);
+	if (!buffered.empty()) {
+		throw logic_error("response " + to_string(next_index) + " was never written");
+	}
+	chunk += "\n]";
+	FlushChunk();
+}
+
+size_t ResponseStreamWriter::GetWrittenCount() const {
+	lock_guard<mutex> guard(write_mutex);
+	return next_index;
+}
+
+size_t ResponseStreamWriter::GetMaxBufferedCount() const {
+	lock_guard<mutex> guard(write_mutex);
+	return max_buffered_count;
+}
+
+void ResponseStreamWriter::FlushChunk() {
+	stream << chunk;
+	stream.flush();
+	chunk.clear();
+}
@@ -1,23 +1,30 @@
 #pragma once
 
 #include <iostream>
+#include <map>
 #include <vector>
 #include <memory>
+#include <mutex>
 #include <string>
 #include "bus.h"
 #include "json.h"
 #include "router_activity.h"
 
+struct Response;
+using ResponsePtr = std::shared_ptr<Response>;
+
 struct Response {
 	Response(size_t rid) : request_id(rid) {}
 	virtual std::string ToString() const { return "";  };
 	virtual Json::Node ToJson() const = 0;
+	// Same text as printing ToJson()
+	virtual void PrintJson(std::ostream& stream) const;
+	// Answers a duplicate request without computing it again
+	virtual ResponsePtr CloneWithRequestId(size_t rid) const = 0;
 
 	size_t request_id = 0;
 };
 
-using ResponsePtr = std::shared_ptr<Response>;
-
 struct BusInfoResponse : Response {
 	std::string bus_id;
 	BusPtr bus;
@@ -25,6 +32,8 @@ struct BusInfoResponse : Response {
 	BusInfoResponse(size_t rid, const std::string& id, BusPtr b) : Response(rid), bus_id(id), bus(b) {}
 	std::string ToString() const override;
 	Json::Node ToJson() const override;
+	void PrintJson(std::ostream& stream) const override;
+	ResponsePtr CloneWithRequestId(size_t rid) const override;
 };
 
 struct StopInfoResponse : Response {
@@ -34,12 +43,22 @@ struct StopInfoResponse : Response {
 	StopInfoResponse(size_t rid, const std::string& id, StopPtr s) : Response(rid), stop_id(id), stop(s) {}
 	std::string ToString() const override;
 	Json::Node ToJson() const override;
+	void PrintJson(std::ostream& stream) const override;
+	ResponsePtr CloneWithRequestId(size_t rid) const override;
+};
+
+struct RouteItems {
+	double total_time = 0.0;
+	std::vector<RouterActivityPtr> items;
+
+	Json::Node ToJson() const;
 };
 
 struct RouteBetweenStopsInfoResponse : Response {
 	bool found;
 	double total_time = 0.0;
 	std::vector<RouterActivityPtr> items;
+	std::vector<RouteItems> alternatives;
 
 	RouteBetweenStopsInfoResponse(bool is_found, size_t rid, double tt = 0.0, const std::vector<RouterActivityPtr>& activities = {})
 		: found(is_found)
@@ -49,7 +68,69 @@ struct RouteBetweenStopsInfoResponse : Response {
 	{}
 
 	Json::Node ToJson() const override;
+	ResponsePtr CloneWithRequestId(size_t rid) const override;
+};
+
+struct SearchStopsResponse : Response {
+	std::vector<std::string> stops_names;
+
+	SearchStopsResponse(size_t rid, std::vector<std::string> names) : Response(rid), stops_names(std::move(names)) {}
+	Json::Node ToJson() const override;
+	ResponsePtr CloneWithRequestId(size_t rid) const override;
+};
+
+struct IsochroneResponse : Response {
+	struct ReachableStop {
+		std::string name;
+		double time;
+	};
+
+	bool found;
+	// in order of arrival
+	std::vector<ReachableStop> stops;
+
+	IsochroneResponse(bool is_found, size_t rid, std::vector<ReachableStop> reachable = {})
+		: Response(rid)
+		, found(is_found)
+		, stops(std::move(reachable))
+	{}
+	Json::Node ToJson() const override;
+	ResponsePtr CloneWithRequestId(size_t rid) const override;
 };
 
+// Info answers never change after base requests, so their JSON is rendered once per stop or bus
+const PrerenderedJson& GetBusInfoJson(BusPtr bus);
+const PrerenderedJson& GetStopInfoJson(StopPtr stop);
+
 void PrintResponses(const std::vector<ResponsePtr>& responses, std::ostream& stream = std::cout);
+// Same text as printing ResponsesToJson(responses)
+void PrintResponsesJson(const std::vector<ResponsePtr>& responses, std::ostream& stream = std::cout);
 Json::Node ResponsesToJson(const std::vector<ResponsePtr>& responses);
+
+// Prints the same text as PrintResponsesJson while responses are still being computed.
+// Responses may come from several threads in any order: each one waits in a reorder
+// buffer until all the previous ones are written. Output goes to the stream in chunks.
+class ResponseStreamWriter {
+public:
+	explicit ResponseStreamWriter(std::ostream& stream, size_t chunk_size = 1 << 16);
+
+	// index is the position of the request in the batch
+	void Write(size_t index, const Response& response);
+	// Closes the array; every index before the last written one must be written
+	void Finish();
+
+	size_t GetWrittenCount() const;
+	size_t GetMaxBufferedCount() const;
+
+private:
+	std::ostream& stream;
+	const size_t chunk_size;
+
+	mutable std::mutex write_mutex;
+	size_t next_index = 0;
+	std::map<size_t, std::string> buffered;
+	size_t max_buffered_count = 0;
+	std::string chunk;
+
+	void FlushChunk();
+};
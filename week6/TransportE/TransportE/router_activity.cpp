@@ -20,3 +20,18 @@ Json::Node BusActivity::ToJson() const {
 	nodes_map["time"] = time;
 	return Node(nodes_map);
 }
+
+Json::Node WalkActivity::ToJson() const {
+	using namespace Json;
+	map<string, Node> nodes_map;
+	nodes_map["type"] = type;
+	if (from_stop) {
+		nodes_map["from_stop"] = *from_stop;
+	}
+	if (to_stop) {
+		nodes_map["to_stop"] = *to_stop;
+	}
+	nodes_map["distance"] = distance;
+	nodes_map["time"] = time;
+	return Node(nodes_map);
+}
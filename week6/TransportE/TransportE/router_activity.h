@@ -2,6 +2,7 @@
 
 #include <string>
 #include <memory>
+#include <optional>
 #include "json.h"
 
 struct RouterActivity {
@@ -37,3 +38,18 @@ struct BusActivity : RouterActivity {
 
 	Json::Node ToJson() const override;
 };
+
+struct WalkActivity : RouterActivity {
+	std::optional<std::string> from_stop;
+	std::optional<std::string> to_stop;
+	double distance;
+
+	WalkActivity(std::optional<std::string> from, std::optional<std::string> to, double time, double walk_distance)
+		: RouterActivity("Walk", time)
+		, from_stop(from)
+		, to_stop(to)
+		, distance(walk_distance)
+	{}
+
+	Json::Node ToJson() const override;
+};
@@ -0,0 +1,404 @@
+#include "server.h"
+#include "request.h"
+#include "thread_pool.h"
+#include "trace.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#endif
+
+using namespace std;
+
+string SerializeToLine(const Json::Node& node) {
+	ostringstream os;
+	os.precision(6);
+	os << node;
+	string line = os.str();
+	line.erase(remove(line.begin(), line.end(), '\n'), line.end());
+	return line;
+}
+
+string ProcessRequestLine(const Database& db, const string& line, string* request_type) {
+	try {
+		istringstream is(line);
+		const Json::Document doc = Json::Load(is);
+		if (request_type) {
+			*request_type = doc.GetRoot().AsMap().at("type").AsString();
+		}
+		const RequestHolder request = ParseRequest(Request::Mode::READ, doc.GetRoot());
+		if (!request) {
+			return R"({"error_message": "unknown request"})";
+		}
+		const auto response = static_cast<const ReadRequest&>(*request).Process(db);
+		ostringstream os;
+		os.precision(6);
+		response->PrintJson(os);
+		string answer = os.str();
+		answer.erase(remove(answer.begin(), answer.end(), '\n'), answer.end());
+		return answer;
+	} catch (const exception& e) {
+		return SerializeToLine(Json::Node(map<string, Json::Node>{ { "error_message", Json::Node(string("bad request: ") + e.what()) } }));
+	}
+}
+
+#ifdef __linux__
+
+namespace {
+
+	void SetNonBlocking(int fd) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+	}
+
+	sockaddr_un MakeAddress(const string& socket_path) {
+		sockaddr_un address{};
+		address.sun_family = AF_UNIX;
+		if (socket_path.size() >= sizeof(address.sun_path)) {
+			throw runtime_error("socket path is too long: " + socket_path);
+		}
+		strcpy(address.sun_path, socket_path.c_str());
+		return address;
+	}
+
+	// Ids of connections are kept in epoll data; these two are reserved
+	const uint64_t LISTEN_EVENT_ID = numeric_limits<uint64_t>::max();
+	const uint64_t WAKE_EVENT_ID = numeric_limits<uint64_t>::max() - 1;
+
+}
+
+QueryServer::QueryServer(const Database& db, const ServerSettings& settings)
+	: db(db)
+	, settings(settings)
+{
+	listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_fd < 0) {
+		throw runtime_error("cannot create socket");
+	}
+	const auto address = MakeAddress(settings.socket_path);
+	unlink(settings.socket_path.c_str());
+	if (bind(listen_fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0 || listen(listen_fd, SOMAXCONN) < 0) {
+		close(listen_fd);
+		throw runtime_error("cannot listen on " + settings.socket_path + ": " + strerror(errno));
+	}
+	SetNonBlocking(listen_fd);
+
+	epoll_fd = epoll_create1(0);
+	wake_fd = eventfd(0, EFD_NONBLOCK);
+
+	epoll_event event{};
+	event.events = EPOLLIN;
+	event.data.u64 = LISTEN_EVENT_ID;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+	event.data.u64 = WAKE_EVENT_ID;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event);
+}
+
+QueryServer::~QueryServer() {
+	for (auto& [id, connection] : connections) {
+		close(connection.fd);
+	}
+	close(wake_fd);
+	close(epoll_fd);
+	close(listen_fd);
+	unlink(settings.socket_path.c_str());
+}
+
+void QueryServer::Run() {
+	ThreadPool workers(settings.worker_count);
+	auto process = [this](ConnectionId id, size_t seq, string line) {
+		string answer = ProcessRequestLine(db, line);
+		{
+			lock_guard<mutex> guard(answers_mutex);
+			answers.push_back({ id, seq, move(answer) });
+		}
+		const uint64_t one = 1;
+		write(wake_fd, &one, sizeof(one));
+	};
+
+	ofstream trace_file;
+	optional<TraceWriter> trace;
+	if (!settings.trace_path.empty()) {
+		trace_file.open(settings.trace_path, ios::binary);
+		if (!trace_file) {
+			throw runtime_error("cannot open " + settings.trace_path);
+		}
+		trace.emplace(trace_file);
+	}
+
+	vector<epoll_event> events(64);
+	while (!stopping) {
+		const int event_count = epoll_wait(epoll_fd, events.data(), events.size(), -1);
+		for (int i = 0; i < event_count; ++i) {
+			const uint64_t event_id = events[i].data.u64;
+			if (event_id == LISTEN_EVENT_ID) {
+				AcceptConnections();
+			} else if (event_id == WAKE_EVENT_ID) {
+				uint64_t counter;
+				read(wake_fd, &counter, sizeof(counter));
+				CollectAnswers();
+			} else if (connections.count(event_id)) {
+				if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+					ReadFromConnection(event_id);
+				}
+				if (connections.count(event_id) && (events[i].events & EPOLLOUT)) {
+					WriteToConnection(event_id);
+				}
+			}
+		}
+
+		for (auto& [id, connection] : connections) {
+			size_t line_end;
+			while ((line_end = connection.input.find('\n')) != string::npos) {
+				string line = connection.input.substr(0, line_end);
+				connection.input.erase(0, line_end + 1);
+				if (!line.empty()) {
+					if (trace) {
+						trace->Record(line);
+					}
+					workers.Submit([process, id = id, seq = connection.next_seq++, line = move(line)] {
+						process(id, seq, line);
+					});
+				}
+			}
+		}
+		if (trace) {
+			trace_file.flush();
+		}
+	}
+}
+
+void QueryServer::Stop() {
+	stopping = true;
+	const uint64_t one = 1;
+	write(wake_fd, &one, sizeof(one));
+}
+
+void QueryServer::AcceptConnections() {
+	while (true) {
+		const int fd = accept(listen_fd, nullptr, nullptr);
+		if (fd < 0) {
+			return;
+		}
+		SetNonBlocking(fd);
+		const ConnectionId id = next_connection_id++;
+		connections[id].fd = fd;
+
+		epoll_event event{};
+		event.events = EPOLLIN;
+		event.data.u64 = id;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+	}
+}
+
+void QueryServer::ReadFromConnection(ConnectionId id) {
+	auto& connection = connections.at(id);
+	char buffer[1 << 16];
+	while (true) {
+		const ssize_t size = read(connection.fd, buffer, sizeof(buffer));
+		if (size > 0) {
+			connection.input.append(buffer, size);
+		} else if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		} else {
+			connection.input_closed = true;
+			break;
+		}
+	}
+	UpdateConnectionEvents(id);
+}
+
+void QueryServer::WriteToConnection(ConnectionId id) {
+	auto& connection = connections.at(id);
+	while (!connection.output.empty()) {
+		// a client gone before its answers must not kill the server with SIGPIPE
+		const ssize_t size = send(connection.fd, connection.output.data(), connection.output.size(), MSG_NOSIGNAL);
+		if (size < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			CloseConnection(id);
+			return;
+		}
+		connection.output.erase(0, size);
+	}
+	UpdateConnectionEvents(id);
+}
+
+void QueryServer::CollectAnswers() {
+	vector<Answer> collected;
+	{
+		lock_guard<mutex> guard(answers_mutex);
+		collected.swap(answers);
+	}
+	vector<ConnectionId> touched;
+	for (auto& answer : collected) {
+		const auto it = connections.find(answer.connection_id);
+		if (it == connections.end()) {
+			continue;
+		}
+		auto& connection = it->second;
+		connection.ready_answers[answer.seq] = move(answer.line);
+		// answers computed out of order wait until their predecessors are ready
+		for (auto ready = connection.ready_answers.begin();
+			ready != connection.ready_answers.end() && ready->first == connection.next_seq_to_write;
+			ready = connection.ready_answers.erase(ready)) {
+			connection.output += ready->second;
+			connection.output += '\n';
+			++connection.next_seq_to_write;
+		}
+		touched.push_back(answer.connection_id);
+	}
+	for (const ConnectionId id : touched) {
+		if (connections.count(id)) {
+			WriteToConnection(id);
+		}
+	}
+}
+
+void QueryServer::UpdateConnectionEvents(ConnectionId id) {
+	auto& connection = connections.at(id);
+	const bool all_answered = connection.next_seq_to_write == connection.next_seq && connection.input.find('\n') == string::npos;
+	if (connection.input_closed && all_answered && connection.output.empty()) {
+		CloseConnection(id);
+		return;
+	}
+	const uint32_t events = (connection.input_closed ? 0u : static_cast<uint32_t>(EPOLLIN)) | (connection.output.empty() ? 0u : static_cast<uint32_t>(EPOLLOUT));
+	if (events == 0) {
+		if (connection.watched) {
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection.fd, nullptr);
+			connection.watched = false;
+		}
+		return;
+	}
+	epoll_event event{};
+	event.events = events;
+	event.data.u64 = id;
+	epoll_ctl(epoll_fd, connection.watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, connection.fd, &event);
+	connection.watched = true;
+}
+
+void QueryServer::CloseConnection(ConnectionId id) {
+	auto& connection = connections.at(id);
+	if (connection.watched) {
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection.fd, nullptr);
+	}
+	close(connection.fd);
+	connections.erase(id);
+}
+
+LoadGeneratorStats RunLoadGenerator(const LoadGeneratorSettings& settings, const vector<string>& request_lines) {
+	using Clock = chrono::steady_clock;
+
+	if (request_lines.empty()) {
+		throw runtime_error("no stat requests to send");
+	}
+	vector<vector<double>> latencies(settings.connection_count);
+	auto run_connection = [&](size_t connection_index) {
+		const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		const auto address = MakeAddress(settings.socket_path);
+		if (connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0) {
+			close(fd);
+			return;
+		}
+
+		const size_t request_count = settings.request_count / settings.connection_count;
+		deque<Clock::time_point> in_flight;
+		size_t sent = 0, received = 0;
+		string input;
+		char buffer[1 << 16];
+		while (received < request_count) {
+			string batch;
+			while (sent < request_count && in_flight.size() < settings.pipeline_depth) {
+				batch += request_lines[(connection_index + sent * settings.connection_count) % request_lines.size()];
+				batch += '\n';
+				in_flight.push_back(Clock::now());
+				++sent;
+			}
+			for (size_t written = 0; written < batch.size(); ) {
+				const ssize_t size = send(fd, batch.data() + written, batch.size() - written, MSG_NOSIGNAL);
+				if (size <= 0) {
+					close(fd);
+					return;
+				}
+				written += size;
+			}
+
+			const ssize_t size = read(fd, buffer, sizeof(buffer));
+			if (size <= 0) {
+				break;
+			}
+			input.append(buffer, size);
+			size_t line_end;
+			while ((line_end = input.find('\n')) != string::npos) {
+				input.erase(0, line_end + 1);
+				const auto latency = Clock::now() - in_flight.front();
+				in_flight.pop_front();
+				latencies[connection_index].push_back(chrono::duration<double, micro>(latency).count());
+				++received;
+			}
+		}
+		close(fd);
+	};
+
+	const auto start = Clock::now();
+	vector<thread> threads;
+	for (size_t i = 0; i < settings.connection_count; ++i) {
+		threads.emplace_back(run_connection, i);
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+	const auto finish = Clock::now();
+
+	vector<double> all_latencies;
+	for (const auto& connection_latencies : latencies) {
+		all_latencies.insert(all_latencies.end(), connection_latencies.begin(), connection_latencies.end());
+	}
+	LoadGeneratorStats stats;
+	stats.request_count = all_latencies.size();
+	stats.seconds = chrono::duration<double>(finish - start).count();
+	if (!all_latencies.empty()) {
+		sort(all_latencies.begin(), all_latencies.end());
+		stats.p50_latency_us = all_latencies[all_latencies.size() / 2];
+		stats.p99_latency_us = all_latencies[min(all_latencies.size() - 1, all_latencies.size() * 99 / 100)];
+	}
+	return stats;
+}
+
+#else
+
+QueryServer::QueryServer(const Database& db, const ServerSettings& settings)
+	: db(db)
+	, settings(settings)
+{
+	throw runtime_error("server mode is supported on Linux only");
+}
+
+QueryServer::~QueryServer() {
+}
+
+void QueryServer::Run() {
+}
+
+void QueryServer::Stop() {
+}
+
+LoadGeneratorStats RunLoadGenerator(const LoadGeneratorSettings& settings, const vector<string>& request_lines) {
+	throw runtime_error("load generator is supported on Linux only");
+}
+
+#endif
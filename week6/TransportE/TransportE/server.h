@@ -0,0 +1,95 @@
+#pragma once
+
+#include "database.h"
+#include "json.h"
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Long-running mode: the database is built once, then newline-delimited JSON stat
+// requests are answered over a Unix domain socket. Requests of one connection may
+// be pipelined; answers come back in the order of the requests.
+struct ServerSettings {
+	std::string socket_path;
+	size_t worker_count = 4;
+	// when set, incoming requests are recorded there, see trace.h
+	std::string trace_path;
+};
+
+class QueryServer {
+public:
+	QueryServer(const Database& db, const ServerSettings& settings);
+	~QueryServer();
+
+	QueryServer(const QueryServer&) = delete;
+	QueryServer& operator=(const QueryServer&) = delete;
+
+	// Blocks until Stop() is called from another thread
+	void Run();
+	void Stop();
+
+private:
+	using ConnectionId = size_t;
+
+	struct Connection {
+		int fd = -1;
+		std::string input;
+		std::string output;
+		size_t next_seq = 0;
+		size_t next_seq_to_write = 0;
+		std::map<size_t, std::string> ready_answers;
+		bool input_closed = false;
+		// EPOLLHUP cannot be masked, so a connection waiting for nothing but answers is kept out of epoll
+		bool watched = true;
+	};
+
+	struct Answer {
+		ConnectionId connection_id;
+		size_t seq;
+		std::string line;
+	};
+
+	const Database& db;
+	ServerSettings settings;
+	int listen_fd = -1;
+	int epoll_fd = -1;
+	int wake_fd = -1;
+	std::atomic<bool> stopping = false;
+
+	ConnectionId next_connection_id = 0;
+	std::unordered_map<ConnectionId, Connection> connections;
+
+	std::mutex answers_mutex;
+	std::vector<Answer> answers;
+
+	void AcceptConnections();
+	void ReadFromConnection(ConnectionId id);
+	void WriteToConnection(ConnectionId id);
+	void CollectAnswers();
+	void UpdateConnectionEvents(ConnectionId id);
+	void CloseConnection(ConnectionId id);
+};
+
+struct LoadGeneratorSettings {
+	std::string socket_path;
+	size_t connection_count = 4;
+	size_t pipeline_depth = 16;
+	size_t request_count = 100000;
+};
+
+struct LoadGeneratorStats {
+	size_t request_count = 0;
+	double seconds = 0.0;
+	double p50_latency_us = 0.0;
+	double p99_latency_us = 0.0;
+};
+
+// Replays request_lines round-robin over several pipelined connections
+LoadGeneratorStats RunLoadGenerator(const LoadGeneratorSettings& settings, const std::vector<std::string>& request_lines);
+
+// Answers one request on one line; request_type receives the "type" of a parsed request
+std::string ProcessRequestLine(const Database& db, const std::string& line, std::string* request_type = nullptr);
+std::string SerializeToLine(const Json::Node& node);
@@ -0,0 +1,491 @@
+#include "sharded_router.h"
+#include "dijkstra.h"
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_set>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace Graph;
+
+namespace {
+
+	using Weight = ShardedRouter::Weight;
+	const Weight UNREACHABLE = numeric_limits<Weight>::infinity();
+
+	// edges of a cell are sent in batches of this size while the graph is being built
+	const size_t EDGE_BATCH_SIZE = 1 << 12;
+
+	enum class WorkerRequest : uint32_t {
+		EDGES,
+		BUILD,
+		DISTANCES,
+		BACKWARD_DISTANCES,
+		PATH,
+		BOUNDARY_TABLE,
+		STOP,
+	};
+
+	// Messages are length-prefixed blobs of trivially copyable values and vectors of them
+	class Message {
+	public:
+		template <typename T>
+		Message& Put(const T& value) {
+			static_assert(is_trivially_copyable_v<T>);
+			const char* bytes = reinterpret_cast<const char*>(&value);
+			data.insert(data.end(), bytes, bytes + sizeof(T));
+			return *this;
+		}
+
+		template <typename T>
+		Message& PutVector(const vector<T>& values) {
+			Put<uint64_t>(values.size());
+			for (const T& value : values) {
+				Put(value);
+			}
+			return *this;
+		}
+
+		template <typename T>
+		T Get() {
+			T value;
+			if (position + sizeof(T) > data.size()) {
+				throw runtime_error("truncated worker message");
+			}
+			memcpy(&value, data.data() + position, sizeof(T));
+			position += sizeof(T);
+			return value;
+		}
+
+		template <typename T>
+		vector<T> GetVector() {
+			vector<T> values(Get<uint64_t>());
+			for (T& value : values) {
+				value = Get<T>();
+			}
+			return values;
+		}
+
+		void Send(int fd) const;
+		static Message Receive(int fd);
+
+	private:
+		vector<char> data;
+		size_t position = 0;
+	};
+
+	struct CellEdge {
+		VertexId from;
+		VertexId to;
+		Weight weight;
+		EdgeId edge_id;
+	};
+
+#ifdef __linux__
+
+	void WriteAll(int fd, const char* data, size_t size) {
+		while (size > 0) {
+			const ssize_t written = send(fd, data, size, MSG_NOSIGNAL);
+			if (written <= 0) {
+				throw runtime_error("worker connection is broken");
+			}
+			data += written;
+			size -= written;
+		}
+	}
+
+	void ReadAll(int fd, char* data, size_t size) {
+		while (size > 0) {
+			const ssize_t received = read(fd, data, size);
+			if (received <= 0) {
+				throw runtime_error("worker connection is broken");
+			}
+			data += received;
+			size -= received;
+		}
+	}
+
+	void Message::Send(int fd) const {
+		const uint64_t size = data.size();
+		WriteAll(fd, reinterpret_cast<const char*>(&size), sizeof(size));
+		WriteAll(fd, data.data(), data.size());
+	}
+
+	Message Message::Receive(int fd) {
+		uint64_t size;
+		ReadAll(fd, reinterpret_cast<char*>(&size), sizeof(size));
+		Message message;
+		message.data.resize(size);
+		ReadAll(fd, message.data.data(), size);
+		return message;
+	}
+
+	// Worker process: collects the edges of one cell, then holds its graph with local vertex ids
+	class CellWorker {
+	public:
+		explicit CellWorker(Message cell_message) {
+			global_vertices = cell_message.GetVector<VertexId>();
+			for (VertexId local = 0; local < global_vertices.size(); ++local) {
+				local_ids[global_vertices[local]] = local;
+			}
+		}
+
+		void Serve(int fd) {
+			while (true) {
+				Message request = Message::Receive(fd);
+				Message answer;
+				const auto type = request.Get<WorkerRequest>();
+				switch (type) {
+				// the cell graph is loaded without answers, the coordinator only streams edges
+				case WorkerRequest::EDGES: {
+					const auto edges = request.GetVector<CellEdge>();
+					pending_edges.insert(pending_edges.end(), edges.begin(), edges.end());
+					continue;
+				}
+				case WorkerRequest::BUILD:
+					Build(request.GetVector<VertexId>());
+					continue;
+				case WorkerRequest::DISTANCES:
+				case WorkerRequest::BACKWARD_DISTANCES: {
+					const bool backward = type == WorkerRequest::BACKWARD_DISTANCES;
+					const VertexId source = request.Get<VertexId>();
+					answer.PutVector(ComputeWeights(backward ? *reversed_graph : *graph, source, request.GetVector<VertexId>()));
+					break;
+				}
+				case WorkerRequest::PATH: {
+					const VertexId from = local_ids.at(request.Get<VertexId>());
+					const VertexId to = local_ids.at(request.Get<VertexId>());
+					ShortestPathSearch<Weight> search(*graph);
+					search.AddSource(from, 0);
+					search.Run([to](VertexId vertex, Weight) { return vertex == to; });
+					vector<EdgeId> edges;
+					for (const EdgeId edge_id : search.GetWeight(to) ? search.GetRouteEdges(to) : vector<EdgeId>{}) {
+						edges.push_back(global_edges[edge_id]);
+					}
+					answer.Put(search.GetWeight(to).value_or(UNREACHABLE)).PutVector(edges);
+					break;
+				}
+				case WorkerRequest::BOUNDARY_TABLE: {
+					vector<Weight> table;
+					for (const VertexId source : boundary_vertices) {
+						const auto weights = ComputeWeights(*graph, source, boundary_vertices);
+						table.insert(table.end(), weights.begin(), weights.end());
+					}
+					answer.PutVector(table);
+					break;
+				}
+				case WorkerRequest::STOP:
+					return;
+				}
+				answer.Send(fd);
+			}
+		}
+
+	private:
+		vector<VertexId> global_vertices;
+		unordered_map<VertexId, VertexId> local_ids;
+		vector<CellEdge> pending_edges;
+		vector<EdgeId> global_edges;
+		unique_ptr<DirectedWeightedGraph<Weight>> graph;
+		unique_ptr<DirectedWeightedGraph<Weight>> reversed_graph;
+		vector<VertexId> boundary_vertices;
+
+		void Build(vector<VertexId> boundary) {
+			graph = make_unique<DirectedWeightedGraph<Weight>>(global_vertices.size());
+			for (const auto& edge : pending_edges) {
+				graph->AddEdge({ local_ids.at(edge.from), local_ids.at(edge.to), edge.weight });
+				global_edges.push_back(edge.edge_id);
+			}
+			pending_edges = {};
+			reversed_graph = make_unique<DirectedWeightedGraph<Weight>>(BuildReversedGraph(*graph));
+			boundary_vertices = move(boundary);
+		}
+
+		vector<Weight> ComputeWeights(const DirectedWeightedGraph<Weight>& cell_graph, VertexId source, const vector<VertexId>& targets) const {
+			unordered_set<VertexId> pending;
+			for (const VertexId target : targets) {
+				pending.insert(local_ids.at(target));
+			}
+			ShortestPathSearch<Weight> search(cell_graph);
+			search.AddSource(local_ids.at(source), 0);
+			search.Run([&pending](VertexId vertex, Weight) {
+				pending.erase(vertex);
+				return pending.empty();
+			});
+			vector<Weight> weights;
+			for (const VertexId target : targets) {
+				weights.push_back(search.GetWeight(local_ids.at(target)).value_or(UNREACHABLE));
+			}
+			return weights;
+		}
+	};
+
+#endif
+
+}
+
+#ifdef __linux__
+
+ShardedRouter::ShardedRouter(vector<CellId> cells, size_t cell_count)
+	: cells_(move(cells))
+	, workers_(cell_count)
+	, pending_cell_edges_(cell_count)
+{
+	StartWorkers();
+}
+
+ShardedRouter::~ShardedRouter() {
+	for (const auto& worker : workers_) {
+		if (worker.fd < 0) {
+			continue;
+		}
+		try {
+			Message().Put(WorkerRequest::STOP).Send(worker.fd);
+		} catch (const runtime_error&) {
+		}
+		close(worker.fd);
+		waitpid(worker.pid, nullptr, 0);
+	}
+}
+
+EdgeId ShardedRouter::AddEdge(const Edge<Weight>& edge) {
+	const EdgeId edge_id = edge_count_++;
+	const CellId cell = cells_[edge.from];
+	if (cell != cells_[edge.to]) {
+		cut_edges_.push_back({ edge_id, edge });
+		return edge_id;
+	}
+	pending_cell_edges_[cell].push_back({ edge_id, edge });
+	if (pending_cell_edges_[cell].size() == EDGE_BATCH_SIZE) {
+		SendCellEdges(cell);
+	}
+	return edge_id;
+}
+
+void ShardedRouter::Build() {
+	vector<bool> is_boundary(cells_.size(), false);
+	for (const auto& [edge_id, edge] : cut_edges_) {
+		is_boundary[edge.from] = is_boundary[edge.to] = true;
+	}
+	for (VertexId vertex = 0; vertex < cells_.size(); ++vertex) {
+		if (is_boundary[vertex]) {
+			overlay_ids_[vertex] = overlay_vertices_.size();
+			overlay_vertices_.push_back(vertex);
+			workers_[cells_[vertex]].boundary_vertices.push_back(vertex);
+		}
+	}
+	for (CellId cell = 0; cell < workers_.size(); ++cell) {
+		SendCellEdges(cell);
+		Message().Put(WorkerRequest::BUILD).PutVector(workers_[cell].boundary_vertices).Send(workers_[cell].fd);
+	}
+	pending_cell_edges_ = {};
+	BuildOverlay();
+}
+
+void ShardedRouter::StartWorkers() {
+	for (auto& worker : workers_) {
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+			throw runtime_error("cannot create worker socket");
+		}
+		const pid_t pid = fork();
+		if (pid < 0) {
+			throw runtime_error("cannot start worker process");
+		}
+		if (pid == 0) {
+			close(fds[0]);
+			for (const auto& other : workers_) {
+				if (other.fd >= 0) {
+					close(other.fd);
+				}
+			}
+			int exit_code = 0;
+			try {
+				CellWorker(Message::Receive(fds[1])).Serve(fds[1]);
+			} catch (const exception&) {
+				exit_code = 1;
+			}
+			_exit(exit_code);
+		}
+		close(fds[1]);
+		worker.pid = pid;
+		worker.fd = fds[0];
+	}
+
+	vector<vector<VertexId>> cell_vertices(workers_.size());
+	for (VertexId vertex = 0; vertex < cells_.size(); ++vertex) {
+		cell_vertices[cells_[vertex]].push_back(vertex);
+	}
+	for (CellId cell = 0; cell < workers_.size(); ++cell) {
+		Message().PutVector(cell_vertices[cell]).Send(workers_[cell].fd);
+	}
+}
+
+void ShardedRouter::SendCellEdges(CellId cell) {
+	vector<CellEdge> edges;
+	edges.reserve(pending_cell_edges_[cell].size());
+	for (const auto& [edge_id, edge] : pending_cell_edges_[cell]) {
+		edges.push_back({ edge.from, edge.to, edge.weight, edge_id });
+	}
+	Message().Put(WorkerRequest::EDGES).PutVector(edges).Send(workers_[cell].fd);
+	pending_cell_edges_[cell].clear();
+}
+
+void ShardedRouter::BuildOverlay() {
+	overlay_graph_ = make_unique<DirectedWeightedGraph<Weight>>(overlay_vertices_.size());
+	for (const auto& [edge_id, edge] : cut_edges_) {
+		overlay_graph_->AddEdge({ overlay_ids_.at(edge.from), overlay_ids_.at(edge.to), edge.weight });
+		overlay_edges_.push_back({ edge_id, cells_[edge.from] });
+	}
+	cut_edges_ = {};
+
+	// all cells compute their tables at once
+	for (const auto& worker : workers_) {
+		Message().Put(WorkerRequest::BOUNDARY_TABLE).Send(worker.fd);
+	}
+	for (CellId cell = 0; cell < workers_.size(); ++cell) {
+		const auto& boundary = workers_[cell].boundary_vertices;
+		const auto table = ReceiveWeights(cell);
+		for (size_t i = 0; i < boundary.size(); ++i) {
+			for (size_t j = 0; j < boundary.size(); ++j) {
+				const Weight weight = table[i * boundary.size() + j];
+				if (i != j && weight != UNREACHABLE) {
+					overlay_graph_->AddEdge({ overlay_ids_.at(boundary[i]), overlay_ids_.at(boundary[j]), weight });
+					overlay_edges_.push_back({ nullopt, cell });
+				}
+			}
+		}
+	}
+}
+
+vector<Weight> ShardedRouter::ReceiveWeights(CellId cell) const {
+	return Message::Receive(workers_[cell].fd).GetVector<Weight>();
+}
+
+ShardedRouter::Path ShardedRouter::FindPathInCell(CellId cell, VertexId from, VertexId to) const {
+	lock_guard<mutex> guard(workers_[cell].mutex);
+	Message().Put(WorkerRequest::PATH).Put(from).Put(to).Send(workers_[cell].fd);
+	Message answer = Message::Receive(workers_[cell].fd);
+	const Weight weight = answer.Get<Weight>();
+	return { weight, answer.GetVector<EdgeId>() };
+}
+
+optional<ShardedRouter::Path> ShardedRouter::FindRoute(VertexId from, VertexId to) const {
+	const CellId from_cell = cells_[from], to_cell = cells_[to];
+
+	vector<VertexId> forward_targets = workers_[from_cell].boundary_vertices;
+	if (from_cell == to_cell) {
+		forward_targets.push_back(to);
+	}
+	vector<Weight> forward_weights, backward_weights;
+	{
+		// both end cells are held at once, std::lock takes them without deadlocks
+		unique_lock<mutex> from_lock(workers_[from_cell].mutex, defer_lock), to_lock(workers_[to_cell].mutex, defer_lock);
+		if (from_cell == to_cell) {
+			from_lock.lock();
+		} else {
+			lock(from_lock, to_lock);
+		}
+		auto request_backward_weights = [&] {
+			Message().Put(WorkerRequest::BACKWARD_DISTANCES).Put(to).PutVector(workers_[to_cell].boundary_vertices).Send(workers_[to_cell].fd);
+		};
+		// different cells search at the same time
+		Message().Put(WorkerRequest::DISTANCES).Put(from).PutVector(forward_targets).Send(workers_[from_cell].fd);
+		if (from_cell != to_cell) {
+			request_backward_weights();
+		}
+		forward_weights = ReceiveWeights(from_cell);
+		if (from_cell == to_cell) {
+			request_backward_weights();
+		}
+		backward_weights = ReceiveWeights(to_cell);
+	}
+
+	Weight best_weight = from_cell == to_cell ? forward_weights.back() : UNREACHABLE;
+	optional<VertexId> best_exit;
+	unordered_map<VertexId, Weight> exit_weights;
+	for (size_t i = 0; i < workers_[to_cell].boundary_vertices.size(); ++i) {
+		if (backward_weights[i] != UNREACHABLE) {
+			exit_weights[overlay_ids_.at(workers_[to_cell].boundary_vertices[i])] = backward_weights[i];
+		}
+	}
+
+	ShortestPathSearch<Weight> search(*overlay_graph_);
+	for (size_t i = 0; i < workers_[from_cell].boundary_vertices.size(); ++i) {
+		if (forward_weights[i] != UNREACHABLE) {
+			search.AddSource(overlay_ids_.at(workers_[from_cell].boundary_vertices[i]), forward_weights[i]);
+		}
+	}
+	search.Run([&](VertexId vertex, Weight weight) {
+		if (weight >= best_weight) {
+			return true;
+		}
+		if (const auto it = exit_weights.find(vertex); it != exit_weights.end() && weight + it->second < best_weight) {
+			best_weight = weight + it->second;
+			best_exit = vertex;
+		}
+		return false;
+	});
+
+	if (best_weight == UNREACHABLE) {
+		return nullopt;
+	}
+	if (!best_exit) {
+		return FindPathInCell(from_cell, from, to);
+	}
+
+	const VertexId entry = overlay_vertices_[search.GetRouteSource(*best_exit)];
+	Path path{ best_weight, FindPathInCell(from_cell, from, entry).edges };
+	auto append = [&path](const vector<EdgeId>& edges) {
+		path.edges.insert(path.edges.end(), edges.begin(), edges.end());
+	};
+	for (const EdgeId overlay_edge_id : search.GetRouteEdges(*best_exit)) {
+		const auto& overlay_edge = overlay_edges_[overlay_edge_id];
+		if (overlay_edge.cut_edge) {
+			path.edges.push_back(*overlay_edge.cut_edge);
+		} else {
+			const auto& edge = overlay_graph_->GetEdge(overlay_edge_id);
+			append(FindPathInCell(overlay_edge.cell, overlay_vertices_[edge.from], overlay_vertices_[edge.to]).edges);
+		}
+	}
+	append(FindPathInCell(to_cell, overlay_vertices_[*best_exit], to).edges);
+	return path;
+}
+
+#else
+
+ShardedRouter::ShardedRouter(vector<CellId> cells, size_t cell_count) {
+	throw runtime_error("sharded routing is supported on Linux only");
+}
+
+ShardedRouter::~ShardedRouter() {
+}
+
+EdgeId ShardedRouter::AddEdge(const Edge<Weight>& edge) {
+	return edge_count_++;
+}
+
+void ShardedRouter::Build() {
+}
+
+optional<ShardedRouter::Path> ShardedRouter::FindRoute(VertexId from, VertexId to) const {
+	return nullopt;
+}
+
+#endif
+
+size_t ShardedRouter::GetCellCount() const {
+	return workers_.size();
+}
+
+size_t ShardedRouter::GetBoundaryVertexCount() const {
+	return overlay_vertices_.size();
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include "graph.h"
+#include "graph_partition.h"
+#include "k_shortest_paths.h"
+
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Routes over a graph split into cells, each cell served by its own worker
+// process. Workers are forked before any edge exists and edges are streamed
+// in one by one: an edge inside a cell goes to its worker over a local socket,
+// so no process ever holds the whole graph. The coordinator keeps the overlay
+// graph: boundary vertices, edges between cells and the boundary-to-boundary
+// distance tables of every cell.
+// A query asks the source and the target cells for distances to their
+// boundaries, runs Dijkstra over the overlay and expands the overlay path
+// into graph edges with the help of the cells it crosses. Queries run
+// concurrently; a worker serves one of them at a time.
+class ShardedRouter {
+public:
+	using Weight = double;
+	using Path = Graph::WeightedPath<Weight>;
+
+	ShardedRouter(std::vector<Graph::CellId> cells, size_t cell_count);
+	~ShardedRouter();
+
+	ShardedRouter(const ShardedRouter&) = delete;
+	ShardedRouter& operator=(const ShardedRouter&) = delete;
+
+	// Edge ids are given in the order of addition, as DirectedWeightedGraph does
+	Graph::EdgeId AddEdge(const Graph::Edge<Weight>& edge);
+	// Called once after the last edge, before the first route
+	void Build();
+
+	std::optional<Path> FindRoute(Graph::VertexId from, Graph::VertexId to) const;
+
+	size_t GetCellCount() const;
+	size_t GetBoundaryVertexCount() const;
+
+private:
+	struct Worker {
+		int pid = -1;
+		int fd = -1;
+		std::vector<Graph::VertexId> boundary_vertices;
+		// held for a request and its answer
+		mutable std::mutex mutex;
+	};
+
+	struct OverlayEdge {
+		// an edge between cells or a shortest path inside the cell
+		std::optional<Graph::EdgeId> cut_edge;
+		Graph::CellId cell;
+	};
+
+	std::vector<Graph::CellId> cells_;
+	std::vector<Worker> workers_;
+
+	using NumberedEdge = std::pair<Graph::EdgeId, Graph::Edge<Weight>>;
+	// edges inside a cell wait here until a batch for its worker is full
+	std::vector<std::vector<NumberedEdge>> pending_cell_edges_;
+	std::vector<NumberedEdge> cut_edges_;
+	Graph::EdgeId edge_count_ = 0;
+
+	std::unordered_map<Graph::VertexId, Graph::VertexId> overlay_ids_;
+	std::vector<Graph::VertexId> overlay_vertices_;
+	std::unique_ptr<Graph::DirectedWeightedGraph<Weight>> overlay_graph_;
+	std::vector<OverlayEdge> overlay_edges_;
+
+	void StartWorkers();
+	void SendCellEdges(Graph::CellId cell);
+	void BuildOverlay();
+	std::vector<Weight> ReceiveWeights(Graph::CellId cell) const;
+	Path FindPathInCell(Graph::CellId cell, Graph::VertexId from, Graph::VertexId to) const;
+};
@@ -2,6 +2,7 @@
 
 #include "bus.h"
 #include <stdexcept>
+#include <algorithm>
 #include <math.h>
 
 using namespace std;
@@ -10,6 +11,10 @@ double DegreesToRadians(double degree) {
 	return degree * M_PI / 180.0;
 }
 
+Stop::Coords ConvertCoordsToRadians(const Stop::Coords& coords_in_degrees) {
+	return { DegreesToRadians(coords_in_degrees.lat), DegreesToRadians(coords_in_degrees.lon) };
+}
+
 Stop::Stop(const string& stop_name)
 	: name(stop_name)
 {
@@ -31,11 +36,16 @@ size_t Stop::GetIndex() const {
 Stop& Stop::SetCoords(double lat_in_degrees, double lon_in_degrees) {
 	coords.lat = lat_in_degrees;
 	coords.lon = lon_in_degrees;
+	has_coords = true;
 	return *this;
 }
 
+bool Stop::HasCoords() const {
+	return has_coords;
+}
+
 Stop::Coords Stop::GetCoordsInRadians() const {
-	return { DegreesToRadians(coords.lat), DegreesToRadians(coords.lon) };
+	return ConvertCoordsToRadians(coords);
 }
 
 Stop& Stop::AddBus(BusPtr bus) {
@@ -47,42 +57,20 @@ const set<string>& Stop::GetBuses() const {
 	return buses;
 }
 
-Stop& Stop::SetDistances(const StopsDistances& new_distances) {
-	distances = new_distances;
-	return *this;
-}
-
-Stop& Stop::AddDistance(const std::string& other_stop, double distance) {
-	distances[other_stop] = distance;
-	return *this;
-}
-
-StopsDistances Stop::GetDistances() const {
-	return distances;
-}
-
-optional<double> Stop::GetDistanceTo(StopPtr other_stop) const {
-	const string stop = other_stop->GetName();
-	if (distances.count(stop)) {
-		return distances.at(stop);
+double ComputeRealDistanceBetweenStops(const DistanceMatrix& distances, StopPtr lhs, StopPtr rhs) {
+	if (const auto distance = distances.FindEitherWay(lhs->GetIndex(), rhs->GetIndex())) {
+		return *distance;
 	} else {
-		return nullopt;
+		throw runtime_error("no distance between " + lhs->GetName() + " and " + rhs->GetName());
 	}
 }
 
-double ComputeRealDistanceBetweenStops(StopPtr lhs, StopPtr rhs) {
-	if (auto distance_from_lhs_to_rhs = lhs->GetDistanceTo(rhs)) {
-		return *distance_from_lhs_to_rhs;
-	} else if (auto distance_from_rhs_to_lhs = rhs->GetDistanceTo(lhs)) {
-		return *distance_from_rhs_to_lhs;
-	} else {
-		throw runtime_error("no distance between " + lhs->GetName() + " and " + rhs->GetName());
-	}
+double ComputeGeographicalDistance(const Stop::Coords& lc, const Stop::Coords& rc) {
+	const double EARTH_RADIUS = 6371000.0;
+	const double cos_angle = sin(lc.lat) * sin(rc.lat) + cos(lc.lat) * cos(rc.lat) * cos(abs(lc.lon - rc.lon));
+	return acos(min(1.0, max(-1.0, cos_angle))) * EARTH_RADIUS;
 }
 
 double ComputeGeographicalDistanceBetweenStops(StopPtr lhs, StopPtr rhs) {
-	const double EARTH_RADIUS = 6371000.0;
-	const auto lc = lhs->GetCoordsInRadians();
-	const auto rc = rhs->GetCoordsInRadians();
-	return acos(sin(lc.lat) * sin(rc.lat) + cos(lc.lat) * cos(rc.lat) * cos(abs(lc.lon - rc.lon))) * EARTH_RADIUS;
+	return ComputeGeographicalDistance(lhs->GetCoordsInRadians(), rhs->GetCoordsInRadians());
 }
@@ -0,0 +1,182 @@
+#include "stop_index.h"
+#include <algorithm>
+#include <numeric>
+
+using namespace std;
+
+StopNameIndex::StopNameIndex(vector<string> names) {
+	sort(names.begin(), names.end());
+	names.erase(unique(names.begin(), names.end()), names.end());
+
+	name_offsets_.reserve(names.size() + 1);
+	name_offsets_.push_back(0);
+	for (const auto& name : names) {
+		names_buffer_ += name;
+		name_offsets_.push_back(names_buffer_.size());
+	}
+	names_buffer_.shrink_to_fit();
+
+	vector<pair<Trigram, NameId>> occurrences;
+	for (NameId id = 0; id < names.size(); ++id) {
+		for (const Trigram trigram : ComputeTrigrams(names[id])) {
+			occurrences.push_back({ trigram, id });
+		}
+	}
+	sort(occurrences.begin(), occurrences.end());
+
+	postings_.reserve(occurrences.size());
+	for (size_t i = 0; i < occurrences.size(); ++i) {
+		if (i == 0 || occurrences[i].first != occurrences[i - 1].first) {
+			trigrams_.push_back(occurrences[i].first);
+			trigram_offsets_.push_back(postings_.size());
+		}
+		postings_.push_back(occurrences[i].second);
+	}
+	trigram_offsets_.push_back(postings_.size());
+}
+
+vector<string_view> StopNameIndex::FindByPrefix(string_view prefix, size_t limit) const {
+	vector<string_view> result;
+	NameId first = 0, last = GetNameCount();
+	while (first < last) {
+		const NameId middle = first + (last - first) / 2;
+		if (GetName(middle) < prefix) {
+			first = middle + 1;
+		} else {
+			last = middle;
+		}
+	}
+	for (NameId id = first; id < GetNameCount() && result.size() < limit; ++id) {
+		const string_view name = GetName(id);
+		if (name.substr(0, prefix.size()) != prefix) {
+			break;
+		}
+		result.push_back(name);
+	}
+	return result;
+}
+
+vector<StopNameIndex::Match> StopNameIndex::FindSimilar(string_view query, size_t max_distance, size_t limit) const {
+	vector<Match> result;
+	for (const NameId id : FindCandidates(query, max_distance)) {
+		const string_view name = GetName(id);
+		if (const auto distance = ComputeEditDistance(query, name, max_distance)) {
+			result.push_back({ name, *distance });
+		}
+	}
+	sort(result.begin(), result.end(), [](const Match& lhs, const Match& rhs) {
+		return make_pair(lhs.distance, lhs.name) < make_pair(rhs.distance, rhs.name);
+	});
+	if (result.size() > limit) {
+		result.resize(limit);
+	}
+	return result;
+}
+
+size_t StopNameIndex::GetNameCount() const {
+	return name_offsets_.size() - 1;
+}
+
+size_t StopNameIndex::GetMemoryUsage() const {
+	return names_buffer_.capacity()
+		+ name_offsets_.capacity() * sizeof(uint32_t)
+		+ trigrams_.capacity() * sizeof(Trigram)
+		+ trigram_offsets_.capacity() * sizeof(uint32_t)
+		+ postings_.capacity() * sizeof(NameId);
+}
+
+string_view StopNameIndex::GetName(NameId id) const {
+	return string_view(names_buffer_).substr(name_offsets_[id], name_offsets_[id + 1] - name_offsets_[id]);
+}
+
+vector<StopNameIndex::NameId> StopNameIndex::FindCandidates(string_view query, size_t max_distance) const {
+	auto length_fits = [&](NameId id) {
+		const size_t length = name_offsets_[id + 1] - name_offsets_[id];
+		return max(length, query.size()) - min(length, query.size()) <= max_distance;
+	};
+
+	// One edit breaks at most three trigrams of the query, so a match keeps the rest
+	const auto query_trigrams = ComputeTrigrams(query);
+	vector<NameId> candidates;
+	if (query_trigrams.size() <= 3 * max_distance) {
+		for (NameId id = 0; id < GetNameCount(); ++id) {
+			if (length_fits(id)) {
+				candidates.push_back(id);
+			}
+		}
+		return candidates;
+	}
+	const size_t min_common = query_trigrams.size() - 3 * max_distance;
+
+	vector<pair<const NameId*, const NameId*>> posting_lists;
+	for (const Trigram trigram : query_trigrams) {
+		const auto it = lower_bound(trigrams_.begin(), trigrams_.end(), trigram);
+		if (it != trigrams_.end() && *it == trigram) {
+			const size_t index = it - trigrams_.begin();
+			posting_lists.push_back({ postings_.data() + trigram_offsets_[index], postings_.data() + trigram_offsets_[index + 1] });
+		}
+	}
+	if (posting_lists.size() < min_common) {
+		return candidates;
+	}
+	sort(posting_lists.begin(), posting_lists.end(), [](const auto& lhs, const auto& rhs) {
+		return lhs.second - lhs.first < rhs.second - rhs.first;
+	});
+
+	// A match misses at most posting_lists.size() - min_common of the lists, so it
+	// is found in one of the shortest lists beyond that number
+	const size_t generating_count = posting_lists.size() - min_common + 1;
+	for (size_t i = 0; i < generating_count; ++i) {
+		candidates.insert(candidates.end(), posting_lists[i].first, posting_lists[i].second);
+	}
+	sort(candidates.begin(), candidates.end());
+	candidates.erase(unique(candidates.begin(), candidates.end()), candidates.end());
+	candidates.erase(remove_if(candidates.begin(), candidates.end(), [&](NameId id) { return !length_fits(id); }), candidates.end());
+
+	return candidates;
+}
+
+vector<StopNameIndex::Trigram> StopNameIndex::ComputeTrigrams(string_view name) {
+	// padding makes the first and the last characters take part in several trigrams
+	const string padded = "\x01\x01" + string(name) + "\x02";
+	vector<Trigram> trigrams;
+	for (size_t i = 0; i + 3 <= padded.size(); ++i) {
+		trigrams.push_back(
+			static_cast<Trigram>(static_cast<unsigned char>(padded[i])) << 16
+			| static_cast<Trigram>(static_cast<unsigned char>(padded[i + 1])) << 8
+			| static_cast<unsigned char>(padded[i + 2]));
+	}
+	sort(trigrams.begin(), trigrams.end());
+	trigrams.erase(unique(trigrams.begin(), trigrams.end()), trigrams.end());
+	return trigrams;
+}
+
+optional<size_t> StopNameIndex::ComputeEditDistance(string_view lhs, string_view rhs, size_t max_distance) {
+	// only cells within max_distance of the diagonal can stay within the bound
+	const size_t infinity = max_distance + 1;
+	vector<size_t> previous(rhs.size() + 1, infinity), current(rhs.size() + 1, infinity);
+	for (size_t j = 0; j <= min(rhs.size(), max_distance); ++j) {
+		previous[j] = j;
+	}
+	for (size_t i = 1; i <= lhs.size(); ++i) {
+		const size_t first = i > max_distance ? i - max_distance : 1;
+		const size_t last = min(rhs.size(), i + max_distance);
+		current[first - 1] = first == 1 && i <= max_distance ? i : infinity;
+		size_t row_min = current[first - 1];
+		for (size_t j = first; j <= last; ++j) {
+			current[j] = min({ previous[j] + 1, current[j - 1] + 1, previous[j - 1] + (lhs[i - 1] != rhs[j - 1]), infinity });
+			row_min = min(row_min, current[j]);
+		}
+		if (last < rhs.size()) {
+			current[last + 1] = infinity;
+		}
+		if (row_min > max_distance) {
+			return nullopt;
+		}
+		swap(previous, current);
+	}
+	if (previous[rhs.size()] > max_distance) {
+		return nullopt;
+	}
+	return previous[rhs.size()];
+}
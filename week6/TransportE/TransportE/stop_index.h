@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Read-only index of stop names for autocomplete. Names are sorted and packed
+// into one buffer, so a prefix is an equal range found by binary search. Typo
+// tolerant search takes candidates from the trigram inverted index (a name within
+// d edits shares all but 3d trigrams with the query) and verifies them with a
+// banded edit distance.
+class StopNameIndex {
+public:
+	struct Match {
+		std::string_view name;
+		size_t distance;
+	};
+
+	explicit StopNameIndex(std::vector<std::string> names);
+
+	// At most limit names in lexicographical order
+	std::vector<std::string_view> FindByPrefix(std::string_view prefix, size_t limit) const;
+	// At most limit names within max_distance edits, closest first
+	std::vector<Match> FindSimilar(std::string_view query, size_t max_distance, size_t limit) const;
+
+	size_t GetNameCount() const;
+	size_t GetMemoryUsage() const;
+
+private:
+	using NameId = uint32_t;
+	using Trigram = uint32_t;
+
+	std::string names_buffer_;
+	std::vector<uint32_t> name_offsets_;
+
+	// postings_[trigram_offsets_[i], trigram_offsets_[i + 1]) are the ids of names containing trigrams_[i]
+	std::vector<Trigram> trigrams_;
+	std::vector<uint32_t> trigram_offsets_;
+	std::vector<NameId> postings_;
+
+	std::string_view GetName(NameId id) const;
+	std::vector<NameId> FindCandidates(std::string_view query, size_t max_distance) const;
+	static std::vector<Trigram> ComputeTrigrams(std::string_view name);
+	static std::optional<size_t> ComputeEditDistance(std::string_view lhs, std::string_view rhs, size_t max_distance);
+};
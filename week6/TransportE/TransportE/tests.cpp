@@ -1,9 +1,28 @@
 #include "database.h"
 #include "request.h"
+#include "k_shortest_paths.h"
+#include "pareto_router.h"
+#include "graph_partition.h"
+#include "stop_index.h"
+#include "distance_matrix.h"
+#include "server.h"
+#include "trace.h"
 #include "tests.h"
 #include "test_runner.h"
 #include <iostream>
 #include <sstream>
+#include <cmath>
+#include <random>
+#include <thread>
+#include <chrono>
+#include <atomic>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cstring>
+#endif
 
 using namespace std;
 
@@ -52,6 +71,10 @@ void TestPrintJson() {
 	os.precision(6);
 	os << doc.GetRoot();
 	ASSERT_EQUAL(os.str(), expected.str());
+
+	stringstream escaped;
+	escaped << Node(map<string, Node>{ { "message", Node(string("a \"quoted\" \\ name\n")) } });
+	ASSERT_EQUAL(escaped.str(), "{\n\"message\": \"a \\\"quoted\\\" \\\\ name\\n\"\n}");
 }
 
 void TestBusAndStopsRequests() {
@@ -263,11 +286,975 @@ void TestBusAndStopsRequests() {
 }
 ])";
 	ASSERT_EQUAL(ans.str(), expected);
+
+	// rendered lazily by the first print, then reused
+	for (int pass = 0; pass < 2; ++pass) {
+		ostringstream prerendered;
+		PrintResponsesJson(responses, prerendered);
+		ASSERT_EQUAL(prerendered.str(), expected);
+	}
+	Database parallel_db;
+	ProcessBaseRequests(parallel_db, ReadJsonRequests("base_requests", doc));
+	parallel_db.PrerenderInfoJson(3);
+	ostringstream prerendered;
+	PrintResponsesJson(ProcessStatRequests(parallel_db, stat_requests), prerendered);
+	ASSERT_EQUAL(prerendered.str(), expected);
+}
+
+void TestRouteBetweenCoords() {
+	using namespace Json;
+	stringstream ss;
+	ss << R"({
+				"base_requests": [
+				{
+					"type": "Stop",
+					"road_distances": {
+					"B": 2300
+					},
+					"longitude": 37.6,
+					"name": "A",
+					"latitude": 55.6
+				},
+				{
+					"type": "Stop",
+					"road_distances": {
+					"C": 2300
+					},
+					"longitude": 37.6,
+					"name": "B",
+					"latitude": 55.62
+				},
+				{
+					"type": "Stop",
+					"road_distances": {},
+					"longitude": 37.6,
+					"name": "C",
+					"latitude": 55.64
+				},
+				{
+					"type": "Bus",
+					"name": "1",
+					"stops": [
+					"A",
+					"B",
+					"C"
+					],
+					"is_roundtrip": false
+				}
+				],
+				"routing_settings": {
+					"bus_wait_time": 6,
+					"bus_velocity": 40,
+					"pedestrian_velocity": 5
+				},
+				"stat_requests": [
+				{
+					"type": "RouteByCoords",
+					"from": {"latitude": 55.601, "longitude": 37.6},
+					"to": {"latitude": 55.639, "longitude": 37.6},
+					"id": 1
+				},
+				{
+					"type": "RouteByCoords",
+					"from": {"latitude": 55.601, "longitude": 37.6},
+					"to": {"latitude": 55.602, "longitude": 37.6},
+					"id": 2
+				}
+				]
+			})";
+	Json::Document doc = Json::Load(ss);
+
+	Database db;
+	ProcessBaseRequests(db, ReadJsonRequests("base_requests", doc));
+	ProcessSettingsRequests(db, ReadJsonRequests("routing_settings", doc));
+	const auto responses = ProcessStatRequests(db, ReadJsonRequests("stat_requests", doc));
+
+	const auto responses_json = ResponsesToJson(responses);
+	const auto& by_bus = responses_json.AsArray()[0].AsMap();
+	const auto& bus_items = by_bus.at("items").AsArray();
+	ASSERT_EQUAL(bus_items.size(), 4u);
+	ASSERT_EQUAL(bus_items[0].AsMap().at("type").AsString(), "Walk");
+	ASSERT_EQUAL(bus_items[0].AsMap().at("to_stop").AsString(), "A");
+	ASSERT_EQUAL(bus_items[1].AsMap().at("type").AsString(), "Wait");
+	ASSERT_EQUAL(bus_items[2].AsMap().at("type").AsString(), "Bus");
+	ASSERT_EQUAL(bus_items[2].AsMap().at("span_count").AsInt(), 2);
+	ASSERT_EQUAL(bus_items[3].AsMap().at("type").AsString(), "Walk");
+	ASSERT_EQUAL(bus_items[3].AsMap().at("from_stop").AsString(), "C");
+	double items_time = 0.0;
+	for (const auto& item : bus_items) {
+		items_time += item.AsMap().at("time").AsDouble();
+	}
+	ASSERT(abs(items_time - by_bus.at("total_time").AsDouble()) < 1e-6);
+	ASSERT(by_bus.at("total_time").AsDouble() < 16.0);
+
+	const auto& on_foot = responses_json.AsArray()[1].AsMap();
+	const auto& walk_items = on_foot.at("items").AsArray();
+	ASSERT_EQUAL(walk_items.size(), 1u);
+	ASSERT_EQUAL(walk_items[0].AsMap().at("type").AsString(), "Walk");
+	ASSERT_EQUAL(walk_items[0].AsMap().count("from_stop"), 0u);
+}
+
+void TestKShortestPaths() {
+	Graph::DirectedWeightedGraph<double> graph(4);
+	graph.AddEdge({ 0, 1, 1.0 });
+	graph.AddEdge({ 1, 3, 1.0 });
+	graph.AddEdge({ 0, 2, 1.5 });
+	graph.AddEdge({ 2, 3, 1.0 });
+	graph.AddEdge({ 1, 2, 0.2 });
+	graph.AddEdge({ 0, 3, 4.0 });
+	const auto reversed_graph = Graph::BuildReversedGraph(graph);
+
+	Graph::KShortestPathsFinder<double> finder(graph, reversed_graph);
+	auto accept_all = [](const auto&, const auto&) { return true; };
+	const auto paths = finder.Find(0, 3, 5, accept_all, 50);
+
+	vector<double> weights;
+	for (const auto& path : paths) {
+		weights.push_back(path.weight);
+	}
+	ASSERT_EQUAL(weights, vector<double>({ 2.0, 2.2, 2.5, 4.0 }));
+	ASSERT_EQUAL(paths[1].edges, vector<Graph::EdgeId>({ 0, 4, 3 }));
+}
+
+void TestRouteAlternatives() {
+	using namespace Json;
+	stringstream ss;
+	ss << R"({
+				"base_requests": [
+				{"type": "Stop", "road_distances": {"B": 1000, "C": 1200}, "longitude": 37.6, "name": "A", "latitude": 55.6},
+				{"type": "Stop", "road_distances": {"D": 1000}, "longitude": 37.61, "name": "B", "latitude": 55.605},
+				{"type": "Stop", "road_distances": {"D": 1200}, "longitude": 37.59, "name": "C", "latitude": 55.605},
+				{"type": "Stop", "road_distances": {}, "longitude": 37.6, "name": "D", "latitude": 55.61},
+				{"type": "Bus", "name": "1", "stops": ["A", "B", "D"], "is_roundtrip": false},
+				{"type": "Bus", "name": "2", "stops": ["A", "C", "D"], "is_roundtrip": false}
+				],
+				"routing_settings": {"bus_wait_time": 2, "bus_velocity": 30},
+				"stat_requests": [
+				{"type": "Route", "from": "A", "to": "D", "id": 1, "alternatives": 3}
+				]
+			})";
+	Json::Document doc = Json::Load(ss);
+
+	Database db;
+	ProcessBaseRequests(db, ReadJsonRequests("base_requests", doc));
+	ProcessSettingsRequests(db, ReadJsonRequests("routing_settings", doc));
+	const auto responses = ProcessStatRequests(db, ReadJsonRequests("stat_requests", doc));
+
+	const auto responses_json = ResponsesToJson(responses);
+	const auto& route = responses_json.AsArray()[0].AsMap();
+	const auto& alternatives = route.at("alternatives").AsArray();
+	ASSERT_EQUAL(alternatives.size(), 2u);
+	ASSERT_EQUAL(alternatives[0].AsMap().at("items").AsArray()[1].AsMap().at("bus").AsString(), "1");
+	ASSERT_EQUAL(alternatives[1].AsMap().at("items").AsArray()[1].AsMap().at("bus").AsString(), "2");
+	ASSERT_EQUAL(route.at("total_time").AsDouble(), alternatives[0].AsMap().at("total_time").AsDouble());
+	ASSERT(alternatives[0].AsMap().at("total_time").AsDouble() < alternatives[1].AsMap().at("total_time").AsDouble());
+
+	// a client asking for too many alternatives gets the capped number of them, a negative count is an error
+	stringstream many_alternatives(R"({"type": "Route", "from": "A", "to": "D", "id": 2, "alternatives": 1000000000})");
+	const auto many_request = ParseRequest(Request::Mode::READ, Json::Load(many_alternatives).GetRoot());
+	const auto many_json = static_cast<const ReadRequest&>(*many_request).Process(db)->ToJson();
+	ASSERT_EQUAL(many_json.AsMap().at("alternatives").AsArray().size(), 2u);
+	stringstream negative_alternatives(R"({"type": "Route", "from": "A", "to": "D", "id": 3, "alternatives": -1})");
+	bool thrown = false;
+	try {
+		ParseRequest(Request::Mode::READ, Json::Load(negative_alternatives).GetRoot());
+	} catch (const invalid_argument&) {
+		thrown = true;
+	}
+	ASSERT(thrown);
+}
+
+void FillSmallGridCity(Database& db, Database::RouterMode mode) {
+	const size_t side = 5;
+	auto name = [](size_t row, size_t col) { return to_string(row) + ":" + to_string(col); };
+	for (size_t row = 0; row < side; ++row) {
+		for (size_t col = 0; col < side; ++col) {
+			Database::StopParams params{ name(row, col), 55.5 + row * 0.005, 37.5 + col * 0.008, {} };
+			if (col + 1 < side) {
+				params.distances[name(row, col + 1)] = 500 + 37 * ((row * 7 + col * 3) % 11);
+			}
+			if (row + 1 < side) {
+				params.distances[name(row + 1, col)] = 560 + 41 * ((row * 5 + col) % 9);
+			} else if (col % 2 == 0) {
+				params.distances[name(0, col)] = 2100;
+			}
+			db.AddOrUpdateStop(params);
+		}
+	}
+	for (size_t line = 0; line < side; ++line) {
+		Database::BusParams row_bus{ "R" + to_string(line), {} };
+		Database::BusParams col_bus{ "C" + to_string(line), {} };
+		for (size_t i = 0; i < side; ++i) {
+			row_bus.stops_names.push_back(name(line, i));
+			col_bus.stops_names.push_back(name(i, line));
+		}
+		db.AddBusWithRoute(row_bus);
+		if (line % 2 == 0) {
+			db.AddBusWithRingRoute(col_bus);
+			db.AddBusWithRoute({ "X" + to_string(line), { name(side - 1, line), name(0, line) } });
+		} else {
+			db.AddBusWithRoute(col_bus);
+		}
+	}
+	db.UpdateDistanceMatrix();
+	db.UpdateAllBusesStats();
+	Database::RouterSettings settings{ 4, 500.0, 80.0, 1000.0 };
+	settings.mode = mode;
+	settings.landmark_count = 3;
+	settings.shard_count = 3;
+	db.SetRouterSettings(settings);
+	db.UpdateGraphAndRouter();
+}
+
+void TestRouterModesAgree() {
+	Database all_pairs_db;
+	FillSmallGridCity(all_pairs_db, Database::RouterMode::ALL_PAIRS);
+	const auto router = all_pairs_db.GetRouter();
+	const size_t vertex_count = all_pairs_db.GetGraph()->GetVertexCount();
+
+	for (const auto mode : { Database::RouterMode::DIJKSTRA, Database::RouterMode::ASTAR, Database::RouterMode::ALT }) {
+		Database db;
+		FillSmallGridCity(db, mode);
+		const auto point_router = db.GetPointRouter();
+		ASSERT(point_router != nullptr);
+		ASSERT(db.GetRouter() == nullptr);
+		for (size_t from = 0; from < vertex_count; ++from) {
+			for (size_t to = 0; to < vertex_count; ++to) {
+				const auto expected = router->BuildRoute(from, to);
+				const auto path = point_router->FindRoute(from, to);
+				ASSERT_EQUAL(path.has_value(), expected.has_value());
+				if (expected) {
+					router->ReleaseRoute(expected->id);
+					ASSERT(abs(path->weight - expected->weight) < 1e-9);
+				}
+			}
+		}
+	}
+
+	// landmarks are stops, so a larger count means all of them
+	Database alt_db;
+	FillSmallGridCity(alt_db, Database::RouterMode::ALT);
+	auto settings = alt_db.GetRouterSettings();
+	settings.landmark_count = 1000;
+	alt_db.SetRouterSettings(settings);
+	alt_db.UpdateGraphAndRouter();
+	ASSERT_EQUAL(alt_db.GetPointRouter()->GetLandmarkCount(), vertex_count);
+
+	stringstream negative_landmarks(R"({"routing_settings": {"bus_wait_time": 2, "bus_velocity": 30, "router_mode": "alt", "landmark_count": -1}})");
+	bool thrown = false;
+	try {
+		ReadJsonRequests("routing_settings", Json::Load(negative_landmarks));
+	} catch (const invalid_argument&) {
+		thrown = true;
+	}
+	ASSERT(thrown);
+}
+
+void TestPartitionByCoordinates() {
+	vector<Graph::Point> points;
+	for (int x = 0; x < 10; ++x) {
+		for (int y = 0; y < 7; ++y) {
+			points.push_back({ x * 1.0, y * 0.5 });
+		}
+	}
+	for (const size_t cell_count : { 1, 2, 3, 5, 8 }) {
+		const auto cells = Graph::PartitionByCoordinates(points, cell_count);
+		vector<size_t> sizes(cell_count, 0);
+		for (const auto cell : cells) {
+			++sizes[cell];
+		}
+		ASSERT(*max_element(sizes.begin(), sizes.end()) - *min_element(sizes.begin(), sizes.end()) <= 1);
+	}
+	// the long side is cut first
+	const auto halves = Graph::PartitionByCoordinates(points, 2);
+	for (size_t i = 0; i < points.size(); ++i) {
+		ASSERT_EQUAL(halves[i], points[i].x < 5 ? 0u : 1u);
+	}
+}
+
+#ifdef __linux__
+void TestShardedRouterAgrees() {
+	Database all_pairs_db;
+	FillSmallGridCity(all_pairs_db, Database::RouterMode::ALL_PAIRS);
+	const auto router = all_pairs_db.GetRouter();
+	Database db;
+	FillSmallGridCity(db, Database::RouterMode::SHARDED);
+	const auto sharded_router = db.GetShardedRouter();
+	ASSERT(sharded_router != nullptr);
+	ASSERT_EQUAL(sharded_router->GetCellCount(), 3u);
+	ASSERT(sharded_router->GetBoundaryVertexCount() > 0);
+	// the cells hold the graph, the coordinator does not
+	ASSERT(db.GetGraph() == nullptr);
+	ASSERT(db.GetReversedGraph() == nullptr);
+
+	// both databases number the edges in the same order
+	const auto graph = all_pairs_db.GetGraph();
+	const size_t vertex_count = graph->GetVertexCount();
+	for (size_t from = 0; from < vertex_count; ++from) {
+		for (size_t to = 0; to < vertex_count; ++to) {
+			const auto expected = router->BuildRoute(from, to);
+			const auto path = sharded_router->FindRoute(from, to);
+			ASSERT_EQUAL(path.has_value(), expected.has_value());
+			if (!expected) {
+				continue;
+			}
+			router->ReleaseRoute(expected->id);
+			ASSERT(abs(path->weight - expected->weight) < 1e-9);
+			double path_weight = 0;
+			Graph::VertexId vertex = from;
+			for (const auto edge_id : path->edges) {
+				const auto& edge = graph->GetEdge(edge_id);
+				ASSERT_EQUAL(edge.from, vertex);
+				path_weight += edge.weight;
+				vertex = edge.to;
+			}
+			ASSERT_EQUAL(vertex, to);
+			ASSERT(abs(path_weight - path->weight) < 1e-9);
+		}
+	}
+
+	// queries from several threads share the workers
+	vector<optional<double>> expected_weights;
+	for (size_t from = 0; from < vertex_count; ++from) {
+		for (size_t to = 0; to < vertex_count; ++to) {
+			const auto route = router->BuildRoute(from, to);
+			expected_weights.push_back(route ? optional<double>(route->weight) : nullopt);
+			if (route) {
+				router->ReleaseRoute(route->id);
+			}
+		}
+	}
+	atomic<size_t> error_count = 0;
+	vector<thread> threads;
+	for (size_t thread_index = 0; thread_index < 4; ++thread_index) {
+		threads.emplace_back([&, thread_index] {
+			for (size_t i = thread_index; i < expected_weights.size(); i += 2) {
+				const auto path = sharded_router->FindRoute(i / vertex_count, i % vertex_count);
+				if (path.has_value() != expected_weights[i].has_value() || (path && abs(path->weight - *expected_weights[i]) >= 1e-9)) {
+					++error_count;
+				}
+			}
+		});
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	ASSERT_EQUAL(error_count.load(), 0u);
+
+	// every shard needs a stop
+	for (const size_t shard_count : { size_t(0), vertex_count + 1 }) {
+		auto settings = db.GetRouterSettings();
+		settings.shard_count = shard_count;
+		db.SetRouterSettings(settings);
+		bool thrown = false;
+		try {
+			db.UpdateGraphAndRouter();
+		} catch (const invalid_argument&) {
+			thrown = true;
+		}
+		ASSERT(thrown);
+	}
+	stringstream negative_shards(R"({"routing_settings": {"bus_wait_time": 2, "bus_velocity": 30, "router_mode": "sharded", "shard_count": -1}})");
+	bool thrown = false;
+	try {
+		ReadJsonRequests("routing_settings", Json::Load(negative_shards));
+	} catch (const invalid_argument&) {
+		thrown = true;
+	}
+	ASSERT(thrown);
+}
+#endif
+
+void TestParetoRouter() {
+	Graph::DirectedWeightedGraph<double> graph(4);
+	graph.AddEdge({ 0, 1, 1.0 });
+	graph.AddEdge({ 1, 2, 1.0 });
+	graph.AddEdge({ 2, 3, 1.0 });
+	graph.AddEdge({ 0, 3, 10.0 });
+	graph.AddEdge({ 0, 2, 2.5 });
+	graph.AddEdge({ 1, 3, 12.0 });
+
+	Graph::ParetoRouter<double> router(graph);
+	const auto routes = router.FindRoutes(0, 3, 5, 10);
+	vector<double> weights;
+	vector<size_t> edge_counts;
+	for (const auto& route : routes) {
+		weights.push_back(route.path.weight);
+		edge_counts.push_back(route.edge_count);
+		ASSERT_EQUAL(route.path.edges.size(), route.edge_count);
+	}
+	ASSERT_EQUAL(weights, vector<double>({ 10.0, 3.5, 3.0 }));
+	ASSERT_EQUAL(edge_counts, vector<size_t>({ 1, 2, 3 }));
+
+	const auto bounded = router.FindRoutes(0, 3, 2, 10);
+	ASSERT_EQUAL(bounded.size(), 2u);
+	ASSERT_EQUAL(bounded.back().path.weight, 3.5);
+
+	const auto capped = router.FindRoutes(0, 3, 5, 2);
+	ASSERT_EQUAL(capped.size(), 2u);
+	ASSERT_EQUAL(capped.front().path.weight, 10.0);
+	ASSERT_EQUAL(capped.back().path.weight, 3.0);
+}
+
+void TestParetoFastestMatchesRouter() {
+	Database db;
+	FillSmallGridCity(db, Database::RouterMode::ALL_PAIRS);
+	const auto router = db.GetRouter();
+	Graph::ParetoRouter<double> pareto_router(*db.GetGraph());
+	const size_t vertex_count = db.GetGraph()->GetVertexCount();
+	for (size_t from = 0; from < vertex_count; ++from) {
+		for (size_t to = 0; to < vertex_count; ++to) {
+			const auto expected = router->BuildRoute(from, to);
+			const auto routes = pareto_router.FindRoutes(from, to, vertex_count, 0);
+			ASSERT_EQUAL(routes.empty(), !expected);
+			if (expected) {
+				router->ReleaseRoute(expected->id);
+				ASSERT(abs(routes.back().path.weight - expected->weight) < 1e-9);
+				for (size_t i = 1; i < routes.size(); ++i) {
+					ASSERT(routes[i - 1].edge_count < routes[i].edge_count);
+					ASSERT(routes[i - 1].path.weight > routes[i].path.weight);
+				}
+			}
+		}
+	}
+
+	for (const string limit : { "max_boardings -1", "max_routes -1", "max_routes 0" }) {
+		const string name = limit.substr(0, limit.find(' ')), value = limit.substr(limit.find(' ') + 1);
+		stringstream request(R"({"type": "Route", "from": "0:0", "to": "4:4", "id": 1, "pareto": true, ")" + name + R"(": )" + value + "}");
+		bool thrown = false;
+		try {
+			ParseRequest(Request::Mode::READ, Json::Load(request).GetRoot());
+		} catch (const invalid_argument&) {
+			thrown = true;
+		}
+		ASSERT(thrown);
+	}
+	// huge limits are capped like alternatives
+	stringstream huge_limits(R"({"type": "Route", "from": "0:0", "to": "4:4", "id": 1, "pareto": true, "max_boardings": 1000, "max_routes": 1000})");
+	const auto request = ParseRequest(Request::Mode::READ, Json::Load(huge_limits).GetRoot());
+	const string key = static_cast<const ReadRequest&>(*request).GetCanonicalKey().value_or("");
+	// the key ends with the pareto flag, max_boardings and max_routes
+	ASSERT_EQUAL(key.substr(key.rfind(" 1 ")), " 1 16 16");
+}
+
+void TestStatRequestsDeduplication() {
+	for (const auto mode : { Database::RouterMode::ALL_PAIRS, Database::RouterMode::DIJKSTRA }) {
+		Database db;
+		FillSmallGridCity(db, mode);
+
+		vector<RequestHolder> requests;
+		auto add_request = [&requests](const string& json) {
+			istringstream is(json);
+			requests.push_back(ParseRequest(Request::Mode::READ, Json::Load(is).GetRoot()));
+		};
+		int id = 0;
+		for (int repeat = 0; repeat < 3; ++repeat) {
+			add_request(R"({"type": "Bus", "name": "R1", "id": )" + to_string(id++) + "}");
+			add_request(R"({"type": "Stop", "name": "2:2", "id": )" + to_string(id++) + "}");
+			add_request(R"({"type": "Stop", "name": "unknown", "id": )" + to_string(id++) + "}");
+			for (const string to : { "4:4", "0:3", "3:0", "0:0" }) {
+				add_request(R"({"type": "Route", "from": "0:0", "to": ")" + to + R"(", "id": )" + to_string(id++) + "}");
+			}
+			add_request(R"({"type": "Route", "from": "1:1", "to": "4:4", "alternatives": 2, "id": )" + to_string(id++) + "}");
+		}
+
+		StatRequestsStats stats;
+		const auto responses = ProcessStatRequests(db, requests, &stats);
+		ASSERT_EQUAL(stats.request_count, 24u);
+		ASSERT_EQUAL(stats.unique_request_count, 8u);
+		ASSERT_EQUAL(stats.coalesced_search_count, mode == Database::RouterMode::DIJKSTRA ? 1u : 0u);
+		ASSERT_EQUAL(stats.coalesced_request_count, mode == Database::RouterMode::DIJKSTRA ? 4u : 0u);
+
+		ASSERT_EQUAL(responses.size(), requests.size());
+		for (size_t i = 0; i < requests.size(); ++i) {
+			const auto expected = static_cast<const ReadRequest&>(*requests[i]).Process(db)->ToJson().AsMap();
+			const auto actual = responses[i]->ToJson().AsMap();
+			ASSERT_EQUAL(actual.at("request_id").AsInt(), static_cast<int>(i));
+			if (expected.count("total_time")) {
+				ASSERT(abs(actual.at("total_time").AsDouble() - expected.at("total_time").AsDouble()) < 1e-9);
+			} else {
+				ostringstream expected_json, actual_json;
+				expected_json << Json::Node(expected);
+				actual_json << Json::Node(actual);
+				ASSERT_EQUAL(actual_json.str(), expected_json.str());
+			}
+		}
+	}
+}
+
+void TestStopNameIndex() {
+	const StopNameIndex index({ "Tolstopaltsevo", "Marushkino", "Rasskazovka", "Tolstoy street", "Biryulyovo Zapadnoye", "Biryusinka", "Tolstopaltsevo" });
+	ASSERT_EQUAL(index.GetNameCount(), 6u);
+
+	const auto tolst = index.FindByPrefix("Tolst", 10);
+	ASSERT_EQUAL(vector<string>(tolst.begin(), tolst.end()), vector<string>({ "Tolstopaltsevo", "Tolstoy street" }));
+	ASSERT_EQUAL(index.FindByPrefix("Biryu", 1).size(), 1u);
+	ASSERT_EQUAL(index.FindByPrefix("", 10).size(), 6u);
+	ASSERT(index.FindByPrefix("Z", 10).empty());
+
+	const auto similar = index.FindSimilar("Marushkina", 2, 10);
+	ASSERT_EQUAL(similar.size(), 1u);
+	ASSERT_EQUAL(string(similar[0].name), "Marushkino");
+	ASSERT_EQUAL(similar[0].distance, 1u);
+	ASSERT_EQUAL(string(index.FindSimilar("Tolstopaltsev", 1, 10)[0].name), "Tolstopaltsevo");
+	ASSERT_EQUAL(string(index.FindSimilar("Rasskzovka", 1, 10)[0].name), "Rasskazovka");
+	ASSERT(index.FindSimilar("Rasskzovka", 0, 10).empty());
+	ASSERT_EQUAL(index.FindSimilar("Biryusinka", 0, 10).size(), 1u);
+
+	mt19937 gen(3);
+	uniform_int_distribution<int> letter_dist('a', 'd');
+	uniform_int_distribution<int> length_dist(1, 7);
+	auto make_name = [&] {
+		string name;
+		for (int i = length_dist(gen); i > 0; --i) {
+			name += static_cast<char>(letter_dist(gen));
+		}
+		return name;
+	};
+	auto edit_distance = [](const string& lhs, const string& rhs) {
+		vector<vector<size_t>> d(lhs.size() + 1, vector<size_t>(rhs.size() + 1));
+		for (size_t i = 0; i <= lhs.size(); ++i) {
+			for (size_t j = 0; j <= rhs.size(); ++j) {
+				d[i][j] = i == 0 || j == 0 ? i + j
+					: min({ d[i - 1][j] + 1, d[i][j - 1] + 1, d[i - 1][j - 1] + (lhs[i - 1] != rhs[j - 1]) });
+			}
+		}
+		return d[lhs.size()][rhs.size()];
+	};
+	vector<string> random_names(300);
+	for (auto& name : random_names) {
+		name = make_name();
+	}
+	const StopNameIndex random_index(random_names);
+	sort(random_names.begin(), random_names.end());
+	random_names.erase(unique(random_names.begin(), random_names.end()), random_names.end());
+	for (int query_index = 0; query_index < 200; ++query_index) {
+		const string query = make_name();
+		for (const size_t max_distance : { 0, 1, 2 }) {
+			size_t expected_count = 0;
+			for (const auto& name : random_names) {
+				expected_count += edit_distance(query, name) <= max_distance;
+			}
+			const auto matches = random_index.FindSimilar(query, max_distance, random_names.size());
+			ASSERT_EQUAL(matches.size(), expected_count);
+			for (const auto& match : matches) {
+				ASSERT_EQUAL(match.distance, edit_distance(query, string(match.name)));
+			}
+		}
+	}
+
+	istringstream input(R"({
+		"base_requests": [
+			{"type": "Stop", "name": "Marushkino", "latitude": 55.595884, "longitude": 37.209755, "road_distances": {}},
+			{"type": "Stop", "name": "Mamyri", "latitude": 55.595, "longitude": 37.2, "road_distances": {}}
+		],
+		"stat_requests": [
+			{"type": "StopSearch", "query": "Ma", "id": 1},
+			{"type": "StopSearch", "query": "Mamyry", "fuzzy": true, "max_distance": 1, "id": 2},
+			{"type": "StopSearch", "query": "Mamyry", "fuzzy": true, "max_distance": 1000, "id": 3}
+		]
+	})");
+	const auto doc = Json::Load(input);
+	Database db;
+	ProcessBaseRequests(db, ReadJsonRequests("base_requests", doc));
+	const auto responses = ProcessStatRequests(db, ReadJsonRequests("stat_requests", doc));
+	ostringstream output;
+	output << ResponsesToJson(responses);
+	ASSERT_EQUAL(output.str(), "[\n{\n\"request_id\": 1,\n\"stops\": [\n\"Mamyri\",\n\"Marushkino\"\n]\n},\n"
+		"{\n\"request_id\": 2,\n\"stops\": [\n\"Mamyri\"\n]\n},\n"
+		"{\n\"request_id\": 3,\n\"stops\": [\n\"Mamyri\"\n]\n}\n]");
+
+	for (const string field : { "max_distance", "limit" }) {
+		istringstream negative(R"({"stat_requests": [{"type": "StopSearch", "query": "Ma", "fuzzy": true, ")" + field + R"(": -1, "id": 4}]})");
+		bool thrown = false;
+		try {
+			ReadJsonRequests("stat_requests", Json::Load(negative));
+		} catch (const invalid_argument&) {
+			thrown = true;
+		}
+		ASSERT(thrown);
+	}
+}
+
+void TestDistanceMatrix() {
+	{
+		const DistanceMatrix distances(4, { { 0, 1, 100 }, { 2, 1, 300 }, { 0, 2, 50 }, { 0, 1, 120 }, { 1, 0, 90 } });
+		ASSERT_EQUAL(distances.GetEntryCount(), 4u);
+		ASSERT_EQUAL(distances.Find(0, 1).value_or(0), 120u);
+		ASSERT_EQUAL(distances.Find(1, 0).value_or(0), 90u);
+		ASSERT(!distances.Find(1, 2));
+		ASSERT_EQUAL(distances.FindEitherWay(1, 2).value_or(0), 300u);
+		ASSERT_EQUAL(distances.FindEitherWay(2, 0).value_or(0), 50u);
+		ASSERT(!distances.FindEitherWay(3, 0));
+		ASSERT(!distances.Find(7, 0));
+	}
+	{
+		mt19937 gen(23);
+		const size_t stop_count = 300;
+		uniform_int_distribution<DistanceMatrix::StopIndex> stop_dist(0, stop_count - 1);
+		vector<DistanceMatrix::Entry> entries;
+		map<pair<DistanceMatrix::StopIndex, DistanceMatrix::StopIndex>, DistanceMatrix::Distance> expected;
+		for (int i = 0; i < 3000; ++i) {
+			const DistanceMatrix::Entry entry{ stop_dist(gen), stop_dist(gen), static_cast<DistanceMatrix::Distance>(gen() % 100000) };
+			entries.push_back(entry);
+			expected[{ entry.from, entry.to }] = entry.distance;
+		}
+		const DistanceMatrix distances(stop_count, entries);
+		ASSERT_EQUAL(distances.GetEntryCount(), expected.size());
+		for (DistanceMatrix::StopIndex from = 0; from < stop_count; ++from) {
+			for (DistanceMatrix::StopIndex to = 0; to < stop_count; ++to) {
+				const auto it = expected.find({ from, to });
+				const auto found = distances.Find(from, to);
+				ASSERT_EQUAL(found.has_value(), it != expected.end());
+				if (found) {
+					ASSERT_EQUAL(*found, it->second);
+				}
+			}
+		}
+	}
+}
+
+void TestResponseStreamWriter() {
+	Database db;
+	FillSmallGridCity(db, Database::RouterMode::DIJKSTRA);
+
+	vector<RequestHolder> requests;
+	for (int id = 0; id < 300; ++id) {
+		const string from = to_string(id % 5) + ":" + to_string(id / 5 % 5);
+		const string to = to_string(id / 7 % 5) + ":" + to_string(id % 3);
+		const string json = id % 4 == 0
+			? R"({"type": "Stop", "name": ")" + from + R"(", "id": )" + to_string(id) + "}"
+			: id % 4 == 1
+			? R"({"type": "Bus", "name": "R)" + to_string(id % 6) + R"(", "id": )" + to_string(id) + "}"
+			: R"({"type": "Route", "from": ")" + from + R"(", "to": ")" + to + R"(", "id": )" + to_string(id) + "}";
+		istringstream is(json);
+		requests.push_back(ParseRequest(Request::Mode::READ, Json::Load(is).GetRoot()));
+	}
+	StatRequestsStats expected_stats;
+	const auto responses = ProcessStatRequests(db, requests, &expected_stats);
+	ostringstream expected;
+	expected.precision(6);
+	PrintResponsesJson(responses, expected);
+
+	{
+		ostringstream actual;
+		actual.precision(6);
+		ResponseStreamWriter writer(actual, 1);
+		writer.Write(1, *responses[1]);
+		ASSERT_EQUAL(writer.GetWrittenCount(), 0u);
+		ASSERT(actual.str().empty());
+		writer.Write(0, *responses[0]);
+		ASSERT_EQUAL(writer.GetWrittenCount(), 2u);
+		ASSERT(actual.str().find(to_string(responses[1]->request_id)) != string::npos);
+		for (size_t i = responses.size() - 1; i >= 2; --i) {
+			writer.Write(i, *responses[i]);
+		}
+		writer.Finish();
+		ASSERT_EQUAL(writer.GetMaxBufferedCount(), responses.size() - 3);
+		ASSERT_EQUAL(actual.str(), expected.str());
+	}
+	{
+		ostringstream actual;
+		actual.precision(6);
+		ResponseStreamWriter writer(actual, 1000);
+		writer.Write(1, *responses[1]);
+		ASSERT_EQUAL(writer.GetWrittenCount(), 0u);
+		bool thrown = false;
+		try {
+			writer.Finish();
+		} catch (const logic_error&) {
+			thrown = true;
+		}
+		ASSERT(thrown);
+	}
+	for (const size_t thread_count : { 1, 4 }) {
+		ostringstream actual;
+		actual.precision(6);
+		ResponseStreamWriter writer(actual, 256);
+		StatRequestsStats stats;
+		ProcessStatRequests(db, requests, writer, thread_count, requests.size(), &stats);
+		writer.Finish();
+		ASSERT_EQUAL(actual.str(), expected.str());
+		ASSERT_EQUAL(stats.unique_request_count, expected_stats.unique_request_count);
+		ASSERT_EQUAL(stats.coalesced_search_count, expected_stats.coalesced_search_count);
+	}
+	{
+		ostringstream actual;
+		actual.precision(6);
+		ResponseStreamWriter writer(actual);
+		StatRequestsStats stats;
+		ProcessStatRequests(db, requests, writer, 3, 32, &stats);
+		writer.Finish();
+		ASSERT_EQUAL(actual.str(), expected.str());
+		ASSERT_EQUAL(stats.request_count, requests.size());
+		ASSERT(writer.GetMaxBufferedCount() < 32);
+	}
+}
+
+void TestIsochrone() {
+	Database db;
+	FillSmallGridCity(db, Database::RouterMode::DIJKSTRA);
+	auto process = [&db](const string& json) {
+		istringstream is(json);
+		const auto request = ParseRequest(Request::Mode::READ, Json::Load(is).GetRoot());
+		return static_cast<const ReadRequest&>(*request).Process(db)->ToJson().AsMap();
+	};
+
+	for (const string from : { "0:0", "2:3", "4:1" }) {
+		for (const double max_time : { 0.0, 7.5, 12.0, 30.0 }) {
+			const auto answer = process(R"({"type": "Isochrone", "from": ")" + from + R"(", "max_time": )" + to_string(max_time) + R"(, "id": 1})");
+			map<string, double> reachable;
+			double last_time = 0.0;
+			for (const auto& node : answer.at("stops").AsArray()) {
+				const double time = node.AsMap().at("time").AsDouble();
+				ASSERT(time >= last_time);
+				last_time = time;
+				reachable[node.AsMap().at("stop_name").AsString()] = time;
+			}
+			ASSERT_EQUAL(reachable.at(from), 0.0);
+
+			// the same as asking for a route to every stop
+			for (size_t row = 0; row < 5; ++row) {
+				for (size_t col = 0; col < 5; ++col) {
+					const string to = to_string(row) + ":" + to_string(col);
+					if (to == from) {
+						continue;
+					}
+					const auto route = process(R"({"type": "Route", "from": ")" + from + R"(", "to": ")" + to + R"(", "id": 2})");
+					const bool in_budget = route.count("total_time") && route.at("total_time").AsDouble() <= max_time;
+					ASSERT_EQUAL(reachable.count(to) == 1, in_budget);
+					if (in_budget) {
+						ASSERT(abs(reachable.at(to) - route.at("total_time").AsDouble()) < 1e-9);
+					}
+				}
+			}
+		}
+	}
+
+	const auto unknown = process(R"({"type": "Isochrone", "from": "nowhere", "max_time": 10, "id": 3})");
+	ASSERT_EQUAL(unknown.at("error_message").AsString(), "not found");
+	ASSERT_EQUAL(unknown.at("request_id").AsInt(), 3);
+}
+
+void TestTraceReplay() {
+	Database db;
+	FillSmallGridCity(db, Database::RouterMode::DIJKSTRA);
+
+	vector<TraceRecord> records = {
+		{ 0, R"({"type": "Bus", "name": "R1", "id": 1})" },
+		{ 0, R"({"type": "Route", "from": "0:0", "to": "4:4", "id": 2})" },
+		{ 150, R"({"type": "Stop", "name": "2:2", "id": 3})" },
+		{ 1000000, R"({"type": "Route", "from": "4:4", "to": "0:0", "id": 4})" },
+		{ 1000001, "not a json" },
+	};
+	stringstream trace_stream;
+	{
+		TraceWriter writer(trace_stream);
+		for (const auto& record : records) {
+			writer.Write(record);
+		}
+	}
+	const auto trace = ReadTrace(trace_stream);
+	ASSERT_EQUAL(trace.size(), records.size());
+	for (size_t i = 0; i < records.size(); ++i) {
+		ASSERT_EQUAL(trace[i].timestamp_us, records[i].timestamp_us);
+		ASSERT_EQUAL(trace[i].request_line, records[i].request_line);
+	}
+
+	// a second of recorded load replayed a thousand times faster
+	const auto stats = ReplayTrace(db, trace, { 1000.0 });
+	ASSERT_EQUAL(stats.request_count, records.size());
+	ASSERT(stats.seconds >= 0.001);
+	ASSERT_EQUAL(stats.latencies_by_type.at("Route").GetCount(), 2u);
+	ASSERT_EQUAL(stats.latencies_by_type.at("Bus").GetCount(), 1u);
+	ASSERT_EQUAL(stats.latencies_by_type.at("unknown").GetCount(), 1u);
+	for (size_t i = 0; i < records.size(); ++i) {
+		ASSERT_EQUAL(stats.answers[i], ProcessRequestLine(db, records[i].request_line));
+	}
+
+	stringstream golden;
+	WriteGolden(stats.answers, golden);
+	ASSERT(!CompareWithGolden(stats.answers, golden));
+	auto changed_answers = stats.answers;
+	changed_answers[2] += " ";
+	golden.clear();
+	golden.seekg(0);
+	const auto difference = CompareWithGolden(changed_answers, golden);
+	ASSERT(difference && difference->find("line 3") == 0);
+	const vector<string> missing_answers(stats.answers.begin(), stats.answers.end() - 1);
+	golden.clear();
+	golden.seekg(0);
+	ASSERT(CompareWithGolden(missing_answers, golden).has_value());
+
+	LatencyHistogram histogram;
+	for (const double latency : { 0.5, 3.0, 3.0, 100.0 }) {
+		histogram.Add(latency);
+	}
+	ASSERT_EQUAL(histogram.GetPercentile(0.5), 4.0);
+	ASSERT_EQUAL(histogram.GetPercentile(0.99), 100.0);
+}
+
+#ifdef __linux__
+// Sends the batch over one connection and reads the answers until the server closes it
+string ExchangeWithServer(const string& socket_path, const string& batch) {
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	sockaddr_un address{};
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socket_path.c_str());
+	ASSERT(connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0);
+	ASSERT_EQUAL(write(fd, batch.data(), batch.size()), static_cast<ssize_t>(batch.size()));
+	shutdown(fd, SHUT_WR);
+
+	string received;
+	char buffer[4096];
+	for (ssize_t size; (size = read(fd, buffer, sizeof(buffer))) > 0; ) {
+		received.append(buffer, size);
+	}
+	close(fd);
+	return received;
+}
+
+void TestQueryServerPipelining() {
+	Database db;
+	FillSmallGridCity(db, Database::RouterMode::DIJKSTRA);
+	const string socket_path = "/tmp/transport_test_" + to_string(getpid()) + ".sock";
+	QueryServer server(db, { socket_path, 4, "" });
+	thread server_thread([&server] { server.Run(); });
+
+	vector<string> requests, expected;
+	for (int id = 0; id < 200; ++id) {
+		const string from = to_string(id % 5) + ":" + to_string(id / 5 % 5);
+		const string to = to_string(id / 7 % 5) + ":" + to_string(id % 3);
+		const string line = id % 3 == 0
+			? R"({"type": "Stop", "name": ")" + from + R"(", "id": )" + to_string(id) + "}"
+			: R"({"type": "Route", "from": ")" + from + R"(", "to": ")" + to + R"(", "id": )" + to_string(id) + "}";
+		requests.push_back(line);
+		expected.push_back(ProcessRequestLine(db, line));
+	}
+	requests.push_back("not a json");
+
+	string batch;
+	for (const auto& line : requests) {
+		batch += line + "\n";
+	}
+	const string received = ExchangeWithServer(socket_path, batch);
+	server.Stop();
+	server_thread.join();
+
+	istringstream lines(received);
+	string line;
+	for (const auto& answer : expected) {
+		ASSERT(static_cast<bool>(getline(lines, line)));
+		ASSERT_EQUAL(line, answer);
+	}
+	ASSERT(static_cast<bool>(getline(lines, line)));
+	ASSERT(line.find("error_message") != string::npos);
+	ASSERT(!static_cast<bool>(getline(lines, line)));
+}
+
+// Requests from clients may name unknown stops or carry invalid counts: they get
+// answers, and the server goes on serving the next ones
+void TestQueryServerBadRequests() {
+	Database db;
+	FillSmallGridCity(db, Database::RouterMode::DIJKSTRA);
+	const string socket_path = "/tmp/transport_test_bad_" + to_string(getpid()) + ".sock";
+	QueryServer server(db, { socket_path, 2, "" });
+	thread server_thread([&server] { server.Run(); });
+
+	const vector<string> requests = {
+		R"({"type": "Route", "from": "zzz", "to": "0:0", "id": 7})",
+		R"({"type": "Route", "from": "0:0", "to": "zzz", "id": 8, "alternatives": 2})",
+		R"({"type": "Route", "from": "zzz", "to": "0:0", "id": 9, "pareto": true})",
+		R"({"type": "Route", "from": "0:0", "to": "4:4", "id": 10, "alternatives": -1})",
+		R"({"type": "Route", "from": "0:0", "to": "4:4", "id": 11})",
+	};
+	string batch;
+	for (const auto& line : requests) {
+		batch += line + "\n";
+	}
+	const string received = ExchangeWithServer(socket_path, batch);
+	server.Stop();
+	server_thread.join();
+
+	istringstream lines(received);
+	string line;
+	for (const int id : { 7, 8, 9 }) {
+		ASSERT(static_cast<bool>(getline(lines, line)));
+		ASSERT(line.find("\"request_id\": " + to_string(id)) != string::npos);
+		ASSERT(line.find("not found") != string::npos);
+	}
+	ASSERT(static_cast<bool>(getline(lines, line)));
+	ASSERT(line.find("bad request: alternatives must not be negative") != string::npos);
+	ASSERT(static_cast<bool>(getline(lines, line)));
+	ASSERT_EQUAL(line, ProcessRequestLine(db, requests.back()));
+	ASSERT(line.find("total_time") != string::npos);
+	ASSERT(!static_cast<bool>(getline(lines, line)));
+
+	bool thrown = false;
+	try {
+		RunLoadGenerator({ socket_path }, {});
+	} catch (const runtime_error&) {
+		thrown = true;
+	}
+	ASSERT(thrown);
+}
+
+// Clients that hang up before reading their answers must not bring the server down
+void TestQueryServerAbandonedConnections() {
+	Database db;
+	FillSmallGridCity(db, Database::RouterMode::DIJKSTRA);
+	const string socket_path = "/tmp/transport_test_abandoned_" + to_string(getpid()) + ".sock";
+	QueryServer server(db, { socket_path, 2, "" });
+	thread server_thread([&server] { server.Run(); });
+
+	const string route = R"({"type": "Route", "from": "0:0", "to": "4:4", "id": 1})";
+	string batch;
+	for (int i = 0; i < 500; ++i) {
+		batch += route + "\n";
+	}
+	for (int client = 0; client < 3; ++client) {
+		const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		sockaddr_un address{};
+		address.sun_family = AF_UNIX;
+		strcpy(address.sun_path, socket_path.c_str());
+		ASSERT(connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0);
+		ASSERT_EQUAL(write(fd, batch.data(), batch.size()), static_cast<ssize_t>(batch.size()));
+		close(fd);
+	}
+	// the answers to the abandoned clients are written, or fail to be, meanwhile
+	this_thread::sleep_for(chrono::milliseconds(200));
+
+	const string received = ExchangeWithServer(socket_path, route + "\n");
+	server.Stop();
+	server_thread.join();
+	ASSERT_EQUAL(received, ProcessRequestLine(db, route) + "\n");
 }
+#endif
 
 void RunAllTests() {
 	TestRunner tr;
 	RUN_TEST(tr, TestJsonLoad);
 	RUN_TEST(tr, TestPrintJson);
 	RUN_TEST(tr, TestBusAndStopsRequests);
+	RUN_TEST(tr, TestDistanceMatrix);
+	RUN_TEST(tr, TestRouteBetweenCoords);
+	RUN_TEST(tr, TestKShortestPaths);
+	RUN_TEST(tr, TestRouteAlternatives);
+	RUN_TEST(tr, TestRouterModesAgree);
+	RUN_TEST(tr, TestPartitionByCoordinates);
+#ifdef __linux__
+	RUN_TEST(tr, TestShardedRouterAgrees);
+#endif
+	RUN_TEST(tr, TestParetoRouter);
+	RUN_TEST(tr, TestParetoFastestMatchesRouter);
+	RUN_TEST(tr, TestIsochrone);
+	RUN_TEST(tr, TestStatRequestsDeduplication);
+	RUN_TEST(tr, TestResponseStreamWriter);
+	RUN_TEST(tr, TestStopNameIndex);
+	RUN_TEST(tr, TestTraceReplay);
+#ifdef __linux__
+	RUN_TEST(tr, TestQueryServerPipelining);
+	RUN_TEST(tr, TestQueryServerBadRequests);
+	RUN_TEST(tr, TestQueryServerAbandonedConnections);
+#endif
 }
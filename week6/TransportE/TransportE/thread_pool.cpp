@@ -0,0 +1,44 @@
+#include "thread_pool.h"
+
+using namespace std;
+
+ThreadPool::ThreadPool(size_t thread_count) {
+	for (size_t i = 0; i < thread_count; ++i) {
+		workers.emplace_back([this] { RunWorker(); });
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		lock_guard<mutex> guard(m);
+		stopping = true;
+	}
+	has_tasks.notify_all();
+	for (auto& worker : workers) {
+		worker.join();
+	}
+}
+
+void ThreadPool::Submit(function<void()> task) {
+	{
+		lock_guard<mutex> guard(m);
+		tasks.push_back(move(task));
+	}
+	has_tasks.notify_one();
+}
+
+void ThreadPool::RunWorker() {
+	while (true) {
+		function<void()> task;
+		{
+			unique_lock<mutex> lock(m);
+			has_tasks.wait(lock, [this] { return stopping || !tasks.empty(); });
+			if (tasks.empty()) {
+				return;
+			}
+			task = move(tasks.front());
+			tasks.pop_front();
+		}
+		task();
+	}
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+public:
+	explicit ThreadPool(size_t thread_count);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	void Submit(std::function<void()> task);
+
+private:
+	std::mutex m;
+	std::condition_variable has_tasks;
+	std::deque<std::function<void()>> tasks;
+	bool stopping = false;
+	std::vector<std::thread> workers;
+
+	void RunWorker();
+};
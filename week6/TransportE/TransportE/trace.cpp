@@ -0,0 +1,174 @@
+#include "trace.h"
+#include "server.h"
+#include <cmath>
+#include <iterator>
+#include <stdexcept>
+#include <thread>
+
+using namespace std;
+
+namespace {
+
+	const string TRACE_MAGIC = "TRACE1\n";
+
+	void WriteVarint(ostream& output, uint64_t value) {
+		while (value >= 0x80) {
+			output.put(static_cast<char>((value & 0x7f) | 0x80));
+			value >>= 7;
+		}
+		output.put(static_cast<char>(value));
+	}
+
+	optional<uint64_t> ReadVarint(istream& input) {
+		uint64_t value = 0;
+		for (int shift = 0; shift < 64; shift += 7) {
+			const int byte = input.get();
+			if (byte == EOF) {
+				return nullopt;
+			}
+			value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+			if (!(byte & 0x80)) {
+				return value;
+			}
+		}
+		throw runtime_error("bad varint in trace");
+	}
+
+}
+
+TraceWriter::TraceWriter(ostream& output)
+	: output(output)
+	, start(chrono::steady_clock::now())
+{
+	output << TRACE_MAGIC;
+}
+
+void TraceWriter::Write(const TraceRecord& record) {
+	if (record.timestamp_us < last_timestamp_us) {
+		throw invalid_argument("trace records must be written in time order");
+	}
+	WriteVarint(output, record.timestamp_us - last_timestamp_us);
+	WriteVarint(output, record.request_line.size());
+	output << record.request_line;
+	last_timestamp_us = record.timestamp_us;
+}
+
+void TraceWriter::Record(const string& request_line) {
+	const auto elapsed = chrono::steady_clock::now() - start;
+	Write({ static_cast<uint64_t>(chrono::duration_cast<chrono::microseconds>(elapsed).count()), request_line });
+}
+
+vector<TraceRecord> ReadTrace(istream& input) {
+	string magic(TRACE_MAGIC.size(), '\0');
+	if (!input.read(magic.data(), magic.size()) || magic != TRACE_MAGIC) {
+		throw runtime_error("not a request trace");
+	}
+	vector<TraceRecord> trace;
+	uint64_t timestamp_us = 0;
+	while (const auto delay_us = ReadVarint(input)) {
+		const auto length = ReadVarint(input);
+		if (!length) {
+			throw runtime_error("truncated trace");
+		}
+		timestamp_us += *delay_us;
+		string request_line(*length, '\0');
+		if (!input.read(request_line.data(), request_line.size())) {
+			throw runtime_error("truncated trace");
+		}
+		trace.push_back({ timestamp_us, move(request_line) });
+	}
+	return trace;
+}
+
+void LatencyHistogram::Add(double latency_us) {
+	size_t bucket = 0;
+	while (bucket + 1 < buckets.size() && latency_us >= ldexp(1.0, bucket)) {
+		++bucket;
+	}
+	++buckets[bucket];
+	++count;
+	max_latency_us = max(max_latency_us, latency_us);
+}
+
+size_t LatencyHistogram::GetCount() const {
+	return count;
+}
+
+double LatencyHistogram::GetMaxLatency() const {
+	return max_latency_us;
+}
+
+double LatencyHistogram::GetPercentile(double fraction) const {
+	const size_t rank = static_cast<size_t>(ceil(fraction * count));
+	size_t seen = 0;
+	for (size_t bucket = 0; bucket < buckets.size(); ++bucket) {
+		seen += buckets[bucket];
+		if (seen >= rank && seen > 0) {
+			return min(ldexp(1.0, bucket), max_latency_us);
+		}
+	}
+	return max_latency_us;
+}
+
+void LatencyHistogram::Print(ostream& output) const {
+	for (size_t bucket = 0; bucket < buckets.size(); ++bucket) {
+		if (buckets[bucket]) {
+			output << "  < " << ldexp(1.0, bucket) << " us: " << buckets[bucket] << '\n';
+		}
+	}
+}
+
+ReplayStats ReplayTrace(const Database& db, const vector<TraceRecord>& trace, const ReplaySettings& settings) {
+	using Clock = chrono::steady_clock;
+
+	ReplayStats stats;
+	stats.answers.reserve(trace.size());
+	const auto start = Clock::now();
+	for (const auto& record : trace) {
+		auto arrival = Clock::now();
+		if (settings.speed > 0) {
+			arrival = start + chrono::duration_cast<Clock::duration>(chrono::duration<double, micro>(record.timestamp_us / settings.speed));
+			this_thread::sleep_until(arrival);
+		}
+		string request_type = "unknown";
+		stats.answers.push_back(ProcessRequestLine(db, record.request_line, &request_type));
+		const auto latency = Clock::now() - arrival;
+		stats.latencies_by_type[request_type].Add(chrono::duration<double, micro>(latency).count());
+	}
+	stats.request_count = trace.size();
+	stats.seconds = chrono::duration<double>(Clock::now() - start).count();
+	return stats;
+}
+
+void PrintReplayStats(const ReplayStats& stats, ostream& output) {
+	output << stats.request_count << " requests in " << stats.seconds << " s: "
+		<< stats.request_count / stats.seconds << " rps\n";
+	for (const auto& [type, histogram] : stats.latencies_by_type) {
+		output << type << ": " << histogram.GetCount() << " requests, p50 " << histogram.GetPercentile(0.5)
+			<< " us, p99 " << histogram.GetPercentile(0.99) << " us, max " << histogram.GetMaxLatency() << " us\n";
+		histogram.Print(output);
+	}
+}
+
+void WriteGolden(const vector<string>& answers, ostream& golden) {
+	for (const auto& answer : answers) {
+		golden << answer << '\n';
+	}
+}
+
+optional<string> CompareWithGolden(const vector<string>& answers, istream& golden) {
+	const string expected(istreambuf_iterator<char>(golden), {});
+	size_t offset = 0;
+	for (size_t i = 0; i < answers.size(); ++i) {
+		const string actual = answers[i] + '\n';
+		if (expected.compare(offset, actual.size(), actual) != 0) {
+			const size_t line_end = expected.find('\n', offset);
+			return "line " + to_string(i + 1) + " differs: expected " + expected.substr(offset, line_end - offset) + ", got " + answers[i];
+		}
+		offset += actual.size();
+	}
+	if (offset != expected.size()) {
+		return "golden file has " + to_string(expected.size() - offset) + " more bytes after line " + to_string(answers.size());
+	}
+	return nullopt;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "database.h"
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Recorded stat requests in a compact binary log. After the magic every record
+// keeps the delay since the previous record in microseconds and the length of the
+// request line as varints, then the request line itself.
+struct TraceRecord {
+	uint64_t timestamp_us = 0;  // since the start of recording
+	std::string request_line;
+};
+
+class TraceWriter {
+public:
+	explicit TraceWriter(std::ostream& output);
+
+	void Write(const TraceRecord& record);
+	// Stamps the line with the time passed since construction
+	void Record(const std::string& request_line);
+
+private:
+	std::ostream& output;
+	std::chrono::steady_clock::time_point start;
+	uint64_t last_timestamp_us = 0;
+};
+
+std::vector<TraceRecord> ReadTrace(std::istream& input);
+
+class LatencyHistogram {
+public:
+	void Add(double latency_us);
+
+	size_t GetCount() const;
+	double GetMaxLatency() const;
+	// Upper bound of the bucket holding the given fraction of latencies
+	double GetPercentile(double fraction) const;
+	void Print(std::ostream& output) const;
+
+private:
+	// bucket i counts latencies in [2^(i - 1), 2^i) microseconds
+	std::array<size_t, 40> buckets{};
+	size_t count = 0;
+	double max_latency_us = 0.0;
+};
+
+struct ReplaySettings {
+	// 1 keeps the recorded pace, 10 replays ten times faster, 0 as fast as possible
+	double speed = 0.0;
+};
+
+struct ReplayStats {
+	size_t request_count = 0;
+	double seconds = 0.0;
+	std::map<std::string, LatencyHistogram> latencies_by_type;
+	// one line per request, as the server writes them
+	std::vector<std::string> answers;
+};
+
+// Answers requests one by one the way the server does. When paced, latency counts
+// from the scheduled arrival, so falling behind the recorded load shows up.
+ReplayStats ReplayTrace(const Database& db, const std::vector<TraceRecord>& trace, const ReplaySettings& settings);
+void PrintReplayStats(const ReplayStats& stats, std::ostream& output);
+
+void WriteGolden(const std::vector<std::string>& answers, std::ostream& golden);
+// Describes the first difference, if any
+std::optional<std::string> CompareWithGolden(const std::vector<std::string>& answers, std::istream& golden);